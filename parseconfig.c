@@ -253,3 +253,19 @@ keylist * parse_config_file ( const char * config ){
 
    return param;
 }
+
+/*
+ * checks a yes/no config parameter, "yes" (any case) or "1" means yes,
+ * defval is returned when parameter is not set
+ */
+int check_param_bool ( keylist * paramlist, const char * key, int defval ){
+
+   char * val;
+
+   val = search_key ( paramlist, key );
+   if ( ! val ){
+      return defval;
+   }
+
+   return strcasecmp ( val, "yes" ) == 0 || strcmp ( val, "1" ) == 0;
+}
@@ -23,5 +23,6 @@ void close_config ( char * config_buf );
 //void remove_whitespaces (char * buf);
 keylist * parse_config ( char * buf );
 keylist * parse_config_file ( const char * config );
+int check_param_bool ( keylist * paramlist, const char * key, int defval );
 
 #endif
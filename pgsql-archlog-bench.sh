@@ -0,0 +1,180 @@
+#!/bin/sh
+#
+# Copyright (c) 2013 by Inteos sp. z o.o.
+# All rights reserved. See LICENSE.Inteos for details.
+#
+# archive_command latency benchmark for pgsql-archlog. It starts a throwaway
+# PostgreSQL cluster with a pgsql catalog database and drives pgsql-archlog
+# with synthetic 16MB WAL segments:
+#  - at a configured rate, reporting per-call latency percentiles split into
+#    config parse, catalog connect, catalog queries, copy and fsync phases
+#    (collected by pgsql-archlog with ARCHTIMING),
+#  - back to back, reporting the maximum sustainable segments/sec.
+#
+# PostgreSQL binaries are taken from pg_config --bindir or -B, the script has
+# to be run as an unprivileged user as initdb refuses to run as root.
+#
+# usage: pgsql-archlog-bench.sh [-n segments] [-r segs/s] [-m segments] [-F yes|no]
+#                               [-a archdest] [-B pgbindir] [-P port] [-k]
+#
+
+NSEGS=100
+RATE=2
+NMAX=100
+FSYNC=yes
+ARCHDEST=
+PGBIN=
+PORT=55432
+KEEP=no
+# segments are archived on a timeline of their own, so only bench segments
+# are removed from an archive destination given with -a
+BENCHTLI=000000FF
+BINDIR=`cd \`dirname $0\` && pwd`
+WORK=/tmp/pgsql-archlog-bench.$$
+
+usage ()
+{
+   echo "usage: $0 [-n segments] [-r segs/s] [-m segments] [-F yes|no] [-a archdest] [-B pgbindir] [-P port] [-k]"
+   echo "   -n  number of segments archived at a given rate"
+   echo "   -r  archiving rate in segments per second"
+   echo "   -m  number of segments archived back to back for maximum rate"
+   echo "   -F  ARCHFSYNC setting"
+   echo "   -a  archive destination, default is a work directory"
+   echo "   -B  PostgreSQL binaries directory"
+   echo "   -P  port of throwaway PostgreSQL cluster"
+   echo "   -k  keep work directory"
+   exit 1
+}
+
+while getopts "n:r:m:F:a:B:P:k" opt
+do
+   case $opt in
+      n) NSEGS=$OPTARG ;;
+      r) RATE=$OPTARG ;;
+      m) NMAX=$OPTARG ;;
+      F) FSYNC=$OPTARG ;;
+      a) ARCHDEST=$OPTARG ;;
+      B) PGBIN=$OPTARG ;;
+      P) PORT=$OPTARG ;;
+      k) KEEP=yes ;;
+      *) usage ;;
+   esac
+done
+
+[ -z "$PGBIN" ] && PGBIN=`pg_config --bindir 2>/dev/null`
+if [ ! -x "$PGBIN/initdb" ]
+then
+   echo "PostgreSQL binaries not found, use -B <pgbindir>."
+   exit 2
+fi
+if [ ! -x "$BINDIR/pgsql-archlog" ]
+then
+   echo "$BINDIR/pgsql-archlog not found, run make first."
+   exit 2
+fi
+[ -z "$ARCHDEST" ] && ARCHDEST=$WORK/archdest
+
+cleanup ()
+{
+   [ -f $WORK/pgdata/postmaster.pid ] && $PGBIN/pg_ctl -D $WORK/pgdata -m immediate stop >/dev/null 2>&1
+   rm -f $ARCHDEST/${BENCHTLI}000000??000000??
+   [ "$KEEP" = "no" ] && rm -rf $WORK
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p $WORK/pg_wal $ARCHDEST || exit 2
+
+echo "Starting throwaway PostgreSQL on port $PORT ..."
+$PGBIN/initdb -D $WORK/pgdata -U pgcat --auth=trust >$WORK/initdb.log 2>&1 || { echo "initdb failed, see $WORK/initdb.log"; KEEP=yes; exit 2; }
+$PGBIN/pg_ctl -D $WORK/pgdata -w -l $WORK/postgresql.log \
+   -o "-p $PORT -k $WORK -c listen_addresses=127.0.0.1" start >/dev/null || { echo "PostgreSQL start failed, see $WORK/postgresql.log"; KEEP=yes; exit 2; }
+$PGBIN/createdb -h 127.0.0.1 -p $PORT -U pgcat catdb || exit 2
+$PGBIN/psql -q -h 127.0.0.1 -p $PORT -U pgcat -f $BINDIR/pgsql-tables.sql catdb >/dev/null 2>&1
+
+cat > $WORK/pgsql.conf << EOF
+CATDB = catdb
+CATDBHOST = 127.0.0.1
+CATDBPORT = $PORT
+CATUSER = pgcat
+CATPASSWD = pgcat
+ARCHDEST = $ARCHDEST
+ARCHCLIENT = bench
+ARCHFSYNC = $FSYNC
+ARCHTIMING = $WORK/timing
+EOF
+
+# PostgreSQL archives a segment just written, so a single source segment stays
+# in page cache as it would in pg_wal
+dd if=/dev/urandom of=$WORK/pg_wal/segment bs=1048576 count=16 2>/dev/null
+
+now ()
+{
+   date +%s.%N
+}
+
+# archives a segment with a given sequence number and records its wall latency
+archive ()
+{
+   WAL=`printf "${BENCHTLI}%08X%08X" $(( $1 / 256 )) $(( $1 % 256 ))`
+   S=`now`
+   if ! $BINDIR/pgsql-archlog -c $WORK/pgsql.conf $WAL $WORK/pg_wal/segment >/dev/null 2>&1
+   then
+      echo "   pgsql-archlog $WAL failed"
+   fi
+   echo "`now` $S" | awk '{ printf "%.6f\n", $1 - $2 }' >> $WORK/wall
+}
+
+# prints p50, p90, p99 and max of a timing file column in milliseconds
+percentiles ()
+{
+   awk "{ print \$$1 }" $2 | sort -n | awk '{ v[NR] = $1 * 1000 } END {
+      if ( NR == 0 ) { print "no data"; exit }
+      i50 = int(NR * 0.50); i90 = int(NR * 0.90); i99 = int(NR * 0.99)
+      printf "p50 %8.2f  p90 %8.2f  p99 %8.2f  max %8.2f ms\n",
+         v[i50 > 0 ? i50 : 1], v[i90 > 0 ? i90 : 1], v[i99 > 0 ? i99 : 1], v[NR] }'
+}
+
+report ()
+{
+   printf "   %-16s %s\n" "wall" "`percentiles 1 $WORK/wall`"
+   printf "   %-16s %s\n" "in process" "`percentiles 3 $WORK/timing`"
+   printf "   %-16s %s\n" "config parse" "`percentiles 4 $WORK/timing`"
+   printf "   %-16s %s\n" "catalog connect" "`percentiles 5 $WORK/timing`"
+   printf "   %-16s %s\n" "catalog queries" "`percentiles 6 $WORK/timing`"
+   printf "   %-16s %s\n" "copy" "`percentiles 8 $WORK/timing`"
+   printf "   %-16s %s\n" "fsync" "`percentiles 9 $WORK/timing`"
+   awk '$2 != 0 { e++ } END { if ( e ) printf "   %i calls failed\n", e }' $WORK/timing
+}
+
+echo "Archiving $NSEGS segments at $RATE segments/s, ARCHFSYNC=$FSYNC ..."
+rm -f $WORK/timing $WORK/wall
+LATE=0
+T0=`now`
+i=0
+while [ $i -lt $NSEGS ]
+do
+   archive $(( i + 16 ))
+   rm -f $ARCHDEST/${BENCHTLI}000000??000000??
+   i=$(( i + 1 ))
+   # next call is scheduled at T0 + i / RATE
+   D=`echo "\`now\` $T0 $i $RATE" | awk '{ printf "%.6f", $2 + $3 / $4 - $1 }'`
+   case $D in
+      -*) LATE=$(( LATE + 1 )) ;;
+      *) sleep $D ;;
+   esac
+done
+report
+[ $LATE -gt 0 ] && echo "   $LATE calls took longer than the archiving interval"
+
+echo "Archiving $NMAX segments back to back ..."
+rm -f $WORK/timing $WORK/wall
+T0=`now`
+i=0
+while [ $i -lt $NMAX ]
+do
+   archive $(( i + 16 + NSEGS ))
+   i=$(( i + 1 ))
+done
+T=`now`
+report
+echo "$T $T0 $NMAX" | awk '{ printf "   maximum sustainable rate %.2f segments/s (%.1f MB/s)\n", $3 / ($1 - $2), $3 * 16 / ($1 - $2) }'
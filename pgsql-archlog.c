@@ -26,6 +26,21 @@
    CATPASSWD = <catalog.db.password>
    ARCHDEST = <destination.of.archived.wal's.path>
    ARCHCLIENT = <name.of.archived.client>
+   ARCHFSYNC = <yes.to.flush.archived.wal.to.disk.before.success>
+   ARCHTIMING = <file.to.append.per.call.timing.lines>
+   WALSUMMARY = <yes.to.summarize.changed.blocks.of.archived.wal>
+   WALINDEX = <yes.to.index.commit.times.and.xids.of.archived.wal>
+
+   With WALSUMMARY every archived WAL segment is decoded and a list of relation
+   blocks changed by its records is saved in catalog (pgsql_walsummaries), so
+   incremental and differential database backups read changed blocks only.
+   A summary failure is reported but it does not fail archiving, a backup then
+   falls back to file level incremental.
+
+   With WALINDEX commit and abort records of every archived WAL segment are
+   indexed in catalog (pgsql_walsummaries): their count, timestamp and
+   transaction id ranges, so pgsql-restore knows the last segment required by
+   recovery_target_time or recovery_target_xid and finds WAL covering a time.
 
    Next, you have to restart database instance, and check database log if everything is ok.
 */
@@ -60,7 +75,9 @@ TODO:
 #include <errno.h>
 #include <string.h>
 #include "pgsqllib.h"
- 
+#include "pgsqlwal.h"
+#include "utils.h"
+
 /*
  * pgsql-archlog exit status:
  *  0 - OK
@@ -102,6 +119,71 @@ enum ARCHEXITS {
    EXITARCHERROR  = 17,
 };
 
+/*
+ * archiving time split into phases, collected for ARCHTIMING
+ */
+typedef struct _archtiming archtiming;
+struct _archtiming {
+   double start;
+   double parse;        /* config file parsing */
+   double connect;      /* catalog database connection */
+   double sql;          /* catalog queries */
+   double copy;         /* WAL file copy */
+   double fsync;        /* archived WAL file and ARCHDEST flush */
+   double summary;      /* WAL decoding and summary save (WALSUMMARY, WALINDEX) */
+   int queries;
+};
+
+static archtiming timing;
+
+/*
+ * executes a catalog query and accounts its time
+ */
+PGresult * catdb_exec ( pgsqldata * pdata, const char * sql ){
+
+   PGresult * result;
+   double start;
+
+   start = monotonic_time ();
+   result = PQexec ( pdata->catdb, sql );
+   timing.sql += monotonic_time () - start;
+   timing.queries++;
+
+   return result;
+}
+
+/*
+ * appends a timing line of current call into ARCHTIMING file:
+ *    <walfile> <status> <total> <parse> <connect> <sql> <queries> <copy> <fsync> <summary>
+ * times are in seconds
+ */
+void report_archive_timing ( pgsqldata * pdata, int status ){
+
+   char * path;
+   FILE * fp;
+   int err;
+
+   path = search_key ( pdata->paramlist, "ARCHTIMING" );
+   if ( ! path ){
+      return;
+   }
+   fp = fopen ( path, "a" );
+   if ( ! fp ){
+      logprg ( LOGWARNING, "ARCHTIMING file open problem:" );
+      logprg ( LOGWARNING, strerror ( errno ) );
+      return;
+   }
+   fprintf ( fp, "%s %i %.6f %.6f %.6f %.6f %i %.6f %.6f %.6f\n",
+         pdata->walfilename, status, monotonic_time () - timing.start,
+         timing.parse, timing.connect, timing.sql, timing.queries,
+         timing.copy, timing.fsync, timing.summary );
+   err = ferror ( fp );
+   if ( fclose ( fp ) || err ){
+      logprg ( LOGWARNING, "ARCHTIMING file write problem:" );
+      logprg ( LOGWARNING, strerror ( errno ) );
+   }
+}
+
 /*
  * connects into catalog database
  * uppon succesful fills required pgdata structure fields
@@ -113,7 +195,11 @@ enum ARCHEXITS {
  */
 void dbconnect ( pgsqldata * pdata, int abort ){
 
+   double start;
+
+   start = monotonic_time ();
    pdata->catdb = catdbconnect ( pdata->paramlist );
+   timing.connect += monotonic_time () - start;
    if ( !pdata->catdb && abort ){
       abortprg ( pdata, EXITECATDB, "Problem connecting to catalog database!" );
    }
@@ -231,6 +317,7 @@ void check_env_setup ( pgsqldata * pdata ){
 void parse_args ( pgsqldata * pdata, int argc, char* argv[] ){
 
    char * configfile = NULL;
+   double start;
    int i;
 
    if ( argc < 3 ){
@@ -274,7 +361,59 @@ void parse_args ( pgsqldata * pdata, int argc, char* argv[] ){
    printf ( "path to wal file: %s\n", pdata->pathtowalfilename );
 #endif
 
+   start = monotonic_time ();
    pdata->paramlist = parse_pgsql_conf ( configfile );
+   timing.parse = monotonic_time () - start;
+}
+
+/*
+ * flushes an archived WAL file and its directory entry to disk, so PostgreSQL
+ * could remove a WAL segment as soon as archive_command returns success
+ *
+ * input:
+ *  pdata - primary data
+ *  arch - archived wal file path
+ * output return codes:
+ *  0 - success;
+ *  1 - error;
+ */
+int fsync_wal_file ( pgsqldata * pdata, const char * arch ){
+
+   int fd;
+   int err;
+
+   fd = open ( arch, O_RDONLY );
+   if ( fd < 0 ){
+      logprg ( LOGERROR, "Archived WAL access problem:" );
+      logprg ( LOGERROR, strerror ( errno ) );
+      return 1;
+   }
+   err = fsync ( fd );
+   close ( fd );
+   if ( err ){
+      logprg ( LOGERROR, "Archived WAL flush problem:" );
+      logprg ( LOGERROR, strerror ( errno ) );
+      return 1;
+   }
+
+   fd = open ( search_key ( pdata->paramlist, "ARCHDEST" ), O_RDONLY );
+   if ( fd < 0 ){
+      logprg ( LOGERROR, "ARCHDEST access problem:" );
+      logprg ( LOGERROR, strerror ( errno ) );
+      return 1;
+   }
+   err = fsync ( fd );
+   /* some filesystems do not support directory fsync (EINVAL), it is not an error */
+   if ( err && errno == EINVAL ){
+      err = 0;
+   }
+   if ( err ){
+      logprg ( LOGERROR, "ARCHDEST flush problem:" );
+      logprg ( LOGERROR, strerror ( errno ) );
+   }
+   close ( fd );
+
+   return err ? 1 : 0;
 }
 
 /*
@@ -293,6 +432,7 @@ int perform_copy_wal_file ( pgsqldata * pdata ){
 
    int err;
    char * arch;
+   double start;
    
    arch = MALLOC ( BUFLEN );
 
@@ -302,13 +442,237 @@ int perform_copy_wal_file ( pgsqldata * pdata ){
          search_key ( pdata->paramlist, "ARCHDEST" ),
          pdata->walfilename );
 
+   start = monotonic_time ();
    err = _copy_wal_file ( pdata, pdata->pathtowalfilename, arch);
+   timing.copy += monotonic_time () - start;
+
+   if ( ! err && check_param_bool ( pdata->paramlist, "ARCHFSYNC", 0 ) ){
+      start = monotonic_time ();
+      err = fsync_wal_file ( pdata, arch );
+      timing.fsync += monotonic_time () - start;
+   }
 
    FREE ( arch );
    
    return err;
 }
 
+/*
+ * loads a record which started in a previous segment and continues in this
+ * one, saved in catalog with a summary of the previous segment
+ *
+ * input:
+ *    pdata - primary data
+ *    wr - WAL reader
+ *    segstart - LSN of summarized segment
+ */
+void load_wal_summary_tail ( pgsqldata * pdata, walreader * wr, uint64_t segstart ){
+
+   char * sql;
+   PGresult * result;
+   unsigned char * tail;
+   size_t len;
+
+   sql = MALLOC ( SQLLEN );
+   ASSERT_NVAL_RET ( sql );
+   snprintf ( sql, SQLLEN, "select tail_lsn, tail_total, tail from pgsql_walsummaries where client='%s' "
+         "and next_lsn=%llu and tail is not null order by id desc limit 1",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ),
+         (unsigned long long) segstart );
+   result = catdb_exec ( pdata, sql );
+   FREE ( sql );
+
+   if ( PQresultStatus ( result ) == PGRES_TUPLES_OK && PQntuples ( result ) == 1 ){
+      tail = PQunescapeBytea ( (unsigned char *) PQgetvalue ( result, 0, 2 ), &len );
+      if ( tail ){
+         walreader_set_tail ( wr, strtoull ( PQgetvalue ( result, 0, 0 ), NULL, 10 ),
+               strtoul ( PQgetvalue ( result, 0, 1 ), NULL, 10 ), tail, len, segstart );
+         PQfreemem ( tail );
+      }
+   }
+   PQclear ( result );
+}
+
+/* a decoder callback argument, a WAL summary and a transaction index of a segment */
+typedef struct _walsegindex walsegindex;
+struct _walsegindex {
+   walsummary * ws;
+   walxactindex * wx;
+};
+
+/*
+ * a decoder callback which feeds both a WAL summary and a transaction index
+ */
+void walsegindex_record ( const walrecord * rec, void * arg ){
+
+   walsegindex * si = (walsegindex *) arg;
+
+   if ( si->ws ){
+      walsummary_record ( rec, si->ws );
+   }
+   if ( si->wx ){
+      walxact_record ( rec, si->wx );
+   }
+}
+
+/*
+ * renders a PostgreSQL timestamp as SQL expression of timestamptz
+ *
+ * input:
+ *    buf - output buffer
+ *    len - size of buf
+ *    pgtime - microseconds since 2000-01-01 00:00:00 UTC
+ */
+void format_wal_time ( char * buf, int len, int64_t pgtime ){
+
+   snprintf ( buf, len, "'2000-01-01 00:00:00+00'::timestamptz + %lld * interval '1 microsecond'",
+         (long long) pgtime );
+}
+
+/*
+ * decodes an archived WAL segment and saves a summary of changed blocks and
+ * a transaction index in catalog (pgsql_walsummaries), a record which
+ * continues in the next segment is saved with it, so the next call completes it
+ *
+ * input:
+ *    pdata - primary data
+ *    summary - save a summary of changed blocks (WALSUMMARY)
+ *    walindex - save a transaction index (WALINDEX)
+ * output:
+ *    0 - summary saved
+ *    1 - error, a warning is logged
+ */
+int summarize_wal_file ( pgsqldata * pdata, int summary, int walindex ){
+
+   unsigned char * seg = NULL;
+   walreader wr;
+   walsummary * ws = NULL;
+   walxactindex wx;
+   walsegindex si;
+   struct stat st;
+   char * text = NULL;
+   char * sql = NULL;
+   char tailinfo [ 64 ];
+   char mintime [ 96 ];
+   char maxtime [ 96 ];
+   char xactinfo [ 320 ];
+   const char * values [ 2 ];
+   int lengths [ 2 ];
+   int formats [ 2 ] = { 0, 1 };
+   PGresult * result;
+   ssize_t nr;
+   size_t len = 0;
+   uint64_t segstart;
+   double start;
+   int err = 1;
+   int fd;
+
+   /* history, backup label and partial files have nothing to summarize */
+   if ( strlen ( pdata->walfilename ) != 24 || strspn ( pdata->walfilename, "0123456789ABCDEF" ) != 24 ){
+      return 0;
+   }
+
+   start = monotonic_time ();
+   if ( walreader_init ( &wr ) != 0 ){
+      logprg ( LOGWARNING, "WAL summary: out of memory." );
+      return 1;
+   }
+
+   fd = open ( pdata->pathtowalfilename, O_RDONLY );
+   if ( fd < 0 || fstat ( fd, &st ) != 0 || ! ( seg = (unsigned char *) malloc ( st.st_size ) ) ){
+      logprg ( LOGWARNING, "WAL summary: cannot read WAL file." );
+      goto bailout;
+   }
+   while ( len < (size_t) st.st_size && ( nr = read ( fd, seg + len, st.st_size - len ) ) > 0 ){
+      len += nr;
+   }
+   if ( len < WALLONGPHD ){
+      logprg ( LOGWARNING, "WAL summary: cannot read WAL file." );
+      goto bailout;
+   }
+
+   /* a segment start from the first page header */
+   memcpy ( &segstart, seg + 8, sizeof ( segstart ) );
+   load_wal_summary_tail ( pdata, &wr, segstart );
+
+   /* a summary is built even when not saved, it counts block references */
+   ws = walsummary_alloc ();
+   walxact_init ( &wx );
+   si.ws = ws;
+   si.wx = walindex ? &wx : NULL;
+   if ( ! ws || wal_decode_segment ( &wr, seg, len, walsegindex_record, &si ) != 0 ||
+         ( summary && ! ( text = walsummary_format ( ws ) ) ) ){
+      logprg ( LOGWARNING, "WAL summary: unsupported WAL format or out of memory." );
+      goto bailout;
+   }
+
+   if ( ! walindex ){
+      snprintf ( xactinfo, sizeof ( xactinfo ), "null, null, null, null, null, null, null" );
+   } else if ( wx.commits + wx.aborts == 0 ){
+      snprintf ( xactinfo, sizeof ( xactinfo ), "0, 0, null, null, null, null, 0" );
+   } else {
+      format_wal_time ( mintime, sizeof ( mintime ), wx.mintime );
+      format_wal_time ( maxtime, sizeof ( maxtime ), wx.maxtime );
+      if ( wx.maxxid ){
+         snprintf ( xactinfo, sizeof ( xactinfo ), "%lld, %lld, %s, %s, %u, %u, %lld",
+               (long long) wx.commits, (long long) wx.aborts, mintime, maxtime,
+               wx.minxid, wx.maxxid, (long long) wx.unknownxids );
+      } else {
+         snprintf ( xactinfo, sizeof ( xactinfo ), "%lld, %lld, %s, %s, null, null, %lld",
+               (long long) wx.commits, (long long) wx.aborts, mintime, maxtime,
+               (long long) wx.unknownxids );
+      }
+   }
+
+   if ( wr.reclen ){
+      snprintf ( tailinfo, sizeof ( tailinfo ), "%llu, %u, %llu",
+            (unsigned long long) wr.reclsn, wr.rectot, (unsigned long long) wr.contlsn );
+   } else {
+      snprintf ( tailinfo, sizeof ( tailinfo ), "null, null, null" );
+   }
+
+   sql = MALLOC ( BUFLEN );
+   snprintf ( sql, BUFLEN, "delete from pgsql_walsummaries where client='%s' and filename='%s'",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ),
+         pdata->walfilename );
+   PQclear ( catdb_exec ( pdata, sql ) );
+
+   snprintf ( sql, BUFLEN, "insert into pgsql_walsummaries (client, filename, tli, start_lsn, end_lsn, "
+         "records, blocks, summary, tail_lsn, tail_total, next_lsn, tail, "
+         "commits, aborts, min_time, max_time, min_xid, max_xid, unknown_xids) values "
+         "('%s', '%s', %u, %llu, %llu, %lld, %lld, $1, %s, $2, %s)",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ),
+         pdata->walfilename, wr.tli,
+         (unsigned long long) wr.covstart, (unsigned long long) wr.covend,
+         (long long) wr.records, (long long) ws->blocks, tailinfo, xactinfo );
+   values [ 0 ] = text;
+   lengths [ 0 ] = 0;
+   values [ 1 ] = wr.reclen ? (const char *) wr.rec : NULL;
+   lengths [ 1 ] = wr.reclen;
+
+   result = PQexecParams ( pdata->catdb, sql, 2, NULL, values, lengths, formats, 0 );
+   timing.queries++;
+   if ( PQresultStatus ( result ) != PGRES_COMMAND_OK ){
+      logprg ( LOGWARNING, "WAL summary: CATDB: SQL insert error!" );
+   } else {
+      err = 0;
+   }
+   PQclear ( result );
+
+bailout:
+   if ( fd >= 0 ){
+      close ( fd );
+   }
+   FREE ( sql );
+   free ( text );
+   free ( seg );
+   walsummary_free ( ws );
+   walreader_free ( &wr );
+   timing.summary += monotonic_time () - start;
+
+   return err;
+}
+
 /*
  * gets information of walid from catalog database
  * 
@@ -329,7 +693,7 @@ int get_walid_from_catalog ( pgsqldata * pdata ){
          search_key ( pdata->paramlist, "ARCHCLIENT" ),
          pdata->walfilename );
 
-   result = PQexec ( pdata->catdb, sql );
+   result = catdb_exec ( pdata, sql );
    FREE ( sql );
    
    if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
@@ -365,7 +729,7 @@ int insert_status_in_catalog ( pgsqldata * pdata, int status ){
          search_key ( pdata->paramlist, "ARCHCLIENT" ),
          pdata->walfilename, status );
 
-   result = PQexec ( pdata->catdb, sql );
+   result = catdb_exec ( pdata, sql );
    FREE ( sql );
    
    if ( PQresultStatus ( result ) != PGRES_COMMAND_OK ){
@@ -395,7 +759,7 @@ int update_status_in_catalog ( pgsqldata * pdata, int pgid, int status ){
    snprintf ( sql, SQLLEN, "update pgsql_archivelogs set status = %i, mod_date = now() where id='%i'",
          status, pgid );
 
-   result = PQexec ( pdata->catdb, sql );
+   result = catdb_exec ( pdata, sql );
    FREE ( sql );
    
    if ( PQresultStatus ( result ) != PGRES_COMMAND_OK ){
@@ -498,7 +862,7 @@ int perform_another_wal_archive ( pgsqldata * pdata, int pgid ){
    ASSERT_NVAL_RET_ONE ( sql );
    
    snprintf ( sql, SQLLEN, "select status from pgsql_archivelogs where id='%i'", pgid);
-   result = PQexec ( pdata->catdb, sql );
+   result = catdb_exec ( pdata, sql );
    FREE ( sql );
    if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
       abortprg ( pdata, EXITCATDBERROR, "SQL Exec error!" );
@@ -554,9 +918,12 @@ int perform_another_wal_archive ( pgsqldata * pdata, int pgid ){
 int main(int argc, char* argv[]){
 
    pgsqldata * pdata;
+   int summary;
+   int walindex;
    int pgid;
    int err;
 
+   timing.start = monotonic_time ();
    pgsqllibinit ( argc, argv );
 
    pdata = allocpdata ();
@@ -572,7 +939,13 @@ int main(int argc, char* argv[]){
       /* there was a prievious or is an archiving process, check what was or is going on */
       err = perform_another_wal_archive ( pdata, pgid );
    }
+   summary = check_param_bool ( pdata->paramlist, "WALSUMMARY", 0 );
+   walindex = check_param_bool ( pdata->paramlist, "WALINDEX", 0 );
+   if ( ! err && ( summary || walindex ) ){
+      summarize_wal_file ( pdata, summary, walindex );
+   }
    /* check status of operation */
+   report_archive_timing ( pdata, err );
    if ( err ){
       /* inform about copy wal file error */
       abortprg ( pdata, EXITARCHDPROB, "WAL archiving problem!" );
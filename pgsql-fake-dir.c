@@ -0,0 +1,768 @@
+/*
+ * Copyright (c) 2013 by Inteos sp. z o.o.
+ * All rights reserved. See LICENSE.Inteos for details.
+ *
+ * A local stand-in for Bacula Director used for pgsql-restore tests and
+ * benchmarks. It speaks a console protocol with CRAM-MD5 authentication and
+ * answers only the commands pgsql-restore uses:
+ *
+ *    .filesets
+ *    restore ... select [yes]      ls      add <path>      .      done
+ *    restore ... file=<pgsqlarch:client/wal> ... done yes
+ *    wait jobid=<N>
+ *
+ * A restore job "restores" files from local directories: WAL files from a WAL
+ * source directory and database files from a copy of cluster directory.
+ * A job runs when pgsql-restore waits for it, with injected job start latency
+ * and optional throughput limit, so Director round trips and job scheduling
+ * overhead could be reproduced without a real Bacula.
+ *
+ * usage: pgsql-fake-dir [-a address] [-p port] [-n dirname] [-P password]
+ *                       [-w waldir] [-d dbdir] [-t target] [-l jobms] [-L cmdms]
+ *                       [-r MB/s] [-e N] [-v]
+ */
+
+#include "bacula.h"
+
+#include <stdarg.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "utils.h"
+
+/*
+ * libbac uses its own sscanf implementation which is not compatible with
+ * libc implementation, unfortunately. usage of bsscanf require format string rewriting.
+ */
+#ifdef sscanf
+#undef sscanf
+#endif
+
+/* console protocol end of data signal */
+#define FD_EOD          -1
+#define FDMSGLEN        65536
+#define FDMAXFILES      1024
+#define FDCOPYBUF       ( 1024 * 1024 )
+
+/* fake director settings */
+typedef struct _fakedir fakedir;
+struct _fakedir {
+   const char * address;
+   int      port;
+   const char * name;
+   const char * password;
+   const char * waldir;       /* source of archived WAL files */
+   const char * dbdir;        /* source of database files */
+   const char * target;       /* database restore location when where is empty */
+   int      joblatency;       /* job start latency in ms */
+   int      cmdlatency;       /* command latency in ms */
+   double   mbps;             /* restore throughput limit, 0 unlimited */
+   int      failevery;        /* every N-th job fails */
+   int      verbose;
+};
+
+/* restore job prepared by a restore command */
+typedef struct _fakejob fakejob;
+struct _fakejob {
+   int      jobid;
+   int      queued;
+   int      db;               /* database files restore */
+   char     where [ PATH_MAX ];
+   char     * files [ FDMAXFILES ];
+   int      nfiles;
+};
+
+/* console session state */
+typedef struct _fakesession fakesession;
+struct _fakesession {
+   fakedir  * fd;
+   int      sock;
+   char     client [ 128 ];
+   int      intree;           /* restore tree selection mode */
+   int      treetype;         /* 0 - database fileset, 1 - WAL fileset */
+   int      marked;
+   int      jobseq;
+   fakejob  job;
+   double   throttle;         /* time when next copy chunk is allowed */
+};
+
+static const char * filesets[] = { "pgsql-db", "pgsql-arch" };
+
+static void fdlog ( fakedir * fd, const char * fmt, ... ){
+
+   va_list args;
+
+   if ( fd->verbose ){
+      va_start ( args, fmt );
+      fprintf ( stderr, "pgsql-fake-dir[%d]: ", (int) getpid () );
+      vfprintf ( stderr, fmt, args );
+      fprintf ( stderr, "\n" );
+      va_end ( args );
+   }
+}
+
+static void fdsleep ( int ms ){
+
+   struct timespec ts;
+
+   if ( ms > 0 ){
+      ts.tv_sec = ms / 1000;
+      ts.tv_nsec = ( ms % 1000 ) * 1000000L;
+      nanosleep ( &ts, NULL );
+   }
+}
+
+/*
+ * writes a whole buffer into socket
+ */
+static int fd_write_full ( int sock, const char * buf, int len ){
+
+   int err;
+
+   while ( len > 0 ){
+      err = write ( sock, buf, len );
+      if ( err < 0 && errno == EINTR ){
+         continue;
+      }
+      if ( err <= 0 ){
+         return 1;
+      }
+      buf += err;
+      len -= err;
+   }
+
+   return 0;
+}
+
+/*
+ * reads a whole buffer from socket
+ */
+static int fd_read_full ( int sock, char * buf, int len ){
+
+   int err;
+
+   while ( len > 0 ){
+      err = read ( sock, buf, len );
+      if ( err < 0 && errno == EINTR ){
+         continue;
+      }
+      if ( err <= 0 ){
+         return 1;
+      }
+      buf += err;
+      len -= err;
+   }
+
+   return 0;
+}
+
+/*
+ * sends a console message, a message is prefixed with its length in network order
+ */
+static int fd_send ( fakesession * fs, const char * fmt, ... ){
+
+   char msg [ FDMSGLEN ];
+   int32_t blen;
+   va_list args;
+   int len;
+
+   va_start ( args, fmt );
+   len = vsnprintf ( msg + sizeof ( blen ), FDMSGLEN - sizeof ( blen ), fmt, args );
+   va_end ( args );
+   if ( len >= FDMSGLEN - (int) sizeof ( blen ) ){
+      len = FDMSGLEN - sizeof ( blen ) - 1;
+   }
+   blen = (int32_t) htonl ( len );
+   memcpy ( msg, &blen, sizeof ( blen ) );
+
+   return fd_write_full ( fs->sock, msg, len + sizeof ( blen ) );
+}
+
+/*
+ * sends an end of data signal which finishes a command answer
+ */
+static int fd_signal ( fakesession * fs, int sig ){
+
+   int32_t blen;
+
+   blen = (int32_t) htonl ( sig );
+
+   return fd_write_full ( fs->sock, (char *) &blen, sizeof ( blen ) );
+}
+
+/*
+ * receives a console message
+ *
+ * out:
+ *    message length, -1 on error or connection close
+ */
+static int fd_recv ( fakesession * fs, char * msg, int size ){
+
+   int32_t blen;
+
+   do {
+      if ( fd_read_full ( fs->sock, (char *) &blen, sizeof ( blen ) ) ){
+         return -1;
+      }
+      blen = ntohl ( blen );
+      /* signals from client are ignored */
+   } while ( blen <= 0 );
+   if ( blen >= size ){
+      return -1;
+   }
+   if ( fd_read_full ( fs->sock, msg, blen ) ){
+      return -1;
+   }
+   msg [ blen ] = 0;
+   /* strip end of line */
+   while ( blen > 0 && ( msg [ blen - 1 ] == '\n' || msg [ blen - 1 ] == '\r' ) ){
+      msg [ --blen ] = 0;
+   }
+
+   return blen;
+}
+
+/*
+ * computes a CRAM-MD5 response the same way Bacula does, a console password is
+ * a hex string of MD5 digest of a configured password
+ */
+static void fd_cram_response ( fakedir * fd, const char * chal, char * out, int len ){
+
+   struct MD5Context md5c;
+   unsigned char digest [ CRYPTO_DIGEST_MD5_SIZE ];
+   char password [ CRYPTO_DIGEST_MD5_SIZE * 2 + 1 ];
+   uint8_t hmac [ 20 ];
+   unsigned int i;
+
+   MD5Init ( &md5c );
+   MD5Update ( &md5c, (unsigned char *) fd->password, strlen ( fd->password ) );
+   MD5Final ( digest, &md5c );
+   for ( i = 0; i < sizeof ( digest ); i++ ){
+      sprintf ( &password [ i * 2 ], "%02x", digest [ i ] );
+   }
+
+   hmac_md5 ( (uint8_t *) chal, strlen ( chal ), (uint8_t *) password, strlen ( password ), hmac );
+   bin_to_base64 ( out, len, (char *) hmac, 16, 1 );
+}
+
+/*
+ * performs a director side of console authentication
+ *
+ * out:
+ *    0 - on success
+ *    1 - on error
+ */
+static int fd_auth ( fakesession * fs ){
+
+   char msg [ FDMSGLEN ];
+   char chal [ 256 ];
+   char expect [ 64 ];
+   int tls;
+
+   /* R: Hello <name> calling */
+   if ( fd_recv ( fs, msg, FDMSGLEN ) < 0 || sscanf ( msg, "Hello %127s calling", fs->client ) != 1 ){
+      return 1;
+   }
+
+   /* S: auth cram-md5 <chal> ssl=0 */
+   snprintf ( chal, sizeof ( chal ), "<%u.%u@%s>", (unsigned) getpid (), (unsigned) time ( NULL ),
+         fs->fd->name );
+   fd_send ( fs, "auth cram-md5 %s ssl=0\n", chal );
+   if ( fd_recv ( fs, msg, FDMSGLEN ) < 0 ){
+      return 1;
+   }
+   fd_cram_response ( fs->fd, chal, expect, sizeof ( expect ) );
+   if ( strcmp ( msg, expect ) != 0 ){
+      fd_send ( fs, "1999 Authorization failed.\n" );
+      fdlog ( fs->fd, "authorization of %s failed", fs->client );
+      return 1;
+   }
+   fd_send ( fs, "1000 OK auth\n" );
+
+   /* R: auth cram-md5 <chal> ssl=N, S: response */
+   if ( fd_recv ( fs, msg, FDMSGLEN ) < 0 || sscanf ( msg, "auth cram-md5 %255s ssl=%d", chal, &tls ) != 2 ){
+      return 1;
+   }
+   fd_cram_response ( fs->fd, chal, expect, sizeof ( expect ) );
+   fd_send ( fs, "%s", expect );
+   if ( fd_recv ( fs, msg, FDMSGLEN ) < 0 || strncmp ( msg, "1000 OK", 7 ) != 0 ){
+      return 1;
+   }
+   fd_send ( fs, "1000 OK: %s Version: 5.2.13 (fake)\n", fs->fd->name );
+   fd_send ( fs, "You have no messages.\n" );
+   fd_signal ( fs, FD_EOD );
+
+   fdlog ( fs->fd, "console %s authorized", fs->client );
+
+   return 0;
+}
+
+/*
+ * finds a quoted or plain parameter value in a command, i.e. where="..."
+ */
+static int fd_param ( const char * cmd, const char * key, char * val, int len, const char ** next ){
+
+   const char * p;
+   const char * e;
+   int klen = strlen ( key );
+   int n;
+
+   for ( p = cmd; ( p = strstr ( p, key ) ); p += klen ){
+      if ( ( p == cmd || p [ -1 ] == ' ' ) && p [ klen ] == '=' ){
+         break;
+      }
+   }
+   if ( ! p ){
+      return 0;
+   }
+   p += klen + 1;
+   if ( *p == '"' ){
+      p++;
+      e = strchr ( p, '"' );
+      /* where="""" is an empty value */
+      if ( e == p && e [ 1 ] == '"' ){
+         e++;
+         p = e;
+      }
+   } else {
+      e = strchr ( p, ' ' );
+   }
+   if ( ! e ){
+      e = p + strlen ( p );
+   }
+   n = e - p < len - 1 ? e - p : len - 1;
+   memcpy ( val, p, n );
+   val [ n ] = 0;
+   if ( next ){
+      *next = *e ? e + 1 : e;
+   }
+
+   return 1;
+}
+
+/*
+ * copies a file with throughput limit
+ */
+static int fd_copy_file ( fakesession * fs, const char * src, const char * dst, mode_t mode ){
+
+   char * buf;
+   int in;
+   int out;
+   ssize_t nr;
+   double now;
+   int err = 0;
+
+   in = open ( src, O_RDONLY );
+   if ( in < 0 ){
+      fdlog ( fs->fd, "cannot open %s: %s", src, strerror ( errno ) );
+      return 1;
+   }
+   unlink ( dst );
+   out = open ( dst, O_WRONLY | O_CREAT | O_TRUNC, mode & 07777 );
+   buf = (char *) malloc ( FDCOPYBUF );
+   if ( out < 0 || ! buf ){
+      fdlog ( fs->fd, "cannot create %s: %s", dst, strerror ( errno ) );
+      close ( in );
+      if ( out >= 0 ){
+         close ( out );
+      }
+      free ( buf );
+      return 1;
+   }
+   while ( ( nr = read ( in, buf, FDCOPYBUF ) ) > 0 ){
+      if ( fd_write_full ( out, buf, nr ) ){
+         err = 1;
+         break;
+      }
+      if ( fs->fd->mbps > 0 ){
+         /* every chunk has its time slot */
+         now = monotonic_time ();
+         if ( fs->throttle < now ){
+            fs->throttle = now;
+         }
+         fs->throttle += nr / ( fs->fd->mbps * 1024 * 1024 );
+         if ( fs->throttle > now ){
+            fdsleep ( (int) ( ( fs->throttle - now ) * 1000 ) );
+         }
+      }
+   }
+   if ( nr < 0 ){
+      err = 1;
+   }
+   free ( buf );
+   close ( in );
+   close ( out );
+
+   return err;
+}
+
+/* a session used by nftw callback */
+static fakesession * copysession = NULL;
+static int copybaselen = 0;
+static const char * copytarget = NULL;
+static int copyerrors = 0;
+
+static int fd_copy_entry ( const char * path, const struct stat * st, int flag, struct FTW * ftw ){
+
+   char dst [ PATH_MAX ];
+   char link [ PATH_MAX ];
+   int len;
+
+   snprintf ( dst, PATH_MAX, "%s%s", copytarget, path + copybaselen );
+   switch ( flag ){
+      case FTW_D:
+         if ( mkdir ( dst, st->st_mode & 07777 ) && errno != EEXIST ){
+            copyerrors++;
+         }
+         break;
+      case FTW_SL:
+         len = readlink ( path, link, PATH_MAX - 1 );
+         if ( len >= 0 ){
+            link [ len ] = 0;
+            unlink ( dst );
+            if ( symlink ( link, dst ) ){
+               copyerrors++;
+            }
+         }
+         break;
+      case FTW_F:
+         copyerrors += fd_copy_file ( copysession, path, dst, st->st_mode );
+         break;
+      default:
+         break;
+   }
+
+   return 0;
+}
+
+/*
+ * executes a queued restore job
+ *
+ * out:
+ *    0 - job finished successfully
+ *    1 - job failed
+ */
+static int fd_run_job ( fakesession * fs ){
+
+   fakejob * job = &fs->job;
+   char src [ PATH_MAX ];
+   char dst [ PATH_MAX ];
+   const char * name;
+   const char * target;
+   double start;
+   int err = 0;
+   int a;
+
+   start = monotonic_time ();
+   fdsleep ( fs->fd->joblatency );
+
+   if ( fs->fd->failevery > 0 && job->jobid % fs->fd->failevery == 0 ){
+      fdlog ( fs->fd, "JobId=%d injected failure", job->jobid );
+      return 1;
+   }
+
+   if ( job->db ){
+      target = job->where [ 0 ] ? job->where : fs->fd->target;
+      if ( ! fs->fd->dbdir || ! target ){
+         fdlog ( fs->fd, "JobId=%d no database source or target", job->jobid );
+         return 1;
+      }
+      mkdir ( target, 0700 );
+      copysession = fs;
+      copybaselen = strlen ( fs->fd->dbdir );
+      copytarget = target;
+      copyerrors = 0;
+      nftw ( fs->fd->dbdir, fd_copy_entry, 32, FTW_PHYS );
+      err = copyerrors ? 1 : 0;
+   } else {
+      for ( a = 0; a < job->nfiles && ! err; a++ ){
+         /* pgsqlarch:<client>/<walname> */
+         name = strrchr ( job->files [ a ], '/' );
+         name = name ? name + 1 : job->files [ a ];
+         snprintf ( src, PATH_MAX, "%s/%s", fs->fd->waldir ? fs->fd->waldir : ".", name );
+         snprintf ( dst, PATH_MAX, "%s/%s", job->where [ 0 ] ? job->where : "/tmp", name );
+         err = fd_copy_file ( fs, src, dst, 0600 );
+      }
+   }
+
+   fdlog ( fs->fd, "JobId=%d %s %s in %.3fs", job->jobid, job->db ? "database" : "WAL",
+         err ? "failed" : "done", monotonic_time () - start );
+
+   return err;
+}
+
+static void fd_reset_job ( fakesession * fs ){
+
+   int a;
+
+   for ( a = 0; a < fs->job.nfiles; a++ ){
+      free ( fs->job.files [ a ] );
+   }
+   memset ( &fs->job, 0, sizeof ( fakejob ) );
+   fs->intree = 0;
+   fs->marked = 0;
+}
+
+/*
+ * queues a restore job and answers with its JobId
+ */
+static void fd_queue_job ( fakesession * fs ){
+
+   fs->job.jobid = ( getpid () % 10000 ) * 1000 + ++fs->jobseq;
+   fs->job.queued = 1;
+   fs->intree = 0;
+   fd_send ( fs, "Bootstrap records written to /tmp/fake-dir.restore.%d.bsr\n", fs->jobseq );
+   fd_send ( fs, "Job queued. JobId=%d\n", fs->job.jobid );
+}
+
+/*
+ * handles a restore command
+ */
+static void fd_cmd_restore ( fakesession * fs, const char * cmd ){
+
+   char fileset [ 256 ];
+   char file [ PATH_MAX ];
+   const char * p;
+
+   fd_reset_job ( fs );
+   fd_param ( cmd, "where", fs->job.where, PATH_MAX, NULL );
+   if ( ! fd_param ( cmd, "fileset", fileset, sizeof ( fileset ), NULL ) ){
+      fd_send ( fs, "No FileSet specified.\n" );
+      return;
+   }
+   fs->treetype = strcmp ( fileset, filesets [ 1 ] ) == 0;
+
+   /* file= entries with done restore a set of files without a selection tree */
+   p = cmd;
+   while ( fs->job.nfiles < FDMAXFILES && fd_param ( p, "file", file, PATH_MAX, &p ) ){
+      fs->job.files [ fs->job.nfiles++ ] = strdup ( file );
+   }
+   if ( strstr ( cmd, " done" ) ){
+      fd_queue_job ( fs );
+      return;
+   }
+
+   fs->job.db = ! fs->treetype;
+   fs->intree = 1;
+   fd_send ( fs, "You have selected the following JobId: 1\n" );
+   fd_send ( fs, "Building directory tree for JobId(s) 1 ...\n" );
+   fd_send ( fs, "You are now entering file selection mode where you add (mark) and\n"
+                 "remove (unmark) files to be restored. No files are initially added.\n" );
+   fd_send ( fs, "cwd is: /\n" );
+}
+
+/*
+ * executes a single console command
+ *
+ * out:
+ *    0 - continue session
+ *    1 - quit
+ */
+static int fd_command ( fakesession * fs, const char * cmd ){
+
+   int jobid;
+   unsigned a;
+
+   fdlog ( fs->fd, "command: %s", cmd );
+   fdsleep ( fs->fd->cmdlatency );
+
+   if ( strcmp ( cmd, "quit" ) == 0 || strcmp ( cmd, "exit" ) == 0 ){
+      return 1;
+   } else
+   if ( strcmp ( cmd, ".filesets" ) == 0 ){
+      for ( a = 0; a < sizeof ( filesets ) / sizeof ( filesets [ 0 ] ); a++ ){
+         fd_send ( fs, "%s\n", filesets [ a ] );
+      }
+   } else
+   if ( strncmp ( cmd, "restore ", 8 ) == 0 ){
+      fd_cmd_restore ( fs, cmd );
+   } else
+   if ( fs->intree && strcmp ( cmd, "ls" ) == 0 ){
+      if ( fs->treetype ){
+         fd_send ( fs, "pgsqlarch:%s/\n", fs->client );
+      } else {
+         fd_send ( fs, "pgsqldb:%s/\n", fs->client );
+         fd_send ( fs, "pgsqltbs:%s/\n", fs->client );
+      }
+   } else
+   if ( fs->intree && strncmp ( cmd, "add ", 4 ) == 0 ){
+      fs->marked += 1000;
+      fd_send ( fs, "1000 files marked.\n" );
+   } else
+   if ( fs->intree && strcmp ( cmd, "." ) == 0 ){
+      fd_reset_job ( fs );
+      fd_send ( fs, "Selection terminated.\n" );
+   } else
+   if ( fs->intree && strcmp ( cmd, "done" ) == 0 ){
+      if ( fs->marked ){
+         fd_queue_job ( fs );
+      } else {
+         fd_reset_job ( fs );
+         fd_send ( fs, "No files marked.\n" );
+      }
+   } else
+   if ( sscanf ( cmd, "wait jobid=%d", &jobid ) == 1 ){
+      if ( ! fs->job.queued || fs->job.jobid != jobid ){
+         fd_send ( fs, "JobId %d not found.\n", jobid );
+      } else {
+         fd_send ( fs, "JobId=%d\n", jobid );
+         if ( fd_run_job ( fs ) ){
+            fd_send ( fs, "JobStatus=Error (E)\n" );
+         } else {
+            fd_send ( fs, "JobStatus=OK (T)\n" );
+         }
+         fd_reset_job ( fs );
+      }
+   } else {
+      fd_send ( fs, "%s: is an invalid command.\n", cmd );
+   }
+   fd_signal ( fs, FD_EOD );
+
+   return 0;
+}
+
+/*
+ * serves a single console connection
+ */
+static void fd_session ( fakedir * fd, int sock ){
+
+   fakesession fs;
+   char * msg;
+
+   memset ( &fs, 0, sizeof ( fs ) );
+   fs.fd = fd;
+   fs.sock = sock;
+
+   msg = (char *) malloc ( FDMSGLEN );
+   if ( ! msg || fd_auth ( &fs ) ){
+      free ( msg );
+      return;
+   }
+   while ( fd_recv ( &fs, msg, FDMSGLEN ) >= 0 ){
+      if ( fd_command ( &fs, msg ) ){
+         break;
+      }
+   }
+   fd_reset_job ( &fs );
+   free ( msg );
+}
+
+static void usage ( void ){
+
+   fprintf ( stderr, "usage: pgsql-fake-dir [-a address] [-p port] [-n dirname] [-P password]\n" );
+   fprintf ( stderr, "                      [-w waldir] [-d dbdir] [-t target] [-l jobms] [-L cmdms]\n" );
+   fprintf ( stderr, "                      [-r MB/s] [-e N] [-v]\n" );
+   fprintf ( stderr, "   -w  directory with archived WAL files to restore\n" );
+   fprintf ( stderr, "   -d  directory with database files to restore\n" );
+   fprintf ( stderr, "   -t  database restore location when restore where is empty\n" );
+   fprintf ( stderr, "   -l  restore job start latency, -L  console command latency\n" );
+   fprintf ( stderr, "   -r  restore throughput limit, -e  every N-th job fails\n" );
+   exit ( 1 );
+}
+
+int main ( int argc, char * argv[] ){
+
+   fakedir fd;
+   struct sockaddr_in addr;
+   int lsock;
+   int sock;
+   int opt;
+   int on = 1;
+
+   memset ( &fd, 0, sizeof ( fd ) );
+   fd.address = "127.0.0.1";
+   fd.port = 9101;
+   fd.name = "fake-dir";
+   fd.password = "password";
+
+   while ( ( opt = getopt ( argc, argv, "a:p:n:P:w:d:t:l:L:r:e:v" ) ) != -1 ){
+      switch ( opt ){
+         case 'a':
+            fd.address = optarg;
+            break;
+         case 'p':
+            fd.port = atoi ( optarg );
+            break;
+         case 'n':
+            fd.name = optarg;
+            break;
+         case 'P':
+            fd.password = optarg;
+            break;
+         case 'w':
+            fd.waldir = optarg;
+            break;
+         case 'd':
+            fd.dbdir = optarg;
+            break;
+         case 't':
+            fd.target = optarg;
+            break;
+         case 'l':
+            fd.joblatency = atoi ( optarg );
+            break;
+         case 'L':
+            fd.cmdlatency = atoi ( optarg );
+            break;
+         case 'r':
+            fd.mbps = atof ( optarg );
+            break;
+         case 'e':
+            fd.failevery = atoi ( optarg );
+            break;
+         case 'v':
+            fd.verbose++;
+            break;
+         default:
+            usage ();
+      }
+   }
+
+   lsock = socket ( AF_INET, SOCK_STREAM, 0 );
+   if ( lsock < 0 ){
+      perror ( "socket" );
+      return 2;
+   }
+   setsockopt ( lsock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof ( on ) );
+   memset ( &addr, 0, sizeof ( addr ) );
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons ( fd.port );
+   if ( inet_pton ( AF_INET, fd.address, &addr.sin_addr ) != 1 ){
+      fprintf ( stderr, "invalid address: %s\n", fd.address );
+      return 2;
+   }
+   if ( bind ( lsock, (struct sockaddr *) &addr, sizeof ( addr ) ) || listen ( lsock, 16 ) ){
+      perror ( "bind" );
+      return 2;
+   }
+   /* sessions are served by child processes, no zombies */
+   signal ( SIGCHLD, SIG_IGN );
+   fdlog ( &fd, "listening on %s:%d", fd.address, fd.port );
+
+   for ( ;; ){
+      sock = accept ( lsock, NULL, NULL );
+      if ( sock < 0 ){
+         if ( errno == EINTR ){
+            continue;
+         }
+         perror ( "accept" );
+         return 2;
+      }
+      if ( fork () == 0 ){
+         close ( lsock );
+         fd_session ( &fd, sock );
+         close ( sock );
+         exit ( 0 );
+      }
+      close ( sock );
+   }
+
+   return 0;
+}
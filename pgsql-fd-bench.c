@@ -0,0 +1,870 @@
+/*
+ * Copyright (c) 2013 by Inteos sp. z o.o.
+ * All rights reserved. See LICENSE.Inteos for details.
+ *
+ * Plugin benchmark harness. It loads pgsql-fd.so with dlopen and drives it the
+ * same way Bacula File Daemon does, with a fake set of Bacula functions:
+ * a database backup of a synthetic PGDATA (startBackupFile/pluginIO/
+ * endBackupFile loop) and a restore of backed up files (createFile/pluginIO)
+ * into a separate directory. No Bacula daemons or running database is required,
+ * a pg_start_backup/pg_stop_backup is disabled with PGSTARTSTOP = no.
+ * With -I a command is run after the full backup, an incremental backup follows
+ * and both jobs are restored together, the latest version of every file only,
+ * as Director does; with -P a stopped cluster is backed up instead of a
+ * synthetic PGDATA. pgsql-fd-test.sh uses it for a restore after DROP TABLE.
+ *
+ * usage: pgsql-fd-bench [-p plugin.so] [-d dir] [-n files] [-s sizeKB] [-z zero%]
+ *                       [-D databases] [-t tablespaces] [-l links] [-b bufsize]
+ *                       [-o KEY=VALUE] [-P pgdata] [-I command] [-B|-R] [-k] [-v]
+ */
+
+#include "bacula.h"
+#include "fd_plugins.h"
+
+#include <stdarg.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include "keylist.h"
+#include "utils.h"
+
+/*
+ * libbac uses its own sscanf implementation which is not compatible with
+ * libc implementation, unfortunately. usage of bsscanf require format string rewriting.
+ */
+#ifdef sscanf
+#undef sscanf
+#endif
+
+#define BENCHCLIENT  "bench"
+#define BENCHPAGE    8192
+
+/* a single backed up entry, replayed on restore */
+typedef struct _benchfile benchfile;
+struct _benchfile {
+   char     * fname;          /* plugin virtual file name */
+   char     * link;           /* link target */
+   char     * src;            /* real file used as restore data source */
+   int      type;
+   int      job;              /* backup job of entry */
+   int      skip;             /* a newer version is in a later job */
+   int      virt;             /* virtual file, src is its data saved by backup */
+   struct stat statp;
+};
+
+/* benchmark parameters and collected data */
+typedef struct _benchparam benchparam;
+struct _benchparam {
+   const char * plugin;
+   const char * dir;
+   char     pgdata [ PATH_MAX ];
+   char     restdir [ PATH_MAX ];
+   char     conf [ PATH_MAX ];
+   keylist  * options;        /* additional config file entries */
+   const char * pgdir;        /* existing PGDATA, not generated (-P) */
+   const char * chaincmd;     /* command run between full and incremental (-I) */
+   int      files;
+   int      size;             /* average file size in KB */
+   int      zeropct;
+   int      databases;
+   int      tablespaces;
+   int      links;
+   int      bufsize;
+   int      dorestore;
+   int      keep;
+   benchfile * list;
+   int      nlist;
+   int      alist;
+};
+
+/* results of a single benchmark phase */
+typedef struct _benchresult benchresult;
+struct _benchresult {
+   int64_t  files;
+   int64_t  bytes;
+   double   elapsed;
+   double   plugin;           /* time spent inside plugin calls */
+   double   cpu;
+};
+
+static int verbose = 0;
+static int64_t joberrors = 0;
+static int jobid = 0;
+
+/*
+ * fake Bacula functions
+ */
+static bRC bench_registerBaculaEvents ( bpContext *ctx, ... ){
+
+   return bRC_OK;
+}
+
+static bRC bench_getBaculaValue ( bpContext *ctx, bVariable var, void *value ){
+
+   if ( var == bVarJobId && value ){
+      *(int *) value = jobid;
+   }
+   return bRC_OK;
+}
+
+static bRC bench_setBaculaValue ( bpContext *ctx, bVariable var, void *value ){
+
+   return bRC_OK;
+}
+
+static bRC bench_JobMessage ( bpContext *ctx, const char *file, int line, int type,
+      utime_t mtime, const char *fmt, ... ){
+
+   va_list args;
+
+   if ( type == M_ERROR || type == M_FATAL || type == M_ABORT ){
+      joberrors++;
+   }
+   if ( verbose || type != M_INFO ){
+      va_start ( args, fmt );
+      vprintf ( fmt, args );
+      va_end ( args );
+   }
+   return bRC_OK;
+}
+
+static bRC bench_DebugMessage ( bpContext *ctx, const char *file, int line, int level,
+      const char *fmt, ... ){
+
+   va_list args;
+
+   if ( verbose > 1 ){
+      va_start ( args, fmt );
+      vprintf ( fmt, args );
+      va_end ( args );
+   }
+   return bRC_OK;
+}
+
+static void * bench_baculaMalloc ( bpContext *ctx, const char *file, int line, size_t size ){
+
+   return malloc ( size );
+}
+
+static void bench_baculaFree ( bpContext *ctx, const char *file, int line, void *mem ){
+
+   free ( mem );
+}
+
+/* a plugin interface loaded from shared object */
+static pFuncs * pfuncs = NULL;
+static pInfo * pinfo = NULL;
+static bFuncs bfuncs;
+static bInfo binfo;
+
+/*
+ * loads a plugin and connects it to fake Bacula functions
+ *
+ * out:
+ *    0 - on success
+ *    -1 - on error
+ */
+static int bench_load_plugin ( const char * path ){
+
+   void * handle;
+   loadPlugin_t loadPlugin;
+
+   handle = dlopen ( path, RTLD_NOW );
+   if ( ! handle ){
+      fprintf ( stderr, "cannot load plugin %s: %s\n", path, dlerror () );
+      return -1;
+   }
+   loadPlugin = (loadPlugin_t) dlsym ( handle, "loadPlugin" );
+   if ( ! loadPlugin ){
+      fprintf ( stderr, "no loadPlugin in %s\n", path );
+      return -1;
+   }
+
+   memset ( &binfo, 0, sizeof ( binfo ) );
+   binfo.size = sizeof ( binfo );
+   binfo.version = FD_PLUGIN_INTERFACE_VERSION;
+
+   memset ( &bfuncs, 0, sizeof ( bfuncs ) );
+   bfuncs.size = sizeof ( bfuncs );
+   bfuncs.version = FD_PLUGIN_INTERFACE_VERSION;
+   bfuncs.registerBaculaEvents = bench_registerBaculaEvents;
+   bfuncs.getBaculaValue = bench_getBaculaValue;
+   bfuncs.setBaculaValue = bench_setBaculaValue;
+   bfuncs.JobMessage = bench_JobMessage;
+   bfuncs.DebugMessage = bench_DebugMessage;
+   bfuncs.baculaMalloc = bench_baculaMalloc;
+   bfuncs.baculaFree = bench_baculaFree;
+
+   if ( loadPlugin ( &binfo, &bfuncs, &pinfo, &pfuncs ) != bRC_OK || ! pfuncs ){
+      fprintf ( stderr, "plugin initialization failed\n" );
+      return -1;
+   }
+
+   return 0;
+}
+
+/*
+ * a simple xorshift generator, data does not need to be random, only
+ * reproducible and not compressible
+ */
+static uint32_t bench_random ( uint32_t * state ){
+
+   uint32_t x = *state;
+
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *state = x;
+
+   return x;
+}
+
+/*
+ * creates a relation file with pages of random data or zeros
+ */
+static int bench_make_file ( const char * path, off_t size, int zeropct, uint32_t seed ){
+
+   char page [ BENCHPAGE ];
+   uint32_t * p = (uint32_t *) page;
+   off_t off;
+   int fd;
+   int a;
+
+   fd = open ( path, O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+   if ( fd < 0 ){
+      fprintf ( stderr, "create %s error: %s\n", path, strerror ( errno ) );
+      return -1;
+   }
+   for ( off = 0; off < size; off += BENCHPAGE ){
+      if ( bench_random ( &seed ) % 100 < (uint32_t) zeropct ){
+         memset ( page, 0, BENCHPAGE );
+      } else {
+         for ( a = 0; a < BENCHPAGE / 4; a++ ){
+            p [ a ] = bench_random ( &seed );
+         }
+      }
+      if ( write ( fd, page, BENCHPAGE ) != BENCHPAGE ){
+         fprintf ( stderr, "write %s error: %s\n", path, strerror ( errno ) );
+         close ( fd );
+         return -1;
+      }
+   }
+   close ( fd );
+
+   return 0;
+}
+
+/*
+ * generates a synthetic PGDATA with PostgreSQL 9.x layout: databases in base/,
+ * tablespaces as pg_tblspc links into separate directories and additional
+ * symbolic links in cluster directory
+ *
+ * out:
+ *    total size of generated files in bytes, -1 on error
+ */
+static int64_t bench_make_pgdata ( benchparam * bp ){
+
+   char path [ PATH_MAX ];
+   char target [ PATH_MAX ];
+   const char * dirs[] = { "global", "base", "pg_tblspc", "pg_xlog", "pg_xlog/archive_status",
+                           "pg_clog", "pg_multixact", NULL };
+   uint32_t seed = 2463534242u;
+   int64_t total = 0;
+   off_t size;
+   int where;
+   int db;
+   int a;
+
+   mkdir ( bp->dir, 0700 );
+   if ( mkdir ( bp->pgdata, 0700 ) && errno != EEXIST ){
+      fprintf ( stderr, "mkdir %s error: %s\n", bp->pgdata, strerror ( errno ) );
+      return -1;
+   }
+   for ( a = 0; dirs [ a ]; a++ ){
+      snprintf ( path, PATH_MAX, "%s/%s", bp->pgdata, dirs [ a ] );
+      mkdir ( path, 0700 );
+   }
+   snprintf ( path, PATH_MAX, "%s/PG_VERSION", bp->pgdata );
+   bench_make_file ( path, 0, 0, 1 );
+
+   for ( db = 0; db < bp->databases; db++ ){
+      snprintf ( path, PATH_MAX, "%s/base/%d", bp->pgdata, 16384 + db );
+      mkdir ( path, 0700 );
+   }
+   for ( a = 0; a < bp->tablespaces; a++ ){
+      snprintf ( target, PATH_MAX, "%s/tbs%d", bp->dir, a );
+      mkdir ( target, 0700 );
+      snprintf ( path, PATH_MAX, "%s/PG_9.2_201204301", target );
+      mkdir ( path, 0700 );
+      for ( db = 0; db < bp->databases; db++ ){
+         snprintf ( path, PATH_MAX, "%s/PG_9.2_201204301/%d", target, 16384 + db );
+         mkdir ( path, 0700 );
+      }
+      snprintf ( path, PATH_MAX, "%s/pg_tblspc/%d", bp->pgdata, 32768 + a );
+      unlink ( path );
+      if ( symlink ( target, path ) ){
+         fprintf ( stderr, "symlink %s error: %s\n", path, strerror ( errno ) );
+         return -1;
+      }
+   }
+
+   for ( a = 0; a < bp->files; a++ ){
+      /* size between a half and one and a half of average size, in whole pages */
+      size = (off_t) bp->size * 1024 / 2 + bench_random ( &seed ) % ( (uint32_t) bp->size * 1024 + 1 );
+      size = size / BENCHPAGE * BENCHPAGE;
+      db = a % bp->databases;
+      /* files are spread between main cluster and tablespaces */
+      where = bp->tablespaces ? a % ( bp->tablespaces + 1 ) : 0;
+      if ( where ){
+         snprintf ( path, PATH_MAX, "%s/tbs%d/PG_9.2_201204301/%d/%d", bp->dir,
+               where - 1, 16384 + db, 100000 + a );
+      } else {
+         snprintf ( path, PATH_MAX, "%s/base/%d/%d", bp->pgdata, 16384 + db, 100000 + a );
+      }
+      if ( bench_make_file ( path, size, bp->zeropct, a + 1 ) ){
+         return -1;
+      }
+      total += size;
+   }
+
+   for ( a = 0; a < bp->links; a++ ){
+      snprintf ( path, PATH_MAX, "%s/link.%d", bp->pgdata, a );
+      snprintf ( target, PATH_MAX, "base/%d/%d", 16384, 100000 + a );
+      unlink ( path );
+      symlink ( target, path );
+   }
+
+   return total;
+}
+
+/*
+ * writes a plugin config file for benchmark
+ */
+static int bench_write_conf ( benchparam * bp ){
+
+   FILE * conf;
+   keyitem * item;
+
+   conf = fopen ( bp->conf, "w" );
+   if ( ! conf ){
+      fprintf ( stderr, "create %s error: %s\n", bp->conf, strerror ( errno ) );
+      return -1;
+   }
+   fprintf ( conf, "PGDATA = %s\n", bp->pgdata );
+   fprintf ( conf, "PGVERSION = 9.x\n" );
+   fprintf ( conf, "ARCHCLIENT = %s\n", BENCHCLIENT );
+   fprintf ( conf, "PGSTARTSTOP = no\n" );
+   foreach_dlist ( item, bp->options ){
+      fprintf ( conf, "%s = %s\n", item->key, item->value );
+   }
+   fclose ( conf );
+
+   return 0;
+}
+
+/*
+ * remembers a backed up entry for restore
+ */
+static void bench_add_file ( benchparam * bp, struct save_pkt * sp ){
+
+   benchfile * bf;
+   char path [ PATH_MAX ];
+   const char * prefix;
+
+   if ( bp->nlist == bp->alist ){
+      bp->alist = bp->alist ? bp->alist * 2 : 1024;
+      bp->list = (benchfile *) realloc ( bp->list, bp->alist * sizeof ( benchfile ) );
+      if ( ! bp->list ){
+         fprintf ( stderr, "memory allocation error\n" );
+         exit ( 2 );
+      }
+   }
+   bf = &bp->list [ bp->nlist++ ];
+   memset ( bf, 0, sizeof ( benchfile ) );
+   bf->fname = strdup ( sp->fname );
+   bf->type = sp->type;
+   bf->job = jobid;
+   memcpy ( &bf->statp, &sp->statp, sizeof ( struct stat ) );
+   if ( sp->type == FT_LNK && sp->link ){
+      bf->link = strdup ( sp->link );
+   }
+   if ( sp->type == FT_REG ){
+      /* pgsqldb:<client>/<relative path> or pgsqltbs:<client><absolute path> */
+      prefix = "pgsqldb:" BENCHCLIENT "/";
+      if ( strncmp ( sp->fname, prefix, strlen ( prefix ) ) == 0 ){
+         snprintf ( path, PATH_MAX, "%s/%s", bp->pgdata, sp->fname + strlen ( prefix ) );
+      } else {
+         snprintf ( path, PATH_MAX, "%s", sp->fname + strlen ( "pgsqltbs:" BENCHCLIENT ) );
+      }
+      if ( strcmp ( sp->fname, prefix ) == 0 || strcmp ( sp->fname + strlen ( prefix ), PGMANIFEST ) != 0 ){
+         bf->src = strdup ( path );
+      } else {
+         /* a virtual file, its data is saved by backup */
+         snprintf ( path, PATH_MAX, "%s/" PGMANIFEST ".%d", bp->dir, jobid );
+         bf->src = strdup ( path );
+         bf->virt = 1;
+      }
+   }
+}
+
+/*
+ * marks entries of older jobs which are restored from a later job, so a restore
+ * gets the latest version of every file as Director selects it
+ */
+static void bench_select_latest ( benchparam * bp ){
+
+   pathset * set;
+   int a;
+
+   set = pathset_alloc ();
+   if ( ! set ){
+      fprintf ( stderr, "memory allocation error\n" );
+      exit ( 2 );
+   }
+   for ( a = bp->nlist - 1; a >= 0; a-- ){
+      bp->list [ a ].skip = pathset_find ( set, bp->list [ a ].fname );
+      if ( ! bp->list [ a ].skip && pathset_add ( set, bp->list [ a ].fname ) < 0 ){
+         fprintf ( stderr, "memory allocation error\n" );
+         exit ( 2 );
+      }
+   }
+   pathset_free ( set );
+}
+
+/*
+ * returns user and system cpu time of benchmark process
+ */
+static double bench_cpu_time ( void ){
+
+   struct rusage ru;
+
+   getrusage ( RUSAGE_SELF, &ru );
+   return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+          ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+/* calls a plugin function and accounts time spent inside plugin */
+#define PLUGINCALL(res,rc,call) \
+   do { \
+      double _t = monotonic_time (); \
+      rc = call; \
+      res->plugin += monotonic_time () - _t; \
+   } while ( 0 )
+
+/*
+ * runs a database backup job the same way as File Daemon does
+ *
+ * in:
+ *    level - job level 'F' or 'I'
+ *    since - incremental base time
+ */
+static int bench_backup ( benchparam * bp, int level, time_t since, benchresult * res ){
+
+   bpContext ctx;
+   bEvent event;
+   struct save_pkt sp;
+   struct io_pkt io;
+   benchfile * bf;
+   char * buf;
+   char * cmd;
+   double start;
+   double cpu;
+   int out;
+   bRC rc;
+
+   buf = (char *) malloc ( bp->bufsize );
+   cmd = (char *) malloc ( PATH_MAX );
+   if ( ! buf || ! cmd ){
+      fprintf ( stderr, "memory allocation error\n" );
+      return -1;
+   }
+   snprintf ( cmd, PATH_MAX, "pgsql:%s:db", bp->conf );
+   memset ( &ctx, 0, sizeof ( ctx ) );
+   memset ( res, 0, sizeof ( benchresult ) );
+
+   jobid++;
+   start = monotonic_time ();
+   cpu = bench_cpu_time ();
+
+   PLUGINCALL ( res, rc, pfuncs->newPlugin ( &ctx ) );
+   event.eventType = bEventJobStart;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, (void *) "bench" ) );
+   event.eventType = bEventLevel;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, (void *) (intptr_t) level ) );
+   event.eventType = bEventSince;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, (void *) (intptr_t) since ) );
+   event.eventType = bEventStartBackupJob;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, NULL ) );
+   event.eventType = bEventBackupCommand;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, cmd ) );
+   if ( rc != bRC_OK ){
+      fprintf ( stderr, "backup command failed\n" );
+      return -1;
+   }
+
+   do {
+      memset ( &sp, 0, sizeof ( sp ) );
+      sp.pkt_size = sizeof ( sp );
+      sp.pkt_end = sizeof ( sp );
+      PLUGINCALL ( res, rc, pfuncs->startBackupFile ( &ctx, &sp ) );
+      if ( rc != bRC_OK ){
+         break;
+      }
+      res->files++;
+      bench_add_file ( bp, &sp );
+      bf = &bp->list [ bp->nlist - 1 ];
+
+      /* data is read for regular files only */
+      if ( sp.type == FT_REG ){
+         memset ( &io, 0, sizeof ( io ) );
+         io.pkt_size = sizeof ( io );
+         io.pkt_end = sizeof ( io );
+         io.func = IO_OPEN;
+         io.fname = sp.fname;
+         io.flags = O_RDONLY;
+         PLUGINCALL ( res, rc, pfuncs->pluginIO ( &ctx, &io ) );
+         if ( rc != bRC_OK ){
+            fprintf ( stderr, "open %s error: %s\n", sp.fname, strerror ( io.io_errno ) );
+            return -1;
+         }
+         /* a virtual file data is saved for restore */
+         out = bf->virt ? open ( bf->src, O_WRONLY | O_CREAT | O_TRUNC, 0600 ) : -1;
+         io.func = IO_READ;
+         io.buf = buf;
+         io.count = bp->bufsize;
+         for ( ;; ){
+            PLUGINCALL ( res, rc, pfuncs->pluginIO ( &ctx, &io ) );
+            if ( rc != bRC_OK || io.status <= 0 ){
+               break;
+            }
+            res->bytes += io.status;
+            if ( out >= 0 && write ( out, buf, io.status ) != io.status ){
+               fprintf ( stderr, "write %s error: %s\n", bf->src, strerror ( errno ) );
+               close ( out );
+               out = -1;
+            }
+         }
+         if ( out >= 0 ){
+            close ( out );
+         }
+         io.func = IO_CLOSE;
+         PLUGINCALL ( res, rc, pfuncs->pluginIO ( &ctx, &io ) );
+      }
+
+      PLUGINCALL ( res, rc, pfuncs->endBackupFile ( &ctx ) );
+   } while ( rc == bRC_More );
+
+   event.eventType = bEventEndBackupJob;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, NULL ) );
+   event.eventType = bEventJobEnd;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, NULL ) );
+   PLUGINCALL ( res, rc, pfuncs->freePlugin ( &ctx ) );
+
+   res->elapsed = monotonic_time () - start;
+   res->cpu = bench_cpu_time () - cpu;
+
+   free ( buf );
+   free ( cmd );
+
+   return 0;
+}
+
+/*
+ * runs a database restore job of all backed up files into a separate directory,
+ * file data is read from original files outside of plugin time; older versions
+ * of files backed up again by a later job are skipped
+ */
+static int bench_restore ( benchparam * bp, benchresult * res ){
+
+   bpContext ctx;
+   bEvent event;
+   struct restore_pkt rp;
+   struct io_pkt io;
+   benchfile * bf;
+   char * buf;
+   char * cmd;
+   char * ofname;
+   double start;
+   double cpu;
+   ssize_t nr;
+   int fd;
+   int a;
+   bRC rc;
+
+   buf = (char *) malloc ( bp->bufsize );
+   cmd = (char *) malloc ( PATH_MAX );
+   ofname = (char *) malloc ( PATH_MAX );
+   if ( ! buf || ! cmd || ! ofname ){
+      fprintf ( stderr, "memory allocation error\n" );
+      return -1;
+   }
+   snprintf ( cmd, PATH_MAX, "pgsql:%s:db", bp->conf );
+   memset ( &ctx, 0, sizeof ( ctx ) );
+   memset ( res, 0, sizeof ( benchresult ) );
+   mkdir ( bp->restdir, 0700 );
+
+   start = monotonic_time ();
+   cpu = bench_cpu_time ();
+
+   PLUGINCALL ( res, rc, pfuncs->newPlugin ( &ctx ) );
+   event.eventType = bEventJobStart;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, (void *) "bench" ) );
+   event.eventType = bEventStartRestoreJob;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, NULL ) );
+   event.eventType = bEventRestoreCommand;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, cmd ) );
+   if ( rc != bRC_OK ){
+      fprintf ( stderr, "restore command failed\n" );
+      return -1;
+   }
+
+   for ( a = 0; a < bp->nlist; a++ ){
+      bf = &bp->list [ a ];
+      if ( bf->skip ){
+         continue;
+      }
+      snprintf ( ofname, PATH_MAX, "%s/%s", bp->restdir, bf->fname );
+
+      memset ( &rp, 0, sizeof ( rp ) );
+      rp.pkt_size = sizeof ( rp );
+      rp.pkt_end = sizeof ( rp );
+      rp.type = bf->type;
+      rp.ofname = ofname;
+      rp.olname = bf->link;
+      rp.where = bp->restdir;
+      rp.replace = 'a';
+      memcpy ( &rp.statp, &bf->statp, sizeof ( struct stat ) );
+      PLUGINCALL ( res, rc, pfuncs->createFile ( &ctx, &rp ) );
+      res->files++;
+      if ( rc != bRC_OK || rp.create_status != CF_EXTRACT ){
+         continue;
+      }
+
+      fd = bf->src ? open ( bf->src, O_RDONLY ) : -1;
+      memset ( &io, 0, sizeof ( io ) );
+      io.pkt_size = sizeof ( io );
+      io.pkt_end = sizeof ( io );
+      io.func = IO_OPEN;
+      io.fname = ofname;
+      io.flags = O_WRONLY | O_CREAT | O_TRUNC;
+      io.mode = bf->statp.st_mode;
+      PLUGINCALL ( res, rc, pfuncs->pluginIO ( &ctx, &io ) );
+      io.func = IO_WRITE;
+      io.buf = buf;
+      while ( fd >= 0 && rc == bRC_OK && ( nr = read ( fd, buf, bp->bufsize ) ) > 0 ){
+         io.count = nr;
+         PLUGINCALL ( res, rc, pfuncs->pluginIO ( &ctx, &io ) );
+         res->bytes += nr;
+      }
+      if ( rc != bRC_OK ){
+         fprintf ( stderr, "write %s error: %s\n", ofname, strerror ( io.io_errno ) );
+      }
+      io.func = IO_CLOSE;
+      PLUGINCALL ( res, rc, pfuncs->pluginIO ( &ctx, &io ) );
+      if ( fd >= 0 ){
+         close ( fd );
+      }
+   }
+
+   event.eventType = bEventEndRestoreJob;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, NULL ) );
+   event.eventType = bEventJobEnd;
+   PLUGINCALL ( res, rc, pfuncs->handlePluginEvent ( &ctx, &event, NULL ) );
+   PLUGINCALL ( res, rc, pfuncs->freePlugin ( &ctx ) );
+
+   res->elapsed = monotonic_time () - start;
+   res->cpu = bench_cpu_time () - cpu;
+
+   free ( buf );
+   free ( cmd );
+   free ( ofname );
+
+   return 0;
+}
+
+static void bench_print ( const char * phase, benchresult * res ){
+
+   double mb = (double) res->bytes / ( 1024 * 1024 );
+
+   printf ( "%-8s %8lld %10.1f %9.3f %9.3f %10.0f %9.1f %8.3f\n", phase,
+         (long long) res->files, mb, res->elapsed, res->plugin,
+         res->elapsed > 0 ? res->files / res->elapsed : 0,
+         res->elapsed > 0 ? mb / res->elapsed : 0, res->cpu );
+}
+
+static void usage ( void ){
+
+   fprintf ( stderr, "usage: pgsql-fd-bench [-p plugin.so] [-d dir] [-n files] [-s sizeKB] [-z zero%%]\n" );
+   fprintf ( stderr, "                      [-D databases] [-t tablespaces] [-l links] [-b bufsize]\n" );
+   fprintf ( stderr, "                      [-o KEY=VALUE] [-P pgdata] [-I command] [-B|-R] [-k] [-v]\n" );
+   fprintf ( stderr, "   -o  additional plugin config entry, i.e. -o DELTARESTORE=yes\n" );
+   fprintf ( stderr, "   -P  back up an existing stopped cluster instead of a generated one\n" );
+   fprintf ( stderr, "   -I  run a command after full backup, then incremental backup, restore both\n" );
+   fprintf ( stderr, "   -B  backup only, -R  backup and restore (default)\n" );
+   fprintf ( stderr, "   -k  keep generated and restored files\n" );
+   exit ( 1 );
+}
+
+int main ( int argc, char * argv[] ){
+
+   benchparam bp;
+   benchresult res;
+   struct rusage ru;
+   char * cmd;
+   char * val;
+   int64_t total;
+   time_t since;
+   int opt;
+
+   memset ( &bp, 0, sizeof ( bp ) );
+   bp.plugin = "./.libs/pgsql-fd.so";
+   bp.dir = "./fdbench";
+   bp.files = 1000;
+   bp.size = 256;
+   bp.zeropct = 10;
+   bp.databases = 2;
+   bp.tablespaces = 1;
+   bp.links = 0;
+   bp.bufsize = 65536;
+   bp.dorestore = 1;
+
+   while ( ( opt = getopt ( argc, argv, "p:d:n:s:z:D:t:l:b:o:P:I:BRkv" ) ) != -1 ){
+      switch ( opt ){
+         case 'p':
+            bp.plugin = optarg;
+            break;
+         case 'd':
+            bp.dir = optarg;
+            break;
+         case 'n':
+            bp.files = atoi ( optarg );
+            break;
+         case 's':
+            bp.size = atoi ( optarg );
+            break;
+         case 'z':
+            bp.zeropct = atoi ( optarg );
+            break;
+         case 'D':
+            bp.databases = atoi ( optarg );
+            break;
+         case 't':
+            bp.tablespaces = atoi ( optarg );
+            break;
+         case 'l':
+            bp.links = atoi ( optarg );
+            break;
+         case 'b':
+            bp.bufsize = atoi ( optarg );
+            break;
+         case 'o':
+            val = strchr ( optarg, '=' );
+            if ( ! val ){
+               usage ();
+            }
+            *val++ = 0;
+            bp.options = add_keylist ( bp.options, optarg, val );
+            break;
+         case 'P':
+            bp.pgdir = optarg;
+            break;
+         case 'I':
+            bp.chaincmd = optarg;
+            break;
+         case 'B':
+            bp.dorestore = 0;
+            break;
+         case 'R':
+            bp.dorestore = 1;
+            break;
+         case 'k':
+            bp.keep = 1;
+            break;
+         case 'v':
+            verbose++;
+            break;
+         default:
+            usage ();
+      }
+   }
+   if ( bp.files < 0 || bp.size < 1 || bp.databases < 1 || bp.bufsize < 1 ){
+      usage ();
+   }
+   if ( bp.links > bp.files ){
+      bp.links = bp.files;
+   }
+   if ( bp.pgdir ){
+      snprintf ( bp.pgdata, PATH_MAX, "%s", bp.pgdir );
+   } else {
+      snprintf ( bp.pgdata, PATH_MAX, "%s/pgdata", bp.dir );
+   }
+   snprintf ( bp.restdir, PATH_MAX, "%s/restore", bp.dir );
+   snprintf ( bp.conf, PATH_MAX, "%s/pgsql-bench.conf", bp.dir );
+
+   if ( bench_load_plugin ( bp.plugin ) ){
+      return 2;
+   }
+
+   if ( bp.pgdir ){
+      mkdir ( bp.dir, 0700 );
+      total = 0;
+   } else {
+      total = bench_make_pgdata ( &bp );
+   }
+   if ( total < 0 || bench_write_conf ( &bp ) ){
+      return 2;
+   }
+   if ( bp.pgdir ){
+      printf ( "dataset: cluster %s, buffer %d bytes\n", bp.pgdir, bp.bufsize );
+   } else {
+      printf ( "dataset: %d files, %.1f MB, %d databases, %d tablespaces, %d links, buffer %d bytes\n",
+            bp.files, (double) total / ( 1024 * 1024 ), bp.databases, bp.tablespaces, bp.links,
+            bp.bufsize );
+   }
+   printf ( "%-8s %8s %10s %9s %9s %10s %9s %8s\n", "phase", "files", "MB", "time [s]",
+         "plugin[s]", "files/s", "MB/s", "cpu [s]" );
+
+   since = time ( NULL );
+   if ( bench_backup ( &bp, 'F', 0, &res ) ){
+      return 2;
+   }
+   bench_print ( "backup", &res );
+
+   if ( bp.chaincmd ){
+      if ( system ( bp.chaincmd ) != 0 ){
+         fprintf ( stderr, "command failed: %s\n", bp.chaincmd );
+         return 2;
+      }
+      if ( bench_backup ( &bp, 'I', since, &res ) ){
+         return 2;
+      }
+      bench_print ( "incr", &res );
+      bench_select_latest ( &bp );
+   }
+
+   if ( bp.dorestore ){
+      if ( bench_restore ( &bp, &res ) ){
+         return 2;
+      }
+      bench_print ( "restore", &res );
+   }
+
+   getrusage ( RUSAGE_SELF, &ru );
+   printf ( "peak RSS: %ld KB, job errors: %lld\n", (long) ru.ru_maxrss, (long long) joberrors );
+
+   if ( ! bp.keep ){
+      /* only generated entries are removed, benchmark directory could be shared */
+      cmd = (char *) malloc ( 4 * PATH_MAX );
+      if ( cmd ){
+         snprintf ( cmd, 4 * PATH_MAX, "rm -rf '%s' '%s' '%s' '%s'/tbs[0-9]* '%s'/" PGMANIFEST ".*",
+               bp.pgdir ? "" : bp.pgdata, bp.restdir, bp.conf, bp.dir, bp.dir );
+         system ( cmd );
+         free ( cmd );
+      }
+   }
+
+   return joberrors ? 1 : 0;
+}
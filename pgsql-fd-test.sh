@@ -0,0 +1,134 @@
+#!/bin/sh
+#
+# Copyright (c) 2013 by Inteos sp. z o.o.
+# All rights reserved. See LICENSE.Inteos for details.
+#
+# Restore test of full and incremental database backups after DROP TABLE.
+# It starts a throwaway PostgreSQL cluster with two tables, and pgsql-fd-bench
+# runs the plugin: a full backup of the stopped cluster, one table is dropped,
+# an incremental backup follows and both jobs are restored together without
+# DELTARESTORE. A relation file of the dropped table is restored by the full
+# job and has to be removed by the incremental manifest, restored database
+# directories have to be the same as in the cluster.
+#
+# PostgreSQL (10 or later) binaries are taken from pg_config --bindir or -B,
+# the script has to be run as an unprivileged user as initdb refuses to run
+# as root.
+#
+# usage: pgsql-fd-test.sh [-p plugin.so] [-B pgbindir] [-P port] [-k]
+#
+
+PLUGIN=
+PGBIN=
+PORT=55434
+KEEP=no
+BINDIR=`cd \`dirname $0\` && pwd`
+WORK=/tmp/pgsql-fd-test.$$
+
+usage ()
+{
+   echo "usage: $0 [-p plugin.so] [-B pgbindir] [-P port] [-k]"
+   echo "   -p  plugin shared object"
+   echo "   -B  PostgreSQL binaries directory"
+   echo "   -P  port of throwaway PostgreSQL cluster"
+   echo "   -k  keep work directory"
+   exit 1
+}
+
+while getopts "p:B:P:k" opt
+do
+   case $opt in
+      p) PLUGIN=$OPTARG ;;
+      B) PGBIN=$OPTARG ;;
+      P) PORT=$OPTARG ;;
+      k) KEEP=yes ;;
+      *) usage ;;
+   esac
+done
+
+if [ -z "$PLUGIN" ]
+then
+   for P in $BINDIR/.libs/pgsql-fd.so $BINDIR/.libs/pgsql-fd.dylib $BINDIR/pgsql-fd.so
+   do
+      [ -f $P ] && PLUGIN=$P && break
+   done
+fi
+[ -z "$PGBIN" ] && PGBIN=`pg_config --bindir 2>/dev/null`
+if [ ! -x "$PGBIN/initdb" ]
+then
+   echo "PostgreSQL binaries not found, use -B <pgbindir>."
+   exit 2
+fi
+if [ ! -x "$BINDIR/pgsql-fd-bench" -o ! -f "$PLUGIN" ]
+then
+   echo "$BINDIR/pgsql-fd-bench or plugin not found, run make bench first."
+   exit 2
+fi
+
+cleanup ()
+{
+   [ -f $WORK/pgdata/postmaster.pid ] && $PGBIN/pg_ctl -D $WORK/pgdata -m immediate stop >/dev/null 2>&1
+   [ "$KEEP" = "no" ] && rm -rf $WORK
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p $WORK || exit 2
+
+PGSTART="$PGBIN/pg_ctl -D $WORK/pgdata -w -l $WORK/postgresql.log -o \"-p $PORT -k $WORK -c listen_addresses=127.0.0.1\" start >/dev/null"
+PGSTOP="$PGBIN/pg_ctl -D $WORK/pgdata -w stop >/dev/null"
+PSQL="$PGBIN/psql -X -q -A -t -v ON_ERROR_STOP=1 -h 127.0.0.1 -p $PORT -U pgtest -d fdtest"
+
+echo "Starting throwaway PostgreSQL on port $PORT ..."
+$PGBIN/initdb -D $WORK/pgdata -U pgtest --auth=trust >$WORK/initdb.log 2>&1 || { echo "initdb failed, see $WORK/initdb.log"; KEEP=yes; exit 2; }
+eval $PGSTART || { echo "PostgreSQL start failed, see $WORK/postgresql.log"; KEEP=yes; exit 2; }
+$PGBIN/createdb -h 127.0.0.1 -p $PORT -U pgtest fdtest || exit 2
+
+$PSQL -c "create table kept (id integer, val text); create table dropped (id integer, val text);
+   insert into kept select i, repeat('k', 100) from generate_series(1, 10000) i;
+   insert into dropped select i, repeat('d', 100) from generate_series(1, 10000) i;" || exit 2
+DROPPED=`$PSQL -c "select pg_relation_filepath('dropped')"`
+eval $PGSTOP || exit 2
+
+# the plugin refuses a running cluster without pg_start_backup
+cat > $WORK/drop.sh <<EOF
+#!/bin/sh
+$PGSTART || exit 1
+$PSQL -c "drop table dropped" -c "checkpoint" || exit 1
+$PGSTOP
+EOF
+chmod 700 $WORK/drop.sh
+
+echo "Full backup, DROP TABLE, incremental backup and restore of both ..."
+$BINDIR/pgsql-fd-bench -p $PLUGIN -d $WORK/bench -P $WORK/pgdata -I $WORK/drop.sh -o SINCEMARGIN=0 -k -v >$WORK/bench.log 2>&1
+RC=$?
+RESTORE=$WORK/bench/restore
+if [ $RC -ne 0 ]
+then
+   echo "pgsql-fd-bench failed, see $WORK/bench.log"
+   RC=1
+elif [ -e $WORK/pgdata/$DROPPED ]
+then
+   echo "$DROPPED of dropped table not removed by PostgreSQL"
+   RC=2
+elif [ ! -f $RESTORE/pgsql_manifest ]
+then
+   echo "backup manifest not restored"
+   RC=1
+elif [ -e $RESTORE/$DROPPED ]
+then
+   echo "$DROPPED of dropped table restored"
+   RC=1
+else
+   ( cd $WORK/pgdata && find base global | sort ) > $WORK/pgdata.list
+   ( cd $RESTORE && find base global | sort ) > $WORK/restore.list
+   if ! cmp -s $WORK/pgdata.list $WORK/restore.list
+   then
+      echo "restored database directories differ from cluster:"
+      diff $WORK/pgdata.list $WORK/restore.list
+      RC=1
+   fi
+fi
+grep "backup manifest:" $WORK/bench.log
+[ $RC -eq 0 ] && echo "OK" || echo "FAILED"
+[ $RC -ne 0 ] && KEEP=yes && echo "work directory kept: $WORK"
+exit $RC
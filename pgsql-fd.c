@@ -20,6 +20,53 @@
    CATPASSWD = <catalog.db.password>
    ARCHDEST = <destination.of.archived.wal's.path>
    ARCHCLIENT = <name.of.archived.client>
+   DELTARESTORE = <yes.to.restore.in.place.changed.blocks.only>
+   RESTOREPREALLOC = <no.to.disable.restored.file.preallocation>
+   RESTORESPARSE = <yes.for.zero.block.holes.in.restored.relation.files>
+   RESTORESYNC = <none|writebehind|syncfs>
+   STATSFILE = <job.statistics.json.lines.file>
+   PGSTARTSTOP = <no.to.skip.pg_start_backup.and.pg_stop_backup>
+   SHARDWAIT = <seconds.all.shards.of.sharded.backup.have.to.start.within>
+   SCHEDULE = <none|largefirst|extent|device>
+   THROTTLEMBPS = <database.backup.read.limit.in.MB/s>
+   THROTTLEIOPS = <database.backup.read.calls.limit.per.second>
+   THROTTLEADAPTIVE = <no|psi|latency>
+   THROTTLEPRESSURE = <io.stall.percent.or.device.latency.ms.to.back.off.at>
+   SINCEMARGIN = <seconds.subtracted.from.incremental.since.time>
+   WALSUMMARY = <yes.for.block.incremental.database.backups>
+
+ plugin command: pgsql:<config.file>:wal | db[:shard=<K>/<N>]
+
+ A database backup could be split into N jobs running concurrently, shard K
+ backs up a disjoint, size balanced part of database files. All shards share
+ a single pg_start_backup/pg_stop_backup window coordinated in catalog
+ (pgsql_shardsets), so they have to be started within SHARDWAIT seconds.
+
+ Database files are read in an order selected by SCHEDULE: as found on disk
+ (none), the largest first (largefirst), in physical disk order (extent) or
+ in physical order on every device with reads interleaved between devices
+ of tablespaces (device).
+
+ Incremental and differential database backups skip relation segments not
+ modified since the previous job start less SINCEMARGIN seconds. Every database
+ backup ends with a manifest of a whole file set (pgsql_manifest): backup start
+ and stop LSN and size, mtime and CRC32C of every file read by the job, so
+ pg_stop_backup is called before it. Restore of an Incremental/Differential
+ manifest (the last job of a restored chain), a delta restore or a restore
+ into PGDATA cleaned by pgsql-restore removes entries of restored directories
+ not found there, so files deleted between backups are not resurrected, and
+ Accurate mode checks use it too.
+
+ With WALSUMMARY pgsql-archlog saves a summary of blocks changed by every
+ archived WAL segment in catalog (pgsql_walsummaries). Incremental and
+ differential backups then send main fork relation segments as changed blocks
+ only, in <segment>.pgincr.<JobId> files with blocks changed since the start of
+ the base backup (the previous job or a full one). Restore applies them to
+ restored segments in job order at the end of job. When WAL since the base
+ backup is not fully summarized, changed segments are sent in the same format
+ with all of their blocks. A full backup is required after WALSUMMARY is
+ turned off, an incremental one fails when previous incremental backups since
+ the last full or differential sent block incremental files. Relation pages have to be of a default 8kB size.
 
  */
 /*
@@ -48,9 +95,20 @@ TODO:
 #include <dirent.h>
 #include <libgen.h>
 #include <utime.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <sys/sysmacros.h>
+#endif
 
 #include "keylist.h"
 #include "parseconfig.h"
+#include "pgsqlwriter.h"
+#include "pgsqlwal.h"
+#include "pgsqlstatus.h"
+#include "utils.h"
 
 /* 
  * libbac uses its own sscanf implementation which is not compatible with
@@ -86,6 +144,11 @@ static bRC endRestoreFile(bpContext *ctx);
 static bRC createFile(bpContext *ctx, struct restore_pkt *rp);
 static bRC setFileAttributes(bpContext *ctx, struct restore_pkt *rp);
 static bRC checkFile(bpContext *ctx, char *fname);
+
+bRC perform_delta_cleanup ( bpContext *ctx );
+int delta_remove_tree ( int dirfd, const char * name );
+int64_t perform_manifest_cleanup ( bpContext *ctx );
+int manifest_cleanup_required ( bpContext *ctx );
 keylist * get_file_list ( bpContext *ctx, keylist * list, const char * base, const char * path );
 
 
@@ -148,6 +211,16 @@ enum PGFileType {
    PG_FILE,
    PG_LINK,
    PG_DIR,
+   PG_MANIFEST,            /* backup manifest, a virtual file */
+   PG_INCR,                /* changed blocks of relation segment, a virtual file */
+};
+
+/* a restore destination mode read from pgsql-restore PGRESTOREMODE file */
+enum PGRestoreMode {
+   RESTOREMODE_UNKNOWN = 0,   /* not checked yet */
+   RESTOREMODE_NONE,          /* not restored by pgsql-restore */
+   RESTOREMODE_CLEAN,         /* destination cleaned before restore */
+   RESTOREMODE_DELTA,         /* existing files kept for delta restore */
 };
 
 typedef enum {
@@ -155,6 +228,134 @@ typedef enum {
    PARSE_RESTORE,
 } ParseMode;
 
+/* delta restore statistics, block statistics are in restore writer */
+typedef struct _pg_delta_stats pg_delta_stats;
+struct _pg_delta_stats {
+   int64_t  files;         /* files restored in place */
+   int64_t  removed;       /* files and dirs not found in backup */
+};
+
+/* job phases measured by plugin metrics */
+enum PGPhase {
+   PH_START = 0,           /* pg_start_backup */
+   PH_SCAN,                /* file list build */
+   PH_CATALOG,             /* catalog round trips */
+   PH_OPEN,                /* file open on backup, file create on restore */
+   PH_READ,
+   PH_WRITE,
+   PH_CLOSE,
+   PH_STOP,                /* pg_stop_backup */
+   PH_MAX,
+};
+
+/* latency histogram buckets, bucket n counts calls of [2^n, 2^(n+1)) us */
+#define PGHISTBUCKETS   24
+
+/* backup LSN and WAL file name length */
+#define PGLSNLEN        32
+
+/* database file read order (SCHEDULE) */
+enum PGSchedule {
+   SCHED_NONE = 0,
+   SCHED_LARGEFIRST,
+   SCHED_EXTENT,
+   SCHED_DEVICE,
+   SCHED_MAX,
+};
+
+/* adaptive throttle pressure source (THROTTLEADAPTIVE) */
+enum PGThrottle {
+   THROTTLE_NONE = 0,
+   THROTTLE_PSI,           /* /proc/pressure/io stall time */
+   THROTTLE_LATENCY,       /* PGDATA device IO latency from /proc/diskstats */
+   THROTTLE_MAX,
+};
+
+/* database file read throttle, token buckets for bandwidth and IOPS */
+typedef struct _pg_throttle pg_throttle;
+struct _pg_throttle {
+   int      enabled;
+   double   mbps;          /* bandwidth limit, 0 - unlimited */
+   double   iops;          /* read calls limit, 0 - unlimited */
+   int      adaptive;      /* pressure source PGThrottle */
+   double   threshold;     /* pressure to back off at, percent or ms */
+   dev_t    dev;           /* PGDATA device for latency source */
+   double   scale;         /* limit scale 0..1 set by adaptive backoff */
+   int      base;          /* mbps is a measured base rate, not a limit */
+   double   bytes;         /* bandwidth tokens */
+   double   ios;           /* IOPS tokens */
+   double   last;          /* last tokens refill */
+   double   sample;        /* last pressure sample */
+   double   stall;         /* pressure counters of last sample */
+   double   count;
+   double   pressure;      /* last measured pressure */
+   int64_t  sbytes;        /* bytes read at last sample */
+};
+
+/* job metrics, timers are monotonic and in seconds */
+typedef struct _pg_metrics pg_metrics;
+struct _pg_metrics {
+   double   start;                  /* job start */
+   time_t   wallstart;
+   double   time [ PH_MAX ];        /* total time spent in phase */
+   int64_t  calls [ PH_MAX ];
+   int64_t  hist [ PH_MAX ][ PGHISTBUCKETS ];
+   int64_t  files;
+   int64_t  bytes;
+   int64_t  syscalls;
+   int      schedule;               /* file read order PGSchedule */
+   int      devices;                /* devices interleaved by device schedule */
+   double   schedtime;              /* file list ordering time */
+   double   seekgb;                 /* estimated head movement between files */
+   double   throttlewait;           /* time slept by read throttle */
+   int64_t  throttles;              /* read throttle sleeps */
+   int64_t  backoffs;               /* adaptive throttle backoffs */
+   double   minscale;               /* the lowest adaptive limit scale */
+   double   maxpressure;            /* the highest measured IO pressure */
+   int64_t  skipped;                /* files unchanged since previous job */
+   int64_t  skippedbytes;
+   int      blockincr;              /* incremental driven by WAL summaries */
+   int64_t  incrfiles;              /* relation segments sent as changed blocks */
+   int64_t  incrblocks;
+   int      reported;
+};
+
+/* a database file read by backup with its checksum, for manifest */
+typedef struct _pg_fsum pg_fsum;
+struct _pg_fsum {
+   char     * path;
+   int64_t  size;
+   time_t   mtime;
+   uint32_t crc;
+};
+
+/* a relation segment sent as its changed blocks only (PG_INCR) */
+typedef struct _pg_incr pg_incr;
+struct _pg_incr {
+   char     * path;        /* relation segment path */
+   uint32_t * blocks;      /* sorted changed blocks, relative to segment */
+   uint32_t nblocks;
+   uint32_t trunc;         /* segment was truncated to trunc blocks, PGINCRNOTRUNC */
+   uint32_t nsend;         /* blocks sent, those below file size */
+   int64_t  filesize;      /* file size at backup */
+   int      all;           /* all blocks are sent, the segment is new */
+};
+
+/*
+ * a header of block incremental file <segment>.pgincr.<JobId>, followed by
+ * nblocks block numbers and nblocks pages
+ */
+typedef struct _pg_incr_header pg_incr_header;
+struct _pg_incr_header {
+   char     magic [ 8 ];
+   uint32_t blcksz;
+   uint32_t nblocks;
+   uint32_t trunc;
+   uint32_t jobid;
+   int64_t  filesize;
+   uint64_t baselsn;       /* changes since this location are included */
+};
+
 typedef struct _pg_plug_inst pg_plug_inst;
 struct _pg_plug_inst {
    int      JobId;
@@ -169,8 +370,68 @@ struct _pg_plug_inst {
    int      diropen;
    char     * linkval;
    int      linkread;
+   int      delta;         /* delta restore mode (DELTARESTORE) */
+   int      restoremode;   /* destination prepared by pgsql-restore (PGRESTOREMODE) */
+   keylist  * restored;    /* all restored paths in delta mode */
+   pg_delta_stats dstats;
+   pathset  * dirs;        /* directories known to exist on restore */
+   char     * lastdir;     /* last parent directory of restored file */
+   int      lastdirfd;     /* and its descriptor for *at() calls */
+   int64_t  metaops;       /* filesystem metadata operations on restore */
+   int64_t  mkdirs;        /* directories created on restore */
+   int      rwflags;       /* restore writer flags RW_PREALLOC/RW_SPARSE */
+   int      rwinit;        /* restore writer initialized */
+   rwriter  writer;        /* restore writer for database files */
+   int      startstop;     /* pg_start_backup/pg_stop_backup enabled (PGSTARTSTOP) */
+   int      shard;         /* shard number 1..shards of sharded backup */
+   int      shards;        /* number of shards, 0 when backup is not sharded */
+   int      shardset;      /* catalog id of shard set (pgsql_shardsets) */
+   int      shardlead;     /* this job started backup for all shards */
+   pg_throttle throttle;   /* database file read throttle */
+   int      level;         /* job level F, I, D (bEventLevel) */
+   time_t   since;         /* incremental/differential base time (bEventSince) */
+   pathset  * seen;        /* virtual names of all files in backup for accurate mode */
+   keylist  * mlist;       /* whole database file list for manifest */
+   char     * manifest;    /* backup manifest contents */
+   int      manifestlen;
+   int      manifestpos;   /* manifest read position */
+   pg_fsum  * sums;        /* checksums of files read */
+   int      nsums;
+   int      sumsize;
+   uint32_t filecrc;       /* current file checksum, size and mtime */
+   int64_t  filebytes;
+   time_t   filemtime;
+   char     startlsn [ PGLSNLEN ];   /* backup start and stop locations */
+   char     startwal [ PGLSNLEN ];
+   char     stoplsn [ PGLSNLEN ];
+   int      stopped;       /* pg_stop_backup before manifest: 1 - done, -1 - failed */
+   char     * manifestfile;   /* restored manifest path */
+   pg_incr  * incrs;       /* relation segments sent as changed blocks, by path */
+   int      nincrs;
+   int      incrsize;
+   pg_incr  * curincr;     /* current block incremental file and its read state */
+   char     * incrbuf;
+   int      incrlen;
+   int      incrpos;
+   uint32_t incrnext;      /* next block to read */
+   uint64_t incrbase;      /* block incremental base backup start location */
+   keylist  * incrfiles;   /* restored block incremental files and their targets */
+   int      incrmode;      /* relation segments of this job sent as block incremental files */
+   pg_metrics metrics;
 };
 
+void close_parent_dir ( pg_plug_inst * pinst );
+void metrics_add ( pg_metrics * m, int phase, double start );
+PGresult * catdb_exec ( bpContext *ctx, const char * sql );
+int catdb_int_value ( bpContext *ctx, const char * sql, int * value );
+void report_job_metrics ( bpContext *ctx, int status );
+void throttle_init ( bpContext *ctx );
+bRC manifest_build ( bpContext *ctx );
+void read_backup_label ( bpContext *ctx );
+int apply_incremental_files ( bpContext *ctx );
+void free_incr_list ( pg_plug_inst * pinst );
+int catdb_command ( bpContext *ctx, const char * sql );
+
 /* 
  * TODO:
  * TODO: integrate pgsql-fd with pgsqllib
@@ -180,6 +441,34 @@ struct _pg_plug_inst {
 /* size of different string or sql buffer */
 #define SQLLEN     256
 #define CONNSTRLEN 128
+#define MSGLEN     512
+/* job statistics JSON object */
+#define STATSBUFLEN  4096
+/* shard set coordination queries */
+#define SHARDSQLLEN  1024
+/* maximum number of database backup shards */
+#define PGMAXSHARDS  64
+/* maximum number of devices interleaved by device schedule */
+#define PGSCHEDMAXDEV  32
+/* an inode number to disk offset factor when FIEMAP is not available */
+#define PGSCHEDINOSCALE  65536
+/* read throttle: pressure sample interval and tokens burst in seconds */
+#define PGTHROTTLESAMPLE   1.0
+#define PGTHROTTLEBURST    0.25
+/* read throttle: adaptive limit scale floor and additive increase step */
+#define PGTHROTTLEMINSCALE 0.05
+#define PGTHROTTLESTEP     0.05
+/* block incremental files: a name suffix, header magic, a default PostgreSQL
+ * page size and relation segment size in pages, pages read at once */
+#define PGINCRSUFFIX ".pgincr."
+#define PGINCRMAGIC  "PGINCR01"
+#define PGINCRNOTRUNC   0xFFFFFFFF
+#define PGBLCKSZ     8192
+#define PGRELSEGBLOCKS  131072
+#define PGINCRCHUNK  64
+/* default and global tablespace oids */
+#define PGDEFAULTTBS 1663
+#define PGGLOBALTBS  1664
 
 /* Assertions defines */
 #define ASSERT_bfuncs \
@@ -310,6 +599,9 @@ static bRC newPlugin ( bpContext *ctx )
    bfuncs->getBaculaValue ( ctx, bVarJobId, (void *)&pinst->JobId );
    DMSG1 ( ctx, D1, "newPlugin JobId=%d\n", pinst->JobId );
 
+   pinst->metrics.start = monotonic_time ();
+   pinst->metrics.wallstart = time ( NULL );
+
    return bRC_OK;
 }
 
@@ -320,6 +612,7 @@ static bRC newPlugin ( bpContext *ctx )
 static bRC freePlugin ( bpContext *ctx )
 {
    int JobId = 0;
+   int a;
    pg_plug_inst *pinst;
 
    ASSERT_ctx_p;
@@ -338,6 +631,30 @@ static bRC freePlugin ( bpContext *ctx )
       FREE ( pinst->configfile );
    keylist_free ( pinst->paramlist );
    keylist_free ( pinst->filelist );
+   if ( pinst->restored ){
+      keylist_free ( pinst->restored );
+   }
+   if ( pinst->rwinit ){
+      rwriter_free ( &pinst->writer );
+   }
+   close_parent_dir ( pinst );
+   pathset_free ( pinst->dirs );
+   pathset_free ( pinst->seen );
+   if ( pinst->manifest ){
+      FREE ( pinst->manifest );
+   }
+   keylist_free ( pinst->mlist );
+   for ( a = 0; a < pinst->nsums; a++ ){
+      FREE ( pinst->sums [ a ].path );
+   }
+   if ( pinst->sums ){
+      FREE ( pinst->sums );
+   }
+   if ( pinst->manifestfile ){
+      FREE ( pinst->manifestfile );
+   }
+   free_incr_list ( pinst );
+   keylist_free ( pinst->incrfiles );
 
    FREE ( pinst );
 
@@ -382,7 +699,7 @@ static bRC setPluginValue ( bpContext *ctx, pVariable var, void *value )
  */
 bRC parse_plugin_command ( bpContext *ctx, const ParseMode parse_mode, const char * command )
 {
-   /* pgsql:/usr/local/bacula/etc/pgsql.phobos.conf:[wal,db] */
+   /* pgsql:/usr/local/bacula/etc/pgsql.phobos.conf:[wal,db[:shard=K/N]] */
    char * s;
    char * n;
    pg_plug_inst * pinst;
@@ -444,6 +761,22 @@ bRC parse_plugin_command ( bpContext *ctx, const ParseMode parse_mode, const cha
          else
          if ( parse_mode == PARSE_RESTORE )
             pinst->mode = PGSQL_DB_RESTORE;
+         /* db:shard=K/N - a part of sharded database backup */
+         pinst->shard = pinst->shards = 0;
+         s = strstr ( n, ":shard=" );
+         if ( s ){
+            if ( sscanf ( s, ":shard=%d/%d", &pinst->shard, &pinst->shards ) != 2 ||
+                  pinst->shards < 1 || pinst->shards > PGMAXSHARDS ||
+                  pinst->shard < 1 || pinst->shard > pinst->shards ){
+               JMSG ( ctx, M_ERROR, "invalid shard specification: %s\n", s + 1 );
+               FREE ( pinst->configfile );
+               return bRC_Error;
+            }
+            if ( pinst->shards == 1 ){
+               /* a single shard is a regular backup */
+               pinst->shard = pinst->shards = 0;
+            }
+         }
       } else {
       /* unknown plugin command */
          FREE ( pinst->configfile );
@@ -471,6 +804,7 @@ bRC catdbconnect ( bpContext *ctx ){
    char * catdbconnstring;
    ConnStatusType status;
    pg_plug_inst * pinst;
+   double start;
 
    ASSERT_ctx_p;
    pinst = (pg_plug_inst *)ctx->pContext;
@@ -485,7 +819,9 @@ bRC catdbconnect ( bpContext *ctx ){
          search_key ( pinst->paramlist, "CATUSER" ),
          search_key ( pinst->paramlist, "CATPASSWD" ));
 
+   start = monotonic_time ();
    pinst->catdb = PQconnectdb ( catdbconnstring );
+   metrics_add ( &pinst->metrics, PH_CATALOG, start );
    FREE ( catdbconnstring );
 
    status = PQstatus ( pinst->catdb );
@@ -495,6 +831,338 @@ bRC catdbconnect ( bpContext *ctx ){
    return bRC_OK;
 }
 
+static const char * schednames [ SCHED_MAX ] = {
+   "none",
+   "largefirst",
+   "extent",
+   "device",
+};
+
+static const char * throttlenames [ THROTTLE_MAX ] = {
+   "none",
+   "psi",
+   "latency",
+};
+
+/* metrics phase names used in reports */
+static const char * phasenames [ PH_MAX ] = {
+   "start", "scan", "catalog", "open", "read", "write", "close", "stop",
+};
+
+/*
+ * accounts a single call of a measured phase: its time and latency bucket
+ *
+ * in:
+ *    m - job metrics
+ *    phase - one of PGPhase
+ *    start - monotonic time when a call started
+ */
+void metrics_add ( pg_metrics * m, int phase, double start ){
+
+   double elapsed;
+   int64_t us;
+   int b = 0;
+
+   elapsed = monotonic_time () - start;
+   m->time [ phase ] += elapsed;
+   m->calls [ phase ]++;
+
+   us = (int64_t) ( elapsed * 1000000 );
+   while ( us > 1 && b < PGHISTBUCKETS - 1 ){
+      us >>= 1;
+      b++;
+   }
+   m->hist [ phase ][ b ]++;
+}
+
+/*
+ * estimates a latency percentile of a phase from its histogram
+ *
+ * out:
+ *    upper bound of a histogram bucket in microseconds, 0 when no calls
+ */
+double metrics_percentile ( pg_metrics * m, int phase, double pct ){
+
+   int64_t limit;
+   int64_t sum = 0;
+   int b;
+
+   if ( ! m->calls [ phase ] ){
+      return 0;
+   }
+   limit = (int64_t) ( m->calls [ phase ] * pct / 100 );
+   for ( b = 0; b < PGHISTBUCKETS; b++ ){
+      sum += m->hist [ phase ][ b ];
+      if ( sum > limit ){
+         break;
+      }
+   }
+
+   return (double) ( (int64_t) 2 << ( b < PGHISTBUCKETS ? b : PGHISTBUCKETS - 1 ) );
+}
+
+/*
+ * counts system calls done by a job, every measured I/O call is a single
+ * syscall, restore writes are counted by restore writer and file creation by
+ * filesystem metadata operations
+ */
+int64_t metrics_syscalls ( pg_plug_inst * pinst ){
+
+   pg_metrics * m = &pinst->metrics;
+   int64_t n;
+
+   n = m->syscalls + pinst->metaops + m->calls [ PH_READ ] + m->calls [ PH_CLOSE ];
+   if ( pinst->mode == PGSQL_DB_RESTORE ){
+      n += pinst->writer.stats.writes;
+   } else {
+      n += m->calls [ PH_WRITE ];
+   }
+   if ( pinst->mode == PGSQL_DB_BACKUP || pinst->mode == PGSQL_ARCH_BACKUP ){
+      n += m->calls [ PH_OPEN ];
+   }
+
+   return n;
+}
+
+/*
+ * executes a catalog query, every round trip is measured
+ */
+PGresult * catdb_exec ( bpContext *ctx, const char * sql ){
+
+   pg_plug_inst * pinst;
+   PGresult * result;
+   double start;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   start = monotonic_time ();
+   result = PQexec ( pinst->catdb, sql );
+   metrics_add ( &pinst->metrics, PH_CATALOG, start );
+
+   return result;
+}
+
+/*
+ * renders job metrics as a single line JSON object
+ *
+ * in:
+ *    pinst - plugin instance
+ *    buf - output buffer
+ *    len - buffer length
+ * out:
+ *    length of rendered object, truncated when buffer is too short
+ */
+int metrics_json ( pg_plug_inst * pinst, char * buf, int len ){
+
+   pg_metrics * m = &pinst->metrics;
+   int pos;
+   int ph;
+   int b;
+   int last;
+
+#define JSONADD(...) \
+   pos += snprintf ( buf + pos, pos < len ? len - pos : 0, __VA_ARGS__ );
+
+   pos = 0;
+   JSONADD ( "{\"jobid\":%i,\"client\":\"%s\",\"mode\":%i,\"start\":%ld,\"elapsed\":%.3f,"
+         "\"files\":%lld,\"bytes\":%lld,\"syscalls\":%lld,\"phases\":{",
+         pinst->JobId, NPRT ( search_key ( pinst->paramlist, "ARCHCLIENT" ) ), pinst->mode,
+         (long) m->wallstart, monotonic_time () - m->start, (long long) m->files,
+         (long long) m->bytes, (long long) metrics_syscalls ( pinst ) );
+   for ( ph = 0; ph < PH_MAX; ph++ ){
+      /* trailing empty buckets are skipped */
+      for ( last = PGHISTBUCKETS - 1; last > 0 && ! m->hist [ ph ][ last ]; last-- );
+      JSONADD ( "%s\"%s\":{\"time\":%.6f,\"calls\":%lld,\"hist\":[",
+            ph ? "," : "", phasenames [ ph ], m->time [ ph ], (long long) m->calls [ ph ] );
+      for ( b = 0; b <= last; b++ ){
+         JSONADD ( "%s%lld", b ? "," : "", (long long) m->hist [ ph ][ b ] );
+      }
+      JSONADD ( "]}" );
+   }
+   JSONADD ( "}" );
+   if ( pinst->mode == PGSQL_DB_BACKUP ){
+      JSONADD ( ",\"start_lsn\":\"%s\",\"stop_lsn\":\"%s\"", pinst->startlsn, pinst->stoplsn );
+      JSONADD ( ",\"level\":\"%c\",\"since\":%ld,\"skipped\":%lld,\"skippedbytes\":%lld",
+            pinst->level ? pinst->level : 'F', (long) pinst->since, (long long) m->skipped,
+            (long long) m->skippedbytes );
+      JSONADD ( ",\"schedule\":{\"policy\":\"%s\",\"time\":%.6f,\"devices\":%i,\"seekgb\":%.3f}",
+            schednames [ m->schedule ], m->schedtime, m->devices, m->seekgb );
+   }
+   if ( m->blockincr || m->incrfiles ){
+      JSONADD ( ",\"blockincr\":{\"enabled\":%i,\"files\":%lld,\"blocks\":%lld}",
+            m->blockincr, (long long) m->incrfiles, (long long) m->incrblocks );
+   }
+   if ( pinst->throttle.enabled ){
+      JSONADD ( ",\"throttle\":{\"mbps\":%.1f,\"iops\":%.0f,\"adaptive\":\"%s\",\"wait\":%.3f,"
+            "\"sleeps\":%lld,\"backoffs\":%lld,\"minscale\":%.2f,\"scale\":%.2f,\"maxpressure\":%.2f}",
+            pinst->throttle.base ? 0 : pinst->throttle.mbps, pinst->throttle.iops,
+            throttlenames [ pinst->throttle.adaptive ], m->throttlewait, (long long) m->throttles,
+            (long long) m->backoffs, m->minscale, pinst->throttle.scale, m->maxpressure );
+   }
+   JSONADD ( "}" );
+
+#undef JSONADD
+
+   return pos;
+}
+
+/*
+ * reports job metrics at job end: a short summary as job messages, a row in
+ * pgsql_backupdbs for database backups and a JSON line in STATSFILE
+ *
+ * in:
+ *    ctx - plugin context
+ *    status - pgsql_status of a database backup, unused for other jobs
+ */
+void report_job_metrics ( bpContext *ctx, int status ){
+
+   pg_plug_inst * pinst;
+   pg_metrics * m;
+   PGresult * result;
+   ExecStatusType resstatus;
+   FILE * out;
+   char * buf;
+   char * json;
+   char * sql;
+   char * file;
+   double elapsed;
+   int pos;
+   int ph;
+   int fd;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+   m = &pinst->metrics;
+   if ( m->reported || pinst->mode == PGSQL_NONE ){
+      return;
+   }
+   m->reported = 1;
+   elapsed = monotonic_time () - m->start;
+
+   buf = MALLOC ( MSGLEN );
+   json = MALLOC ( STATSBUFLEN );
+   if ( ! buf || ! json ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      if ( buf ){
+         FREE ( buf );
+      }
+      return;
+   }
+
+   snprintf ( buf, MSGLEN, "job stats: %lld files, %.1f MB in %.1fs (%.1f MB/s), %lld syscalls, %lld catalog queries",
+         (long long) m->files, (double) m->bytes / ( 1024 * 1024 ), elapsed,
+         elapsed > 0 ? (double) m->bytes / ( 1024 * 1024 ) / elapsed : 0,
+         (long long) metrics_syscalls ( pinst ), (long long) m->calls [ PH_CATALOG ] );
+   JMSG ( ctx, M_INFO, "%s\n", buf );
+
+   pos = snprintf ( buf, MSGLEN, "job phases:" );
+   for ( ph = 0; ph < PH_MAX && pos < MSGLEN; ph++ ){
+      if ( m->calls [ ph ] ){
+         pos += snprintf ( buf + pos, MSGLEN - pos, " %s %.2fs", phasenames [ ph ], m->time [ ph ] );
+         if ( ph >= PH_OPEN && ph <= PH_CLOSE ){
+            pos += snprintf ( buf + pos, pos < MSGLEN ? MSGLEN - pos : 0, " (p50 %.0fus, p99 %.0fus)",
+                  metrics_percentile ( m, ph, 50 ), metrics_percentile ( m, ph, 99 ) );
+         }
+      }
+   }
+   JMSG ( ctx, M_INFO, "%s\n", buf );
+   if ( pinst->mode == PGSQL_DB_BACKUP && m->skipped ){
+      JMSG2 ( ctx, M_INFO, "job level: %lld unchanged files skipped, %.1f MB\n",
+            (long long) m->skipped, (double) m->skippedbytes / ( 1024 * 1024 ) );
+   }
+   if ( pinst->mode == PGSQL_DB_BACKUP && m->blockincr ){
+      JMSG2 ( ctx, M_INFO, "job level: %lld relation segments sent as %lld changed blocks\n",
+            (long long) m->incrfiles, (long long) m->incrblocks );
+   }
+   if ( pinst->mode == PGSQL_DB_BACKUP && m->schedule != SCHED_NONE ){
+      pos = snprintf ( buf, MSGLEN, "job schedule: %s in %.2fs, estimated seek distance %.1f GB",
+            schednames [ m->schedule ], m->schedtime, m->seekgb );
+      if ( m->devices ){
+         snprintf ( buf + pos, pos < MSGLEN ? MSGLEN - pos : 0, ", %i devices interleaved", m->devices );
+      }
+      JMSG ( ctx, M_INFO, "%s\n", buf );
+   }
+   if ( pinst->throttle.enabled ){
+      pos = snprintf ( buf, MSGLEN, "job throttle: %.1fs waited in %lld sleeps",
+            m->throttlewait, (long long) m->throttles );
+      if ( pinst->throttle.adaptive != THROTTLE_NONE ){
+         snprintf ( buf + pos, pos < MSGLEN ? MSGLEN - pos : 0,
+               ", %s backoffs %lld, lowest rate scale %.2f, max pressure %.2f",
+               throttlenames [ pinst->throttle.adaptive ], (long long) m->backoffs,
+               m->minscale, m->maxpressure );
+      }
+      JMSG ( ctx, M_INFO, "%s\n", buf );
+   }
+   FREE ( buf );
+
+   metrics_json ( pinst, json, STATSBUFLEN );
+
+   file = search_key ( pinst->paramlist, "STATSFILE" );
+   if ( file ){
+      /* file daemon runs as root, a symbolic link is never followed */
+      out = NULL;
+      fd = open ( file, O_WRONLY | O_CREAT | O_APPEND | O_NOFOLLOW, S_IRUSR | S_IWUSR );
+      if ( fd >= 0 ){
+         out = fdopen ( fd, "a" );
+         if ( ! out ){
+            close ( fd );
+         }
+      }
+      if ( out ){
+         fprintf ( out, "%s\n", json );
+         fclose ( out );
+      } else {
+         JMSG2 ( ctx, M_WARNING, "cannot write stats file %s: %s\n", file, strerror ( errno ) );
+      }
+   }
+
+   if ( pinst->mode == PGSQL_DB_BACKUP && search_key ( pinst->paramlist, "CATDB" ) ){
+      /* database backup connects to catalog at the end only */
+      if ( ! pinst->catdb && catdbconnect ( ctx ) ){
+         JMSG0 ( ctx, M_WARNING, "catalog connection failed, job stats not saved.\n" );
+      } else {
+         sql = MALLOC ( STATSBUFLEN + SQLLEN );
+         if ( sql ){
+            snprintf ( sql, STATSBUFLEN + SQLLEN,
+                  "insert into pgsql_backupdbs (client, jobid, shardset, start_date, end_date, blevel, status, "
+                  "start_lsn, stop_lsn, start_wal, files, bytes, elapsed, stats) "
+                  "values ('%s', %i, nullif(%i, 0), to_timestamp(%ld), now(), %i, %i, "
+                  "nullif('%s', ''), nullif('%s', ''), nullif('%s', ''), %lld, %lld, %.3f, '%s')",
+                  search_key ( pinst->paramlist, "ARCHCLIENT" ), pinst->JobId, pinst->shardset,
+                  (long) m->wallstart, pinst->level ? pinst->level : 'F', status,
+                  pinst->startlsn, pinst->stoplsn, pinst->startwal,
+                  (long long) m->files, (long long) m->bytes, elapsed, json );
+            result = catdb_exec ( ctx, sql );
+            resstatus = PQresultStatus ( result );
+            if ( resstatus != PGRES_COMMAND_OK ){
+               PGERROR ( "report_job_metrics.pqexec failed!", sql, result, resstatus );
+            }
+            PQclear ( result );
+            if ( ( status == PGSQL_STATUS_DB_ONLINE_FINISH || status == PGSQL_STATUS_DB_OFFLINE_FINISH ) &&
+                  ( ! pinst->level || pinst->level == 'F' ) &&
+                  ! pinst->shards && pinst->startlsn [ 0 ] &&
+                  check_param_bool ( pinst->paramlist, "WALSUMMARY", 0 ) ){
+               /* WAL summaries older than a full backup are not needed anymore,
+                * a transaction index (WALINDEX) in the same rows is kept for PITR */
+               if ( check_param_bool ( pinst->paramlist, "WALINDEX", 0 ) ){
+                  snprintf ( sql, STATSBUFLEN + SQLLEN, "update pgsql_walsummaries set summary=null where client='%s' "
+                        "and end_lsn <= %llu and summary is not null",
+                        search_key ( pinst->paramlist, "ARCHCLIENT" ),
+                        (unsigned long long) wal_parse_lsn ( pinst->startlsn ) );
+               } else {
+                  snprintf ( sql, STATSBUFLEN + SQLLEN, "delete from pgsql_walsummaries where client='%s' and end_lsn <= %llu",
+                        search_key ( pinst->paramlist, "ARCHCLIENT" ),
+                        (unsigned long long) wal_parse_lsn ( pinst->startlsn ) );
+               }
+               catdb_command ( ctx, sql );
+            }
+            FREE ( sql );
+         }
+      }
+   }
+
+   FREE ( json );
+}
+
 /*
  * perform an internal connection to the database in separate process and execute sql
  * statement
@@ -628,6 +1296,33 @@ bRC switch_pg_xlog ( bpContext *ctx ){
    return err;
 }
 
+/*
+ * checks that a cluster is stopped for a database backup without
+ * pg_start_backup (PGSTARTSTOP = no), a running one would be copied
+ * inconsistently and without backup_label
+ *
+ * in:
+ *    ctx - plugin context
+ * out:
+ *    bRC_OK - postmaster.pid not found in PGDATA
+ *    bRC_Error - cluster is running or crashed, reported as job message
+ */
+bRC check_pg_stopped ( bpContext *ctx ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   struct stat st;
+   char path [ PATH_MAX ];
+
+   snprintf ( path, PATH_MAX, "%s/postmaster.pid", search_key ( pinst->paramlist, "PGDATA" ) );
+   if ( lstat ( path, &st ) == 0 ){
+      JMSG ( ctx, M_FATAL, "PGSTARTSTOP is off and %s exists, a running or crashed cluster could not be backed up without pg_start_backup.\n",
+            path );
+      return bRC_Error;
+   }
+
+   return bRC_OK;
+}
+
 /*
  * start backup procedure
  * 
@@ -641,6 +1336,7 @@ bRC start_pg_backup ( bpContext *ctx ){
 
    pg_plug_inst * pinst;
    char * sql;
+   double start;
    bRC err = bRC_OK;
 
    /* check input data */
@@ -675,7 +1371,9 @@ bRC start_pg_backup ( bpContext *ctx ){
          search_key ( pinst->paramlist, "ARCHCLIENT" ),
          pinst->JobId );
 
+   start = monotonic_time ();
    err = pg_internal_conn ( ctx, sql );
+   metrics_add ( &pinst->metrics, PH_START, start );
 
    /* error database connection in this case it is a problem,
     * rise en error for calling function */
@@ -698,9 +1396,16 @@ bRC start_pg_backup ( bpContext *ctx ){
  */
 bRC stop_pg_backup ( bpContext *ctx ){
 
+   pg_plug_inst * pinst;
+   double start;
    bRC err = bRC_OK;
 
+   ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   start = monotonic_time ();
    err = pg_internal_conn ( ctx, "select pg_stop_backup ()" );
+   metrics_add ( &pinst->metrics, PH_STOP, start );
 
    /* error database connection in this case it is a problem,
     * rise en error for calling function */
@@ -741,7 +1446,7 @@ bRC get_wal_list ( bpContext *ctx ){
    snprintf ( sql, SQLLEN, "select * from pgsql_archivelogs where client='%s' and status in (3,5) order by mod_date",
          search_key ( pinst->paramlist, "ARCHCLIENT" ) );
 
-   result = PQexec ( pinst->catdb, sql );
+   result = catdb_exec ( ctx, sql );
    resstatus = PQresultStatus ( result );
    if ( resstatus != PGRES_TUPLES_OK ){
       PGERROR ( "get_wal_list.pqexec failed!", sql, result, resstatus );
@@ -1127,7 +1832,9 @@ keylist * get_file_list ( bpContext *ctx, keylist * list, const char * base, con
          /* avoid ".", ".." and PG_9.xxxxxxxxxxx directories in our scan */
          if ( strcmp ( filedir->d_name, "." ) != 0 &&
                strcmp ( filedir->d_name, ".." ) != 0 &&
-               strncmp ( filedir->d_name, "PG_9.", 5 ) != 0 ){
+               strncmp ( filedir->d_name, "PG_9.", 5 ) != 0 &&
+               ! ( plen == 0 && strcmp ( filedir->d_name, PGMANIFEST ) == 0 ) &&
+               ! ( plen == 0 && strcmp ( filedir->d_name, PGRESTOREMODE ) == 0 ) ){
             /* check if we got tablespaces directory pg_tblspc, then path is empty and
              * base has absolute filename path */
             if ( strcmp ( filedir->d_name, "pg_tblspc" ) == 0 && plen == 0 ){
@@ -1170,11 +1877,27 @@ keylist * get_file_list ( bpContext *ctx, keylist * list, const char * base, con
 bRC get_dbf_list ( bpContext *ctx ){
 
    pg_plug_inst * pinst;
+   keyitem * item;
+   double start;
 
    ASSERT_ctx_p;
    pinst = (pg_plug_inst *)ctx->pContext;
 
+   start = monotonic_time ();
    pinst->filelist = get_file_list ( ctx, NULL, search_key ( pinst->paramlist, "PGDATA" ), "" );
+   metrics_add ( &pinst->metrics, PH_SCAN, start );
+
+   /* backup start location is in backup_label until pg_stop_backup */
+   if ( pinst->startstop ){
+      read_backup_label ( ctx );
+   }
+
+   /* a manifest of whole database is sent by the first shard only */
+   if ( pinst->shard <= 1 && ! pinst->mlist ){
+      foreach_dlist ( item, pinst->filelist ){
+         pinst->mlist = add_keylist_attr ( pinst->mlist, item->key, item->value, item->attrs );
+      }
+   }
 
    /* first node of the list will be our current file for backup */
    pinst->curfile = (keyitem *)pinst->filelist->first();
@@ -1183,85 +1906,2128 @@ bRC get_dbf_list ( bpContext *ctx ){
 }
 
 /*
- * Called by Bacula when there are certain events that the
- *   plugin might want to know.  The value depends on the
- *   event.
+ * returns a real filesystem path of a file list item
  */
-static bRC handlePluginEvent(bpContext *ctx, bEvent *event, void *value){
+const char * dbfile_path ( keyitem * item ){
 
-   int err;
-   pg_plug_inst * pinst;
+   return strncmp ( item->key, "$ROOT$", PATH_MAX ) == 0 ? item->value : item->key;
+}
 
-   ASSERT_ctx_p;
-   pinst = (pg_plug_inst *)ctx->pContext;
+/* database file with its placement used by backup scheduler */
+typedef struct _pg_sched_file pg_sched_file;
+struct _pg_sched_file {
+   keyitem  * item;
+   dev_t    dev;
+   int64_t  size;
+   uint64_t phys;          /* physical offset of the first extent or inode number */
+   int      mapped;        /* phys is a real disk offset (FIEMAP) */
+   int      unknown;       /* file could not be checked, scheduled last */
+};
 
-   ASSERT_p ( event );
-   DMSG1 ( ctx, D1, "handlePluginEvent: %i\n", event->eventType );
+/*
+ * returns a physical offset of the first file extent (FIEMAP), when it is not
+ * available an inode number is used, as filesystems allocate data near inodes
+ *
+ * out:
+ *    mapped - 1 when a returned offset comes from FIEMAP, 0 for inode number
+ */
+uint64_t file_phys_offset ( pg_plug_inst * pinst, const char * path, struct stat * st, int * mapped ){
 
-   switch (event->eventType) {
-   case bEventJobStart:
-   // unused in ur case, information only
-      DMSG1 ( ctx, D2, "bEventJobStart value=%s\n", NPRT((char *)value) );
-      break;
-   case bEventJobEnd:
-   // unused in ur case, information only
-      DMSG1 ( ctx, D2, "bEventJobEnd value=%s\n", NPRT((char *)value) );
-      break;
-   case bEventStartBackupJob:
-   // unused in ur case, information only
-      DMSG1 ( ctx, D2, "bEventStartBackupJob value=%s\n", NPRT((char *)value) );
-      break;
-   case bEventEndBackupJob:
-   // closing database connection
-      DMSG1 ( ctx, D2, "bEventEndBackupJob value=%s\n", NPRT((char *)value));
-      if ( pinst->mode == PGSQL_DB_BACKUP ){
-         err = stop_pg_backup ( ctx );
-         if ( err ){
-            return bRC_Error;
-         }
-      }
-      break;
-   case bEventLevel:
-   // unused in ur case, information only
-   // XXX: it could be usefull
-      DMSG1 ( ctx, D2, "bEventLevel=%c\n", (char) ( (intptr_t)value & 0xff) );
-      break;
-   case bEventSince:
-   // unused in ur case, information only
-      DMSG1 ( ctx, D2, "bEventSince=%ld\n", (intptr_t)value);
-      break;
-   case bEventStartRestoreJob:
-   /* Test if restored database works or not, but we have very limited info about it,
-    * it should be realized by external utility */
-      DMSG1 ( ctx, D2, "StartRestoreJob value=%s\n", NPRT((char *)value));
-      break;
-   case bEventEndRestoreJob:
-   // unused in ur case, information only
-      DMSG0 ( ctx, D2, "bEventEndRestoreJob\n");
-      break;
+#ifdef FS_IOC_FIEMAP
+   union {
+      struct fiemap fm;
+      char buf [ sizeof ( struct fiemap ) + sizeof ( struct fiemap_extent ) ];
+   } req;
+   int fd;
+   int err;
 
-   /* Plugin command e.g. plugin = <plugin-name>:<name-space>:command */
-   case bEventRestoreCommand:
-      /* setup a plugin parameters: plugin = pgsql:<file_conf>:[wal,db] */
-      DMSG1 ( ctx, D2, "bEventRestoreCommand value=%s\n", NPRT((char *)value) );
-      err = parse_plugin_command ( ctx, PARSE_RESTORE, (char *) value );
-      if ( err ){
-         return bRC_Error;
+   fd = open ( path, O_RDONLY );
+   pinst->metrics.syscalls++;
+   if ( fd >= 0 ){
+      memset ( &req, 0, sizeof ( req ) );
+      req.fm.fm_start = 0;
+      req.fm.fm_length = ~0ULL;
+      req.fm.fm_extent_count = 1;
+      err = ioctl ( fd, FS_IOC_FIEMAP, &req.fm );
+      close ( fd );
+      pinst->metrics.syscalls += 2;
+      if ( err == 0 && req.fm.fm_mapped_extents > 0 ){
+         *mapped = 1;
+         return req.fm.fm_extents [ 0 ].fe_physical;
       }
-      break;
+   }
+#endif
 
-   case bEventBackupCommand:
-      /* setup a plugin parameters: plugin = pgsql:<file_conf>:[wal,db] */
-      DMSG1 ( ctx, D2, "bEventBackupCommand value=%s\n", NPRT((char *)value) );
-      err = parse_plugin_command ( ctx, PARSE_BACKUP, (char *) value );
-      if ( err ){
-         return bRC_Error;
-      }
+   *mapped = 0;
+   return (uint64_t) st->st_ino * PGSCHEDINOSCALE;
+}
 
-      if ( pinst->mode == PGSQL_ARCH_BACKUP ){
-         /* we force to switch a database log file, to do that we need to connect into a production
-          * database instance and execute a pg_switch_xlog(); to handle it we have to switch a user
-          * into a database cluster owner (in most cases it will be a postgres user) and perform a
+/* disk order: device, then physical offset; inode based offsets are not
+ * comparable with extent ones, so such files follow mapped files of a device */
+static int sched_extent_cmp ( const void * a, const void * b ){
+
+   const pg_sched_file * fa = (const pg_sched_file *) a;
+   const pg_sched_file * fb = (const pg_sched_file *) b;
+
+   if ( fa->unknown != fb->unknown ){
+      return fa->unknown - fb->unknown;
+   }
+   if ( fa->dev != fb->dev ){
+      return fa->dev < fb->dev ? -1 : 1;
+   }
+   if ( fa->mapped != fb->mapped ){
+      return fb->mapped - fa->mapped;
+   }
+   return fa->phys < fb->phys ? -1 : fa->phys > fb->phys ? 1 : 0;
+}
+
+/* large files first */
+static int sched_size_cmp ( const void * a, const void * b ){
+
+   const pg_sched_file * fa = (const pg_sched_file *) a;
+   const pg_sched_file * fb = (const pg_sched_file *) b;
+
+   if ( fa->unknown != fb->unknown ){
+      return fa->unknown - fb->unknown;
+   }
+   return fa->size < fb->size ? 1 : fa->size > fb->size ? -1 : 0;
+}
+
+/*
+ * interleaves files sorted in disk order across devices, a next file is taken
+ * from a device with the least bytes scheduled, so all devices are read
+ * at the same time and every device is still read sequentially
+ *
+ * in:
+ *    files - files sorted with sched_extent_cmp
+ *    n - number of files
+ *    out - output order
+ * out:
+ *    number of devices
+ */
+int sched_interleave ( pg_sched_file * files, int n, pg_sched_file * out ){
+
+   int first [ PGSCHEDMAXDEV ];
+   int last [ PGSCHEDMAXDEV ];
+   int64_t bytes [ PGSCHEDMAXDEV ];
+   int ndev = 0;
+   int a, d, min;
+
+   for ( a = 0; a < n; a++ ){
+      if ( ndev == 0 || ( files [ a ].dev != files [ a - 1 ].dev && ndev < PGSCHEDMAXDEV ) ){
+         first [ ndev ] = a;
+         bytes [ ndev ] = 0;
+         ndev++;
+      }
+      last [ ndev - 1 ] = a + 1;
+   }
+   for ( a = 0; a < n; a++ ){
+      min = -1;
+      for ( d = 0; d < ndev; d++ ){
+         if ( first [ d ] < last [ d ] && ( min < 0 || bytes [ d ] < bytes [ min ] ) ){
+            min = d;
+         }
+      }
+      out [ a ] = files [ first [ min ]++ ];
+      bytes [ min ] += out [ a ].size;
+   }
+
+   return ndev;
+}
+
+/*
+ * returns a file read order selected by SCHEDULE parameter, default none
+ */
+int get_schedule ( bpContext *ctx ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   char * str;
+   int a;
+
+   str = search_key ( pinst->paramlist, "SCHEDULE" );
+   if ( str ){
+      for ( a = 0; a < SCHED_MAX; a++ ){
+         if ( strcasecmp ( str, schednames [ a ] ) == 0 ){
+            return a;
+         }
+      }
+      JMSG ( ctx, M_WARNING, "unknown SCHEDULE %s, using none.\n", str );
+   }
+
+   return SCHED_NONE;
+}
+
+/*
+ * orders a database file list according to SCHEDULE policy:
+ *    none - readdir order,
+ *    largefirst - the largest files first, they overlap better with other streams,
+ *    extent - physical disk order (FIEMAP), sequential reads on HDD,
+ *    device - physical order on every device, files of devices interleaved.
+ * Files which could not be checked are read last, files without FIEMAP extents
+ * follow mapped files of their device in inode order.
+ * Directories and links are kept in their order after all files, so directory
+ * attributes are restored after its content.
+ *
+ * in:
+ *    ctx - plugin context
+ * out:
+ *    pinst->filelist - ordered file list
+ *    bRC_OK - on success
+ *    bRC_Error - on error
+ */
+bRC schedule_file_list ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   pg_sched_file * files;
+   pg_sched_file * order;
+   keylist * nlist = NULL;
+   keyitem * item;
+   struct stat st;
+   double start;
+   double seek = 0;
+   int n = 0;
+   int unknown = 0;
+   int a;
+
+   ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   if ( pinst->metrics.schedule == SCHED_NONE || ! pinst->filelist ){
+      return bRC_OK;
+   }
+   start = monotonic_time ();
+
+   foreach_dlist ( item, pinst->filelist ){
+      n++;
+   }
+   files = (pg_sched_file *) malloc ( sizeof ( pg_sched_file ) * ( n + 1 ) );
+   order = (pg_sched_file *) malloc ( sizeof ( pg_sched_file ) * ( n + 1 ) );
+   if ( ! files || ! order ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      free ( files );
+      free ( order );
+      return bRC_Error;
+   }
+
+   n = 0;
+   foreach_dlist ( item, pinst->filelist ){
+      if ( item->attrs != PG_FILE && item->attrs != PG_INCR ){
+         continue;
+      }
+      pinst->metrics.syscalls++;
+      memset ( &files [ n ], 0, sizeof ( pg_sched_file ) );
+      files [ n ].item = item;
+      if ( lstat ( dbfile_path ( item ), &st ) != 0 ){
+         /* a file is still backed up, its error is reported on open */
+         files [ n ].unknown = 1;
+         unknown++;
+      } else {
+         files [ n ].dev = st.st_dev;
+         files [ n ].size = st.st_size;
+         files [ n ].phys = file_phys_offset ( pinst, dbfile_path ( item ), &st, &files [ n ].mapped );
+      }
+      n++;
+   }
+
+   switch ( pinst->metrics.schedule ){
+      case SCHED_LARGEFIRST:
+         qsort ( files, n, sizeof ( pg_sched_file ), sched_size_cmp );
+         memcpy ( order, files, sizeof ( pg_sched_file ) * n );
+         break;
+      case SCHED_EXTENT:
+         qsort ( files, n, sizeof ( pg_sched_file ), sched_extent_cmp );
+         memcpy ( order, files, sizeof ( pg_sched_file ) * n );
+         break;
+      case SCHED_DEVICE:
+         qsort ( files, n, sizeof ( pg_sched_file ), sched_extent_cmp );
+         pinst->metrics.devices = sched_interleave ( files, n - unknown, order );
+         memcpy ( order + n - unknown, files + n - unknown, sizeof ( pg_sched_file ) * unknown );
+         break;
+   }
+
+   for ( a = 0; a < n; a++ ){
+      nlist = add_keylist_attr ( nlist, order [ a ].item->key, order [ a ].item->value, order [ a ].item->attrs );
+      /* an estimated head movement on devices between consecutive files */
+      if ( a > 0 && order [ a ].dev == order [ a - 1 ].dev &&
+            order [ a ].mapped && order [ a - 1 ].mapped ){
+         seek += order [ a ].phys > order [ a - 1 ].phys + order [ a - 1 ].size ?
+               order [ a ].phys - ( order [ a - 1 ].phys + order [ a - 1 ].size ) :
+               order [ a - 1 ].phys + order [ a - 1 ].size - order [ a ].phys;
+      }
+   }
+   foreach_dlist ( item, pinst->filelist ){
+      if ( item->attrs != PG_FILE && item->attrs != PG_INCR ){
+         nlist = add_keylist_attr ( nlist, item->key, item->value, item->attrs );
+      }
+   }
+   free ( order );
+   free ( files );
+
+   keylist_free ( pinst->filelist );
+   pinst->filelist = nlist;
+   pinst->curfile = nlist ? (keyitem *)nlist->first() : NULL;
+
+   pinst->metrics.seekgb = seek / ( 1024.0 * 1024 * 1024 );
+   pinst->metrics.schedtime = monotonic_time () - start;
+   DMSG2 ( ctx, D2, "schedule %s done in %.3fs\n", schednames [ pinst->metrics.schedule ],
+         pinst->metrics.schedtime );
+
+   return bRC_OK;
+}
+
+/*
+ * renders a virtual file name of a file list item as sent to Bacula:
+ * pgsqldb:<ARCHCLIENT>/<DB_Filename> or pgsqltbs:<ARCHCLIENT><TBS_Filename>,
+ * block incremental files get a .pgincr.<JobId> suffix
+ */
+char * dbfile_vname ( pg_plug_inst * pinst, keyitem * item, char * buf, int len ){
+
+   if ( strncmp ( item->key, "$ROOT$", PATH_MAX ) == 0 ){
+      snprintf ( buf, len, "pgsqltbs:%s%s", search_key ( pinst->paramlist, "ARCHCLIENT" ), item->value );
+   } else {
+      snprintf ( buf, len, "pgsqldb:%s/%s", search_key ( pinst->paramlist, "ARCHCLIENT" ), item->value );
+   }
+   if ( item->attrs == PG_INCR ){
+      snprintf ( buf + strlen ( buf ), len - strlen ( buf ), PGINCRSUFFIX "%i", pinst->JobId );
+   }
+
+   return buf;
+}
+
+/*
+ * checks if a name is of block incremental file: <name>.pgincr.<JobId>
+ *
+ * out:
+ *    JobId and a length of name without suffix in len, 0 if not
+ */
+int incr_file_jobid ( const char * name, int * len ){
+
+   const char * p;
+   char * end;
+   long jobid;
+
+   p = strstr ( name, PGINCRSUFFIX );
+   if ( ! p ){
+      return 0;
+   }
+   jobid = strtol ( p + strlen ( PGINCRSUFFIX ), &end, 10 );
+   if ( *end || jobid <= 0 ){
+      return 0;
+   }
+   *len = p - name;
+
+   return (int) jobid;
+}
+
+/*
+ * checks if a file list item is a relation segment: a file with numeric name
+ * (relfilenode, its segments and forks) in base, global or a tablespace
+ */
+int is_relation_file ( keyitem * item ){
+
+   const char * name;
+
+   if ( item->attrs != PG_FILE ){
+      return 0;
+   }
+   name = strrchr ( item->value, '/' );
+   name = name ? name + 1 : item->value;
+   if ( ! isdigit ( (unsigned char) *name ) ){
+      return 0;
+   }
+
+   return strncmp ( item->key, "$ROOT$", PATH_MAX ) == 0 ||
+          strncmp ( item->value, "base/", 5 ) == 0 ||
+          strncmp ( item->value, "global/", 7 ) == 0;
+}
+
+/*
+ * reads a backup start location and its WAL file from backup_label
+ */
+void read_backup_label ( bpContext *ctx ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   FILE * in;
+   char * buf;
+
+   buf = MALLOC ( PATH_MAX );
+   if ( ! buf ){
+      return;
+   }
+   snprintf ( buf, PATH_MAX, "%s/backup_label", search_key ( pinst->paramlist, "PGDATA" ) );
+   in = fopen ( buf, "r" );
+   if ( in ){
+      while ( freadline ( in, buf, PATH_MAX ) >= 0 ){
+         if ( sscanf ( buf, "START WAL LOCATION: %31s (file %31[0-9A-F])",
+                  pinst->startlsn, pinst->startwal ) == 2 ){
+            break;
+         }
+      }
+      fclose ( in );
+   }
+   if ( ! pinst->startlsn [ 0 ] ){
+      JMSG0 ( ctx, M_WARNING, "backup start location not found in backup_label.\n" );
+   }
+   DMSG2 ( ctx, D2, "backup start lsn=%s wal=%s\n", pinst->startlsn, pinst->startwal );
+   FREE ( buf );
+}
+
+/*
+ * reads a backup stop location from a backup history file written by
+ * pg_stop_backup: <startwal>.<offset>.backup in pg_xlog or pg_wal
+ */
+void read_stop_lsn ( bpContext *ctx ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   static const char * waldirs [] = { "pg_wal", "pg_xlog", NULL };
+   char lsn [ PGLSNLEN ];
+   char * dir;
+   char * buf;
+   DIR * dirp;
+   struct dirent * filedir;
+   FILE * in;
+   int len;
+   int a;
+
+   if ( ! pinst->startwal [ 0 ] ){
+      return;
+   }
+   dir = MALLOC ( PATH_MAX );
+   buf = MALLOC ( PATH_MAX );
+   if ( ! dir || ! buf ){
+      if ( dir ){
+         FREE ( dir );
+      }
+      return;
+   }
+   len = strlen ( pinst->startwal );
+   for ( a = 0; waldirs [ a ] && ! pinst->stoplsn [ 0 ]; a++ ){
+      snprintf ( dir, PATH_MAX, "%s/%s", search_key ( pinst->paramlist, "PGDATA" ), waldirs [ a ] );
+      dirp = opendir ( dir );
+      if ( ! dirp ){
+         continue;
+      }
+      while ( ! pinst->stoplsn [ 0 ] && ( filedir = readdir ( dirp ) ) ){
+         if ( strncmp ( filedir->d_name, pinst->startwal, len ) != 0 ||
+               ! strstr ( filedir->d_name + len, ".backup" ) ){
+            continue;
+         }
+         /* more backups could start in one WAL segment, start location has to match */
+         snprintf ( buf, PATH_MAX, "%s/%s", dir, filedir->d_name );
+         in = fopen ( buf, "r" );
+         if ( ! in ){
+            continue;
+         }
+         lsn [ 0 ] = 0;
+         while ( freadline ( in, buf, PATH_MAX ) >= 0 ){
+            if ( sscanf ( buf, "START WAL LOCATION: %31s", lsn ) == 1 &&
+                  strcmp ( lsn, pinst->startlsn ) != 0 ){
+               break;
+            }
+            if ( sscanf ( buf, "STOP WAL LOCATION: %31s", pinst->stoplsn ) == 1 ){
+               break;
+            }
+         }
+         fclose ( in );
+      }
+      closedir ( dirp );
+   }
+   if ( ! pinst->stoplsn [ 0 ] ){
+      JMSG0 ( ctx, M_WARNING, "backup stop location not found in backup history file.\n" );
+   }
+   DMSG1 ( ctx, D2, "backup stop lsn=%s\n", pinst->stoplsn );
+   FREE ( buf );
+   FREE ( dir );
+}
+
+/*
+ * remembers a checksum, size and mtime of a database file just read
+ *
+ * out:
+ *    0 - success
+ *    1 - memory allocation error
+ */
+int add_file_sum ( pg_plug_inst * pinst ){
+
+   pg_fsum * sums;
+   const char * path;
+
+   if ( pinst->nsums == pinst->sumsize ){
+      pinst->sumsize = pinst->sumsize ? pinst->sumsize * 2 : 1024;
+      sums = (pg_fsum *) realloc ( pinst->sums, sizeof ( pg_fsum ) * pinst->sumsize );
+      if ( ! sums ){
+         return 1;
+      }
+      pinst->sums = sums;
+   }
+   path = dbfile_path ( pinst->curfile );
+   pinst->sums [ pinst->nsums ].path = MALLOC ( strlen ( path ) + 1 );
+   if ( ! pinst->sums [ pinst->nsums ].path ){
+      return 1;
+   }
+   strcpy ( pinst->sums [ pinst->nsums ].path, path );
+   pinst->sums [ pinst->nsums ].size = pinst->filebytes;
+   pinst->sums [ pinst->nsums ].mtime = pinst->filemtime;
+   pinst->sums [ pinst->nsums ].crc = pinst->filecrc;
+   pinst->nsums++;
+
+   return 0;
+}
+
+static int fsum_cmp ( const void * a, const void * b ){
+
+   return strcmp ( ( (const pg_fsum *) a )->path, ( (const pg_fsum *) b )->path );
+}
+
+/*
+ * builds a backup manifest of a whole database file list with backup start
+ * and stop locations; regular files have a size, mtime and CRC32C of data
+ * sent to Bacula, files not read by this job (unchanged or in other shards)
+ * have a current size and mtime without a checksum; see manifest_entry
+ *
+ * in:
+ *    ctx - plugin context
+ * out:
+ *    pinst->manifest - manifest contents
+ *    bRC_OK - on success
+ *    bRC_Error - on error
+ */
+bRC manifest_build ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   keyitem * item;
+   pg_fsum key;
+   pg_fsum * sum;
+   struct stat st;
+   const char * path;
+   char crc [ 16 ];
+   char * buf;
+   int size = PATH_MAX * 4;
+   int len;
+
+   ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   if ( pinst->manifest ){
+      return bRC_OK;
+   }
+   buf = MALLOC ( size );
+   if ( ! buf ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      return bRC_Error;
+   }
+   len = snprintf ( buf, size, PGMANIFESTHDR " client=%s jobid=%i level=%c\n"
+         "start_lsn %s\nstop_lsn %s\n",
+         search_key ( pinst->paramlist, "ARCHCLIENT" ), pinst->JobId, pinst->level ? pinst->level : 'F',
+         pinst->startlsn [ 0 ] ? pinst->startlsn : "-", pinst->stoplsn [ 0 ] ? pinst->stoplsn : "-" );
+
+   qsort ( pinst->sums, pinst->nsums, sizeof ( pg_fsum ), fsum_cmp );
+
+   foreach_dlist ( item, pinst->mlist ){
+      if ( len + PATH_MAX + 64 > size ){
+         size *= 2;
+         buf = (char *) realloc ( buf, size );
+         if ( ! buf ){
+            JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+            return bRC_Error;
+         }
+      }
+      /* tablespace paths are absolute, a leading slash is removed on restore */
+      path = item->value;
+      if ( strncmp ( item->key, "$ROOT$", PATH_MAX ) == 0 && *path == '/' ){
+         path++;
+      }
+      if ( item->attrs != PG_FILE ){
+         len += snprintf ( buf + len, size - len, "%c %s\n", item->attrs == PG_DIR ? 'd' : 'l', path );
+         continue;
+      }
+      key.path = (char *) dbfile_path ( item );
+      sum = (pg_fsum *) bsearch ( &key, pinst->sums, pinst->nsums, sizeof ( pg_fsum ), fsum_cmp );
+      if ( sum ){
+         snprintf ( crc, sizeof ( crc ), "%08x", sum->crc );
+      } else {
+         strcpy ( crc, "-" );
+         memset ( &st, 0, sizeof ( st ) );
+         lstat ( key.path, &st );
+         pinst->metrics.syscalls++;
+      }
+      len += snprintf ( buf + len, size - len, "f %lld %ld %s %s\n",
+            (long long) ( sum ? sum->size : st.st_size ), (long) ( sum ? sum->mtime : st.st_mtime ),
+            crc, path );
+   }
+
+   pinst->manifest = buf;
+   pinst->manifestlen = len;
+
+   return bRC_OK;
+}
+
+/*
+ * finds a start location of a backup which the current incremental or
+ * differential backup is based on: a successful database backup (a full one
+ * for differential) started at Bacula since time, SINCEMARGIN seconds around
+ * it for a clock skew; the earliest one is taken, as a backup started later
+ * could be a failed Bacula job. A sharded backup is never a base, its shards
+ * could fail independently.
+ *
+ * in:
+ *    ctx - plugin context
+ *    margin - SINCEMARGIN seconds
+ * out:
+ *    base backup start location, 0 when not found
+ */
+uint64_t block_incr_base ( bpContext *ctx, int margin ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   PGresult * result;
+   char * sql;
+   uint64_t lsn = 0;
+
+   sql = MALLOC ( SHARDSQLLEN );
+   if ( ! sql ){
+      return 0;
+   }
+   snprintf ( sql, SHARDSQLLEN, "select start_lsn from pgsql_backupdbs where client='%s' and status in (" PGSQL_STATUS_DB_OK ") "
+         "and shardset is null and start_lsn is not null%s and start_date "
+         "between to_timestamp(%ld) and to_timestamp(%ld) order by start_date, id limit 1",
+         search_key ( pinst->paramlist, "ARCHCLIENT" ),
+         pinst->level == 'D' ? " and blevel = 70" : "",
+         (long) ( pinst->since - margin ), (long) ( pinst->since + margin ) );
+   result = catdb_exec ( ctx, sql );
+   if ( PQresultStatus ( result ) == PGRES_TUPLES_OK && PQntuples ( result ) == 1 ){
+      lsn = wal_parse_lsn ( PQgetvalue ( result, 0, 0 ) );
+   }
+   PQclear ( result );
+   FREE ( sql );
+
+   return lsn;
+}
+
+/*
+ * counts database backups of a current level I chain (since the last Full or
+ * Differential) which sent block incremental files; a restore applies all
+ * block incremental files after files sent whole, so a segment sent whole
+ * when block incremental is disabled would be overwritten by older blocks
+ *
+ * out:
+ *    number of jobs, -1 when catalog is not available
+ */
+int block_incr_chain ( bpContext *ctx ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   char * sql;
+   int count = -1;
+
+   if ( ! pinst->catdb && catdbconnect ( ctx ) ){
+      return -1;
+   }
+   sql = MALLOC ( SHARDSQLLEN );
+   if ( ! sql ){
+      return -1;
+   }
+   snprintf ( sql, SHARDSQLLEN, "select count(*) from pgsql_backupdbs where client='%s' and status in (" PGSQL_STATUS_DB_OK ") "
+         "and shardset is null and blevel <> 70 and stats like '%%\"blockincr\":%%' and id >= coalesce(("
+         "select max(id) from pgsql_backupdbs where client='%s' and status in (" PGSQL_STATUS_DB_OK ") "
+         "and shardset is null and blevel in (70,68)),0)",
+         search_key ( pinst->paramlist, "ARCHCLIENT" ), search_key ( pinst->paramlist, "ARCHCLIENT" ) );
+   if ( catdb_int_value ( ctx, sql, &count ) ){
+      count = -1;
+   }
+   FREE ( sql );
+
+   return count;
+}
+
+/*
+ * reads a whole file into an allocated buffer
+ *
+ * out:
+ *    file contents, has to be freed with free(), NULL on error
+ */
+unsigned char * read_whole_file ( const char * path, size_t * len ){
+
+   unsigned char * buf;
+   struct stat st;
+   ssize_t nr;
+   int fd;
+
+   fd = open ( path, O_RDONLY );
+   if ( fd < 0 ){
+      return NULL;
+   }
+   if ( fstat ( fd, &st ) != 0 || ! ( buf = (unsigned char *) malloc ( st.st_size + 1 ) ) ){
+      close ( fd );
+      return NULL;
+   }
+   *len = 0;
+   while ( *len < (size_t) st.st_size && ( nr = read ( fd, buf + *len, st.st_size - *len ) ) > 0 ){
+      *len += nr;
+   }
+   close ( fd );
+
+   return buf;
+}
+
+/*
+ * decodes local WAL segments (pg_wal or pg_xlog) of the current timeline
+ * from pos up to the backup start location, the WAL which is not archived yet
+ *
+ * in:
+ *    ctx - plugin context
+ *    ws - summary to fill
+ *    wr - WAL reader, with a record continued from archived segments
+ *    pos - decoded WAL start
+ *    to - decoded WAL end
+ * out:
+ *    0 - WAL range covered
+ *    1 - a local segment is missing or invalid
+ */
+int summarize_local_wal ( bpContext *ctx, walsummary * ws, walreader * wr, uint64_t pos, uint64_t to ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   static const char * waldirs [] = { "pg_wal", "pg_xlog", NULL };
+   unsigned char * seg;
+   char * path;
+   struct stat st;
+   size_t len;
+   uint64_t segno;
+   uint64_t segs;
+   unsigned int tli;
+   int err = 1;
+   int a;
+
+   path = MALLOC ( PATH_MAX );
+   if ( ! path || sscanf ( pinst->startwal, "%8X", &tli ) != 1 ){
+      if ( path ){
+         FREE ( path );
+      }
+      return 1;
+   }
+   /* a segment size is the size of backup start segment */
+   for ( a = 0; waldirs [ a ]; a++ ){
+      snprintf ( path, PATH_MAX, "%s/%s/%s", search_key ( pinst->paramlist, "PGDATA" ),
+            waldirs [ a ], pinst->startwal );
+      pinst->metrics.syscalls++;
+      if ( stat ( path, &st ) == 0 && st.st_size > 0 ){
+         break;
+      }
+   }
+   if ( ! waldirs [ a ] ){
+      FREE ( path );
+      return 1;
+   }
+   segs = 0x100000000ULL / st.st_size;
+   segno = wr->reclen ? wr->contlsn / st.st_size : pos / st.st_size;
+
+   while ( pos < to ){
+      snprintf ( path, PATH_MAX, "%s/%s/%08X%08X%08X", search_key ( pinst->paramlist, "PGDATA" ),
+            waldirs [ a ], tli, (unsigned int) ( segno / segs ), (unsigned int) ( segno % segs ) );
+      seg = read_whole_file ( path, &len );
+      pinst->metrics.syscalls += 3;
+      if ( ! seg ){
+         DMSG1 ( ctx, D2, "block incremental: WAL segment %s not found\n", path );
+         break;
+      }
+      if ( wal_decode_segment ( wr, seg, len, walsummary_record, ws ) != 0 || wr->covstart > pos ){
+         DMSG1 ( ctx, D2, "block incremental: WAL segment %s is not continuous\n", path );
+         free ( seg );
+         break;
+      }
+      free ( seg );
+      pos = wr->covend;
+      if ( pos < to && pos < wr->segstart + wr->segsize && ! wr->reclen ){
+         /* WAL ended before the backup start */
+         break;
+      }
+      segno++;
+   }
+   if ( pos >= to ){
+      err = 0;
+   }
+   FREE ( path );
+
+   return err;
+}
+
+/*
+ * builds a summary of relation blocks changed by WAL records in [from, to):
+ * summaries of archived segments saved in catalog by pgsql-archlog, then
+ * local WAL segments not archived yet
+ *
+ * in:
+ *    ctx - plugin context
+ *    from - base backup start location
+ *    to - current backup start location
+ * out:
+ *    summary or NULL when the WAL range is not covered
+ */
+walsummary * load_wal_summary ( bpContext *ctx, uint64_t from, uint64_t to ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   walsummary * ws;
+   walreader wr;
+   PGresult * result;
+   unsigned char * tail;
+   char * sql;
+   size_t len;
+   uint64_t pos = from;
+   uint64_t start;
+   uint64_t end;
+   int rows = 0;
+   int a;
+
+   ws = walsummary_alloc ();
+   sql = MALLOC ( SHARDSQLLEN );
+   if ( ! ws || ! sql || walreader_init ( &wr ) != 0 ){
+      walsummary_free ( ws );
+      if ( sql ){
+         FREE ( sql );
+      }
+      return NULL;
+   }
+
+   snprintf ( sql, SHARDSQLLEN, "select start_lsn, end_lsn, summary from pgsql_walsummaries where client='%s' "
+         "and end_lsn > %llu and start_lsn < %llu and summary is not null order by start_lsn, end_lsn",
+         search_key ( pinst->paramlist, "ARCHCLIENT" ),
+         (unsigned long long) from, (unsigned long long) to );
+   result = catdb_exec ( ctx, sql );
+   if ( PQresultStatus ( result ) == PGRES_TUPLES_OK ){
+      for ( a = 0; a < PQntuples ( result ); a++ ){
+         start = strtoull ( PQgetvalue ( result, a, 0 ), NULL, 10 );
+         end = strtoull ( PQgetvalue ( result, a, 1 ), NULL, 10 );
+         if ( start > pos ){
+            /* a segment was not summarized, the rest is decoded locally */
+            break;
+         }
+         if ( walsummary_parse ( ws, PQgetvalue ( result, a, 2 ) ) != 0 ){
+            pos = from;
+            break;
+         }
+         if ( end > pos ){
+            pos = end;
+         }
+         rows++;
+      }
+   }
+   PQclear ( result );
+
+   if ( pos < to && pos > from ){
+      /* a record which started in the last summarized segment */
+      snprintf ( sql, SHARDSQLLEN, "select tail_lsn, tail_total, tail, next_lsn from pgsql_walsummaries "
+            "where client='%s' and end_lsn=%llu and tail is not null order by id desc limit 1",
+            search_key ( pinst->paramlist, "ARCHCLIENT" ), (unsigned long long) pos );
+      result = catdb_exec ( ctx, sql );
+      if ( PQresultStatus ( result ) == PGRES_TUPLES_OK && PQntuples ( result ) == 1 ){
+         tail = PQunescapeBytea ( (unsigned char *) PQgetvalue ( result, 0, 2 ), &len );
+         if ( tail ){
+            walreader_set_tail ( &wr, strtoull ( PQgetvalue ( result, 0, 0 ), NULL, 10 ),
+                  strtoul ( PQgetvalue ( result, 0, 1 ), NULL, 10 ), tail, len,
+                  strtoull ( PQgetvalue ( result, 0, 3 ), NULL, 10 ) );
+            PQfreemem ( tail );
+         }
+      }
+      PQclear ( result );
+   }
+   FREE ( sql );
+
+   DMSG3 ( ctx, D2, "block incremental: %i archived WAL summaries, local WAL from %llX to %llX\n",
+         rows, (unsigned long long) pos, (unsigned long long) to );
+   if ( pos < to && summarize_local_wal ( ctx, ws, &wr, pos, to ) != 0 ){
+      walsummary_free ( ws );
+      ws = NULL;
+   }
+   walreader_free ( &wr );
+
+   return ws;
+}
+
+/*
+ * builds a map of tablespace locations to their oids from pg_tblspc links,
+ * oids are kept as item attributes
+ */
+keylist * tablespace_oids ( pg_plug_inst * pinst ){
+
+   keylist * list = NULL;
+   DIR * dirp;
+   struct dirent * filedir;
+   char * path;
+   char * link;
+   int dl;
+
+   path = MALLOC ( PATH_MAX );
+   link = MALLOC ( PATH_MAX );
+   if ( ! path || ! link ){
+      if ( path ){
+         FREE ( path );
+      }
+      return NULL;
+   }
+   snprintf ( path, PATH_MAX, "%s/pg_tblspc", search_key ( pinst->paramlist, "PGDATA" ) );
+   dirp = opendir ( path );
+   if ( dirp ){
+      while ( ( filedir = readdir ( dirp ) ) ){
+         if ( ! isdigit ( (unsigned char) filedir->d_name [ 0 ] ) ){
+            continue;
+         }
+         snprintf ( path, PATH_MAX, "%s/pg_tblspc/%s", search_key ( pinst->paramlist, "PGDATA" ),
+               filedir->d_name );
+         dl = readlink ( path, link, PATH_MAX - 1 );
+         pinst->metrics.syscalls++;
+         if ( dl > 0 ){
+            link [ dl ] = 0;
+            list = add_keylist_attr ( list, link, NULL, atoi ( filedir->d_name ) );
+         }
+      }
+      closedir ( dirp );
+   }
+   FREE ( link );
+   FREE ( path );
+
+   return list;
+}
+
+/*
+ * decodes a path of main fork relation segment into tablespace, database
+ * and relfilenode oids and a segment number:
+ *    base/<db>/<rel>[.<seg>], global/<rel>[.<seg>] or
+ *    <tablespace>/<version dir>/<db>/<rel>[.<seg>]
+ *
+ * out:
+ *    0 - success
+ *    1 - not a main fork relation segment
+ */
+int relation_segment_oids ( keyitem * item, keylist * tbs, walblockref * ref, uint32_t * segno ){
+
+   keyitem * t;
+   const char * p = NULL;
+   char * end;
+   int len;
+
+   if ( ! is_relation_file ( item ) ){
+      return 1;
+   }
+   if ( strncmp ( item->key, "$ROOT$", PATH_MAX ) == 0 ){
+      foreach_dlist ( t, tbs ){
+         len = strlen ( t->key );
+         if ( strncmp ( item->value, t->key, len ) == 0 && item->value [ len ] == '/' ){
+            ref->spcoid = t->attrs;
+            p = strchr ( item->value + len + 1, '/' );
+            break;
+         }
+      }
+      if ( ! p ){
+         return 1;
+      }
+      p++;
+   } else
+   if ( strncmp ( item->value, "base/", 5 ) == 0 ){
+      ref->spcoid = PGDEFAULTTBS;
+      p = item->value + 5;
+   } else {
+      ref->spcoid = PGGLOBALTBS;
+      ref->dboid = 0;
+      p = item->value + 7;
+   }
+   if ( ref->spcoid != PGGLOBALTBS ){
+      ref->dboid = strtoul ( p, &end, 10 );
+      if ( end == p || *end != '/' ){
+         return 1;
+      }
+      p = end + 1;
+   }
+   ref->relnode = strtoul ( p, &end, 10 );
+   if ( end == p ){
+      return 1;
+   }
+   *segno = 0;
+   if ( *end == '.' ){
+      p = end + 1;
+      *segno = strtoul ( p, &end, 10 );
+      if ( end == p ){
+         return 1;
+      }
+   }
+   ref->fork = WALMAINFORK;
+   ref->blkno = 0;
+
+   return *end ? 1 : 0;
+}
+
+static int incr_path_cmp ( const void * a, const void * b ){
+
+   return strcmp ( ( (const pg_incr *) a )->path, ( (const pg_incr *) b )->path );
+}
+
+/*
+ * adds a relation segment sent as changed blocks; without a summary (rb NULL)
+ * all its blocks are sent, as a whole file would be applied before older
+ * block incremental files of the same segment on restore
+ *
+ * in:
+ *    pinst - plugin instance
+ *    item - relation segment
+ *    rb - changed blocks of relation or NULL for all blocks
+ *    segno - segment number
+ * out:
+ *    1 - segment added
+ *    0 - segment has no changed blocks
+ *    -1 - memory allocation error
+ */
+int add_incr_file ( pg_plug_inst * pinst, keyitem * item, walrelblocks * rb, uint32_t segno ){
+
+   pg_incr * incr;
+   pg_incr * incrs;
+   uint32_t first = segno * PGRELSEGBLOCKS;
+   uint32_t lo = 0;
+   uint32_t hi;
+   uint32_t mid;
+   uint32_t n = 0;
+   uint32_t trunc = 0;
+   uint32_t a;
+
+   if ( rb ){
+      walsummary_sort ( rb );
+      /* the first changed block of segment */
+      hi = rb->nblocks;
+      while ( lo < hi ){
+         mid = ( lo + hi ) / 2;
+         if ( rb->blocks [ mid ] < first ){
+            lo = mid + 1;
+         } else {
+            hi = mid;
+         }
+      }
+      while ( lo + n < rb->nblocks && rb->blocks [ lo + n ] < first + PGRELSEGBLOCKS ){
+         n++;
+      }
+      if ( rb->limit == WALNOLIMIT || rb->limit >= first + PGRELSEGBLOCKS ){
+         trunc = PGINCRNOTRUNC;
+      } else {
+         trunc = rb->limit > first ? rb->limit - first : 0;
+      }
+      if ( ! n && trunc == PGINCRNOTRUNC ){
+         return 0;
+      }
+   }
+
+   if ( pinst->nincrs == pinst->incrsize ){
+      incrs = (pg_incr *) realloc ( pinst->incrs, sizeof ( pg_incr ) * ( pinst->incrsize ? pinst->incrsize * 2 : 1024 ) );
+      if ( ! incrs ){
+         return -1;
+      }
+      pinst->incrs = incrs;
+      pinst->incrsize = pinst->incrsize ? pinst->incrsize * 2 : 1024;
+   }
+   incr = &pinst->incrs [ pinst->nincrs ];
+   memset ( incr, 0, sizeof ( pg_incr ) );
+   incr->path = strdup ( dbfile_path ( item ) );
+   if ( ! incr->path ){
+      return -1;
+   }
+   incr->trunc = trunc;
+   incr->nblocks = n;
+   if ( rb ){
+      incr->blocks = (uint32_t *) malloc ( sizeof ( uint32_t ) * ( n + 1 ) );
+      if ( ! incr->blocks ){
+         free ( incr->path );
+         return -1;
+      }
+      for ( a = 0; a < n; a++ ){
+         incr->blocks [ a ] = rb->blocks [ lo + a ] - first;
+      }
+   } else {
+      /* all blocks, counted from file size at backup time */
+      incr->all = 1;
+   }
+   pinst->nincrs++;
+
+   return 1;
+}
+
+void free_incr_list ( pg_plug_inst * pinst ){
+
+   int a;
+
+   for ( a = 0; a < pinst->nincrs; a++ ){
+      free ( pinst->incrs [ a ].path );
+      free ( pinst->incrs [ a ].blocks );
+   }
+   free ( pinst->incrs );
+   pinst->incrs = NULL;
+   pinst->nincrs = pinst->incrsize = 0;
+   free ( pinst->incrbuf );
+   pinst->incrbuf = NULL;
+}
+
+/*
+ * checks if relation pages have a default size, block incremental files
+ * are built of PGBLCKSZ pages
+ */
+int check_page_size ( pg_plug_inst * pinst ){
+
+   keyitem * item;
+   uint16_t pagesize;
+   int fd;
+
+   foreach_dlist ( item, pinst->filelist ){
+      if ( ! is_relation_file ( item ) ){
+         continue;
+      }
+      fd = open ( dbfile_path ( item ), O_RDONLY );
+      pinst->metrics.syscalls += 3;
+      if ( fd < 0 ){
+         continue;
+      }
+      /* pd_pagesize_version of page header */
+      if ( pread ( fd, &pagesize, sizeof ( pagesize ), 18 ) == sizeof ( pagesize ) ){
+         close ( fd );
+         return ( pagesize & 0xFF00 ) == PGBLCKSZ ? 0 : 1;
+      }
+      close ( fd );
+   }
+
+   return 0;
+}
+
+/*
+ * prepares a block incremental backup: finds a base backup and a summary of
+ * blocks changed since its start
+ *
+ * in:
+ *    ctx - plugin context
+ *    margin - SINCEMARGIN seconds
+ * out:
+ *    summary or NULL when not available, a reason is reported
+ */
+walsummary * block_incr_summary ( bpContext *ctx, int margin ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   walsummary * ws = NULL;
+   const char * reason = NULL;
+   uint64_t to;
+   double start;
+
+   start = monotonic_time ();
+   to = wal_parse_lsn ( pinst->startlsn );
+   if ( ! pinst->startstop || ! to ){
+      reason = "backup start location unknown";
+   } else
+   if ( ! pinst->catdb && catdbconnect ( ctx ) ){
+      reason = "catalog connection failed";
+   } else
+   if ( ! ( pinst->incrbase = block_incr_base ( ctx, margin ) ) ){
+      reason = "base backup not found in catalog";
+   } else
+   if ( check_page_size ( pinst ) ){
+      reason = "relation page size is not 8kB";
+   } else
+   if ( ! ( ws = load_wal_summary ( ctx, pinst->incrbase, to ) ) ){
+      reason = "WAL since base backup not summarized";
+   }
+   if ( reason ){
+      JMSG ( ctx, M_INFO, "block incremental not available: %s, changed relation segments are sent with all blocks.\n",
+            reason );
+      return NULL;
+   }
+   JMSG2 ( ctx, M_INFO, "block incremental: blocks changed since %X/%X\n",
+         (unsigned int) ( pinst->incrbase >> 32 ), (unsigned int) pinst->incrbase );
+   DMSG1 ( ctx, D2, "block incremental: summary built in %.3fs\n", monotonic_time () - start );
+   pinst->metrics.blockincr = 1;
+
+   return ws;
+}
+
+/*
+ * applies a job level to a database file list: every entry is remembered for
+ * accurate mode checks and on incremental or differential level relation
+ * segments not changed since the previous job start, less SINCEMARGIN
+ * seconds for a clock skew and the previous pg_start_backup, are skipped;
+ * with WALSUMMARY main fork segments are sent as blocks changed since
+ * the base backup start instead (all blocks when a WAL summary is not
+ * available), so they are applied in job order on restore
+ *
+ * in:
+ *    ctx - plugin context
+ * out:
+ *    pinst->filelist - files to backup
+ *    pinst->seen - all files in backup
+ *    bRC_OK - on success
+ *    bRC_Error - on error
+ */
+bRC incremental_file_list ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   keylist * nlist = NULL;
+   keylist * tbs = NULL;
+   keyitem * item;
+   walsummary * ws = NULL;
+   walrelblocks * rb;
+   walblockref ref;
+   struct stat st;
+   char * buf;
+   char * str;
+   time_t since;
+   uint32_t segno;
+   int blockincr;
+   int changed;
+   int margin;
+   int rc;
+
+   ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   if ( ! pinst->filelist ){
+      return bRC_OK;
+   }
+   pinst->seen = pathset_alloc ();
+   buf = MALLOC ( PATH_MAX );
+   if ( ! pinst->seen || ! buf ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      if ( buf ){
+         FREE ( buf );
+      }
+      return bRC_Error;
+   }
+   foreach_dlist ( item, pinst->filelist ){
+      if ( pathset_add ( pinst->seen, dbfile_vname ( pinst, item, buf, PATH_MAX ) ) < 0 ){
+         JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+         FREE ( buf );
+         return bRC_Error;
+      }
+   }
+   FREE ( buf );
+
+   if ( ( pinst->level != 'I' && pinst->level != 'D' ) || pinst->since <= 0 ){
+      return bRC_OK;
+   }
+   if ( pinst->shards ){
+      /* shard plans are balanced by sizes of a current file list, so a file
+       * could move to another shard between jobs and would never be sent */
+      JMSG ( ctx, M_INFO, "sharded backup: level %c sends all files of a shard\n", (char) pinst->level );
+      return bRC_OK;
+   }
+   str = search_key ( pinst->paramlist, "SINCEMARGIN" );
+   margin = str ? atoi ( str ) : 600;
+   since = pinst->since - margin;
+   DMSG2 ( ctx, D2, "level %c, files changed since %ld\n", pinst->level, (long) since );
+
+   blockincr = check_param_bool ( pinst->paramlist, "WALSUMMARY", 0 );
+   if ( blockincr ){
+      ws = block_incr_summary ( ctx, margin );
+      tbs = tablespace_oids ( pinst );
+   } else
+   if ( pinst->level == 'I' ){
+      rc = block_incr_chain ( ctx );
+      if ( rc > 0 ){
+         JMSG ( ctx, M_FATAL, "%i previous incremental backups sent block incremental files, "
+               "a Full or Differential backup is required after WALSUMMARY was disabled.\n", rc );
+         return bRC_Error;
+      }
+      if ( rc < 0 ){
+         JMSG0 ( ctx, M_WARNING, "block incremental backups since last Full not checked, catalog not available.\n" );
+      }
+   }
+   pinst->incrmode = blockincr;
+
+   foreach_dlist ( item, pinst->filelist ){
+      pinst->metrics.syscalls += is_relation_file ( item );
+      if ( ! is_relation_file ( item ) || lstat ( dbfile_path ( item ), &st ) != 0 ){
+         nlist = add_keylist_attr ( nlist, item->key, item->value, item->attrs );
+         continue;
+      }
+      changed = st.st_mtime >= since || st.st_ctime >= since;
+      if ( blockincr && relation_segment_oids ( item, tbs, &ref, &segno ) == 0 ){
+         if ( ws && walsummary_has_db ( ws, ref.spcoid, ref.dboid ) ){
+            /* database created since base backup by a copy of template */
+            rc = add_incr_file ( pinst, item, NULL, segno );
+         } else
+         if ( ws ){
+            /* changes not logged in WAL, hint bits for example, are skipped */
+            rb = walsummary_find ( ws, ref.spcoid, ref.dboid, ref.relnode, WALMAINFORK );
+            rc = rb ? add_incr_file ( pinst, item, rb, segno ) : 0;
+         } else {
+            rc = changed ? add_incr_file ( pinst, item, NULL, segno ) : 0;
+         }
+         if ( rc < 0 ){
+            JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+            walsummary_free ( ws );
+            keylist_free ( tbs );
+            keylist_free ( nlist );
+            return bRC_Error;
+         }
+         changed = 0;
+         if ( rc > 0 ){
+            nlist = add_keylist_attr ( nlist, item->key, item->value, PG_INCR );
+            continue;
+         }
+      }
+      if ( ! changed ){
+         pinst->metrics.skipped++;
+         pinst->metrics.skippedbytes += st.st_size;
+         continue;
+      }
+      nlist = add_keylist_attr ( nlist, item->key, item->value, item->attrs );
+   }
+   walsummary_free ( ws );
+   keylist_free ( tbs );
+   if ( pinst->nincrs ){
+      qsort ( pinst->incrs, pinst->nincrs, sizeof ( pg_incr ), incr_path_cmp );
+   }
+   keylist_free ( pinst->filelist );
+   pinst->filelist = nlist;
+   pinst->curfile = nlist ? (keyitem *)nlist->first() : NULL;
+
+   return bRC_OK;
+}
+
+/*
+ * finds a block incremental file of a relation segment, NULL if not found
+ */
+pg_incr * find_incr_file ( pg_plug_inst * pinst, const char * path ){
+
+   pg_incr key;
+
+   if ( ! pinst->nincrs ){
+      return NULL;
+   }
+   key.path = (char *) path;
+
+   return (pg_incr *) bsearch ( &key, pinst->incrs, pinst->nincrs, sizeof ( pg_incr ), incr_path_cmp );
+}
+
+/*
+ * appends a backup manifest virtual file at the end of a file list
+ */
+bRC add_manifest_file ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+
+   ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   if ( pinst->mlist ){
+      pinst->filelist = add_keylist_attr ( pinst->filelist, "$MANIFEST$", PGMANIFEST, PG_MANIFEST );
+      if ( ! pinst->curfile ){
+         pinst->curfile = (keyitem *)pinst->filelist->first();
+      }
+   }
+
+   return bRC_OK;
+}
+
+/*
+ * executes a catalog command, a result of select is not used
+ *
+ * out:
+ *    0 - on success
+ *    1 - on error, reported as job message
+ */
+int catdb_command ( bpContext *ctx, const char * sql ){
+
+   PGresult * result;
+   ExecStatusType resstatus;
+   int err = 0;
+
+   result = catdb_exec ( ctx, sql );
+   resstatus = PQresultStatus ( result );
+   if ( resstatus != PGRES_COMMAND_OK && resstatus != PGRES_TUPLES_OK ){
+      PGERROR ( "catdb_command.pqexec failed!", sql, result, resstatus );
+      err = 1;
+   }
+   PQclear ( result );
+
+   return err;
+}
+
+/*
+ * executes a catalog query which returns a single integer value
+ *
+ * out:
+ *    0 - on success, value is set
+ *    1 - on error or when query returns no rows
+ */
+int catdb_int_value ( bpContext *ctx, const char * sql, int * value ){
+
+   PGresult * result;
+   ExecStatusType resstatus;
+   int err = 1;
+
+   result = catdb_exec ( ctx, sql );
+   resstatus = PQresultStatus ( result );
+   if ( resstatus != PGRES_TUPLES_OK ){
+      PGERROR ( "catdb_int_value.pqexec failed!", sql, result, resstatus );
+   } else
+   if ( PQntuples ( result ) ){
+      *value = atoi ( PQgetvalue ( result, 0, 0 ) );
+      err = 0;
+   }
+   PQclear ( result );
+
+   return err;
+}
+
+/* a database file with its size used for shard planning */
+typedef struct _pg_shard_file pg_shard_file;
+struct _pg_shard_file {
+   keyitem  * item;
+   int64_t  size;
+};
+
+/* sorts files by size, largest first */
+static int shard_file_cmp ( const void * a, const void * b ){
+
+   int64_t sa = ( (const pg_shard_file *) a )->size;
+   int64_t sb = ( (const pg_shard_file *) b )->size;
+
+   return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+/*
+ * divides a database file list into size balanced shards and saves a plan in
+ * catalog (pgsql_shards.filelist, paths separated by new line char); files
+ * sorted by size are assigned to the least loaded shard (longest processing
+ * time first), directories and links go to the first shard, so a directory
+ * tree is restored by a single job
+ *
+ * in:
+ *    ctx - plugin context, pinst->filelist - full file list
+ * out:
+ *    0 - on success
+ *    1 - on error
+ */
+int shard_plan ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   pg_shard_file * files;
+   keyitem * item;
+   struct stat st;
+   int64_t load [ PGMAXSHARDS ];
+   int len [ PGMAXSHARDS ];
+   char * plan [ PGMAXSHARDS ];
+   int * shardof;
+   const char * params [ 4 ];
+   char pbytes [ 32 ], psetid [ 16 ], pshard [ 16 ];
+   PGresult * result;
+   ExecStatusType resstatus;
+   double start;
+   int nfiles = 0;
+   int n = 0;
+   int a, s, min;
+   int err = 0;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   foreach_dlist ( item, pinst->filelist ){
+      n++;
+   }
+   files = (pg_shard_file *) malloc ( sizeof ( pg_shard_file ) * ( n + 1 ) );
+   shardof = (int *) malloc ( sizeof ( int ) * ( n + 1 ) );
+   if ( ! files || ! shardof ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      free ( files );
+      free ( shardof );
+      return 1;
+   }
+   memset ( load, 0, sizeof ( load ) );
+   memset ( len, 0, sizeof ( len ) );
+   memset ( plan, 0, sizeof ( plan ) );
+
+   /* directories and links first, then regular files */
+   foreach_dlist ( item, pinst->filelist ){
+      if ( item->attrs == PG_FILE ){
+         files [ nfiles ].item = item;
+         files [ nfiles ].size = lstat ( dbfile_path ( item ), &st ) == 0 ? st.st_size : 0;
+         pinst->metrics.syscalls++;
+         nfiles++;
+      }
+   }
+   qsort ( files, nfiles, sizeof ( pg_shard_file ), shard_file_cmp );
+   for ( a = 0; a < nfiles; a++ ){
+      min = 0;
+      for ( s = 1; s < pinst->shards; s++ ){
+         if ( load [ s ] < load [ min ] ){
+            min = s;
+         }
+      }
+      shardof [ a ] = min;
+      load [ min ] += files [ a ].size;
+      len [ min ] += strlen ( files [ a ].item->value ) + 1;
+   }
+   foreach_dlist ( item, pinst->filelist ){
+      if ( item->attrs != PG_FILE ){
+         len [ 0 ] += strlen ( item->value ) + 1;
+      }
+   }
+
+   /* render plan of every shard */
+   for ( s = 0; s < pinst->shards; s++ ){
+      plan [ s ] = MALLOC ( len [ s ] + 1 );
+      if ( ! plan [ s ] ){
+         JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+         err = 1;
+         break;
+      }
+      plan [ s ][ 0 ] = 0;
+      len [ s ] = 0;
+   }
+   if ( ! err ){
+      foreach_dlist ( item, pinst->filelist ){
+         if ( item->attrs != PG_FILE ){
+            len [ 0 ] += sprintf ( plan [ 0 ] + len [ 0 ], "%s\n", item->value );
+         }
+      }
+      for ( a = 0; a < nfiles; a++ ){
+         s = shardof [ a ];
+         len [ s ] += sprintf ( plan [ s ] + len [ s ], "%s\n", files [ a ].item->value );
+      }
+   }
+
+   /* a plan could have megabytes, so it is sent as a query parameter */
+   for ( s = 0; s < pinst->shards && ! err; s++ ){
+      snprintf ( pbytes, sizeof ( pbytes ), "%lld", (long long) load [ s ] );
+      snprintf ( psetid, sizeof ( psetid ), "%i", pinst->shardset );
+      snprintf ( pshard, sizeof ( pshard ), "%i", s + 1 );
+      params [ 0 ] = plan [ s ];
+      params [ 1 ] = pbytes;
+      params [ 2 ] = psetid;
+      params [ 3 ] = pshard;
+      start = monotonic_time ();
+      result = PQexecParams ( pinst->catdb,
+            "update pgsql_shards set filelist=$1, planbytes=$2 where setid=$3 and shard=$4",
+            4, NULL, params, NULL, NULL, 0 );
+      metrics_add ( &pinst->metrics, PH_CATALOG, start );
+      resstatus = PQresultStatus ( result );
+      if ( resstatus != PGRES_COMMAND_OK ){
+         PGERROR ( "shard_plan.pqexec failed!", "update pgsql_shards", result, resstatus );
+         err = 1;
+      }
+      PQclear ( result );
+      DMSG2 ( ctx, D2, "shard %i planned bytes=%lld\n", s + 1, (long long) load [ s ] );
+   }
+
+   for ( s = 0; s < pinst->shards; s++ ){
+      if ( plan [ s ] ){
+         FREE ( plan [ s ] );
+      }
+   }
+   free ( shardof );
+   free ( files );
+
+   return err;
+}
+
+/*
+ * adds all paths of a plan into a path set
+ */
+int shard_plan_paths ( pathset * set, const char * plan ){
+
+   char * path;
+   const char * e;
+   int len;
+
+   path = MALLOC ( PATH_MAX );
+   if ( ! path ){
+      return 1;
+   }
+   for ( ; *plan; plan = *e ? e + 1 : e ){
+      e = strchr ( plan, '\n' );
+      if ( ! e ){
+         e = plan + strlen ( plan );
+      }
+      len = e - plan < PATH_MAX - 1 ? e - plan : PATH_MAX - 1;
+      memcpy ( path, plan, len );
+      path [ len ] = 0;
+      if ( len && pathset_add ( set, path ) < 0 ){
+         FREE ( path );
+         return 1;
+      }
+   }
+   FREE ( path );
+
+   return 0;
+}
+
+/*
+ * limits a file list to files of this shard: files planned for it and files
+ * which were created after planning, they are assigned by a path hash, so all
+ * shards agree on it without any coordination
+ *
+ * in:
+ *    ctx - plugin context, pinst->filelist - full file list
+ * out:
+ *    pinst->filelist - shard file list
+ *    0 - on success
+ *    1 - on error
+ */
+int shard_filter_list ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   PGresult * result;
+   ExecStatusType resstatus;
+   pathset * mine;
+   pathset * all;
+   keylist * nlist = NULL;
+   keyitem * item;
+   char * sql;
+   int64_t nfiles = 0;
+   int shard;
+   int keep;
+   int a;
+   int err = 0;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   sql = MALLOC ( SQLLEN );
+   mine = pathset_alloc ();
+   all = pathset_alloc ();
+   if ( ! sql || ! mine || ! all ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      if ( sql ){
+         FREE ( sql );
+      }
+      pathset_free ( mine );
+      pathset_free ( all );
+      return 1;
+   }
+
+   snprintf ( sql, SQLLEN, "select shard, filelist from pgsql_shards where setid=%i and filelist is not null",
+         pinst->shardset );
+   result = catdb_exec ( ctx, sql );
+   resstatus = PQresultStatus ( result );
+   if ( resstatus != PGRES_TUPLES_OK || PQntuples ( result ) != pinst->shards ){
+      PGERROR ( "shard_filter_list.pqexec failed!", sql, result, resstatus );
+      err = 1;
+   } else {
+      for ( a = 0; a < PQntuples ( result ) && ! err; a++ ){
+         shard = atoi ( PQgetvalue ( result, a, 0 ) );
+         err = shard_plan_paths ( all, PQgetvalue ( result, a, 1 ) );
+         if ( ! err && shard == pinst->shard ){
+            err = shard_plan_paths ( mine, PQgetvalue ( result, a, 1 ) );
+         }
+      }
+   }
+   PQclear ( result );
+   FREE ( sql );
+
+   if ( ! err ){
+      foreach_dlist ( item, pinst->filelist ){
+         if ( pathset_find ( all, item->value ) ){
+            keep = pathset_find ( mine, item->value );
+         } else
+         if ( item->attrs == PG_FILE ){
+            keep = (int) ( path_hash ( item->value ) % pinst->shards ) == pinst->shard - 1;
+         } else {
+            keep = pinst->shard == 1;
+         }
+         if ( keep ){
+            nlist = add_keylist_attr ( nlist, item->key, item->value, item->attrs );
+            nfiles++;
+         }
+      }
+      keylist_free ( pinst->filelist );
+      pinst->filelist = nlist;
+      pinst->curfile = nlist ? (keyitem *)nlist->first() : NULL;
+      JMSG2 ( ctx, M_INFO, "shard %i backup, %lld files\n", pinst->shard, (long long) nfiles );
+   }
+
+   pathset_free ( mine );
+   pathset_free ( all );
+
+   return err;
+}
+
+/*
+ * sets a shard set status in catalog
+ */
+void shard_set_status ( bpContext *ctx, int status ){
+
+   pg_plug_inst * pinst;
+   char * sql;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   sql = MALLOC ( SQLLEN );
+   if ( sql ){
+      snprintf ( sql, SQLLEN, "update pgsql_shardsets set status=%i, mod_date=now() where id=%i",
+            status, pinst->shardset );
+      catdb_command ( ctx, sql );
+      FREE ( sql );
+   }
+}
+
+/*
+ * joins a shard set of concurrently started jobs, a first job creates a new
+ * set and becomes its leader
+ *
+ * out:
+ *    pinst->shardset, pinst->shardlead
+ *    0 - on success
+ *    1 - on error
+ */
+int shard_join ( bpContext *ctx, int wait ){
+
+   pg_plug_inst * pinst;
+   char * sql;
+   const char * client;
+   int err;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+   client = search_key ( pinst->paramlist, "ARCHCLIENT" );
+
+   sql = MALLOC ( SHARDSQLLEN );
+   if ( ! sql ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      return 1;
+   }
+
+   /* a set lookup and a join have to be atomic */
+   err = catdb_command ( ctx, "begin" );
+   err = err || catdb_command ( ctx, "lock table pgsql_shardsets in share row exclusive mode" );
+   if ( ! err ){
+      pinst->shardset = 0;
+      snprintf ( sql, SHARDSQLLEN,
+            "select id from pgsql_shardsets s where client='%s' and shards=%i and not closed "
+            "and status in (%i,%i) and create_date > now() - interval '%i seconds' "
+            "and exists (select 1 from pgsql_shards where setid=s.id and shard=%i and jobid is null) "
+            "order by id desc limit 1",
+            client, pinst->shards, PGSQL_STATUS_DB_ONLINE_START, PGSQL_STATUS_DB_ONLINE_INPROG,
+            wait, pinst->shard );
+      if ( catdb_int_value ( ctx, sql, &pinst->shardset ) ){
+         snprintf ( sql, SHARDSQLLEN,
+               "insert into pgsql_shardsets (client, shards, jobid, status) values ('%s', %i, %i, %i) returning id",
+               client, pinst->shards, pinst->JobId, PGSQL_STATUS_DB_ONLINE_START );
+         err = catdb_int_value ( ctx, sql, &pinst->shardset );
+         if ( ! err ){
+            pinst->shardlead = 1;
+            snprintf ( sql, SHARDSQLLEN,
+                  "insert into pgsql_shards (setid, shard) select %i, generate_series(1, %i)",
+                  pinst->shardset, pinst->shards );
+            err = catdb_command ( ctx, sql );
+         }
+      }
+   }
+   if ( ! err ){
+      snprintf ( sql, SHARDSQLLEN,
+            "update pgsql_shards set jobid=%i, status=%i where setid=%i and shard=%i",
+            pinst->JobId, PGSQL_STATUS_DB_ONLINE_INPROG, pinst->shardset, pinst->shard );
+      err = catdb_command ( ctx, sql );
+   }
+   if ( ! err ){
+      snprintf ( sql, SHARDSQLLEN,
+            "update pgsql_shardsets set joined=joined+1, mod_date=now() where id=%i",
+            pinst->shardset );
+      err = catdb_command ( ctx, sql );
+   }
+   catdb_command ( ctx, err ? "rollback" : "commit" );
+   FREE ( sql );
+
+   if ( err ){
+      pinst->shardset = 0;
+      pinst->shardlead = 0;
+   } else {
+      JMSG2 ( ctx, M_INFO, "shard %i joined shard set %i\n", pinst->shard, pinst->shardset );
+      if ( pinst->shardlead ){
+         JMSG0 ( ctx, M_INFO, "shard starts backup for all shards\n" );
+      }
+   }
+
+   return err;
+}
+
+/*
+ * waits until a shard set leader starts backup and all shards joined or
+ * SHARDWAIT elapsed, a late shard could not join a closed set
+ *
+ * out:
+ *    0 - backup is started, shard can proceed
+ *    1 - on error or timeout
+ */
+int shard_barrier ( bpContext *ctx, int wait ){
+
+   pg_plug_inst * pinst;
+   PGresult * result;
+   ExecStatusType resstatus;
+   char * sql;
+   int status, joined, closed, age, idle;
+   int err = 0;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   sql = MALLOC ( SQLLEN );
+   if ( ! sql ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      return 1;
+   }
+
+   for ( ;; ){
+      snprintf ( sql, SQLLEN,
+            "select status, joined, closed::int, extract(epoch from now()-create_date)::int, "
+            "extract(epoch from now()-mod_date)::int from pgsql_shardsets where id=%i",
+            pinst->shardset );
+      result = catdb_exec ( ctx, sql );
+      resstatus = PQresultStatus ( result );
+      if ( resstatus != PGRES_TUPLES_OK || PQntuples ( result ) != 1 ){
+         PGERROR ( "shard_barrier.pqexec failed!", sql, result, resstatus );
+         PQclear ( result );
+         err = 1;
+         break;
+      }
+      status = atoi ( PQgetvalue ( result, 0, 0 ) );
+      joined = atoi ( PQgetvalue ( result, 0, 1 ) );
+      closed = atoi ( PQgetvalue ( result, 0, 2 ) );
+      age = atoi ( PQgetvalue ( result, 0, 3 ) );
+      idle = atoi ( PQgetvalue ( result, 0, 4 ) );
+      PQclear ( result );
+
+      if ( status == PGSQL_STATUS_DB_ONLINE_INPROG ){
+         if ( closed ){
+            break;
+         }
+         if ( joined == pinst->shards || age > wait ){
+            snprintf ( sql, SQLLEN, "update pgsql_shardsets set closed=true where id=%i",
+                  pinst->shardset );
+            err = catdb_command ( ctx, sql );
+            if ( joined < pinst->shards ){
+               /* an incomplete set is marked failed by the last finished shard */
+               JMSG2 ( ctx, M_WARNING, "only %i of %i shards joined backup, shard set is not usable for restore\n",
+                     joined, pinst->shards );
+            }
+            break;
+         }
+      } else
+      if ( status != PGSQL_STATUS_DB_ONLINE_START || idle > wait ){
+         /* leader failed or died before backup start */
+         JMSG ( ctx, M_ERROR, "shard set %i failed before backup start\n", pinst->shardset );
+         err = 1;
+         break;
+      }
+      sleep ( 1 );
+   }
+   FREE ( sql );
+
+   return err;
+}
+
+/*
+ * starts a shard of database backup: joins a shard set, the leader starts
+ * backup and plans shards, then every shard gets its part of file list
+ *
+ * out:
+ *    bRC_OK - success
+ *    bRC_Error - error
+ */
+bRC start_shard_backup ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   char * str;
+   int wait;
+
+   ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   str = search_key ( pinst->paramlist, "SHARDWAIT" );
+   wait = str ? atoi ( str ) : 600;
+   if ( wait < 1 ){
+      wait = 600;
+   }
+
+   if ( ! search_key ( pinst->paramlist, "CATDB" ) || catdbconnect ( ctx ) ){
+      JMSG0 ( ctx, M_ERROR, "sharded backup requires a catalog database connection.\n" );
+      return bRC_Error;
+   }
+   if ( shard_join ( ctx, wait ) ){
+      return bRC_Error;
+   }
+
+   if ( pinst->shardlead ){
+      if ( pinst->startstop && start_pg_backup ( ctx ) ){
+         shard_set_status ( ctx, PGSQL_STATUS_DB_ONLINE_FAILED );
+         return bRC_Error;
+      }
+      /* the leader file list is a base of a plan */
+      if ( get_dbf_list ( ctx ) || shard_plan ( ctx ) ){
+         shard_set_status ( ctx, PGSQL_STATUS_DB_ONLINE_FAILED );
+         return bRC_Error;
+      }
+      /* shards could proceed */
+      shard_set_status ( ctx, PGSQL_STATUS_DB_ONLINE_INPROG );
+   }
+
+   if ( shard_barrier ( ctx, wait ) ){
+      return bRC_Error;
+   }
+   if ( ! pinst->shardlead && get_dbf_list ( ctx ) ){
+      return bRC_Error;
+   }
+   if ( shard_filter_list ( ctx ) ){
+      return bRC_Error;
+   }
+
+   return bRC_OK;
+}
+
+/*
+ * finishes a shard of database backup, the last finished shard stops backup
+ * for the whole shard set
+ *
+ * in:
+ *    ctx - plugin context
+ * out:
+ *    pgsql_status of this shard job: PGSQL_STATUS_DB_ONLINE_FINISH or
+ *    PGSQL_STATUS_DB_ONLINE_FAILED
+ */
+int finish_shard_backup ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   PGresult * result;
+   ExecStatusType resstatus;
+   char * sql;
+   int finished = 0, joined = -1, failed = 0;
+   int jobstatus = 0;
+   int status = PGSQL_STATUS_DB_ONLINE_FINISH;
+   int err;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   if ( ! pinst->shardset ){
+      /* shard did not join any set */
+      return PGSQL_STATUS_DB_ONLINE_FAILED;
+   }
+   bfuncs->getBaculaValue ( ctx, bVarJobStatus, (void *)&jobstatus );
+   if ( jobstatus == 'E' || jobstatus == 'e' || jobstatus == 'f' || jobstatus == 'A' ){
+      /* whole set is not usable for restore */
+      status = PGSQL_STATUS_DB_ONLINE_FAILED;
+   }
+   if ( PQstatus ( pinst->catdb ) != CONNECTION_OK ){
+      /* a backup could be longer than idle connection lifetime */
+      PQreset ( pinst->catdb );
+   }
+
+   sql = MALLOC ( SHARDSQLLEN );
+   if ( ! sql ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      return PGSQL_STATUS_DB_ONLINE_FAILED;
+   }
+
+   err = catdb_command ( ctx, "begin" );
+   if ( ! err ){
+      snprintf ( sql, SHARDSQLLEN, "select id from pgsql_shardsets where id=%i for update",
+            pinst->shardset );
+      err = catdb_command ( ctx, sql );
+   }
+   if ( ! err ){
+      snprintf ( sql, SHARDSQLLEN,
+            "update pgsql_shards set status=%i, files=%lld, bytes=%lld where setid=%i and shard=%i",
+            status, (long long) pinst->metrics.files, (long long) pinst->metrics.bytes,
+            pinst->shardset, pinst->shard );
+      err = catdb_command ( ctx, sql );
+   }
+   if ( ! err ){
+      snprintf ( sql, SHARDSQLLEN,
+            "update pgsql_shardsets set finished=finished+1, failed=failed+%i, mod_date=now() where id=%i "
+            "returning finished, joined, failed", status == PGSQL_STATUS_DB_ONLINE_FAILED ? 1 : 0,
+            pinst->shardset );
+      result = catdb_exec ( ctx, sql );
+      resstatus = PQresultStatus ( result );
+      if ( resstatus != PGRES_TUPLES_OK || PQntuples ( result ) != 1 ){
+         PGERROR ( "finish_shard_backup.pqexec failed!", sql, result, resstatus );
+         err = 1;
+      } else {
+         finished = atoi ( PQgetvalue ( result, 0, 0 ) );
+         joined = atoi ( PQgetvalue ( result, 0, 1 ) );
+         failed = atoi ( PQgetvalue ( result, 0, 2 ) );
+      }
+      PQclear ( result );
+   }
+   catdb_command ( ctx, err ? "rollback" : "commit" );
+   FREE ( sql );
+
+   if ( err ){
+      return PGSQL_STATUS_DB_ONLINE_FAILED;
+   }
+
+   if ( finished == joined ){
+      /* the last shard, backup of the whole set is done */
+      if ( pinst->startstop && stop_pg_backup ( ctx ) ){
+         status = PGSQL_STATUS_DB_ONLINE_FAILED;
+      }
+      if ( failed || joined < pinst->shards || status == PGSQL_STATUS_DB_ONLINE_FAILED ){
+         /* files of shards which did not join are missing in the set */
+         shard_set_status ( ctx, PGSQL_STATUS_DB_ONLINE_FAILED );
+         JMSG2 ( ctx, M_ERROR, "shard set %i failed, not usable for restore, %i shards joined\n",
+               pinst->shardset, joined );
+      } else {
+         shard_set_status ( ctx, PGSQL_STATUS_DB_ONLINE_FINISH );
+         JMSG2 ( ctx, M_INFO, "shard set %i finished, %i shards\n", pinst->shardset, joined );
+      }
+   }
+
+   return status;
+}
+
+/*
+ * Called by Bacula when there are certain events that the
+ *   plugin might want to know.  The value depends on the
+ *   event.
+ */
+static bRC handlePluginEvent(bpContext *ctx, bEvent *event, void *value){
+
+   int err;
+   char * str;
+   pg_plug_inst * pinst;
+
+   ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   ASSERT_p ( event );
+   DMSG1 ( ctx, D1, "handlePluginEvent: %i\n", event->eventType );
+
+   switch (event->eventType) {
+   case bEventJobStart:
+   // unused in ur case, information only
+      DMSG1 ( ctx, D2, "bEventJobStart value=%s\n", NPRT((char *)value) );
+      break;
+   case bEventJobEnd:
+   // unused in ur case, information only
+      DMSG1 ( ctx, D2, "bEventJobEnd value=%s\n", NPRT((char *)value) );
+      break;
+   case bEventStartBackupJob:
+   // unused in ur case, information only
+      DMSG1 ( ctx, D2, "bEventStartBackupJob value=%s\n", NPRT((char *)value) );
+      break;
+   case bEventEndBackupJob:
+   // closing database connection
+      DMSG1 ( ctx, D2, "bEventEndBackupJob value=%s\n", NPRT((char *)value));
+      if ( pinst->mode == PGSQL_DB_BACKUP && pinst->shards ){
+         /* the last shard stops backup of the whole shard set */
+         err = finish_shard_backup ( ctx );
+         report_job_metrics ( ctx, err );
+         return err == PGSQL_STATUS_DB_ONLINE_FAILED ? bRC_Error : bRC_OK;
+      }
+      if ( pinst->mode == PGSQL_DB_BACKUP && pinst->startstop ){
+         /* backup could be already stopped before its manifest */
+         if ( pinst->stopped ){
+            err = pinst->stopped < 0;
+         } else {
+            err = stop_pg_backup ( ctx );
+         }
+         if ( err ){
+            report_job_metrics ( ctx, PGSQL_STATUS_DB_ONLINE_FAILED );
+            return bRC_Error;
+         }
+         if ( ! pinst->stoplsn [ 0 ] ){
+            /* stop location is saved in catalog for restore base backup selection */
+            read_stop_lsn ( ctx );
+         }
+      }
+      report_job_metrics ( ctx, PGSQL_STATUS_DB_ONLINE_FINISH );
+      break;
+   case bEventLevel:
+      /* database backup level, incremental and differential skip unchanged files */
+      pinst->level = (int) ( (intptr_t)value & 0xff );
+      DMSG1 ( ctx, D2, "bEventLevel=%c\n", (char) pinst->level );
+      break;
+   case bEventSince:
+      pinst->since = (time_t) (intptr_t)value;
+      DMSG1 ( ctx, D2, "bEventSince=%ld\n", (long) pinst->since );
+      break;
+   case bEventStartRestoreJob:
+   /* Test if restored database works or not, but we have very limited info about it,
+    * it should be realized by external utility */
+      DMSG1 ( ctx, D2, "StartRestoreJob value=%s\n", NPRT((char *)value));
+      break;
+   case bEventEndRestoreJob:
+      DMSG0 ( ctx, D2, "bEventEndRestoreJob\n");
+      close_parent_dir ( pinst );
+      if ( pinst->mode == PGSQL_DB_RESTORE ){
+         JMSG2 ( ctx, M_INFO, "restore metadata: %lld filesystem operations, %lld directories created\n",
+               (long long) pinst->metaops, (long long) pinst->mkdirs );
+      }
+      if ( pinst->mode == PGSQL_DB_RESTORE && pinst->incrfiles ){
+         err = apply_incremental_files ( ctx );
+         JMSG2 ( ctx, M_INFO, "block incremental: %lld files applied, %lld blocks written\n",
+               (long long) pinst->metrics.incrfiles, (long long) pinst->metrics.incrblocks );
+         if ( err ){
+            JMSG ( ctx, M_ERROR, "block incremental: %i files not applied, database files are not consistent\n", err );
+         }
+      }
+      if ( pinst->mode == PGSQL_DB_RESTORE && pinst->delta && pinst->shards ){
+         /* a shard does not know files restored by other shards */
+         JMSG0 ( ctx, M_WARNING, "delta restore: cleanup skipped for a shard of database backup\n" );
+      } else
+      if ( pinst->mode == PGSQL_DB_RESTORE && pinst->delta ){
+         /* files which are not in backup are not valid anymore */
+         perform_delta_cleanup ( ctx );
+         JMSG2 ( ctx, M_INFO, "delta restore: %lld files restored in place, %lld entries removed\n",
+               (long long) pinst->dstats.files, (long long) pinst->dstats.removed );
+         JMSG2 ( ctx, M_INFO, "delta restore: %lld blocks unchanged, %lld blocks written\n",
+               (long long) pinst->writer.stats.blkequal, (long long) pinst->writer.stats.blkwritten );
+      }
+      if ( pinst->mode == PGSQL_DB_RESTORE && pinst->manifestfile && manifest_cleanup_required ( ctx ) ){
+         if ( pinst->shards ){
+            JMSG0 ( ctx, M_WARNING, "backup manifest: cleanup skipped for a shard of database backup\n" );
+         } else {
+            /* files deleted between backups restored together are not valid */
+            JMSG ( ctx, M_INFO, "backup manifest: %lld entries not in backup removed\n",
+                  (long long) perform_manifest_cleanup ( ctx ) );
+         }
+      }
+      if ( pinst->mode == PGSQL_DB_RESTORE && pinst->rwinit ){
+         DMSG2 ( ctx, D2, "restore writer: files=%lld writes=%lld\n",
+               (long long) pinst->writer.stats.files, (long long) pinst->writer.stats.writes );
+         DMSG2 ( ctx, D2, "restore writer: zero blocks=%lld holes=%lld\n",
+               (long long) pinst->writer.stats.blkzero, (long long) pinst->writer.stats.holes );
+      }
+      report_job_metrics ( ctx, 0 );
+      break;
+
+   /* Plugin command e.g. plugin = <plugin-name>:<name-space>:command */
+   case bEventRestoreCommand:
+      /* setup a plugin parameters: plugin = pgsql:<file_conf>:[wal,db] */
+      DMSG1 ( ctx, D2, "bEventRestoreCommand value=%s\n", NPRT((char *)value) );
+      err = parse_plugin_command ( ctx, PARSE_RESTORE, (char *) value );
+      if ( err ){
+         return bRC_Error;
+      }
+      if ( pinst->mode == PGSQL_DB_RESTORE ){
+         pinst->delta = check_param_bool ( pinst->paramlist, "DELTARESTORE", 0 );
+         if ( pinst->delta ){
+            DMSG0 ( ctx, D2, "delta restore enabled\n" );
+         }
+         pinst->rwflags = 0;
+         if ( check_param_bool ( pinst->paramlist, "RESTOREPREALLOC", 1 ) ){
+            pinst->rwflags |= RW_PREALLOC;
+         }
+         if ( check_param_bool ( pinst->paramlist, "RESTORESPARSE", 0 ) ){
+            pinst->rwflags |= RW_SPARSE;
+         }
+         /* final syncfs is done by pgsql-restore before database startup */
+         str = search_key ( pinst->paramlist, "RESTORESYNC" );
+         if ( str && strcasecmp ( str, "writebehind" ) == 0 ){
+            pinst->rwflags |= RW_WRITEBEHIND;
+         }
+         if ( ! pinst->rwinit ){
+            if ( rwriter_init ( &pinst->writer ) ){
+               JMSG0 ( ctx, M_FATAL, "restore writer memory allocation error\n" );
+               return bRC_Error;
+            }
+            pinst->rwinit = 1;
+         }
+      }
+      break;
+
+   case bEventBackupCommand:
+      /* setup a plugin parameters: plugin = pgsql:<file_conf>:[wal,db] */
+      DMSG1 ( ctx, D2, "bEventBackupCommand value=%s\n", NPRT((char *)value) );
+      err = parse_plugin_command ( ctx, PARSE_BACKUP, (char *) value );
+      if ( err ){
+         return bRC_Error;
+      }
+
+      if ( pinst->mode == PGSQL_ARCH_BACKUP ){
+         /* we force to switch a database log file, to do that we need to connect into a production
+          * database instance and execute a pg_switch_xlog(); to handle it we have to switch a user
+          * into a database cluster owner (in most cases it will be a postgres user) and perform a
           * required operations; as a user switching is unreversible for a particular process,
           * if we want to drop an admin permissions, we have to switch after a fork(); in different
           * process, it is performed in switch_pg_xlog(); */
@@ -1288,16 +4054,32 @@ static bRC handlePluginEvent(bpContext *ctx, bEvent *event, void *value){
       } else
       if ( pinst->mode == PGSQL_DB_BACKUP ) {
          /* database files backup is performed without explicit database log switch because
-          * log switch is performed by pg_start_backup itself */
-         err = start_pg_backup ( ctx );
-         if ( err ){
+          * log switch is performed by pg_start_backup itself; it could be disabled for
+          * a file level backup of a stopped cluster or a benchmark */
+         pinst->startstop = check_param_bool ( pinst->paramlist, "PGSTARTSTOP", 1 );
+         if ( ! pinst->startstop && check_pg_stopped ( ctx ) != bRC_OK ){
             return bRC_Error;
          }
+         pinst->metrics.schedule = get_schedule ( ctx );
+         throttle_init ( ctx );
+         if ( pinst->shards ){
+            /* a part of sharded backup, backup start and file list are shared
+             * by all shards of a set, every shard orders its own part */
+            err = start_shard_backup ( ctx );
+         } else {
+            if ( pinst->startstop ){
+               err = start_pg_backup ( ctx );
+               if ( err ){
+                  return bRC_Error;
+               }
+            }
 
-         /* if we are backing up db files then we have to get a list, it should be performed after
-          * pg_start_backup because we'd like to get consistent list */
-         err = get_dbf_list ( ctx );
-         if ( err ){
+            /* if we are backing up db files then we have to get a list, it should be performed after
+             * pg_start_backup because we'd like to get consistent list */
+            err = get_dbf_list ( ctx );
+         }
+         /* job level, read order and a manifest at the end of list */
+         if ( err || incremental_file_list ( ctx ) || schedule_file_list ( ctx ) || add_manifest_file ( ctx ) ){
             return bRC_Error;
          }
          //print_keylist ( pinst->filelist );
@@ -1375,6 +4157,8 @@ static bRC startBackupFile(bpContext *ctx, struct save_pkt *sp){
 
          /* we have get stat information about backuped wal files */
          err = stat ( filename, &file_stat );
+         pinst->metrics.files++;
+         pinst->metrics.syscalls++;
          /* name of virtual file */
          sp->fname = vfilename;
          sp->type = FT_REG;
@@ -1395,7 +4179,7 @@ static bRC startBackupFile(bpContext *ctx, struct save_pkt *sp){
          snprintf ( sql, SQLLEN, "update pgsql_archivelogs set status=6 where id='%s'",
                pinst->curfile->key );
 
-         result = PQexec ( pinst->catdb, sql );
+         result = catdb_exec ( ctx, sql );
          FREE ( sql );
 
          resstatus = PQresultStatus ( result );
@@ -1411,27 +4195,19 @@ static bRC startBackupFile(bpContext *ctx, struct save_pkt *sp){
       }
    } else
    if ( pinst->mode == PGSQL_DB_BACKUP ) {
+      if ( ! pinst->curfile ){
+         /* a shard could get no files at all */
+         return bRC_Max;
+      }
       if ( pinst->curfile ){
          buf = MALLOC ( PATH_MAX );
          ASSERT_p ( buf );
 
-         /* real filename || $ROOT$ if vfilename is absolute, check this out */
-         if ( strncmp ( pinst->curfile->key, "$ROOT$", PATH_MAX ) == 0 ){
-            /* pgsqltbs:<ARCHCLIENT>/<TBS_Filename> */
-            /* above sentence will be splited in Bacula catalog on <path>/<file> */
-            snprintf ( buf, PATH_MAX, "pgsqltbs:%s%s",
-                  search_key ( pinst->paramlist, "ARCHCLIENT" ),
-                  pinst->curfile->value );
-            /* filename should point to real file on fs */
-            filename = pinst->curfile->value;
-         } else {
-            /* pgsqldb:<ARCHCLIENT>/<DB_Filename> */
-            /* above sentence will be splited in Bacula catalog on <path>/<file> */
-            snprintf ( buf, PATH_MAX, "pgsqldb:%s/%s",
-                  search_key ( pinst->paramlist, "ARCHCLIENT" ),
-                  pinst->curfile->value );
-            filename = pinst->curfile->key;
-         }
+         /* pgsqltbs:<ARCHCLIENT>/<TBS_Filename> or pgsqldb:<ARCHCLIENT>/<DB_Filename> */
+         /* above sentence will be splited in Bacula catalog on <path>/<file> */
+         dbfile_vname ( pinst, pinst->curfile, buf, PATH_MAX );
+         /* filename should point to real file on fs */
+         filename = (char *) dbfile_path ( pinst->curfile );
 
          vfilename = bstrdup ( buf );
 
@@ -1442,6 +4218,30 @@ static bRC startBackupFile(bpContext *ctx, struct save_pkt *sp){
          sp->fname = vfilename;
          sp->portable = TRUE;
 
+         if ( pinst->curfile->attrs == PG_MANIFEST ){
+            /* all database files were sent, so backup is stopped to get its stop
+             * location, a sharded backup is stopped by the last shard */
+            if ( ! pinst->shards && pinst->startstop && ! pinst->stopped ){
+               pinst->stopped = stop_pg_backup ( ctx ) ? -1 : 1;
+               if ( pinst->stopped > 0 ){
+                  read_stop_lsn ( ctx );
+               }
+            }
+            if ( manifest_build ( ctx ) ){
+               return bRC_Error;
+            }
+            /* manifest is generated in memory, it gets PGDATA owner and current time */
+            err = stat ( search_key ( pinst->paramlist, "PGDATA" ), &file_stat );
+            pinst->metrics.syscalls++;
+            file_stat.st_mode = S_IFREG | S_IRUSR | S_IWUSR;
+            file_stat.st_nlink = 1;
+            file_stat.st_size = pinst->manifestlen;
+            file_stat.st_mtime = file_stat.st_ctime = file_stat.st_atime = time ( NULL );
+            sp->type = FT_REG;
+            memcpy ( &sp->statp, &file_stat, sizeof (sp->statp) );
+            return bRC_OK;
+         }
+
          switch ( pinst->curfile->attrs ) {
             case PG_DIR:
                /* FIXME: I have to add '/' on the end of the vfilename? */
@@ -1462,6 +4262,7 @@ static bRC startBackupFile(bpContext *ctx, struct save_pkt *sp){
                FREE ( buf );
                break;
             case PG_FILE:
+            case PG_INCR:
                sp->type = FT_REG;
                break;
             default:
@@ -1470,6 +4271,29 @@ static bRC startBackupFile(bpContext *ctx, struct save_pkt *sp){
          }
          /* we have got stat information about current file */
          err = lstat ( filename, &file_stat );
+         pinst->metrics.files++;
+         pinst->metrics.syscalls++;
+         pinst->filemtime = file_stat.st_mtime;
+         if ( pinst->curfile->attrs == PG_INCR ){
+            /* blocks below current file size are sent, the stream size is known now */
+            pinst->curincr = find_incr_file ( pinst, filename );
+            if ( ! pinst->curincr ){
+               return bRC_Error;
+            }
+            pinst->curincr->filesize = err ? 0 : file_stat.st_size;
+            len = ( pinst->curincr->filesize + PGBLCKSZ - 1 ) / PGBLCKSZ;
+            if ( pinst->curincr->all ){
+               pinst->curincr->nsend = len;
+            } else {
+               pinst->curincr->nsend = 0;
+               while ( pinst->curincr->nsend < pinst->curincr->nblocks &&
+                     pinst->curincr->blocks [ pinst->curincr->nsend ] < (uint32_t) len ){
+                  pinst->curincr->nsend++;
+               }
+            }
+            file_stat.st_size = sizeof ( pg_incr_header ) +
+                  (off_t) pinst->curincr->nsend * ( sizeof ( uint32_t ) + PGBLCKSZ );
+         }
          /* copy all contents of stat struct */
          memcpy ( &sp->statp, &file_stat, sizeof (sp->statp) );
       }
@@ -1501,7 +4325,7 @@ static bRC endBackupFile ( bpContext *ctx ){
          snprintf ( sql, SQLLEN, "update pgsql_archivelogs set status=8 where id='%s'",
                pinst->curfile->key );
 
-         result = PQexec ( pinst->catdb, sql );
+         result = catdb_exec ( ctx, sql );
          FREE ( sql );
 
          resstatus = PQresultStatus ( result );
@@ -1512,6 +4336,7 @@ static bRC endBackupFile ( bpContext *ctx ){
 
          /* when backup of particular file is done then unlink wal file */
          err = unlink ( pinst->curfile->value );
+         pinst->metrics.syscalls++;
          if ( err ){
             return bRC_Error;
          }
@@ -1533,12 +4358,66 @@ static bRC endBackupFile ( bpContext *ctx ){
    return bRC_OK;
 }
 
+/*
+ * returns a block number of n-th block sent in a block incremental file
+ */
+uint32_t incr_block ( pg_incr * incr, uint32_t n ){
+
+   return incr->all ? n : incr->blocks [ n ];
+}
+
+/*
+ * prepares a block incremental file stream: a header and block numbers
+ * in pinst->incrbuf, pages are read after them
+ *
+ * out:
+ *    0 - success
+ *    1 - memory allocation error
+ */
+int incr_file_header ( pg_plug_inst * pinst ){
+
+   pg_incr * incr = pinst->curincr;
+   pg_incr_header * hdr;
+   uint32_t * blocks;
+   size_t size;
+   uint32_t a;
+
+   size = sizeof ( pg_incr_header ) + sizeof ( uint32_t ) * incr->nsend;
+   if ( size < PGINCRCHUNK * PGBLCKSZ ){
+      size = PGINCRCHUNK * PGBLCKSZ;
+   }
+   free ( pinst->incrbuf );
+   pinst->incrbuf = MALLOC ( size );
+   if ( ! pinst->incrbuf ){
+      return 1;
+   }
+   hdr = (pg_incr_header *) pinst->incrbuf;
+   memset ( hdr, 0, sizeof ( pg_incr_header ) );
+   memcpy ( hdr->magic, PGINCRMAGIC, sizeof ( hdr->magic ) );
+   hdr->blcksz = PGBLCKSZ;
+   hdr->nblocks = incr->nsend;
+   hdr->trunc = incr->trunc;
+   hdr->jobid = pinst->JobId;
+   hdr->filesize = incr->filesize;
+   hdr->baselsn = pinst->incrbase;
+   blocks = (uint32_t *) ( pinst->incrbuf + sizeof ( pg_incr_header ) );
+   for ( a = 0; a < incr->nsend; a++ ){
+      blocks [ a ] = incr_block ( incr, a );
+   }
+   pinst->incrlen = sizeof ( pg_incr_header ) + sizeof ( uint32_t ) * incr->nsend;
+   pinst->incrpos = 0;
+   pinst->incrnext = 0;
+
+   return 0;
+}
+
 /*
  * opens pinst->curfile and fill required data structures
  */
 bRC perform_dbfile_open ( bpContext *ctx, struct io_pkt *io ) {
 
    pg_plug_inst * pinst;
+   double start;
    int dl;
    char * buf;
    char * link;
@@ -1553,6 +4432,7 @@ bRC perform_dbfile_open ( bpContext *ctx, struct io_pkt *io ) {
          switch ( pinst->curfile->attrs ) {
             case PG_FILE:
                /* standard file to open */
+               start = monotonic_time ();
                if ( strncmp ( pinst->curfile->key, "$ROOT$", PATH_MAX ) == 0 ){
                   /* filename to open is at value */
                   pinst->curfd = open ( pinst->curfile->value, io->flags );
@@ -1560,6 +4440,9 @@ bRC perform_dbfile_open ( bpContext *ctx, struct io_pkt *io ) {
                   /* filename to open is at key */
                   pinst->curfd = open ( pinst->curfile->key, io->flags );
                }
+               metrics_add ( &pinst->metrics, PH_OPEN, start );
+               pinst->filecrc = 0;
+               pinst->filebytes = 0;
 
                if ( ! pinst->curfd ){
                   /* there is a problem with opening file, raise an error */
@@ -1568,6 +4451,25 @@ bRC perform_dbfile_open ( bpContext *ctx, struct io_pkt *io ) {
                }
                /* XXX: anything else ? */
 
+               break;
+            case PG_INCR:
+               /* relation segment read at changed blocks only */
+               if ( ! pinst->curincr ){
+                  io->io_errno = EINVAL;
+                  return bRC_Error;
+               }
+               start = monotonic_time ();
+               pinst->curfd = open ( pinst->curincr->path, O_RDONLY );
+               metrics_add ( &pinst->metrics, PH_OPEN, start );
+               if ( pinst->curfd < 0 ){
+                  io->io_errno = errno;
+                  pinst->curfd = 0;
+                  return bRC_Error;
+               }
+               if ( incr_file_header ( pinst ) ){
+                  io->io_errno = ENOMEM;
+                  return bRC_Error;
+               }
                break;
             case PG_LINK:
                if ( strncmp ( pinst->curfile->key, "$ROOT$", PATH_MAX ) == 0 ){
@@ -1580,6 +4482,7 @@ bRC perform_dbfile_open ( bpContext *ctx, struct io_pkt *io ) {
                buf = MALLOC ( PATH_MAX );
                ASSERT_p ( buf );
                dl = readlink ( link, buf, PATH_MAX - 1 );
+               pinst->metrics.syscalls++;
                if ( dl < 0 ){
                   io->io_errno = errno;
                   JMSG ( ctx, M_ERROR, "ERR: %s\n", strerror ( io->io_errno ) );
@@ -1604,6 +4507,9 @@ bRC perform_dbfile_open ( bpContext *ctx, struct io_pkt *io ) {
                pinst->linkread = 0;
                /* its all for now */
                break;
+            case PG_MANIFEST:
+               pinst->manifestpos = 0;
+               break;
             default:
                io->io_errno = EINVAL;
                return bRC_Error;
@@ -1617,6 +4523,348 @@ bRC perform_dbfile_open ( bpContext *ctx, struct io_pkt *io ) {
    return bRC_OK;
 }
 
+/*
+ * reads a total stall time of tasks waiting for IO (some) from PSI
+ *
+ * out:
+ *    0 - success, stall in microseconds
+ *    1 - pressure information not available
+ */
+#ifdef __linux__
+int read_io_pressure ( double * stall ){
+
+   FILE * in;
+   char line [ SQLLEN ];
+   unsigned long long total;
+   int err = 1;
+
+   in = fopen ( "/proc/pressure/io", "r" );
+   if ( ! in ){
+      return 1;
+   }
+   while ( fgets ( line, SQLLEN, in ) ){
+      if ( sscanf ( line, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", &total ) == 1 ){
+         *stall = (double) total;
+         err = 0;
+         break;
+      }
+   }
+   fclose ( in );
+
+   return err;
+}
+
+/*
+ * reads completed IOs and time spent on them of a block device from /proc/diskstats
+ *
+ * out:
+ *    0 - success, ticks in milliseconds
+ *    1 - device not found
+ */
+int read_dev_latency ( dev_t dev, double * ticks, double * count ){
+
+   FILE * in;
+   char line [ SQLLEN ];
+   unsigned int maj, min;
+   double reads, rticks, writes, wticks;
+   int err = 1;
+
+   in = fopen ( "/proc/diskstats", "r" );
+   if ( ! in ){
+      return 1;
+   }
+   while ( fgets ( line, SQLLEN, in ) ){
+      if ( sscanf ( line, "%u %u %*s %lf %*s %*s %lf %lf %*s %*s %lf",
+               &maj, &min, &reads, &rticks, &writes, &wticks ) == 6 &&
+            maj == major ( dev ) && min == minor ( dev ) ){
+         *ticks = rticks + wticks;
+         *count = reads + writes;
+         err = 0;
+         break;
+      }
+   }
+   fclose ( in );
+
+   return err;
+}
+#else
+int read_io_pressure ( double * stall ){
+
+   /* PSI and /proc/diskstats are Linux only */
+   return 1;
+}
+
+int read_dev_latency ( dev_t dev, double * ticks, double * count ){
+
+   return 1;
+}
+#endif
+
+/*
+ * configures a backup read throttle: THROTTLEMBPS and THROTTLEIOPS token
+ * buckets and THROTTLEADAPTIVE backoff with THROTTLEPRESSURE threshold
+ *
+ * in:
+ *    ctx - plugin context
+ * out:
+ *    pinst->throttle - throttle state, disabled when nothing configured
+ */
+void throttle_init ( bpContext *ctx ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   pg_throttle * t = &pinst->throttle;
+   struct stat st;
+   char * str;
+   double dummy;
+   int a;
+
+   memset ( t, 0, sizeof ( pg_throttle ) );
+   t->scale = 1;
+   pinst->metrics.minscale = 1;
+
+   str = search_key ( pinst->paramlist, "THROTTLEMBPS" );
+   t->mbps = str ? atof ( str ) : 0;
+   str = search_key ( pinst->paramlist, "THROTTLEIOPS" );
+   t->iops = str ? atof ( str ) : 0;
+
+   str = search_key ( pinst->paramlist, "THROTTLEADAPTIVE" );
+   if ( str ){
+      for ( a = THROTTLE_NONE; a < THROTTLE_MAX; a++ ){
+         if ( strcasecmp ( str, throttlenames [ a ] ) == 0 ){
+            t->adaptive = a;
+         }
+      }
+      if ( t->adaptive == THROTTLE_NONE && strcasecmp ( str, "no" ) != 0 ){
+         JMSG ( ctx, M_WARNING, "unknown THROTTLEADAPTIVE %s, adaptive throttle disabled.\n", str );
+      }
+   }
+   switch ( t->adaptive ){
+      case THROTTLE_PSI:
+         t->threshold = 10;
+         if ( read_io_pressure ( &dummy ) ){
+            JMSG0 ( ctx, M_WARNING, "IO pressure (/proc/pressure/io) not available, adaptive throttle disabled.\n" );
+            t->adaptive = THROTTLE_NONE;
+         }
+         break;
+      case THROTTLE_LATENCY:
+         t->threshold = 20;
+         str = search_key ( pinst->paramlist, "PGDATA" );
+         if ( ! str || stat ( str, &st ) != 0 || read_dev_latency ( st.st_dev, &dummy, &dummy ) ){
+            JMSG0 ( ctx, M_WARNING, "PGDATA device statistics not available, adaptive throttle disabled.\n" );
+            t->adaptive = THROTTLE_NONE;
+         } else {
+            t->dev = st.st_dev;
+         }
+         break;
+   }
+   str = search_key ( pinst->paramlist, "THROTTLEPRESSURE" );
+   if ( str && atof ( str ) > 0 ){
+      t->threshold = atof ( str );
+   }
+
+   t->enabled = t->mbps > 0 || t->iops > 0 || t->adaptive != THROTTLE_NONE;
+   if ( t->enabled ){
+      DMSG3 ( ctx, D1, "throttle %.1f MB/s, %.0f IOPS, adaptive %s\n",
+            t->mbps, t->iops, throttlenames [ t->adaptive ] );
+   }
+}
+
+/*
+ * samples IO pressure and adjusts a throttle rate scale: multiplicative
+ * decrease when pressure is above threshold, additive increase otherwise;
+ * without a configured bandwidth limit the rate read before the first backoff
+ * becomes a base rate, which is released again when scale recovers
+ *
+ * in:
+ *    pinst - plugin instance
+ *    now - current monotonic time
+ */
+void throttle_sample ( pg_plug_inst * pinst, double now ){
+
+   pg_throttle * t = &pinst->throttle;
+   pg_metrics * m = &pinst->metrics;
+   double stall = 0;
+   double count = 0;
+   double pressure = 0;
+   double elapsed;
+   int err;
+
+   if ( t->adaptive == THROTTLE_PSI ){
+      err = read_io_pressure ( &stall );
+   } else {
+      err = read_dev_latency ( t->dev, &stall, &count );
+   }
+   pinst->metrics.syscalls += 3;
+   if ( err ){
+      return;
+   }
+
+   elapsed = now - t->sample;
+   if ( t->sample > 0 && elapsed > 0 ){
+      if ( t->adaptive == THROTTLE_PSI ){
+         /* percent of time some tasks stalled on IO */
+         pressure = ( stall - t->stall ) / ( elapsed * 10000 );
+      } else
+      if ( count > t->count ){
+         /* average IO completion time in ms */
+         pressure = ( stall - t->stall ) / ( count - t->count );
+      }
+      t->pressure = pressure;
+      if ( pressure > m->maxpressure ){
+         m->maxpressure = pressure;
+      }
+
+      if ( pressure > t->threshold ){
+         if ( t->mbps == 0 ){
+            t->mbps = ( m->bytes - t->sbytes ) / elapsed / ( 1024 * 1024 );
+            t->base = 1;
+         }
+         t->scale /= 2;
+         if ( t->scale < PGTHROTTLEMINSCALE ){
+            t->scale = PGTHROTTLEMINSCALE;
+         }
+         m->backoffs++;
+      } else
+      if ( t->scale < 1 ){
+         t->scale += PGTHROTTLESTEP;
+         if ( t->scale >= 1 ){
+            t->scale = 1;
+            if ( t->base ){
+               t->mbps = 0;
+               t->base = 0;
+            }
+         }
+      }
+      if ( t->scale < m->minscale ){
+         m->minscale = t->scale;
+      }
+   }
+
+   t->sample = now;
+   t->stall = stall;
+   t->count = count;
+   t->sbytes = m->bytes;
+}
+
+/*
+ * waits before a database file read until bandwidth and IOPS tokens are
+ * available, tokens are refilled at a limit rate scaled by adaptive backoff
+ * and a read makes a debt which is paid back by waiting
+ *
+ * in:
+ *    pinst - plugin instance
+ */
+void throttle_wait ( pg_plug_inst * pinst ){
+
+   pg_throttle * t = &pinst->throttle;
+   struct timespec ts;
+   double now;
+   double elapsed;
+   double rate;
+   double wait = 0;
+
+   if ( ! t->enabled ){
+      return;
+   }
+   now = monotonic_time ();
+   if ( t->adaptive != THROTTLE_NONE && now - t->sample >= PGTHROTTLESAMPLE ){
+      throttle_sample ( pinst, now );
+   }
+   elapsed = t->last > 0 ? now - t->last : 0;
+   t->last = now;
+
+   if ( t->mbps > 0 ){
+      rate = t->mbps * t->scale * 1024 * 1024;
+      t->bytes += elapsed * rate;
+      if ( t->bytes > rate * PGTHROTTLEBURST ){
+         t->bytes = rate * PGTHROTTLEBURST;
+      }
+      if ( t->bytes < 0 ){
+         wait = -t->bytes / rate;
+      }
+   } else {
+      t->bytes = 0;
+   }
+   if ( t->iops > 0 ){
+      rate = t->iops * t->scale;
+      t->ios += elapsed * rate;
+      if ( t->ios > rate * PGTHROTTLEBURST + 1 ){
+         t->ios = rate * PGTHROTTLEBURST + 1;
+      }
+      if ( t->ios < 1 && ( 1 - t->ios ) / rate > wait ){
+         wait = ( 1 - t->ios ) / rate;
+      }
+   }
+
+   if ( wait > 0 ){
+      ts.tv_sec = (time_t) wait;
+      ts.tv_nsec = (long) ( ( wait - ts.tv_sec ) * 1000000000 );
+      nanosleep ( &ts, NULL );
+      pinst->metrics.throttlewait += monotonic_time () - now;
+      pinst->metrics.throttles++;
+   }
+}
+
+/*
+ * takes tokens of a finished database file read
+ *
+ * in:
+ *    pinst - plugin instance
+ *    bytes - bytes read
+ */
+void throttle_account ( pg_plug_inst * pinst, ssize_t bytes ){
+
+   pg_throttle * t = &pinst->throttle;
+
+   if ( t->enabled ){
+      if ( bytes > 0 ){
+         t->bytes -= bytes;
+      }
+      t->ios -= 1;
+   }
+}
+
+/*
+ * reads a run of consecutive changed pages, up to PGINCRCHUNK, into
+ * pinst->incrbuf; pages cut by a concurrent truncate are sent zeroed as
+ * WAL replay truncates them again
+ *
+ * out:
+ *    0 - success
+ *    -1 - read error, errno is set
+ */
+int incr_read_chunk ( pg_plug_inst * pinst ){
+
+   pg_incr * incr = pinst->curincr;
+   uint32_t first;
+   uint32_t n = 1;
+   ssize_t nr;
+   double start;
+
+   first = incr_block ( incr, pinst->incrnext );
+   while ( n < PGINCRCHUNK && pinst->incrnext + n < incr->nsend &&
+         incr_block ( incr, pinst->incrnext + n ) == first + n ){
+      n++;
+   }
+   throttle_wait ( pinst );
+   start = monotonic_time ();
+   nr = pread ( pinst->curfd, pinst->incrbuf, (size_t) n * PGBLCKSZ, (off_t) first * PGBLCKSZ );
+   metrics_add ( &pinst->metrics, PH_READ, start );
+   if ( nr < 0 ){
+      return -1;
+   }
+   throttle_account ( pinst, nr );
+   if ( nr < (ssize_t) n * PGBLCKSZ ){
+      memset ( pinst->incrbuf + nr, 0, (size_t) n * PGBLCKSZ - nr );
+   }
+   pinst->incrlen = n * PGBLCKSZ;
+   pinst->incrpos = 0;
+   pinst->incrnext += n;
+   pinst->metrics.incrblocks += n;
+
+   return 0;
+}
+
 /*
  * perform a db file read into an iobuffer
  * 
@@ -1629,6 +4877,7 @@ bRC perform_dbfile_open ( bpContext *ctx, struct io_pkt *io ) {
 bRC perform_dbfile_read ( bpContext *ctx, struct io_pkt *io ) {
 
    pg_plug_inst * pinst;
+   double start;
    int len;
 
    ASSERT_ctx_p;
@@ -1641,13 +4890,40 @@ bRC perform_dbfile_read ( bpContext *ctx, struct io_pkt *io ) {
          case PG_FILE:
             /* standard file to read */
             if ( pinst->curfd > 0 ){
+               throttle_wait ( pinst );
+               start = monotonic_time ();
                io->status = read ( pinst->curfd, io->buf, io->count );
+               metrics_add ( &pinst->metrics, PH_READ, start );
+               throttle_account ( pinst, io->status );
                if ( io->status == 0 && errno ){
                   /* error occured, raide it upper */
                   io->io_errno = errno;
                   return bRC_Error;
                }
+               if ( io->status > 0 ){
+                  pinst->metrics.bytes += io->status;
+                  /* manifest checksum of streamed data */
+                  pinst->filecrc = crc32c ( pinst->filecrc, io->buf, io->status );
+                  pinst->filebytes += io->status;
+               }
+            }
+            break;
+         case PG_INCR:
+            /* a header with block numbers, then changed pages, zero at the end */
+            if ( pinst->incrpos == pinst->incrlen && pinst->incrnext < pinst->curincr->nsend &&
+                  incr_read_chunk ( pinst ) ){
+               io->io_errno = errno;
+               return bRC_Error;
+            }
+            len = pinst->incrlen - pinst->incrpos;
+            if ( len > io->count ){
+               len = io->count;
             }
+            memcpy ( io->buf, pinst->incrbuf + pinst->incrpos, len );
+            pinst->incrpos += len;
+            pinst->metrics.bytes += len;
+            io->status = len;
+            io->io_errno = 0;
             break;
          case PG_LINK:
             if ( pinst->linkread ) {
@@ -1687,6 +4963,17 @@ bRC perform_dbfile_read ( bpContext *ctx, struct io_pkt *io ) {
                }
             }
             break;
+         case PG_MANIFEST:
+            /* manifest contents in chunks, zero at the end */
+            len = pinst->manifestlen - pinst->manifestpos;
+            if ( len > io->count ){
+               len = io->count;
+            }
+            memcpy ( io->buf, pinst->manifest + pinst->manifestpos, len );
+            pinst->manifestpos += len;
+            io->status = len;
+            io->io_errno = 0;
+            break;
          default:
             io->io_errno = EINVAL;
             return bRC_Error;
@@ -1707,6 +4994,7 @@ bRC perform_dbfile_read ( bpContext *ctx, struct io_pkt *io ) {
 bRC perform_dbfile_write ( bpContext *ctx, struct io_pkt *io ) {
 
    pg_plug_inst * pinst;
+   double start;
 
    ASSERT_ctx_p;
    pinst = (pg_plug_inst *)ctx->pContext;
@@ -1715,10 +5003,15 @@ bRC perform_dbfile_write ( bpContext *ctx, struct io_pkt *io ) {
    if ( pinst->curfile ){
       switch ( pinst->curfile->attrs ) {
          case PG_FILE:
-            /* standard file to write */
+            /* standard file to write, through restore writer */
             if ( pinst->curfd > 0 ){
-               io->status = write ( pinst->curfd, io->buf, io->count );
-               if ( io->status == 0 && errno ){
+               start = monotonic_time ();
+               io->status = rwriter_write ( &pinst->writer, io->buf, io->count );
+               metrics_add ( &pinst->metrics, PH_WRITE, start );
+               if ( io->status > 0 ){
+                  pinst->metrics.bytes += io->status;
+               }
+               if ( io->status < 0 ){
                   /* error occured, raise it upper */
                   io->io_errno = errno;
                   return bRC_Error;
@@ -1739,6 +5032,7 @@ bRC perform_dbfile_write ( bpContext *ctx, struct io_pkt *io ) {
 bRC perform_dbfile_close ( bpContext *ctx, struct io_pkt *io ) {
 
    pg_plug_inst * pinst;
+   double start;
 
    ASSERT_ctx_p;
    pinst = (pg_plug_inst *)ctx->pContext;
@@ -1748,9 +5042,43 @@ bRC perform_dbfile_close ( bpContext *ctx, struct io_pkt *io ) {
       switch ( pinst->curfile->attrs ) {
          case PG_FILE:
             if ( pinst->curfd > 0){
+               start = monotonic_time ();
+               if ( pinst->mode == PGSQL_DB_BACKUP ){
+                  io->status = close ( pinst->curfd );
+                  pinst->curfd = 0;
+                  metrics_add ( &pinst->metrics, PH_CLOSE, start );
+                  if ( pinst->mlist && add_file_sum ( pinst ) ){
+                     io->io_errno = ENOMEM;
+                     return bRC_Error;
+                  }
+                  break;
+               }
+               /* flush buffered data and set a real file size */
+               if ( rwriter_close ( &pinst->writer ) ){
+                  io->io_errno = errno;
+                  JMSG ( ctx, M_ERROR, "write file error: %s\n", strerror ( errno ) );
+                  close ( pinst->curfd );
+                  pinst->curfd = 0;
+                  io->status = -1;
+                  return bRC_Error;
+               }
+               io->status = close ( pinst->curfd );
+               pinst->curfd = 0;
+               metrics_add ( &pinst->metrics, PH_CLOSE, start );
+            }
+            break;
+         case PG_INCR:
+            /* manifest keeps a size of relation segment, not of its changed blocks */
+            if ( pinst->curfd > 0 ){
+               start = monotonic_time ();
                io->status = close ( pinst->curfd );
                pinst->curfd = 0;
+               metrics_add ( &pinst->metrics, PH_CLOSE, start );
+               pinst->metrics.incrfiles++;
             }
+            free ( pinst->incrbuf );
+            pinst->incrbuf = NULL;
+            pinst->curincr = NULL;
             break;
          case PG_LINK:
             if ( pinst->linkval ){
@@ -1768,6 +5096,8 @@ bRC perform_dbfile_close ( bpContext *ctx, struct io_pkt *io ) {
                return bRC_Error;
             }
             break;
+         case PG_MANIFEST:
+            break;
          default:
             io->io_errno = EINVAL;
             return bRC_Error;
@@ -1786,6 +5116,7 @@ bRC perform_dbfile_close ( bpContext *ctx, struct io_pkt *io ) {
 bRC perform_arch_open ( bpContext *ctx, struct io_pkt *io ) {
 
    pg_plug_inst * pinst;
+   double start;
 
    ASSERT_ctx_p;
    pinst = (pg_plug_inst *)ctx->pContext;
@@ -1793,7 +5124,9 @@ bRC perform_arch_open ( bpContext *ctx, struct io_pkt *io ) {
    if ( pinst->curfile ){
       if ( ! pinst->curfd ){
          /* we are backing up a real wal file */
+         start = monotonic_time ();
          pinst->curfd = open ( pinst->curfile->value, io->flags );
+         metrics_add ( &pinst->metrics, PH_OPEN, start );
 
          if ( ! pinst->curfd ){
             io->io_errno = errno;
@@ -1816,17 +5149,23 @@ bRC perform_arch_open ( bpContext *ctx, struct io_pkt *io ) {
 bRC perform_arch_read ( bpContext *ctx, struct io_pkt *io ) {
 
    pg_plug_inst * pinst;
+   double start;
 
    ASSERT_ctx_p;
    pinst = (pg_plug_inst *)ctx->pContext;
 
    if ( pinst->curfd > 0 ){
+      start = monotonic_time ();
       io->status = read ( pinst->curfd, io->buf, io->count );
+      metrics_add ( &pinst->metrics, PH_READ, start );
       if ( io->status == 0 && errno ){
          /* error occured, raise it upper */
          io->io_errno = errno;
          return bRC_Error;
       }
+      if ( io->status > 0 ){
+         pinst->metrics.bytes += io->status;
+      }
    } else {
       return bRC_Error;
    }
@@ -1839,17 +5178,23 @@ bRC perform_arch_read ( bpContext *ctx, struct io_pkt *io ) {
 bRC perform_arch_write ( bpContext *ctx, struct io_pkt *io ) {
 
    pg_plug_inst * pinst;
+   double start;
 
    ASSERT_ctx_p;
    pinst = (pg_plug_inst *)ctx->pContext;
 
    if ( pinst->curfd > 0 ){
+      start = monotonic_time ();
       io->status = write ( pinst->curfd, io->buf, io->count );
+      metrics_add ( &pinst->metrics, PH_WRITE, start );
       if ( io->status == 0 && errno ){
          /* error occured, raide it upper */
          io->io_errno = errno;
          return bRC_Error;
       }
+      if ( io->status > 0 ){
+         pinst->metrics.bytes += io->status;
+      }
    } else {
       return bRC_Error;
    }
@@ -1862,13 +5207,16 @@ bRC perform_arch_write ( bpContext *ctx, struct io_pkt *io ) {
 bRC perform_arch_close ( bpContext *ctx, struct io_pkt *io ) {
 
    pg_plug_inst * pinst;
+   double start;
 
    ASSERT_ctx_p;
    pinst = (pg_plug_inst *)ctx->pContext;
 
    if ( pinst->curfd > 0){
+         start = monotonic_time ();
          io->status = close ( pinst->curfd );
          pinst->curfd = 0;
+         metrics_add ( &pinst->metrics, PH_CLOSE, start );
    } else {
          return bRC_Error;
    }
@@ -1981,71 +5329,153 @@ static bRC endRestoreFile ( bpContext *ctx )
 }
 
 /*
+ * creates all missing parent directories of a file; directories created or found
+ * are remembered for the whole job, so every directory is checked only once
  * 
+ * in:
+ *    ctx - plugin context
+ *    filename - full path of a file
+ * out:
+ *    0 - on success
+ *    -1 - on error
  */
 int makepath ( bpContext *ctx, const char * filename ){
 
-   char * dir;
-   char * next;
-   char * file; // allocated
+   pg_plug_inst * pinst;
    char * path; // allocated
+   char * next;
    int len;
-   int err;
-   struct stat sp;
-
-   if ( filename ){
-      len = strlen ( filename ) + 2;
-      file = MALLOC ( len );
-      strncpy ( file, filename, len );
 
-      /* 
-       * Well, a dirname function returns the same pointer what we had provided
-       * and modify input string - we can exploit this for simplyfing all work
-       * - for later discussion !!!
-       */
-      dir = dirname ( file );
+   if ( ! filename || ! ctx || ! ctx->pContext ){
+      return -1;
+   }
+   pinst = (pg_plug_inst *)ctx->pContext;
 
-      /* 
-       * Main dirname fuction formally returns unknown pointer, so if we'd like 
-       * to use it we have to duplicate string returned, but we can free file var.
-       */
-      len = strlen ( dir ) + 2;
-      path = MALLOC ( len );
+   if ( ! pinst->dirs ){
+      /* without a cache all directories are simply checked every time */
+      pinst->dirs = pathset_alloc ();
+   }
 
-      /* Now we have a copy of separated directory in path var. */
-      strncpy ( path, dir, len );
-      DMSG1 ( ctx, D3, "path: %s\n", path );
-      file [0] = '\0';
-      dir = path;
-      next = dir + 1;
+   len = strlen ( filename ) + 1;
+   path = MALLOC ( len );
+   if ( ! path ){
+      return -1;
+   }
+   strncpy ( path, filename, len );
 
-      while ( ( next = strchr ( next, '/' ) ) != NULL ){
-         len = next - dir;
-         strncpy ( file, dir, len );
-         file [ len ] = '\0';
-         DMSG1 ( ctx, D3, " DIR: %s\n", file );
+   /* a parent directory of file */
+   next = strrchr ( path, '/' );
+   if ( ! next || next == path ){
+      FREE ( path );
+      return 0;
+   }
+   *next = '\0';
+   if ( pathset_find ( pinst->dirs, path ) ){
+      FREE ( path );
+      return 0;
+   }
+   DMSG1 ( ctx, D3, "path: %s\n", path );
 
-         err = stat ( file, &sp );
-         if ( err ) {
-            /* This means that directory doesn't exist, so we create it */
-            DMSG0 ( ctx, D3, "created\n");
-            mkdir ( file, S_IRWXU );
+   for ( next = path + 1; ; next++ ){
+      next = strchr ( next, '/' );
+      if ( next ){
+         *next = '\0';
+      }
+      if ( ! pathset_find ( pinst->dirs, path ) ){
+         pinst->metaops++;
+         if ( mkdir ( path, S_IRWXU ) == 0 ){
+            DMSG1 ( ctx, D3, " DIR: %s created\n", path );
+            pinst->mkdirs++;
+            pathset_add ( pinst->dirs, path );
+         } else
+         if ( errno == EEXIST ){
+            pathset_add ( pinst->dirs, path );
+         } else {
+            DMSG2 ( ctx, D1, " DIR: %s error: %s\n", path, strerror ( errno ) );
          }
-
-         next++;
       }
-      DMSG1 ( ctx, D3, " DIR: %s\n", path );
-      err = stat ( path, &sp );
-      if ( err ) {
-         DMSG0 ( ctx, D3, "created\n");
-         mkdir ( path, S_IRWXU );
+      if ( ! next ){
+         break;
       }
-      FREE ( file );
-      FREE ( path );
-      return 0;
+      *next = '/';
+   }
+
+   FREE ( path );
+   return 0;
+}
+
+/*
+ * closes the cached parent directory descriptor
+ */
+void close_parent_dir ( pg_plug_inst * pinst ){
+
+   if ( pinst->lastdir ){
+      close ( pinst->lastdirfd );
+      FREE ( pinst->lastdir );
+   }
+}
+
+/*
+ * returns a descriptor of a parent directory of a file for *at() calls, missing
+ * directories are created; files are restored directory by directory so the last
+ * directory descriptor is kept open
+ * 
+ * in:
+ *    ctx - plugin context
+ *    file - full path of a file
+ * out:
+ *    name - file name relative to returned directory
+ *    directory descriptor or -1 on error
+ */
+int open_parent_dir ( bpContext *ctx, const char * file, const char ** name ){
+
+   pg_plug_inst * pinst;
+   const char * slash;
+   int len;
+   int fd;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   slash = strrchr ( file, '/' );
+   if ( ! slash ){
+      errno = EINVAL;
+      return -1;
+   }
+   *name = slash + 1;
+   len = slash - file;
+
+   if ( pinst->lastdir && (int) strlen ( pinst->lastdir ) == len &&
+         strncmp ( pinst->lastdir, file, len ) == 0 ){
+      return pinst->lastdirfd;
+   }
+   close_parent_dir ( pinst );
+
+   makepath ( ctx, file );
+
+   pinst->lastdir = MALLOC ( len + 2 );
+   if ( ! pinst->lastdir ){
+      errno = ENOMEM;
+      return -1;
+   }
+   if ( len ){
+      strncpy ( pinst->lastdir, file, len );
+      pinst->lastdir [ len ] = '\0';
    } else {
+      strcpy ( pinst->lastdir, "/" );
+   }
+   pinst->metaops++;
+   fd = open ( pinst->lastdir, O_RDONLY | O_DIRECTORY );
+   if ( fd < 0 ){
+      FREE ( pinst->lastdir );
       return -1;
    }
+   if ( ! len ){
+      /* "/" is not the same as a zero length parent */
+      pinst->lastdir [ 0 ] = '\0';
+   }
+   pinst->lastdirfd = fd;
+
+   return fd;
 }
 
 /*
@@ -2162,8 +5592,12 @@ bRC perform_create_file ( bpContext *ctx, struct restore_pkt *rp, char * file ){
 
    pg_plug_inst * pinst;
    int fd;
-   int err;
-   struct utimbuf ut;
+   int dirfd;
+   int err = -1;
+   int rwflags;
+   const char * name;
+   struct stat st;
+   struct timespec ts [ 2 ];
    bRC rc = bRC_OK;
 
    ASSERT_ctx_p;
@@ -2171,13 +5605,62 @@ bRC perform_create_file ( bpContext *ctx, struct restore_pkt *rp, char * file ){
 
    DMSG1 ( ctx, D3, "creating file: %s\n", file );
 
-   check_exist_rm ( file );
-
-   /* creating a full path for a file */
-   makepath ( ctx, file );
+   fd = -1;
+   rwflags = pinst->rwflags;
+   if ( strstr ( file, "/pg_wal/" ) || strstr ( file, "/pg_xlog/" ) ){
+      /* wal segments are never restored with holes */
+      rwflags &= ~RW_SPARSE;
+   }
+   dirfd = open_parent_dir ( ctx, file, &name );
+   if ( dirfd < 0 ){
+      rp->create_status = CF_ERROR;
+      JMSG ( ctx, M_ERROR, "create file error: %s\n", strerror ( errno ) );
+      return bRC_Error;
+   }
+   if ( pinst->delta ){
+      pinst->metaops++;
+      err = fstatat ( dirfd, name, &st, AT_SYMLINK_NOFOLLOW );
+   }
+   if ( pinst->delta && err == 0 && S_ISREG ( st.st_mode ) ){
+      /* delta restore: existing file is rewritten in place */
+      pinst->metaops++;
+      fd = openat ( dirfd, name, O_RDWR | O_NOFOLLOW );
+      if ( fd >= 0 ){
+         rwflags |= RW_DELTA;
+         pinst->dstats.files++;
+#ifdef POSIX_FADV_SEQUENTIAL
+         /* on-disk data is read ahead for comparison */
+         posix_fadvise ( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+      }
+   }
 
-   /* file creation */
-   fd = creat ( file, rp->statp.st_mode );
+   if ( fd < 0 ){
+      /* file creation, an existing file is truncated and never followed,
+       * a fifo without reader is not waited for */
+      pinst->metaops++;
+      fd = openat ( dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_NONBLOCK,
+            rp->statp.st_mode & 07777 );
+      if ( fd < 0 && ( errno == ELOOP || errno == ENXIO || errno == EISDIR ) ){
+         /* a symbolic link, fifo or directory in place of file is removed */
+         pinst->metaops += 2;
+         if ( errno == EISDIR ){
+            delta_remove_tree ( dirfd, name );
+         } else {
+            unlinkat ( dirfd, name, 0 );
+         }
+         fd = openat ( dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_NONBLOCK,
+               rp->statp.st_mode & 07777 );
+      }
+   }
+   /* restore writer is set up for database restore only, archived wal is
+    * written directly by perform_arch_write */
+   if ( fd >= 0 && pinst->mode == PGSQL_DB_RESTORE &&
+         rwriter_open ( &pinst->writer, fd, rp->statp.st_size, rwflags ) ){
+      close ( fd );
+      fd = -1;
+      errno = ENOMEM;
+   }
    if ( fd < 0 ){
       /* skasowaliśmy wcześniej ewentualny plik, więc błąd może wystąpić co
        * najwyżej ze względu na to że odtwarzamy plik na miejsce katalogu.
@@ -2190,21 +5673,24 @@ bRC perform_create_file ( bpContext *ctx, struct restore_pkt *rp, char * file ){
       rp->create_status = CF_EXTRACT;
 
       /* set file owner */
-      err = chown ( file, rp->statp.st_uid, rp->statp.st_gid );
+      err = fchown ( fd, rp->statp.st_uid, rp->statp.st_gid );
       if ( err ){
          JMSG ( ctx, M_WARNING, "chown file error: %s\n", strerror ( errno ) );
       }
 
       /* set file permissions */
-      err = chmod ( file, rp->statp.st_mode );
+      err = fchmod ( fd, rp->statp.st_mode );
       if ( err ){
          JMSG ( ctx, M_WARNING, "chmod file error: %s\n", strerror ( errno ) );
       }
 
       /* set file times */
-      ut.actime = rp->statp.st_atime;
-      ut.modtime = rp->statp.st_mtime;
-      utime ( file, &ut );
+      ts [ 0 ].tv_sec = rp->statp.st_atime;
+      ts [ 0 ].tv_nsec = 0;
+      ts [ 1 ].tv_sec = rp->statp.st_mtime;
+      ts [ 1 ].tv_nsec = 0;
+      futimens ( fd, ts );
+      pinst->metaops += 3;
 
       perform_add_filelist ( ctx, rp, file );
    }
@@ -2223,15 +5709,19 @@ bRC perform_create_file ( bpContext *ctx, struct restore_pkt *rp, char * file ){
  */
 bRC perform_create_link ( bpContext *ctx, struct restore_pkt *rp, char * file ){
 
+   pg_plug_inst * pinst;
    int err;
    bRC rc = bRC_OK;
 
    ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
 
    DMSG2 ( ctx, D3, "creating link: %s -> %s\n", file, rp->olname );
 
    /* sprawdza i ewentualnie kasuje link */
-   check_exist_rm ( file );
+   if ( unlink ( file ) && errno != ENOENT ){
+      check_exist_rm ( file );
+   }
 
    /* tworzymy do niego ścieżkę katalogów */
    makepath ( ctx, file );
@@ -2248,6 +5738,7 @@ bRC perform_create_link ( bpContext *ctx, struct restore_pkt *rp, char * file ){
    if ( err ){
       JMSG ( ctx, M_WARNING, "chown link error: %s\n", strerror ( errno ) );
    }
+   pinst->metaops += 3;
 
    /* CF_CREATED; */
    rp->create_status = CF_CREATED;
@@ -2265,22 +5756,32 @@ bRC perform_create_link ( bpContext *ctx, struct restore_pkt *rp, char * file ){
  */
 bRC perform_create_dir ( bpContext *ctx, struct restore_pkt *rp, char * file ){
 
+   pg_plug_inst * pinst;
    int err;
-   int exist = 0;
+   struct stat st;
    struct utimbuf ut;
 
    ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
 
    DMSG1 ( ctx, D3, "creating dir: %s\n", file );
 
-   /* sprawdza czy wskazywany plik istnieje. generalnie go nie kasuje, a może powinien? */
-   exist = check_exist_rm ( file );
-
-   if ( !exist ){
+   /* directories created for restored files already exist */
+   if ( ! pathset_find ( pinst->dirs, file ) ){
       makepath ( ctx, file );
+      pinst->metaops++;
       err = mkdir ( file, rp->statp.st_mode );
-      if ( err ){
+      if ( err && errno == EEXIST && lstat ( file, &st ) == 0 && ! S_ISDIR ( st.st_mode ) ){
+         /* a file in place of directory */
+         pinst->metaops += 2;
+         unlink ( file );
+         err = mkdir ( file, rp->statp.st_mode );
+      }
+      if ( err && errno != EEXIST ){
          JMSG ( ctx, M_WARNING, "creating directory error: %s\n", strerror ( errno ) );
+      } else {
+         pinst->mkdirs += err == 0;
+         pathset_add ( pinst->dirs, file );
       }
    }
    
@@ -2300,6 +5801,7 @@ bRC perform_create_dir ( bpContext *ctx, struct restore_pkt *rp, char * file ){
    ut.actime = rp->statp.st_atime;
    ut.modtime = rp->statp.st_mtime;
    utime ( file, &ut );
+   pinst->metaops += 3;
 
    rp->create_status = CF_CREATED;
 
@@ -2365,25 +5867,553 @@ bRC perform_arch_restore ( bpContext *ctx, struct restore_pkt *rp ){
    return rc;
 }
 
+/*
+ * removes duplicated and trailing slashes from a path, in place
+ */
+void normalize_path ( char * path ){
+
+   char * src;
+   char * dst;
+
+   for ( src = dst = path; *src; src++ ){
+      if ( *src == '/' && dst > path && *( dst - 1 ) == '/' ){
+         continue;
+      }
+      *dst++ = *src;
+   }
+   if ( dst > path + 1 && *( dst - 1 ) == '/' ){
+      dst--;
+   }
+   *dst = 0;
+}
+
+static int delta_path_cmp ( const void * a, const void * b ){
+
+   return strcmp ( *(const char **) a, *(const char **) b );
+}
+
+/*
+ * removes a directory tree which is not a part of restored backup,
+ * symbolic links are not followed
+ */
+int delta_remove_tree ( int dirfd, const char * name ){
+
+   DIR * dirp;
+   struct dirent * filedir;
+   struct stat st;
+   int fd;
+   int nr = 0;
+
+   fd = openat ( dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+   if ( fd >= 0 ){
+      dirp = fdopendir ( fd );
+      if ( dirp ){
+         while ( ( filedir = readdir ( dirp ) ) ){
+            if ( strcmp ( filedir->d_name, "."  ) == 0 ||
+                 strcmp ( filedir->d_name, ".." ) == 0 ){
+               continue;
+            }
+            if ( fstatat ( fd, filedir->d_name, &st, AT_SYMLINK_NOFOLLOW ) == 0 &&
+                 S_ISDIR ( st.st_mode ) ){
+               nr += delta_remove_tree ( fd, filedir->d_name );
+            } else
+            if ( unlinkat ( fd, filedir->d_name, 0 ) == 0 ){
+               nr++;
+            }
+         }
+         closedir ( dirp );
+      } else {
+         close ( fd );
+      }
+   }
+   if ( unlinkat ( dirfd, name, AT_REMOVEDIR ) == 0 ){
+      nr++;
+   }
+
+   return nr;
+}
+
+/*
+ * removes all entries of restored directories which were not restored in delta
+ * mode, so a directory content is exactly the same as in backup
+ */
+bRC perform_delta_cleanup ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   keyitem * item;
+   char ** paths;
+   char * path;
+   char * key;
+   DIR * dirp;
+   struct dirent * filedir;
+   struct stat st;
+   int n, a;
+
+   ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   if ( ! pinst->restored ){
+      return bRC_OK;
+   }
+
+   n = pinst->restored->size ();
+   paths = (char **) MALLOC ( sizeof ( char * ) * ( n + 1 ) );
+   ASSERT_p ( paths );
+   a = 0;
+   foreach_dlist ( item, pinst->restored ){
+      paths [ a++ ] = item->key;
+   }
+   qsort ( paths, n, sizeof ( char * ), delta_path_cmp );
+
+   path = MALLOC ( PATH_MAX );
+   if ( ! path ){
+      FREE ( paths );
+      return bRC_Error;
+   }
+
+   foreach_dlist ( item, pinst->restored ){
+      if ( item->attrs != PG_DIR ){
+         continue;
+      }
+      dirp = opendir ( item->key );
+      if ( ! dirp ){
+         continue;
+      }
+      while ( ( filedir = readdir ( dirp ) ) ){
+         if ( strcmp ( filedir->d_name, "."  ) == 0 ||
+              strcmp ( filedir->d_name, ".." ) == 0 ){
+            continue;
+         }
+         snprintf ( path, PATH_MAX, "%s/%s", item->key, filedir->d_name );
+         normalize_path ( path );
+         key = path;
+         if ( bsearch ( &key, paths, n, sizeof ( char * ), delta_path_cmp ) ){
+            continue;
+         }
+         DMSG1 ( ctx, D3, "delta remove: %s\n", path );
+         if ( fstatat ( dirfd ( dirp ), filedir->d_name, &st, AT_SYMLINK_NOFOLLOW ) == 0 &&
+              S_ISDIR ( st.st_mode ) ){
+            pinst->dstats.removed += delta_remove_tree ( dirfd ( dirp ), filedir->d_name );
+         } else
+         if ( unlinkat ( dirfd ( dirp ), filedir->d_name, 0 ) == 0 ){
+            pinst->dstats.removed++;
+         }
+      }
+      closedir ( dirp );
+   }
+
+   FREE ( path );
+   FREE ( paths );
+
+   return bRC_OK;
+}
+
+/*
+ * checks if entries not listed in a restored backup manifest have to be
+ * removed: in delta restore, into a destination cleaned by pgsql-restore, or
+ * when the manifest is of Incremental or Differential backup, as a restored
+ * manifest is of the last job of a restored chain and older jobs could restore
+ * files deleted since; a Full backup restored alone into not empty
+ * directories removes nothing
+ *
+ * out:
+ *    1 - cleanup required
+ *    0 - entries not in backup are kept
+ */
+int manifest_cleanup_required ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   FILE * in;
+   char * line;
+   int level = 0;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   if ( pinst->delta || pinst->restoremode == RESTOREMODE_CLEAN ){
+      return 1;
+   }
+   line = MALLOC ( PATH_MAX );
+   if ( ! line ){
+      return 0;
+   }
+   in = fopen ( pinst->manifestfile, "r" );
+   if ( in ){
+      if ( freadline ( in, line, PATH_MAX ) >= 0 ){
+         level = manifest_parse_header ( line );
+      }
+      fclose ( in );
+   }
+   FREE ( line );
+   DMSG1 ( ctx, D2, "restored manifest level: %c\n", level ? level : '-' );
+
+   return level == 'I' || level == 'D';
+}
+
+/*
+ * removes entries of restored database directories which are not listed in
+ * a restored backup manifest, e.g. files deleted between a full backup and
+ * an incremental one restored together
+ *
+ * in:
+ *    ctx - plugin context
+ * out:
+ *    number of removed entries
+ */
+int64_t perform_manifest_cleanup ( bpContext *ctx ){
+
+   pg_plug_inst * pinst;
+   keylist * dirs = NULL;
+   keyitem * item;
+   manifest_entry entry;
+   pathset * set;
+   FILE * in;
+   char * root;
+   char * line;
+   char * path;
+   char * p;
+   DIR * dirp;
+   struct dirent * filedir;
+   struct stat st;
+   int64_t nr = 0;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+
+   in = fopen ( pinst->manifestfile, "r" );
+   if ( ! in ){
+      JMSG2 ( ctx, M_WARNING, "cannot read backup manifest %s: %s\n", pinst->manifestfile, strerror ( errno ) );
+      return 0;
+   }
+   set = pathset_alloc ();
+   root = MALLOC ( PATH_MAX );
+   line = MALLOC ( PATH_MAX );
+   path = MALLOC ( PATH_MAX );
+   if ( ! set || ! root || ! line || ! path ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      fclose ( in );
+      pathset_free ( set );
+      if ( root ){
+         FREE ( root );
+      }
+      if ( line ){
+         FREE ( line );
+      }
+      return 0;
+   }
+
+   /* manifest is restored into a destination root */
+   strncpy ( root, pinst->manifestfile, PATH_MAX );
+   p = strrchr ( root, '/' );
+   if ( p ){
+      *p = 0;
+   }
+   pathset_add ( set, pinst->manifestfile );
+   while ( freadline ( in, line, PATH_MAX ) >= 0 ){
+      if ( ! manifest_parse_line ( line, &entry ) ){
+         continue;
+      }
+      snprintf ( path, PATH_MAX, "/%s/%s", root, entry.path );
+      normalize_path ( path );
+      pathset_add ( set, path );
+      if ( entry.type == 'd' ){
+         dirs = add_keylist_attr ( dirs, path, NULL, PG_DIR );
+      }
+   }
+   fclose ( in );
+
+   if ( dirs ){
+      foreach_dlist ( item, dirs ){
+         dirp = opendir ( item->key );
+         if ( ! dirp ){
+            continue;
+         }
+         while ( ( filedir = readdir ( dirp ) ) ){
+            if ( strcmp ( filedir->d_name, "."  ) == 0 ||
+                 strcmp ( filedir->d_name, ".." ) == 0 ){
+               continue;
+            }
+            snprintf ( path, PATH_MAX, "%s/%s", item->key, filedir->d_name );
+            normalize_path ( path );
+            if ( pathset_find ( set, path ) ){
+               continue;
+            }
+            DMSG1 ( ctx, D3, "manifest remove: %s\n", path );
+            if ( fstatat ( dirfd ( dirp ), filedir->d_name, &st, AT_SYMLINK_NOFOLLOW ) == 0 &&
+                 S_ISDIR ( st.st_mode ) ){
+               nr += delta_remove_tree ( dirfd ( dirp ), filedir->d_name );
+            } else
+            if ( unlinkat ( dirfd ( dirp ), filedir->d_name, 0 ) == 0 ){
+               nr++;
+            }
+         }
+         closedir ( dirp );
+      }
+      keylist_free ( dirs );
+   }
+
+   pathset_free ( set );
+   FREE ( path );
+   FREE ( line );
+   FREE ( root );
+
+   return nr;
+}
+
+/* orders restored block incremental files by a segment and a job */
+static int incr_apply_cmp ( const void * a, const void * b ){
+
+   const keyitem * ia = *(const keyitem **) a;
+   const keyitem * ib = *(const keyitem **) b;
+   int c;
+
+   c = strcmp ( ia->value, ib->value );
+   if ( c ){
+      return c;
+   }
+
+   return ia->attrs < ib->attrs ? -1 : ia->attrs > ib->attrs;
+}
+
+/*
+ * applies a single block incremental file to its relation segment: the
+ * segment is truncated as at backup, changed pages are written and a file
+ * size is set to the one at backup
+ *
+ * out:
+ *    number of written blocks, -1 on error reported as job message
+ */
+int64_t apply_incremental_file ( bpContext *ctx, keyitem * item, char * buf ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   pg_incr_header hdr;
+   uint32_t * blocks = NULL;
+   struct stat st;
+   struct stat tst;
+   int64_t written = -1;
+   uint32_t a;
+   uint32_t b;
+   uint32_t n;
+   int created;
+   int in;
+   int out = -1;
+
+   in = open ( item->key, O_RDONLY );
+   if ( in < 0 || fstat ( in, &st ) != 0 ){
+      JMSG2 ( ctx, M_ERROR, "block incremental: cannot open %s: %s\n", item->key, strerror ( errno ) );
+      if ( in >= 0 ){
+         close ( in );
+      }
+      return -1;
+   }
+   pinst->metrics.syscalls += 2;
+   if ( read ( in, &hdr, sizeof ( hdr ) ) != sizeof ( hdr ) ||
+         memcmp ( hdr.magic, PGINCRMAGIC, sizeof ( hdr.magic ) ) != 0 || hdr.blcksz != PGBLCKSZ ||
+         (int64_t) ( sizeof ( hdr ) + (int64_t) hdr.nblocks * ( sizeof ( uint32_t ) + PGBLCKSZ ) ) != (int64_t) st.st_size ){
+      JMSG ( ctx, M_ERROR, "block incremental: %s is not valid\n", item->key );
+      close ( in );
+      return -1;
+   }
+   blocks = (uint32_t *) malloc ( sizeof ( uint32_t ) * ( hdr.nblocks + 1 ) );
+   if ( ! blocks || read ( in, blocks, sizeof ( uint32_t ) * hdr.nblocks ) != (ssize_t) ( sizeof ( uint32_t ) * hdr.nblocks ) ){
+      JMSG ( ctx, M_ERROR, "block incremental: cannot read %s\n", item->key );
+      free ( blocks );
+      close ( in );
+      return -1;
+   }
+
+   created = lstat ( item->value, &tst ) != 0;
+   out = open ( item->value, O_RDWR | O_CREAT, st.st_mode & 07777 );
+   pinst->metrics.syscalls += 2;
+   if ( out < 0 ){
+      JMSG2 ( ctx, M_ERROR, "block incremental: cannot open %s: %s\n", item->value, strerror ( errno ) );
+      free ( blocks );
+      close ( in );
+      return -1;
+   }
+   if ( created && fchown ( out, st.st_uid, st.st_gid ) != 0 ){
+      DMSG2 ( ctx, D2, "block incremental: chown %s: %s\n", item->value, strerror ( errno ) );
+   }
+   if ( hdr.trunc != PGINCRNOTRUNC && ! created && tst.st_size > (off_t) hdr.trunc * PGBLCKSZ &&
+         ftruncate ( out, (off_t) hdr.trunc * PGBLCKSZ ) != 0 ){
+      goto bailout;
+   }
+   for ( a = 0; a < hdr.nblocks; a += n ){
+      n = hdr.nblocks - a < PGINCRCHUNK ? hdr.nblocks - a : PGINCRCHUNK;
+      if ( read ( in, buf, (size_t) n * PGBLCKSZ ) != (ssize_t) n * PGBLCKSZ ){
+         goto bailout;
+      }
+      for ( b = 0; b < n; b++ ){
+         if ( pwrite ( out, buf + (size_t) b * PGBLCKSZ, PGBLCKSZ, (off_t) blocks [ a + b ] * PGBLCKSZ ) != PGBLCKSZ ){
+            goto bailout;
+         }
+      }
+      pinst->metrics.syscalls += n + 1;
+   }
+   if ( ftruncate ( out, hdr.filesize ) != 0 ){
+      goto bailout;
+   }
+   written = hdr.nblocks;
+
+bailout:
+   if ( written < 0 ){
+      JMSG2 ( ctx, M_ERROR, "block incremental: cannot apply %s: %s\n", item->key, strerror ( errno ) );
+   }
+   if ( close ( out ) != 0 && written >= 0 ){
+      JMSG2 ( ctx, M_ERROR, "block incremental: cannot write %s: %s\n", item->value, strerror ( errno ) );
+      written = -1;
+   }
+   close ( in );
+   free ( blocks );
+
+   return written;
+}
+
+/*
+ * applies restored block incremental files to their relation segments in
+ * job order, then removes them; it has to be done before delta and manifest
+ * cleanups, which remove not applied files
+ *
+ * in:
+ *    ctx - plugin context
+ * out:
+ *    number of files not applied
+ */
+int apply_incremental_files ( bpContext *ctx ){
+
+   pg_plug_inst * pinst = (pg_plug_inst *)ctx->pContext;
+   keyitem ** items;
+   keyitem * item;
+   int64_t nr;
+   char * buf;
+   int errors = 0;
+   int n = 0;
+   int a;
+
+   if ( ! pinst->incrfiles ){
+      return 0;
+   }
+   foreach_dlist ( item, pinst->incrfiles ){
+      n++;
+   }
+   items = (keyitem **) malloc ( sizeof ( keyitem * ) * ( n + 1 ) );
+   buf = MALLOC ( PGINCRCHUNK * PGBLCKSZ );
+   if ( ! items || ! buf ){
+      JMSG0 ( ctx, M_ERROR, "error allocating memory." );
+      free ( items );
+      free ( buf );
+      return n;
+   }
+   n = 0;
+   foreach_dlist ( item, pinst->incrfiles ){
+      items [ n++ ] = item;
+   }
+   qsort ( items, n, sizeof ( keyitem * ), incr_apply_cmp );
+
+   for ( a = 0; a < n; a++ ){
+      nr = apply_incremental_file ( ctx, items [ a ], buf );
+      if ( nr < 0 ){
+         errors++;
+         continue;
+      }
+      unlink ( items [ a ]->key );
+      pinst->metrics.syscalls++;
+      pinst->metrics.incrfiles++;
+      pinst->metrics.incrblocks += nr;
+      if ( pinst->delta ){
+         pinst->restored = add_keylist_attr ( pinst->restored, items [ a ]->value, NULL, PG_FILE );
+      }
+   }
+   free ( items );
+   FREE ( buf );
+
+   return errors;
+}
+
+/*
+ * reads a restore mode file left by pgsql-restore in a restore destination;
+ * pgsql-restore and the plugin read DELTARESTORE from their own config files,
+ * so a mode in which pgsql-restore prepared the destination wins
+ *
+ * in:
+ *    ctx - plugin context
+ *    archdest - restore destination
+ * out:
+ *    pinst->restoremode - RESTOREMODE_NONE, RESTOREMODE_CLEAN or RESTOREMODE_DELTA
+ *    pinst->delta - delta restore mode of pgsql-restore
+ */
+void check_restore_mode ( bpContext *ctx, const char * archdest ){
+
+   pg_plug_inst * pinst;
+   FILE * in;
+   char * path;
+   int delta;
+
+   pinst = (pg_plug_inst *)ctx->pContext;
+   pinst->restoremode = RESTOREMODE_NONE;
+
+   path = MALLOC ( PATH_MAX );
+   if ( ! path ){
+      return;
+   }
+   snprintf ( path, PATH_MAX, "/%s/" PGRESTOREMODE, archdest );
+   in = fopen ( path, "r" );
+   if ( ! in ){
+      DMSG1 ( ctx, D2, "no restore mode file %s\n", path );
+      FREE ( path );
+      return;
+   }
+   if ( freadline ( in, path, PATH_MAX ) >= 0 ){
+      if ( strcmp ( path, PGRESTOREDELTA ) == 0 ){
+         pinst->restoremode = RESTOREMODE_DELTA;
+      } else
+      if ( strcmp ( path, PGRESTORECLEAN ) == 0 ){
+         pinst->restoremode = RESTOREMODE_CLEAN;
+      }
+   }
+   fclose ( in );
+   FREE ( path );
+
+   if ( pinst->restoremode == RESTOREMODE_NONE ){
+      JMSG0 ( ctx, M_WARNING, "invalid " PGRESTOREMODE " file, DELTARESTORE of plugin config is used\n" );
+      return;
+   }
+   delta = pinst->restoremode == RESTOREMODE_DELTA;
+   if ( delta != pinst->delta ){
+      JMSG ( ctx, M_WARNING, "DELTARESTORE differs from pgsql-restore, %s restore is used\n",
+            delta ? "delta" : "clean" );
+      pinst->delta = delta;
+   }
+   DMSG1 ( ctx, D2, "restore mode of pgsql-restore: %s\n", delta ? PGRESTOREDELTA : PGRESTORECLEAN );
+}
+
 /*
  * 
  */
 bRC perform_dbfile_restore ( bpContext *ctx, struct restore_pkt *rp ){
 
+   pg_plug_inst * pinst;
    char * client;
    char * filename;
    char * file;
    char * archdest;
    char * ofname;
    int out;
+   int manifest;
+   int jobid;
+   int len;
    bRC rc = bRC_OK;
 
    ASSERT_ctx_p;
+   pinst = (pg_plug_inst *)ctx->pContext;
 
    ofname = check_ofname ( rp );
 
    archdest = check_archdest ( ctx, rp, "PGDATA" );
 
+   /* a destination mode is known before the first file is created */
+   if ( pinst->restoremode == RESTOREMODE_UNKNOWN ){
+      check_restore_mode ( ctx, archdest );
+   }
+
    /* zmienną client możemy wykorzystać do weryfikacji czy odtwarzamy poprawnego klienta */
    client = MALLOC ( 64 );
    ASSERT_p ( client );
@@ -2417,11 +6447,15 @@ bRC perform_dbfile_restore ( bpContext *ctx, struct restore_pkt *rp ){
 
       /* TODO: normalizacja zmiennej file za pomocą realpath */
 
+      manifest = strcmp ( filename, PGMANIFEST ) == 0;
+
       /* zmienne pośrednie nie są już potrzebne */
       FREE ( client );
       FREE ( filename );
 
-      check_exist_rm ( file );
+      /* a path is used as a key of directory cache and delta restore list;
+       * existing entries are handled by every perform_create_* function */
+      normalize_path ( file );
 
       switch ( rp->type ) {
          case FT_REG:
@@ -2443,6 +6477,27 @@ bRC perform_dbfile_restore ( bpContext *ctx, struct restore_pkt *rp ){
             rc = bRC_Error;
       }
 
+      if ( manifest && rc == bRC_OK && ! pinst->manifestfile ){
+         /* backup manifest is used for a cleanup at restore end */
+         pinst->manifestfile = MALLOC ( strlen ( file ) + 1 );
+         ASSERT_p ( pinst->manifestfile );
+         strcpy ( pinst->manifestfile, file );
+      }
+      if ( pinst->delta && rc == bRC_OK ){
+         /* remember restored entry for delta cleanup */
+         pinst->restored = add_keylist_attr ( pinst->restored, file, NULL,
+               rp->type == FT_DIREND ? PG_DIR : PG_FILE );
+      }
+      if ( rc == bRC_OK && rp->type != FT_DIREND && ( jobid = incr_file_jobid ( file, &len ) ) ){
+         /* block incremental file is applied to its relation segment at restore end */
+         filename = MALLOC ( len + 1 );
+         ASSERT_p ( filename );
+         memcpy ( filename, file, len );
+         filename [ len ] = 0;
+         pinst->incrfiles = add_keylist_attr ( pinst->incrfiles, file, filename, jobid );
+         FREE ( filename );
+      }
+
       FREE ( file );
    }
 
@@ -2459,6 +6514,7 @@ bRC perform_dbfile_restore ( bpContext *ctx, struct restore_pkt *rp ){
 static bRC createFile ( bpContext *ctx, struct restore_pkt *rp ){
 
    pg_plug_inst * pinst;
+   double start;
    bRC rc = bRC_OK;
 
    ASSERT_ctx_p;
@@ -2470,6 +6526,7 @@ static bRC createFile ( bpContext *ctx, struct restore_pkt *rp ){
 //   DMSG4 ( PLUGIN_INFO "fname=%s lname=%s where=%s replace=%c\n",
 //         rp->ofname, rp->olname, rp->where, (char)rp->replace );
 
+   start = monotonic_time ();
    switch ( pinst->mode ){
       case PGSQL_ARCH_RESTORE:
          rc = perform_arch_restore ( ctx, rp );
@@ -2480,6 +6537,8 @@ static bRC createFile ( bpContext *ctx, struct restore_pkt *rp ){
       default:
          rc = bRC_Error;
    }
+   metrics_add ( &pinst->metrics, PH_OPEN, start );
+   pinst->metrics.files++;
 
    return rc;
 }
@@ -2489,13 +6548,34 @@ static bRC createFile ( bpContext *ctx, struct restore_pkt *rp ){
  */
 static bRC checkFile ( bpContext *ctx, char *fname ){
 
+   pg_plug_inst * pinst;
    int exist;
+   int len;
    struct stat statp;
+   char name [ PATH_MAX ];
 
    /* check input data */
    ASSERT_ctxp_RET_BRCERROR;
+   pinst = (pg_plug_inst *)ctx->pContext;
 
    DMSG1 ( ctx, D3, "checkFile for: %s\n", fname );
+   if ( pinst->mode == PGSQL_DB_BACKUP && pinst->seen ){
+      /* a file of previous backup is still in database when it is in the current
+       * file set, also when it was skipped as unchanged; block incremental
+       * files of previous jobs are valid as long as their segment exists and
+       * is not sent whole by this job */
+      if ( incr_file_jobid ( fname, &len ) ){
+         if ( ! pinst->incrmode || len >= PATH_MAX ){
+            return bRC_OK;
+         }
+         memcpy ( name, fname, len );
+         name [ len ] = 0;
+         fname = name;
+      }
+      exist = pathset_find ( pinst->seen, fname );
+      DMSG1 ( ctx, D3, "seen: %i\n", exist );
+      return exist ? bRC_Seen : bRC_OK;
+   }
    exist = stat ( fname, &statp );
    DMSG1 ( ctx, D3, "seen: %i\n", exist );
 
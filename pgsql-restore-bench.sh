@@ -0,0 +1,195 @@
+#!/bin/sh
+#
+# Copyright (c) 2013 by Inteos sp. z o.o.
+# All rights reserved. See LICENSE.Inteos for details.
+#
+# Restore orchestration benchmark for pgsql-restore. It runs pgsql-restore
+# against pgsql-fake-dir, a local stand-in for Bacula Director, and measures:
+#  - end-to-end WAL fetch latency (pgsql-restore wal) for a list of WALPREFETCH
+#    values, as PostgreSQL restore_command would do during recovery,
+#  - PITR wall time (pgsql-restore restore) when a database copy and a working
+#    PostgreSQL configuration are given.
+#
+# WAL restore mode resolves WAL location in pgsql catalog, so a catalog
+# database with pgsql-tables.sql is required. Benchmark WAL files are registered
+# there for a dedicated client name and removed at exit.
+#
+# usage: pgsql-restore-bench.sh [-n wals] [-p prefetch,list] [-l jobms] [-L cmdms]
+#                               [-r MB/s] [-d dbdir] [-W waldir] [-c pitr.conf] [-k]
+#
+# catalog connection is taken from CATDB, CATDBHOST, CATDBPORT, CATUSER and
+# CATPASSWD environment variables
+#
+
+NWALS=64
+PREFETCH="0,8,16"
+JOBLAT=200
+CMDLAT=0
+MBPS=0
+DBDIR=
+PITRWAL=
+PITRCONF=
+KEEP=no
+PORT=19101
+BINDIR=`dirname $0`
+CLIENT=pgsql-bench-$$
+WORK=/tmp/pgsql-restore-bench.$$
+
+CATDB=${CATDB:-catdb}
+CATDBHOST=${CATDBHOST:-localhost}
+CATDBPORT=${CATDBPORT:-5432}
+CATUSER=${CATUSER:-postgres}
+CATPASSWD=${CATPASSWD:-}
+
+usage ()
+{
+   echo "usage: $0 [-n wals] [-p prefetch,list] [-l jobms] [-L cmdms] [-r MB/s] [-d dbdir] [-W waldir] [-c pitr.conf] [-k]"
+   echo "   -n  number of WAL segments fetched in a run"
+   echo "   -p  comma separated list of WALPREFETCH values to test"
+   echo "   -l  fake director job start latency, -L  console command latency"
+   echo "   -r  fake director restore throughput limit"
+   echo "   -d  database files restored by PITR benchmark"
+   echo "   -W  archived WAL files replayed by PITR benchmark"
+   echo "   -c  pgsql-restore config for PITR benchmark (PGDATA, PGSTART, PGSTOP ...)"
+   echo "   -k  keep work directory"
+   exit 1
+}
+
+while getopts "n:p:l:L:r:d:W:c:k" opt
+do
+   case $opt in
+      n) NWALS=$OPTARG ;;
+      p) PREFETCH=$OPTARG ;;
+      l) JOBLAT=$OPTARG ;;
+      L) CMDLAT=$OPTARG ;;
+      r) MBPS=$OPTARG ;;
+      d) DBDIR=$OPTARG ;;
+      W) PITRWAL=$OPTARG ;;
+      c) PITRCONF=$OPTARG ;;
+      k) KEEP=yes ;;
+      *) usage ;;
+   esac
+done
+
+export PGPASSWORD=$CATPASSWD
+PSQL="psql -q -t -A -h $CATDBHOST -p $CATDBPORT -U $CATUSER $CATDB"
+
+cleanup ()
+{
+   [ -n "$FAKEDIRPID" ] && kill $FAKEDIRPID 2>/dev/null
+   $PSQL -c "delete from pgsql_archivelogs where client='$CLIENT'" >/dev/null 2>&1
+   [ "$KEEP" = "no" ] && rm -rf $WORK
+}
+trap cleanup EXIT INT TERM
+
+if ! $PSQL -c "select versionid from pgsql_version" >/dev/null
+then
+   echo "pgsql catalog $CATDB on $CATDBHOST:$CATDBPORT is not available."
+   exit 2
+fi
+
+mkdir -p $WORK/wal $WORK/restore || exit 2
+# pgsql-restore disables prefetch for a spool accessible by others
+mkdir -m 700 $WORK/spool || exit 2
+
+# timeline 1 WAL segments 000000010000000000000010 ... registered as backed up
+echo "Generating $NWALS WAL segments ..."
+i=0
+VALUES=
+while [ $i -lt $NWALS ]
+do
+   WAL=`printf "00000001%08X%08X" $(( ( i + 16 ) / 256 )) $(( ( i + 16 ) % 256 ))`
+   dd if=/dev/urandom of=$WORK/wal/$WAL bs=1048576 count=16 2>/dev/null
+   echo $WAL >> $WORK/wal.list
+   VALUES="$VALUES${VALUES:+,}('$CLIENT','$WAL',8)"
+   i=$(( i + 1 ))
+done
+$PSQL -c "insert into pgsql_archivelogs (client, filename, status) values $VALUES" >/dev/null || exit 2
+
+startfakedir ()
+{
+   [ -n "$FAKEDIRPID" ] && kill $FAKEDIRPID 2>/dev/null && sleep 1
+   $BINDIR/pgsql-fake-dir -p $PORT -n bench-dir -P bench -w $1 ${DBDIR:+-d $DBDIR} \
+      -l $JOBLAT -L $CMDLAT -r $MBPS &
+   FAKEDIRPID=$!
+   sleep 1
+}
+startfakedir $WORK/wal
+
+writeconf ()
+{
+   cat > $WORK/pgsql.conf << EOF
+CATDB = $CATDB
+CATDBHOST = $CATDBHOST
+CATDBPORT = $CATDBPORT
+CATUSER = $CATUSER
+CATPASSWD = $CATPASSWD
+ARCHCLIENT = ${2:-$CLIENT}
+DIRNAME = bench-dir
+DIRHOST = 127.0.0.1
+DIRPORT = $PORT
+DIRPASSWD = bench
+WALSPOOL = $WORK/spool
+WALPREFETCH = $1
+EOF
+}
+
+# prints avg, p50, p99 and max of latencies in seconds read from stdin
+stats ()
+{
+   sort -n | awk '{ v[NR] = $1; s += $1 } END {
+      if ( NR == 0 ) { print "no data"; exit }
+      p50 = v[int(NR * 0.50) > 0 ? int(NR * 0.50) : 1]
+      p99 = v[int(NR * 0.99) > 0 ? int(NR * 0.99) : 1]
+      printf "avg %.3fs p50 %.3fs p99 %.3fs max %.3fs", s / NR, p50, p99, v[NR] }'
+}
+
+now ()
+{
+   date +%s.%N
+}
+
+echo "WAL fetch latency, $NWALS segments, job latency ${JOBLAT}ms, command latency ${CMDLAT}ms"
+for P in `echo $PREFETCH | tr ',' ' '`
+do
+   writeconf $P
+   rm -f $WORK/spool/* $WORK/restore/* $WORK/lat.$P $WORK/log.$P
+   T0=`now`
+   for WAL in `cat $WORK/wal.list`
+   do
+      S=`now`
+      if ! $BINDIR/pgsql-restore -c $WORK/pgsql.conf -v wal $WAL $WORK/restore/$WAL >>$WORK/log.$P 2>&1
+      then
+         echo "   WALPREFETCH=$P: restore of $WAL failed"
+         break
+      fi
+      echo "`now` $S" | awk '{ printf "%.6f\n", $1 - $2 }' >> $WORK/lat.$P
+   done
+   T=`echo "\`now\` $T0" | awk '{ printf "%.3f", $1 - $2 }'`
+   printf "   WALPREFETCH=%-4s total %ss, %s\n" $P $T "`stats < $WORK/lat.$P`"
+   # a prefetch run has to serve segments from the spool, otherwise it measures single file restores
+   SERVED=`grep -c "served from prefetch spool" $WORK/log.$P`
+   if [ $P -gt 0 -a $SERVED -eq 0 ]
+   then
+      echo "   WALPREFETCH=$P: prefetch not active, see $WORK/log.$P"
+      KEEP=yes
+   fi
+done
+
+if [ -n "$DBDIR" -a -n "$PITRCONF" ]
+then
+   # PITR run uses the real PostgreSQL cluster and its catalog backup records
+   # described in a given config, director settings are replaced by benchmark ones
+   PITRCLIENT=`sed -n 's/^[[:space:]]*ARCHCLIENT[[:space:]]*=[[:space:]]*//p' $PITRCONF`
+   writeconf 16 $PITRCLIENT
+   [ -n "$PITRWAL" ] && startfakedir $PITRWAL
+   grep -v -E "^[[:space:]]*(CATDB|CATDBHOST|CATDBPORT|CATUSER|CATPASSWD|ARCHCLIENT|DIRNAME|DIRHOST|DIRPORT|DIRPASSWD|WALSPOOL|WALPREFETCH)[[:space:]]*=" \
+      $PITRCONF >> $WORK/pgsql.conf
+   echo "PITR restore of $DBDIR ..."
+   T0=`now`
+   $BINDIR/pgsql-restore -c $WORK/pgsql.conf -v restore > $WORK/pitr.log 2>&1
+   RC=$?
+   T=`echo "\`now\` $T0" | awk '{ printf "%.3f", $1 - $2 }'`
+   echo "   PITR exit code $RC, wall time ${T}s, log: $WORK/pitr.log"
+   [ $RC -ne 0 ] && KEEP=yes
+fi
@@ -30,6 +30,16 @@
    DIRHOST = <director.address>
    DIRPORT = <director.service.port>
    DIRPASSWD = <director.connection.password>
+   WALPREFETCH = <number.of.wal.segments.prefetched.on.restore>
+   WALSPOOL = <wal.prefetch.spool.directory>
+   WALSTAGE = <max.number.of.wal.segments.staged.before.recovery>
+   DIRSESSION = <yes.to.reuse.director.session>
+   DBSHARDS = <number.of.shards.of.database.backup>
+   RESTORETHREADS = <number.of.restore.worker.threads>
+   DELTARESTORE = <yes.to.restore.in.place.changed.blocks.only>
+   RESTORESYNC = <none|writebehind|syncfs>
+   PROGRESSLOG = <recovery.progress.json.lines.file|none>
+   PROGRESSINTERVAL = <seconds.between.recovery.progress.reports>
 
    and valid bacula console resource in bacula-dir.conf:
 
@@ -52,14 +62,24 @@
    Next, you have to execute pgsql-restore command:
    $ pgsql-restore -c <config.file> [-v][-t <recovery.time> | -x <recovery.xid> ] [-w <where>] restore
 
-   Arch restore:
-   $ pgsql-restore -c <config.file> [-v] wal <name.of.wal> <path.to.restore>
+   Arch restore, with -l prefetch stops at the last WAL required by a recovery target:
+   $ pgsql-restore -c <config.file> [-v][-l <last.wal>][-s <wal.spool>] wal <name.of.wal> <path.to.restore>
+
+   Backup verification, without -w a cluster in PGDATA is verified in place,
+   with -w a backup is restored into <where> unless pgsql_manifest is there already:
+   $ pgsql-restore -c <config.file> [-v][-t <recovery.time> | -x <recovery.xid> ] [-w <where>] verify
+
+   Archived WAL covering a recovery time or ending a transaction, found in a transaction
+   index saved by pgsql-archlog with WALINDEX:
+   $ pgsql-restore -c <config.file> [-v] -t <recovery.time> | -x <recovery.xid> findwal
 
    * -c = config file
    * -v = verbose
    * -t = recovery time point
    * -x = recovery transaction point
-   * -w = where database cluster restore to
+   * -w = where database cluster restore to, or where restored cluster is verified
+   * -l = the last WAL segment required by recovery target, set in restore_command
+   * -s = WAL spool directory prepared by database restore, set in restore_command
    * 
 */
 /* Recomended PostgreSQL recovery procedure we'd like to implement:
@@ -139,6 +159,7 @@ TODO:
 #include <libgen.h>
 #include <pwd.h>
 #include <grp.h>
+#include <pthread.h>
 #include "pgsqllib.h"
 #include "utils.h"
 
@@ -167,6 +188,8 @@ void inteos_info ( pgsqldata * pdata ){
 
 void print_help ( pgsqldata * pdata ){
    printf ("Usage: pgsql-restore -c <config.file> [-v] [-t <recovery.time> | -x <recovery.xid> ] [-w <where>] [-r restoreclient] restore\n" );
+   printf ("       pgsql-restore -c <config.file> [-v] [-t <recovery.time> | -x <recovery.xid> ] [-w <where>] [-r restoreclient] verify\n" );
+   printf ("       pgsql-restore -c <config.file> [-v] -t <recovery.time> | -x <recovery.xid> findwal\n" );
 }
 
 void dbconnect ( pgsqldata * pdata ){
@@ -223,6 +246,18 @@ void parse_args ( pgsqldata * pdata, int argc, char* argv[] ){
          i++;
          continue;
       }
+      if ( !strcmp ( argv[i], "-l" ) ){
+         if ( i + 1 < argc && is_wal_filename ( argv [ i + 1 ] ) ){
+            pdata->lastwal = bstrdup ( argv [ i + 1 ] );
+         }
+         i++;
+         continue;
+      }
+      if ( !strcmp ( argv[i], "-s" ) ){
+         pdata->walspool = bstrdup ( argv [ i + 1 ] );
+         i++;
+         continue;
+      }
       if ( !strcasecmp ( argv[i], "-v" ) ){
          pdata->verbose = 1;
          continue;
@@ -235,6 +270,14 @@ void parse_args ( pgsqldata * pdata, int argc, char* argv[] ){
          pdata->mode = PGSQL_ARCH_RESTORE;
          continue;
       }
+      if ( !strcasecmp ( argv[i], "verify" ) ){
+         pdata->mode = PGSQL_DB_VERIFY;
+         continue;
+      }
+      if ( !strcasecmp ( argv[i], "findwal" ) ){
+         pdata->mode = PGSQL_WAL_FIND;
+         continue;
+      }
       if ( pdata->mode == PGSQL_ARCH_RESTORE && ! pdata->walfilename ){
          pdata->walfilename = bstrdup ( argv[i] );
          continue;
@@ -246,7 +289,11 @@ void parse_args ( pgsqldata * pdata, int argc, char* argv[] ){
    }
 
    if ( pdata->mode == PGSQL_NONE ){
-      abortprg ( pdata,  2, "Operation mode [restore,wal] required!" );
+      abortprg ( pdata,  2, "Operation mode [restore,wal,verify,findwal] required!" );
+   }
+
+   if ( pdata->mode == PGSQL_WAL_FIND && pdata->pitr == PITR_CURRENT ){
+      abortprg ( pdata,  2, "Recovery time or transaction required!" );
    }
 
    if ( pdata->mode == PGSQL_ARCH_RESTORE ){
@@ -402,6 +449,7 @@ int exec_popen_process ( pgsqldata * pdata, char * command ){
    int out;
    char * execommand;
    int scnr;
+   int status;
    int exitstatus;
    const char * EXITSTATUS = " 2>&1;echo \"POPENEXITSTATUS: $?\"";
 
@@ -417,11 +465,13 @@ int exec_popen_process ( pgsqldata * pdata, char * command ){
    file = popen ( execommand, "r" );
    ASSERT_NVAL_RET_ONE ( file );
 
-   while ( ( out = freadline ( file, buf, BUFLEN ) ) > 0 ){
-      scnr = sscanf ( buf, "POPENEXITSTATUS: %d", &exitstatus );
-      if ( scnr ){
-         // printf ( "SSCANF: %i, %d\n", scnr, exitstatus );
-         break;
+   /* glibc sscanf returns EOF for an empty line, only a match counts; the
+    * output is read to the end, so the command never blocks on a full pipe */
+   exitstatus = 1;
+   while ( ( out = freadline ( file, buf, BUFLEN ) ) >= 0 ){
+      scnr = sscanf ( buf, "POPENEXITSTATUS: %d", &status );
+      if ( scnr == 1 ){
+         exitstatus = status;
       } else
       if ( pdata->verbose ){
          logprg ( LOGINFO, buf );
@@ -557,62 +607,222 @@ int shutdown_postmaster ( pgsqldata * pdata ){
    return 0;
 }
 
+/* postmaster log reader buffer size */
+#define PGLOGBUFLEN  65536
+
+/* recovery progress tracked by the log reader process */
+typedef struct _recprogress recprogress;
+struct _recprogress {
+   uint64_t firstseg;         /* first segment required by recovery */
+   uint64_t lastseg;          /* expected last segment, 0 when unknown */
+   uint64_t curseg;           /* current replay segment */
+   uint64_t lsn;              /* last redo position reported */
+   int64_t  restored;         /* segments restored by restore_command */
+   char     curwal [ WALNAMELEN + 1 ];
+   double   start;
+   double   fetchtime;        /* time spent in restore_command */
+   double   lastreport;
+   int      interval;         /* seconds between reports */
+   char     * jsonpath;       /* machine readable progress file */
+   FILE     * json;
+};
+
 /*
- * 
+ * reports a recovery progress: segments replayed, replay rate, time spent on
+ * WAL fetch versus replay and an estimated time to the recovery target; the
+ * same is appended as a JSON line to progress file
+ */
+void report_recovery_progress ( recprogress * rp, const char * state ){
+
+   char buf [ BUFLEN ];
+   double now;
+   double elapsed;
+   double replay;
+   double mbps;
+   double eta = -1;
+   double pct = -1;
+   uint64_t done;
+   uint64_t total;
+
+   now = monotonic_time ();
+   elapsed = now - rp->start;
+   rp->lastreport = now;
+
+   done = rp->curseg > rp->firstseg ? rp->curseg - rp->firstseg : 0;
+   replay = elapsed > rp->fetchtime ? elapsed - rp->fetchtime : 0;
+   mbps = elapsed > 0 ? (double) done * WALSEGSIZE / ( 1024 * 1024 ) / elapsed : 0;
+   if ( rp->lastseg >= rp->firstseg && rp->lastseg > 0 ){
+      total = rp->lastseg - rp->firstseg + 1;
+      pct = done * 100.0 / total;
+      if ( done > 0 ){
+         eta = elapsed * ( total - done ) / done;
+      }
+   }
+
+   if ( pct >= 0 ){
+      snprintf ( buf, BUFLEN, "recovery %s: %llu/%llu segments (%.1f%%), %.1f MB/s, fetch %.1fs, replay %.1fs, ETA %s%.0fs",
+            state, (unsigned long long) done, (unsigned long long) total, pct, mbps,
+            rp->fetchtime, replay, eta < 0 ? "unknown " : "", eta < 0 ? 0.0 : eta );
+   } else {
+      snprintf ( buf, BUFLEN, "recovery %s: %llu segments, %.1f MB/s, fetch %.1fs, replay %.1fs",
+            state, (unsigned long long) done, mbps, rp->fetchtime, replay );
+   }
+   logprg ( LOGINFO, buf );
+
+   if ( rp->json ){
+      fprintf ( rp->json, "{\"time\":%ld,\"state\":\"%s\",\"wal\":\"%s\",\"lsn\":\"%X/%X\","
+            "\"segments\":%llu,\"total\":%llu,\"restored\":%lld,\"percent\":%.1f,"
+            "\"mbps\":%.1f,\"elapsed\":%.3f,\"fetch\":%.3f,\"replay\":%.3f,\"eta\":%.0f}\n",
+            (long) time ( NULL ), state, rp->curwal,
+            (unsigned int) ( rp->lsn >> 32 ), (unsigned int) rp->lsn,
+            (unsigned long long) done, (unsigned long long) ( pct >= 0 ? total : 0 ),
+            (long long) rp->restored, pct, mbps, elapsed, rp->fetchtime, replay, eta );
+      fflush ( rp->json );
+   }
+}
+
+/*
+ * updates a recovery progress with an event found in postmaster log
+ */
+void update_recovery_progress ( recprogress * rp, pglogevent * ev ){
+
+   uint64_t segno;
+
+   switch ( ev->type ){
+      case PGLOG_RESTORED:
+         rp->restored++;
+         if ( ! wal_segment_number ( ev->walname, &segno ) && segno > rp->curseg ){
+            /* a segment is restored when the previous one is replayed */
+            rp->curseg = segno;
+            strncpy ( rp->curwal, ev->walname, WALNAMELEN + 1 );
+         }
+         break;
+      case PGLOG_WAL_FETCH:
+         rp->fetchtime += ev->fetchtime;
+         break;
+      case PGLOG_REDO_START:
+      case PGLOG_REDO_PROGRESS:
+      case PGLOG_REDO_DONE:
+         rp->lsn = ev->lsn;
+         segno = ev->lsn / WALSEGSIZE;
+         if ( segno > rp->curseg ){
+            rp->curseg = segno;
+         }
+         break;
+      default:
+         break;
+   }
+
+   if ( rp->interval > 0 && monotonic_time () - rp->lastreport >= rp->interval ){
+      report_recovery_progress ( rp, "progress" );
+   }
+}
+
+/*
+ * reads a postmaster log from fifo and informs recovery controller about
+ * recovery completion, shutdown and errors; lines are read with a buffered
+ * line reader and matched in a single pass as recovery could log a lot
  */
-void read_log_handler ( pgsqldata * pdata, const int msqid, const char * pgctlfifo ){
+void read_log_handler ( pgsqldata * pdata, const int msqid, const char * pgctlfifo, recprogress * rp ){
 
    int fdfifo;
-   char * buffifo;
-   char * str;
-   int outfifo;
+   int fd;
+   int wait;
+   linereader * lr;
+   char * line;
+   int len;
+   pglogevent ev;
 
    /* read log handler */
    fdfifo = open ( pgctlfifo, O_RDONLY ); 
-//   printf ( "open fifo\n" );
+   if ( fdfifo < 0 ){
+      logprg ( LOGERROR, "cant open postmaster log fifo" );
+      pgsql_msg_send ( pdata, msqid, 2, "E. ERROR" );
+      return;
+   }
 
-   /* buffifo as a postmaster log output buffer */
-   buffifo = MALLOC ( BUFLEN );
+   /* postmaster log output buffer */
+   lr = linereader_alloc ( fdfifo, PGLOGBUFLEN );
+   if ( ! lr ){
+      close ( fdfifo );
+      return;
+   }
 
-   while ( ( outfifo = readline ( fdfifo, buffifo, BUFLEN ) ) > 0 ){
-      if ( pdata->verbose ) {
-         printf ( "%s\n", buffifo );
+   rp->start = rp->lastreport = monotonic_time ();
+   if ( rp->jsonpath ){
+      /* opened as pgcluster owner, an existing symbolic link is never followed */
+      fd = open ( rp->jsonpath, O_WRONLY | O_CREAT | O_APPEND | O_NOFOLLOW, S_IRUSR | S_IWUSR );
+      if ( fd >= 0 ){
+         rp->json = fdopen ( fd, "a" );
+         if ( ! rp->json ){
+            close ( fd );
+         }
+      }
+      if ( ! rp->json ){
+         logprg ( LOGWARNING, "cant open recovery progress file" );
+      }
+   }
+
+   for (;;){
+      if ( rp->interval > 0 ){
+         /* periodic reports when postmaster logs nothing for a long time */
+         wait = ( rp->lastreport + rp->interval - monotonic_time () ) * 1000;
+         if ( wait <= 0 || ! linereader_wait ( lr, wait ) ){
+            report_recovery_progress ( rp, "progress" );
+            continue;
+         }
       }
-      /* search for archive recovery completed */
-      str = strstr ( buffifo, "LOG:  archive recovery complete" );
-      if ( str ){
-         logprg ( LOGINFO, "RECOVERY COMPLETED!!!" );
-         pgsql_msg_send ( pdata, msqid, 2, "R. Recovery Completed" );
+      line = linereader_next ( lr, &len );
+      if ( ! line ){
+         break;
       }
-      /* search for database shutdown completed */
-      str = strstr ( buffifo, "LOG:  database system is shut down" );
-      if ( str ){
-         logprg ( LOGINFO, "Shutdown COMPLETED!!!" );
-         pgsql_msg_send ( pdata, msqid, 2, "S. Shutdown" );
+      if ( pdata->verbose ) {
+         printf ( "%s\n", line );
       }
-      /* search for any error */
-      str = strstr ( buffifo, "FATAL:  " );
-      //str = strstr ( buffifo, "postgres cannot access" );
-      if ( str ){
-         logprg ( LOGINFO, "ERROR!!!" );
-         pgsql_msg_send ( pdata, msqid, 2, "E. ERROR" );
+      switch ( parse_pglog_line ( line, len, &ev ) ){
+         case PGLOG_RECOVERY_COMPLETE:
+            report_recovery_progress ( rp, "complete" );
+            logprg ( LOGINFO, "RECOVERY COMPLETED!!!" );
+            pgsql_msg_send ( pdata, msqid, 2, "R. Recovery Completed" );
+            break;
+         case PGLOG_SHUTDOWN:
+            logprg ( LOGINFO, "Shutdown COMPLETED!!!" );
+            pgsql_msg_send ( pdata, msqid, 2, "S. Shutdown" );
+            break;
+         case PGLOG_FATAL:
+            logprg ( LOGINFO, "ERROR!!!" );
+            pgsql_msg_send ( pdata, msqid, 2, "E. ERROR" );
+            break;
+         case PGLOG_NONE:
+            break;
+         default:
+            /* restored WAL files and redo position are used for progress only */
+            update_recovery_progress ( rp, &ev );
+            break;
       }
    }
+   if ( rp->json ){
+      fclose ( rp->json );
+   }
+   linereader_free ( lr );
    close ( fdfifo );
-   FREE ( buffifo );
 }
 
+int set_user_groups ( const pgugid * pgid );
+
 /*
  * input:
  *    pdata - primary data
+ *    pgid - uid/gid the log handler runs as
  *    msqid - message queue id
  *    pgctlfifo - name of log handler fifo
  * output:
  *    pid - forked process pid
  */
-int start_read_log_handler ( pgsqldata * pdata, const int msqid, const char * pgctlfifo ){
+int start_read_log_handler ( pgsqldata * pdata, pgugid * pgid, const int msqid, const char * pgctlfifo, recprogress * rp ){
 
    int pid;
+   int err;
 
    pid = fork ();
    if ( pid == 0 ){
@@ -620,11 +830,16 @@ int start_read_log_handler ( pgsqldata * pdata, const int msqid, const char * pg
       /* sleep used for debuging forked process in gdb */
       //sleep ( 60 );
 
+      /* switch to pgcluster owner (postgres), the fifo and progress file
+       * are accessed without root privileges */
+      err = set_user_groups ( pgid );
+      ASSERT_VAL_EXIT_ONE ( err );
+
       /* sync with other process */
       pgsql_msg_send ( pdata, msqid, 1, "A. log handler ready" );
 
       /* read log handler */
-      read_log_handler ( pdata, msqid, pgctlfifo );
+      read_log_handler ( pdata, msqid, pgctlfifo, rp );
       
       /* finish forked process */
       exit ( 0 );
@@ -797,6 +1012,8 @@ int perform_postmaster_startup_recovery ( pgsqldata * pdata, pgugid * pgid, cons
    return exitstatus;
 }
 
+int init_recovery_progress ( pgsqldata * pdata, recprogress * rp );
+
 /*
  * startup a PostgreSQL instance pointed by PGDATA
  */
@@ -809,6 +1026,7 @@ int startup_postmaster ( pgsqldata * pdata ){
    int pidfifo;
    int exitstatus;
    pgugid pgid;
+   recprogress rp;
 
    ASSERT_NVAL_RET_ONE ( pdata );
    logprg ( LOGINFO, "RECOVERY START!!!" );
@@ -839,8 +1057,11 @@ int startup_postmaster ( pgsqldata * pdata ){
    /* message queue id */
    msqid = pgsql_msg_init ( pdata, 'R' );
 
+   /* a WAL range to replay is known before postmaster removes backup_label */
+   init_recovery_progress ( pdata, &rp );
+
    /* run a read log handler */
-   pidfifo = start_read_log_handler ( pdata, msqid, pgctlfifo );
+   pidfifo = start_read_log_handler ( pdata, &pgid, msqid, pgctlfifo, &rp );
 
    /* execute pg_ctl */
    err = perform_postmaster_startup_recovery ( pdata, &pgid, msqid, pgctlfifo );
@@ -849,6 +1070,7 @@ int startup_postmaster ( pgsqldata * pdata ){
 //   printf ( "EXITSTATUS: %i\n", exitstatus );
 
    pgsql_msg_shutdown ( pdata, msqid );
+   FREE ( rp.jsonpath );
 
    if ( err ) {
       logprg ( LOGERROR, "Recovery failed" );
@@ -860,8 +1082,108 @@ int startup_postmaster ( pgsqldata * pdata ){
    return err;
 }
 
+/* interval in seconds between removal progress reports */
+#define RMREPORTINTERVAL   5
+/* maximum number of different filesystems synced after restore */
+#define SYNCFSMAX          64
+
+/* unarchived WAL files copy state shared by copy threads */
+typedef struct _walcopy walcopy;
+struct _walcopy {
+   pgsqldata * pdata;
+   const char * xlogdir;
+   char ** files;
+   int * status;
+};
+
 /*
- *
+ * copies a single unarchived WAL file into ARCHDEST, used by copy threads
+ */
+int copy_unarchived_wal_task ( void * arg, int item ){
+
+   walcopy * wc = (walcopy *) arg;
+   char src [ PATH_MAX ];
+   char dst [ PATH_MAX ];
+   int err;
+
+   snprintf ( src, PATH_MAX, "%s/%s", wc->xlogdir, wc->files [ item ] );
+   snprintf ( dst, PATH_MAX, "%s/%s", search_key ( wc->pdata->paramlist, "ARCHDEST" ), wc->files [ item ] );
+
+   err = _copy_wal_file ( wc->pdata, src, dst );
+   wc->status [ item ] = err ? PGSQL_STATUS_WAL_ARCH_FAILED : PGSQL_STATUS_WAL_ARCH_FINISH;
+
+   return err;
+}
+
+/*
+ * executes a simple sql command, used for transaction control
+ */
+int catdb_command ( pgsqldata * pdata, const char * sql ){
+
+   PGresult * result;
+   int err;
+
+   result = PQexec ( pdata->catdb, sql );
+   err = PQresultStatus ( result ) != PGRES_COMMAND_OK;
+   PQclear ( result );
+
+   return err;
+}
+
+/*
+ * builds a postgresql array literal {"a","b","c"} from a list of strings,
+ * every element is quoted, so any string is passed as a single element
+ */
+char * build_array_literal ( char ** files, int nfiles ){
+
+   char * array;
+   char * c;
+   int len = 3;
+   int pos;
+   int a;
+
+   for ( a = 0; a < nfiles; a++ ){
+      len += 2 * strlen ( files [ a ] ) + 3;
+   }
+   array = MALLOC ( len );
+   ASSERT_NVAL_RET_NULL ( array );
+
+   pos = 0;
+   array [ pos++ ] = '{';
+   for ( a = 0; a < nfiles; a++ ){
+      if ( a ){
+         array [ pos++ ] = ',';
+      }
+      array [ pos++ ] = '"';
+      for ( c = files [ a ]; *c; c++ ){
+         if ( *c == '"' || *c == '\\' ){
+            array [ pos++ ] = '\\';
+         }
+         array [ pos++ ] = *c;
+      }
+      array [ pos++ ] = '"';
+   }
+   array [ pos++ ] = '}';
+   array [ pos ] = 0;
+
+   return array;
+}
+
+/*
+ * compares file names for qsort, in the same order as a catalog "C" collation
+ */
+int file_name_cmp ( const void * a, const void * b ){
+
+   return strcmp ( *(char * const *) a, *(char * const *) b );
+}
+
+/*
+ * copies WAL files from pg_xlog which were not archived before the system went down,
+ * it works in phases:
+ *    1. pg_xlog scan
+ *    2. a single catalog query for all found files
+ *    3. parallel copy of unarchived files into ARCHDEST
+ *    4. catalog statuses update in a single transaction
  */
 int copy_unarchived_wals ( pgsqldata * pdata ){
 
@@ -869,16 +1191,29 @@ int copy_unarchived_wals ( pgsqldata * pdata ){
    struct dirent * filedir;
    char * path;
    char * file;
-   char * dst;
+   char * array;
+   char ** files = NULL;
+   char ** missing;
+   int * status;
+   int nfiles = 0, nalloc = 0;
+   int nmissing = 0, nfailed;
    struct stat st;
    PGresult * result;
+   const char * params [ 3 ];
    char * sql;
-   int err;
+   int pos, len;
+   int a, b, n;
+   int cmp = 0;
+   double t0, t1, t2, t3, t4;
+   walcopy wc;
 
    dbconnect ( pdata );
 
    path = MALLOC ( PATH_MAX );
-   if ( ! path ){
+   file = MALLOC ( PATH_MAX );
+   if ( ! path || ! file ){
+      FREE ( path );
+      FREE ( file );
       logprg ( LOGERROR, "out of memeory!" );
       return 1;
    }
@@ -887,107 +1222,171 @@ int copy_unarchived_wals ( pgsqldata * pdata ){
             pdata->where ? pdata->where :
             search_key ( pdata->paramlist, "PGDATA" ) );
 
+   /* phase 1: pg_xlog scan */
+   t0 = monotonic_time ();
    dirp = opendir ( path );
    if ( dirp ){
-      /* katalog pg_xlog istnieje, sprawdzmy czy są tam jakieś pliki do
-       * archiwizacji */
-      if ( pdata->verbose ){
-         logprg ( LOGINFO, "copying unarchived wal logs" );
-      }
-      
-      file = MALLOC ( PATH_MAX );
-      if ( ! file ){
-         FREE ( path );
-         logprg ( LOGERROR, "out of memeory!" );
-         return 1;
-      }
-
-      dst = MALLOC ( PATH_MAX );
-      if ( ! dst ){
-         FREE ( path );
-         FREE ( file );
-         logprg ( LOGERROR, "out of memeory!" );
-         return 1;
-      }
-
-      sql = MALLOC ( SQLLEN );
-      if ( ! sql ){
-         FREE ( path );
-         FREE ( file );
-         FREE ( dst );
-         logprg ( LOGERROR, "out of memeory!" );
-         return 1;
-      }
-
       while ( (filedir = readdir ( dirp )) ){
-         if ( strcmp ( filedir->d_name, "."  ) != 0 &&
-              strcmp ( filedir->d_name, ".." ) != 0 ){
-            /* building a name to check */
-            snprintf ( file, PATH_MAX, "%s/%s", path, filedir->d_name );
-
-            if ( stat ( file, &st ) == 0 && S_ISREG ( st.st_mode ) ){
-               /* in pg_xlog directory has at least one file, we assume that it is a
-                * wal file nd we would like to copy it, but we have to check if it was
-                * previously archived
-                * TODO: archived wal means status in (1,3,6),
-                * PGSQL_STATUS_WAL_OK
-                * others means error or unfinished archiving */
-               snprintf ( sql, SQLLEN,
-                     "select status from pgsql_archivelogs where client='%s' and \
-                      filename='%s' and status in (%s)",
-                     search_key ( pdata->paramlist, "ARCHCLIENT" ),
-                     filedir->d_name,
-                     PGSQL_STATUS_WAL_OK );
-
-               result = PQexec ( pdata->catdb, sql );
-               if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
-                  abortprg ( pdata, 6, "SQL Exec error!" );
-               }
-
-               if ( PQntuples ( result ) ){
-                  /* file was previous archived -> ignoring */
-                  continue;
-               }
-
-               /* insert status in catalog */
-               snprintf ( sql, SQLLEN,
-                     "insert into pgsql_archivelogs (client, filename, status) \
-                     values ('%s', '%s', '%i')",
-                     search_key ( pdata->paramlist, "ARCHCLIENT" ),
-                     filedir->d_name, PGSQL_STATUS_WAL_ARCH_START );
+         /* only WAL segments are archived, a partial or history file and
+          * a foreign file are left in place */
+         if ( ! is_wal_filename ( filedir->d_name ) ){
+            continue;
+         }
+         /* building a name to check */
+         snprintf ( file, PATH_MAX, "%s/%s", path, filedir->d_name );
+         if ( stat ( file, &st ) != 0 || ! S_ISREG ( st.st_mode ) ){
+            continue;
+         }
+         if ( nfiles == nalloc ){
+            nalloc = nalloc ? nalloc * 2 : 64;
+            files = (char **) realloc ( files, sizeof ( char * ) * nalloc );
+            if ( ! files ){
+               closedir ( dirp );
+               FREE ( path );
+               FREE ( file );
+               logprg ( LOGERROR, "out of memeory!" );
+               return 1;
+            }
+         }
+         files [ nfiles++ ] = bstrdup ( filedir->d_name );
+      }
+      closedir ( dirp );
+   }
+   FREE ( file );
 
-               result = PQexec ( pdata->catdb, sql );
-               if ( PQresultStatus ( result ) != PGRES_COMMAND_OK ){
-                  abortprg ( pdata, 6, "SQL Exec error!" );
-               }
+   if ( ! nfiles ){
+      /* pg_xlog not found or empty, nothing to do */
+      FREE ( path );
+      FREE ( files );
+      PQfinish ( pdata->catdb );
+      pdata->catdb = NULL;
+      return 0;
+   }
 
-               /* budujemy nazwę miejsca docelowego kopiowanego pliku */
-               snprintf ( dst, PATH_MAX, "%s/%s", search_key ( pdata->paramlist, "ARCHDEST" ), filedir->d_name );
+   if ( pdata->verbose ){
+      logprg ( LOGINFO, "copying unarchived wal logs" );
+   }
 
-               /* perform a wal copy */
-               err = _copy_wal_file ( pdata, file, dst );
+   /* phase 2: a single catalog query for all files, archived wal means status in
+    * PGSQL_STATUS_WAL_OK, others means error or unfinished archiving */
+   t1 = monotonic_time ();
+   array = build_array_literal ( files, nfiles );
+   sql = MALLOC ( SQLLEN );
+   if ( ! array || ! sql ){
+      abortprg ( pdata, 6, "out of memory!" );
+   }
+   snprintf ( sql, SQLLEN,
+         "select distinct filename collate \"C\" as filename from pgsql_archivelogs where client=$1 "
+         "and filename = any($2::varchar[]) and status in (%s) order by 1",
+         PGSQL_STATUS_WAL_OK );
+   params [ 0 ] = search_key ( pdata->paramlist, "ARCHCLIENT" );
+   params [ 1 ] = array;
+
+   result = PQexecParams ( pdata->catdb, sql, 2, NULL, params, NULL, NULL, 0 );
+   FREE ( sql );
+   FREE ( array );
+   if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
+      abortprg ( pdata, 6, "SQL Exec error!" );
+   }
 
-               /* update status in catalog */
-               snprintf ( sql, SQLLEN,
-                     "update pgsql_archivelogs set status='%i' where client='%s' and filename='%s'",
-                     /* if err != 0 then copy was unsuccesfull */
-                     err ? PGSQL_STATUS_WAL_ARCH_FAILED : PGSQL_STATUS_WAL_ARCH_FINISH, 
-                     search_key ( pdata->paramlist, "ARCHCLIENT" ),
-                     filedir->d_name );
+   missing = (char **) malloc ( sizeof ( char * ) * nfiles );
+   status = (int *) malloc ( sizeof ( int ) * nfiles );
+   if ( ! missing || ! status ){
+      abortprg ( pdata, 6, "out of memory!" );
+   }
+   /* both lists are sorted, so archived files are found in a single merge pass */
+   qsort ( files, nfiles, sizeof ( char * ), file_name_cmp );
+   n = PQntuples ( result );
+   for ( a = 0, b = 0; a < nfiles; a++ ){
+      while ( b < n && ( cmp = strcmp ( PQgetvalue ( result, b, 0 ), files [ a ] ) ) < 0 ){
+         b++;
+      }
+      if ( b < n && cmp == 0 ){
+         /* file was previous archived -> ignoring */
+         continue;
+      }
+      missing [ nmissing++ ] = files [ a ];
+   }
+   PQclear ( result );
+
+   /* phase 3: parallel copy into ARCHDEST */
+   t2 = monotonic_time ();
+   wc.pdata = pdata;
+   wc.xlogdir = path;
+   wc.files = missing;
+   wc.status = status;
+   nfailed = pgsql_run_parallel ( get_restore_threads ( pdata->paramlist ), nmissing,
+         copy_unarchived_wal_task, &wc );
+
+   /* phase 4: catalog update in a single transaction, rows of previously failed
+    * archiving are replaced */
+   t3 = monotonic_time ();
+   if ( nmissing ){
+      array = build_array_literal ( missing, nmissing );
+      len = nmissing * 12 + 3;
+      sql = MALLOC ( len );
+      if ( ! array || ! sql ){
+         abortprg ( pdata, 6, "out of memory!" );
+      }
+      /* statuses as an integer array literal */
+      pos = snprintf ( sql, len, "{" );
+      for ( a = 0; a < nmissing; a++ ){
+         pos += snprintf ( sql + pos, len - pos, a ? ",%i" : "%i", status [ a ] );
+      }
+      snprintf ( sql + pos, len - pos, "}" );
 
-               result = PQexec ( pdata->catdb, sql );
-               if ( PQresultStatus ( result ) != PGRES_COMMAND_OK ){
-                  abortprg ( pdata, 6, "SQL Exec error!" );
-               }
+      if ( catdb_command ( pdata, "begin" ) ){
+         abortprg ( pdata, 6, "SQL Exec error!" );
+      }
 
-            }
-         }
+      params [ 1 ] = array;
+      params [ 2 ] = sql;
+      result = PQexecParams ( pdata->catdb,
+            "delete from pgsql_archivelogs where client=$1 and filename = any($2::varchar[])",
+            2, NULL, params, NULL, NULL, 0 );
+      if ( PQresultStatus ( result ) != PGRES_COMMAND_OK ){
+         abortprg ( pdata, 6, "SQL Exec error!" );
       }
+      PQclear ( result );
+
+      result = PQexecParams ( pdata->catdb,
+            "insert into pgsql_archivelogs (client, filename, status) select $1, ($2::varchar[])[i], "
+            "($3::integer[])[i] from generate_subscripts($2::varchar[], 1) i",
+            3, NULL, params, NULL, NULL, 0 );
+      if ( PQresultStatus ( result ) != PGRES_COMMAND_OK || catdb_command ( pdata, "commit" ) ){
+         abortprg ( pdata, 6, "SQL Exec error!" );
+      }
+      PQclear ( result );
+      FREE ( array );
       FREE ( sql );
-      FREE ( path );
-      FREE ( file );
-      closedir ( dirp );
    }
+   t4 = monotonic_time ();
+
+   if ( nfailed ){
+      logprg ( LOGWARNING, "some unarchived wal files could not be copied" );
+   }
+   if ( pdata->verbose ){
+      file = MALLOC ( BUFLEN );
+      if ( file ){
+         snprintf ( file, BUFLEN, "pg_xlog scan: %i files in %.3fs", nfiles, t1 - t0 );
+         logprg ( LOGINFO, file );
+         snprintf ( file, BUFLEN, "catalog check: %i unarchived in %.3fs", nmissing, t2 - t1 );
+         logprg ( LOGINFO, file );
+         snprintf ( file, BUFLEN, "wal copy: %i copied, %i failed in %.3fs", nmissing - nfailed, nfailed, t3 - t2 );
+         logprg ( LOGINFO, file );
+         snprintf ( file, BUFLEN, "catalog update: %i rows in %.3fs", nmissing, t4 - t3 );
+         logprg ( LOGINFO, file );
+         FREE ( file );
+      }
+   }
+
+   for ( a = 0; a < nfiles; a++ ){
+      FREE ( files [ a ] );
+   }
+   FREE ( files );
+   FREE ( missing );
+   FREE ( status );
+   FREE ( path );
 
    /* XXX: czy napewno musimy zamykać połączenie do bazy danych? */
    PQfinish ( pdata->catdb );
@@ -996,126 +1395,469 @@ int copy_unarchived_wals ( pgsqldata * pdata ){
    return 0;
 }
 
-/* funkcja rekursywnie kasująca katalog wraz z zawartością */
-int remove_dir ( pgsqldata * pdata, char * dir ){
+/* removal statistics shared by removal threads */
+typedef struct _rmstats rmstats;
+struct _rmstats {
+   pthread_mutex_t mutex;
+   long files;
+   long dirs;
+   long errors;
+   int tasksdone;
+   int ntasks;
+   double start;
+   double lastreport;
+   int verbose;
+};
+
+/*
+ * removes all content of a directory referenced by dirfd, the directory is
+ * read with fdopendir and entries are removed relative to its fd, so no paths
+ * are built; entry type comes from d_type, fstatat is used for file systems
+ * without d_type support; symbolic links are never followed, just removed
+ *
+ * in:
+ *    dirfd - opened directory, it is closed by this function
+ *    st - removal statistics
+ * out:
+ *    0 - on success
+ *    1 - when any entry could not be removed
+ */
+int remove_dir_content_fd ( int dirfd, rmstats * st ){
 
    DIR * dirp;
    struct dirent * filedir;
-   char * file;
-   struct stat st;
-//   int err;
+   struct stat fst;
+   int isdir;
+   int fd;
    int ret = 0;
+   long files = 0, dirs = 0, errors = 0;
 
-   /* jeśli nazw katalogu jest pusta (NULL) to nie zajmujemy się nią */
-   if ( dir ){
-      dirp = opendir ( dir );
-      if ( dirp ){
-         file = MALLOC ( PATH_MAX );
-         if ( ! file ){
-            logprg ( LOGERROR, "out of memeory!" );
-            return 1;
+   dirp = fdopendir ( dirfd );
+   if ( ! dirp ){
+      close ( dirfd );
+      return 1;
+   }
+
+   while ( ( filedir = readdir ( dirp ) ) ){
+      if ( strcmp ( filedir->d_name, "."  ) == 0 ||
+           strcmp ( filedir->d_name, ".." ) == 0 ){
+         continue;
+      }
+#ifdef DT_DIR
+      if ( filedir->d_type != DT_UNKNOWN ){
+         isdir = filedir->d_type == DT_DIR;
+      } else
+#endif
+      {
+         if ( fstatat ( dirfd, filedir->d_name, &fst, AT_SYMLINK_NOFOLLOW ) ){
+            errors++;
+            continue;
          }
-         while ( ( filedir = readdir ( dirp ) ) ){
-            if ( strcmp ( filedir->d_name, "."  ) != 0 &&
-                 strcmp ( filedir->d_name, ".." ) != 0 ){
-   
-               /* budujemy nazwę do zbadania */
-               snprintf ( file, PATH_MAX, "%s/%s", dir, filedir->d_name );
-   
-               stat ( file, &st );
-               if ( S_ISDIR ( st.st_mode ) ){
-                  ret = remove_dir ( pdata, file );
-               } else {
-                  unlink ( file );
-               }
-            }
+         isdir = S_ISDIR ( fst.st_mode );
+      }
+
+      if ( isdir ){
+         fd = openat ( dirfd, filedir->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+         if ( fd < 0 || remove_dir_content_fd ( fd, st ) ){
+            ret = 1;
          }
-         closedir ( dirp );
-         FREE ( file );
-         rmdir ( dir );
+         if ( unlinkat ( dirfd, filedir->d_name, AT_REMOVEDIR ) ){
+            errors++;
+         } else {
+            dirs++;
+         }
+      } else {
+         if ( unlinkat ( dirfd, filedir->d_name, 0 ) ){
+            errors++;
+         } else {
+            files++;
+         }
+      }
+   }
+   closedir ( dirp );
+
+   if ( st ){
+      pthread_mutex_lock ( &st->mutex );
+      st->files += files;
+      st->dirs += dirs;
+      st->errors += errors;
+      pthread_mutex_unlock ( &st->mutex );
+   }
+
+   return ret || errors ? 1 : 0;
+}
+
+/*
+ * removes a directory with all its content, symbolic link is removed without
+ * following it
+ */
+int remove_dir_tree ( const char * dir, rmstats * st ){
+
+   int fd;
+   int ret;
+
+   fd = open ( dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+   if ( fd < 0 ){
+      if ( errno == ENOENT ){
+         return 0;
+      }
+      if ( errno == ELOOP || errno == ENOTDIR ){
+         /* not a directory, just remove it */
+         return unlink ( dir ) ? 1 : 0;
       }
+      return 1;
+   }
+
+   ret = remove_dir_content_fd ( fd, st );
+   if ( rmdir ( dir ) ){
+      ret = 1;
    }
+
    return ret;
 }
 
-int remove_pgdata_cluster ( pgsqldata * pdata ){
+/*
+ * removes all content of a cluster or tablespace root directory, the root
+ * itself is kept, it could be a mount point
+ */
+int remove_root_content ( const char * dir, rmstats * st ){
+
+   int fd;
 
-   if ( pdata->verbose ){
-      logprg ( LOGINFO, "remove old pgdata cluster" );
+   fd = open ( dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW );
+   if ( fd < 0 ){
+      return errno == ENOENT ? 0 : 1;
    }
-   return remove_dir ( pdata, pdata->where ? 
-               pdata->where : search_key ( pdata->paramlist, "PGDATA" ) );
+
+   return remove_dir_content_fd ( fd, st );
 }
 
-int remove_pgdata_tablespaces ( pgsqldata * pdata ){
+/* funkcja rekursywnie kasująca katalog wraz z zawartością */
+int remove_dir ( pgsqldata * pdata, char * dir ){
 
-   DIR * dirp;
-   struct dirent * filedir;
-   char * file;
-   char * path;
-   char * link;
-   int dl;
-   int ret = 0;
-   
-   path = MALLOC ( PATH_MAX );
-   if ( ! path ){
-      logprg ( LOGERROR, "out of memeory!" );
-      return 1;
+   /* jeśli nazw katalogu jest pusta (NULL) to nie zajmujemy się nią */
+   if ( ! dir ){
+      return 0;
    }
 
-   snprintf ( path, PATH_MAX, "%s/%s",
-            pdata->where ? pdata->where :
-            search_key ( pdata->paramlist, "PGDATA" ),
-            "pg_tblspc" );
+   return remove_dir_tree ( dir, NULL );
+}
 
+/* removal tasks state for removal threads */
+typedef struct _rmtasks rmtasks;
+struct _rmtasks {
+   keylist * list;
+   keyitem ** items;
+   rmstats stats;
+};
+
+/*
+ * removes a single directory tree, used by removal threads
+ */
+int remove_dir_task ( void * arg, int item ){
+
+   rmtasks * rt = (rmtasks *) arg;
+   rmstats * st = &rt->stats;
+   char buf [ BUFLEN ];
+   double now;
+   int err;
+
+   err = remove_dir_tree ( rt->items [ item ]->key, st );
+
+   pthread_mutex_lock ( &st->mutex );
+   st->tasksdone++;
+   now = monotonic_time ();
+   if ( st->verbose && ( now - st->lastreport >= RMREPORTINTERVAL || st->tasksdone == st->ntasks ) ){
+      st->lastreport = now;
+      snprintf ( buf, BUFLEN, "removed %i/%i directories: %li files, %li dirs, %.0f files/s",
+            st->tasksdone, st->ntasks, st->files, st->dirs,
+            now > st->start ? st->files / ( now - st->start ) : 0.0 );
+      logprg ( LOGINFO, buf );
+   }
+   pthread_mutex_unlock ( &st->mutex );
+
+   return err;
+}
+
+/*
+ * adds all subdirectories of a supplied directory into removal task list,
+ * every database directory is a separate task
+ */
+keylist * add_remove_tasks ( keylist * list, const char * dir, int depth ){
+
+   DIR * dirp;
+   struct dirent * filedir;
+   struct stat st;
+   char * path;
+
+   dirp = opendir ( dir );
+   ASSERT_NVAL_RET_V ( dirp, list );
+
+   path = MALLOC ( PATH_MAX );
+   while ( path && ( filedir = readdir ( dirp ) ) ){
+      if ( strcmp ( filedir->d_name, "."  ) == 0 ||
+           strcmp ( filedir->d_name, ".." ) == 0 ){
+         continue;
+      }
+      snprintf ( path, PATH_MAX, "%s/%s", dir, filedir->d_name );
+      if ( lstat ( path, &st ) || ! S_ISDIR ( st.st_mode ) ){
+         continue;
+      }
+      if ( depth > 1 ){
+         list = add_remove_tasks ( list, path, depth - 1 );
+      } else {
+         list = add_keylist ( list, path, filedir->d_name );
+      }
+   }
+   closedir ( dirp );
+   FREE ( path );
+
+   return list;
+}
+
+/*
+ * removes old database cluster and all its tablespaces, every database directory
+ * in PGDATA/base and in tablespaces (<tablespace>/<version>/<dboid>) is removed
+ * by a pool of threads, remaining content is removed after that; PGDATA and
+ * tablespace directories are kept, as they could be mount points
+ *
+ * out:
+ *    0 - on success
+ *    1 - on error
+ */
+int remove_pgdata_files ( pgsqldata * pdata ){
+
+   DIR * dirp;
+   struct dirent * filedir;
+   char * pgdata;
+   char * path;
+   char * link;
+   keylist * roots = NULL;
+   keyitem * item;
+   rmtasks rt;
+   int dl;
+   int a;
+   int ret = 0;
+   char buf [ BUFLEN ];
+
+   pgdata = pdata->where ? pdata->where : search_key ( pdata->paramlist, "PGDATA" );
+
+   path = MALLOC ( PATH_MAX );
+   link = MALLOC ( PATH_MAX );
+   if ( ! path || ! link ){
+      FREE ( path );
+      FREE ( link );
+      logprg ( LOGERROR, "out of memeory!" );
+      return 1;
+   }
+
+   memset ( &rt, 0, sizeof ( rt ) );
+   pthread_mutex_init ( &rt.stats.mutex, NULL );
+   rt.stats.verbose = pdata->verbose;
+
+   /* tablespaces */
+   snprintf ( path, PATH_MAX, "%s/pg_tblspc", pgdata );
    dirp = opendir ( path );
    if ( dirp ){
-      if ( pdata->verbose ){
-         logprg ( LOGINFO, "remove old tablespaces" );
+      while ( ( filedir = readdir ( dirp ) ) ){
+         if ( strcmp ( filedir->d_name, "."  ) == 0 ||
+              strcmp ( filedir->d_name, ".." ) == 0 ){
+            continue;
+         }
+         snprintf ( path, PATH_MAX, "%s/pg_tblspc/%s", pgdata, filedir->d_name );
+         dl = readlink ( path, link, PATH_MAX - 1 );
+         /* only absolute links are valid tablespace locations */
+         if ( dl <= 0 ){
+            continue;
+         }
+         link [ dl ] = 0;
+         if ( link [ 0 ] != '/' ){
+            continue;
+         }
+         roots = add_keylist ( roots, link, filedir->d_name );
+         /* 8.x: <tablespace>/<dboid>, 9.x: <tablespace>/<version>/<dboid> */
+         rt.list = add_remove_tasks ( rt.list, link, 2 );
       }
-      file = MALLOC ( PATH_MAX );
-      if ( ! file ){
-         logprg ( LOGERROR, "out of memeory!" );
-         return 1;
+      closedir ( dirp );
+   }
+
+   /* database directories in main cluster */
+   snprintf ( path, PATH_MAX, "%s/base", pgdata );
+   rt.list = add_remove_tasks ( rt.list, path, 1 );
+
+   if ( pdata->verbose ){
+      logprg ( LOGINFO, "remove old pgdata cluster and tablespaces" );
+   }
+
+   rt.stats.start = rt.stats.lastreport = monotonic_time ();
+   if ( rt.list ){
+      rt.stats.ntasks = rt.list->size ();
+      rt.items = (keyitem **) malloc ( sizeof ( keyitem * ) * rt.stats.ntasks );
+      if ( ! rt.items ){
+         abortprg ( pdata, 6, "out of memory!" );
       }
-      link = MALLOC ( PATH_MAX );
-      if ( ! link ){
-         logprg ( LOGERROR, "out of memeory!" );
-         return 1;
+      a = 0;
+      foreach_dlist ( item, rt.list ){
+         rt.items [ a++ ] = item;
       }
-      while ( ( filedir = readdir ( dirp ) ) ){
-         if ( strcmp ( filedir->d_name, "."  ) != 0 &&
-              strcmp ( filedir->d_name, ".." ) != 0 ){
+      if ( pgsql_run_parallel ( get_restore_threads ( pdata->paramlist ),
+               rt.stats.ntasks, remove_dir_task, &rt ) ){
+         ret = 1;
+      }
+      FREE ( rt.items );
+      keylist_free ( rt.list );
+   }
 
-            snprintf ( file, PATH_MAX, "%s/%s", path, filedir->d_name );
-            dl = readlink ( file, link, PATH_MAX - 1 );
-            if ( dl < 0 ){
-               continue;
-            }
-            /* sprawdzamy, czy link jest względny czy bezwzględny */
-            if ( link [ 0 ] == '/' ){
-               /* bezwzględny link to dobrze */
-               ret = remove_dir ( pdata, link );
-               if ( ret ){
-                  break;
-               }
-            } else {
-               continue;
-            }
+   /* remaining tablespaces and cluster content, root directories are kept */
+   if ( roots ){
+      foreach_dlist ( item, roots ){
+         if ( remove_root_content ( item->key, &rt.stats ) ){
+            ret = 1;
          }
       }
-      closedir ( dirp );
-      FREE ( file );
+      keylist_free ( roots );
+   }
+   if ( remove_root_content ( pgdata, &rt.stats ) ){
+      ret = 1;
+   }
+
+   if ( pdata->verbose ){
+      double t = monotonic_time () - rt.stats.start;
+      snprintf ( buf, BUFLEN, "removed %li files and %li dirs in %.3fs (%.0f files/s), %li errors",
+            rt.stats.files, rt.stats.dirs, t, t > 0 ? rt.stats.files / t : 0.0, rt.stats.errors );
+      logprg ( LOGINFO, buf );
+   }
+
+   pthread_mutex_destroy ( &rt.stats.mutex );
+   FREE ( path );
+   FREE ( link );
+
+   return ret;
+}
+
+/*
+ * flushes restored cluster files to stable storage before database startup,
+ * a single syncfs is executed for every filesystem of PGDATA and tablespaces
+ * instead of fsync of every restored file (RESTORESYNC)
+ *
+ * in:
+ *    pdata - pgsql data
+ * out:
+ *    0 - on success or when disabled
+ *    1 - on error
+ */
+int sync_restored_files ( pgsqldata * pdata ){
+
+   char * pgdata;
+   char * path;
+   char * link;
+   char * val;
+   DIR * dirp;
+   struct dirent * filedir;
+   struct stat st;
+   keylist * roots = NULL;
+   keyitem * item;
+   dev_t devs [ SYNCFSMAX ];
+   int ndevs = 0;
+   int dl;
+   int a;
+   int ret = 0;
+   double start;
+   char buf [ BUFLEN ];
+
+   val = search_key ( pdata->paramlist, "RESTORESYNC" );
+   if ( val && strcasecmp ( val, "none" ) == 0 ){
+      return 0;
+   }
+
+   pgdata = pdata->where ? pdata->where : search_key ( pdata->paramlist, "PGDATA" );
+
+   path = MALLOC ( PATH_MAX );
+   link = MALLOC ( PATH_MAX );
+   if ( ! path || ! link ){
+      FREE ( path );
       FREE ( link );
+      logprg ( LOGERROR, "out of memeory!" );
+      return 1;
+   }
+
+   /* cluster and all tablespace locations */
+   roots = add_keylist ( roots, pgdata, NULL );
+   snprintf ( path, PATH_MAX, "%s/pg_tblspc", pgdata );
+   dirp = opendir ( path );
+   if ( dirp ){
+      while ( ( filedir = readdir ( dirp ) ) ){
+         if ( filedir->d_name [ 0 ] == '.' ){
+            continue;
+         }
+         snprintf ( path, PATH_MAX, "%s/pg_tblspc/%s", pgdata, filedir->d_name );
+         dl = readlink ( path, link, PATH_MAX - 1 );
+         if ( dl <= 0 ){
+            continue;
+         }
+         link [ dl ] = 0;
+         roots = add_keylist ( roots, link, NULL );
+      }
+      closedir ( dirp );
+   }
+
+   foreach_dlist ( item, roots ){
+      if ( stat ( item->key, &st ) ){
+         continue;
+      }
+      /* every filesystem is synced once */
+      for ( a = 0; a < ndevs && devs [ a ] != st.st_dev; a++ );
+      if ( a < ndevs || ndevs == SYNCFSMAX ){
+         continue;
+      }
+      devs [ ndevs++ ] = st.st_dev;
+
+      start = monotonic_time ();
+#ifdef __linux__
+      int fd = open ( item->key, O_RDONLY | O_DIRECTORY );
+      if ( fd < 0 || syncfs ( fd ) ){
+         snprintf ( buf, BUFLEN, "syncfs %s error: %s", item->key, strerror ( errno ) );
+         logprg ( LOGWARNING, buf );
+         ret = 1;
+      }
+      if ( fd >= 0 ){
+         close ( fd );
+      }
+#else
+      /* no per filesystem sync available, a global one covers all of them */
+      if ( ndevs == 1 ){
+         sync ();
+      }
+#endif
+      if ( pdata->verbose ){
+         snprintf ( buf, BUFLEN, "filesystem of %s synced in %.3fs", item->key,
+               monotonic_time () - start );
+         logprg ( LOGINFO, buf );
+      }
    }
 
+   keylist_free ( roots );
    FREE ( path );
-      
-/* XXX: nie wiem po co to zrobiłem !!! Do sprawdzenia !!! */
-//   return remove_dir ( pdata, pdata->where );
+   FREE ( link );
+
    return ret;
 }
 
+/*
+ * logs a restore stage elapsed time and returns current time for the next stage
+ */
+double report_stage_time ( const char * stage, double start ){
+
+   double now;
+   char buf [ BUFLEN ];
+
+   now = monotonic_time ();
+   snprintf ( buf, BUFLEN, "stage %s finished in %.3fs", stage, now - start );
+   logprg ( LOGINFO, buf );
+
+   return now;
+}
+
 /*
  * wykonuje funkcję skrótu na haśle do directora
  * zwracany string jest alokowany przez MALLOC
@@ -1188,84 +1930,222 @@ int connect_director_socket ( pgsqldata * pdata ){
 }
 
 /*
+ * makes sure the session buffer has room for at least size bytes
+ * out:
+ *    0 - on success
+ *    1 - on error
+ */
+int dir_buffer_reserve ( char ** buf, int * bsize, int size ){
+
+   char * nbuf;
+   int nsize;
+
+   if ( *bsize >= size ){
+      return 0;
+   }
+   nsize = *bsize ? *bsize : DIRBUFLEN;
+   while ( nsize < size ){
+      nsize *= 2;
+   }
+   nbuf = (char *) realloc ( *buf, nsize );
+   if ( ! nbuf ){
+      logprg ( LOGERROR, "out of memeory!" );
+      return 1;
+   }
+   *buf = nbuf;
+   *bsize = nsize;
+
+   return 0;
+}
+
+/*
+ * appends a console message into a session write queue, queued messages are
+ * send to director with flush_director_msgs, so a number of commands could be
+ * pipelined in a single write
  *
+ * in:
+ *    pdata
+ *    msg - console command
+ * out:
+ *    0 - on success
+ *    1 - on error
  */
-int send_director_msg ( pgsqldata * pdata, char * msg ){
+int queue_director_msg ( pgsqldata * pdata, const char * msg ){
 
-   consmsgbuf msgbuf;
+   dirsession * ds = &pdata->dirs;
    int len;
-   int err;
+   int32_t blen;
 
    len = strlen ( msg );
-   if ( len < MSGBUFLEN ){
-      /* komunikat zmieści się w naszym buforze */
-      msgbuf.blen = (int) htonl ( len );
-      strncpy ( msgbuf.mbuf, msg, MSGBUFLEN );
-      len += sizeof ( int );
-
-      // printf ("S: %s\n", msgbuf.buf );
-      err = write ( pdata->bsock, &msgbuf, len );
-      if ( err !=  len ){
+   if ( dir_buffer_reserve ( &ds->wbuf, &ds->wsize, ds->wlen + len + (int) sizeof ( blen ) ) ){
+      return 1;
+   }
+
+   blen = (int32_t) htonl ( len );
+   memcpy ( ds->wbuf + ds->wlen, &blen, sizeof ( blen ) );
+   memcpy ( ds->wbuf + ds->wlen + sizeof ( blen ), msg, len );
+   ds->wlen += len + sizeof ( blen );
+
+   return 0;
+}
+
+/*
+ * writes all queued console messages into director socket
+ * out:
+ *    0 - on success
+ *    1 - on error
+ */
+int flush_director_msgs ( pgsqldata * pdata ){
+
+   dirsession * ds = &pdata->dirs;
+   int pos = 0;
+   int err;
+
+   while ( pos < ds->wlen ){
+      err = write ( pdata->bsock, ds->wbuf + pos, ds->wlen - pos );
+      if ( err < 0 && errno == EINTR ){
+         continue;
+      }
+      if ( err <= 0 ){
          logprg ( LOGERROR, "error writting to socket" );
          logprg ( LOGERROR, strerror ( errno ) );
+         ds->wlen = 0;
          return 1;
       }
-   } else {
-      logprg ( LOGERROR, "send msg error -> msg to long" );
-      return 1;
+      pos += err;
    }
+   ds->wlen = 0;
 
    return 0;
 }
 
 /*
- * funkcja odczytuje komunikat z directora i umieszcza go w zaalokowanym buforze
- * niepotrzebny bufor zwalnia się za pomocą free
+ * sends a single console command to director
  */
-char * recv_director_msg ( pgsqldata * pdata ){
+int send_director_msg ( pgsqldata * pdata, char * msg ){
+
+   if ( queue_director_msg ( pdata, msg ) ){
+      return 1;
+   }
+
+   return flush_director_msgs ( pdata );
+}
+
+/*
+ * reads from director socket into session buffer until at least need bytes
+ * of unconsumed data are available
+ * out:
+ *    0 - on success
+ *    1 - on error or connection closed
+ */
+int dir_fill_buffer ( pgsqldata * pdata, int need ){
 
+   dirsession * ds = &pdata->dirs;
    int err;
-   int len;
+
+   if ( ds->rend - ds->rstart >= need ){
+      return 0;
+   }
+
+   /* move unconsumed data to the beginning of the buffer */
+   if ( ds->rstart ){
+      memmove ( ds->rbuf, ds->rbuf + ds->rstart, ds->rend - ds->rstart );
+      ds->rend -= ds->rstart;
+      ds->rstart = 0;
+   }
+   /* one additional byte for message EOS */
+   if ( dir_buffer_reserve ( &ds->rbuf, &ds->rsize, need + 1 ) ){
+      return 1;
+   }
+
+   while ( ds->rend < need ){
+      err = read ( pdata->bsock, ds->rbuf + ds->rend, ds->rsize - ds->rend - 1 );
+      if ( err < 0 && errno == EINTR ){
+         continue;
+      }
+      if ( err <= 0 ){
+         logprg ( LOGERROR, "error reading socket" );
+         logprg ( LOGERROR, err ? strerror ( errno ) : "connection closed" );
+         return 1;
+      }
+      ds->rend += err;
+   }
+
+   return 0;
+}
+
+/*
+ * reads a console message from director and returns a view into session
+ * buffer, a view is valid until next receive call and should not be freed
+ *
+ * in:
+ *    pdata
+ * out:
+ *    len - length of received message
+ *    message view or NULL on signal (end of data) or error
+ */
+char * recv_director_view ( pgsqldata * pdata, int * len ){
+
+   dirsession * ds = &pdata->dirs;
+   int32_t blen;
    char * msg;
 
-   err = read ( pdata->bsock, &len, sizeof ( int ) );
-   if ( err < 0 || err < (int) sizeof ( int ) ){
-      logprg ( LOGERROR, "error reading socket" );
-      logprg ( LOGERROR, strerror ( errno ) );
+   /* restore a byte replaced by EOS of the previous view */
+   if ( ds->rsavepos >= 0 ){
+      ds->rbuf [ ds->rsavepos ] = ds->rsave;
+      ds->rsavepos = -1;
+   }
+
+   if ( dir_fill_buffer ( pdata, sizeof ( blen ) ) ){
       return NULL;
    }
-   /* w zmiennej len będziemy mieli wielkość komunikatu */
-   len = ntohl ( len );
+   memcpy ( &blen, ds->rbuf + ds->rstart, sizeof ( blen ) );
+   blen = ntohl ( blen );
+   ds->rstart += sizeof ( blen );
 
-   /* sprawdzamy czy przesyłany komunikat zmieści się w naszym buforze */
-   if ( len > MSGBUFLEN ){
+   /* zero or negative value is a signal, i.e. end of data */
+   if ( blen <= 0 ){
+      return NULL;
+   }
+   if ( blen > DIRMSGMAX ){
       logprg ( LOGERROR, "recv msg error -> msg to long" );
       return NULL;
    }
 
-   /* wartosc ujemna oznacza koniec transmisji */
-   if ( len < 0 || len == 0 ){
+   if ( dir_fill_buffer ( pdata, blen ) ){
       return NULL;
    }
-   /* alokujemy bufor na komunikat + EOS */
-   msg = MALLOC ( len + 1 );
-   err = read ( pdata->bsock, msg, len );
-   /* jeśli mamy błąd (err < 0) lub odczytaliśmy nie tyle co chcieliśmy
-    * to sygnalizujemy problem */
-   if ( err < 0 || err < len ){
-      logprg ( LOGERROR, "error reading socket" );
-      logprg ( LOGERROR, strerror ( errno ) );
-      return NULL;
+   msg = ds->rbuf + ds->rstart;
+   ds->rstart += blen;
+
+   /* add EOS, a replaced byte is a part of the next message */
+   ds->rsavepos = ds->rstart;
+   ds->rsave = ds->rbuf [ ds->rstart ];
+   ds->rbuf [ ds->rstart ] = 0;
+
+   if ( len ){
+      *len = blen;
    }
-   /* dodajemy EOS */
-   msg[len] = 0;
 
    return msg;
 }
 
-int auth_director ( pgsqldata * pdata, char * password ){
+/*
+ * funkcja odczytuje komunikat z directora i umieszcza go w zaalokowanym buforze
+ * niepotrzebny bufor zwalnia się za pomocą free
+ */
+char * recv_director_msg ( pgsqldata * pdata ){
 
-   char * buf;
+   char * msg;
+
+   msg = recv_director_view ( pdata, NULL );
+
+   return msg ? bstrdup ( msg ) : NULL;
+}
+
+int auth_director ( pgsqldata * pdata, char * password ){
+
+   char * buf;
    char * msg;
    int err;
    char chal[256];
@@ -1379,47 +2259,197 @@ int auth_director ( pgsqldata * pdata, char * password ){
    return 0;
 }
 
+/*
+ * closes director connection and drops a session
+ */
 int shutdown_director_socket ( pgsqldata * pdata ){
 
-   shutdown ( pdata->bsock, SHUT_RDWR );
+   dirsession * ds = &pdata->dirs;
+
+   if ( ds->connected ){
+      shutdown ( pdata->bsock, SHUT_RDWR );
+      close ( pdata->bsock );
+   }
+   ds->connected = 0;
+   ds->auth = 0;
+   ds->rstart = ds->rend = ds->wlen = 0;
+   ds->rsavepos = -1;
 
    return 0;
 }
 
+/*
+ * checks if director session should be reused between operations (DIRSESSION)
+ */
+int director_session_reuse ( pgsqldata * pdata ){
+
+   return check_param_bool ( pdata->paramlist, "DIRSESSION", 0 );
+}
+
+/*
+ * checks if database files are restored in place (DELTARESTORE), existing
+ * cluster files are not removed then and the plugin rewrites changed blocks only
+ */
+int delta_restore_enabled ( pgsqldata * pdata ){
+
+   return check_param_bool ( pdata->paramlist, "DELTARESTORE", 0 );
+}
+
+/*
+ * leaves a restore mode file in a restore destination, so the plugin restores
+ * database files in the same mode as pgsql-restore prepared the destination,
+ * whatever DELTARESTORE is in the plugin config file
+ *
+ * out:
+ *    0 - on success
+ *    1 - on error
+ */
+int write_restore_mode ( pgsqldata * pdata ){
+
+   char * dest;
+   char * path;
+   const char * mode;
+   int fd;
+   int err = 0;
+
+   dest = pdata->where ? pdata->where : search_key ( pdata->paramlist, "PGDATA" );
+   mode = delta_restore_enabled ( pdata ) ? PGRESTOREDELTA : PGRESTORECLEAN;
+
+   path = MALLOC ( PATH_MAX );
+   ASSERT_NVAL_RET_ONE ( path );
+   if ( mkdir ( dest, S_IRWXU ) != 0 && errno != EEXIST ){
+      logprg ( LOGERROR, "cant create restore destination:" );
+      logprg ( LOGERROR, strerror ( errno ) );
+      FREE ( path );
+      return 1;
+   }
+   snprintf ( path, PATH_MAX, "%s/" PGRESTOREMODE, dest );
+   fd = open ( path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, S_IRUSR | S_IWUSR );
+   if ( fd < 0 ||
+        write ( fd, mode, strlen ( mode ) ) != (ssize_t) strlen ( mode ) ||
+        write ( fd, "\n", 1 ) != 1 ){
+      logprg ( LOGERROR, "cant write " PGRESTOREMODE " file:" );
+      logprg ( LOGERROR, strerror ( errno ) );
+      err = 1;
+   }
+   if ( fd >= 0 ){
+      close ( fd );
+   }
+   if ( pdata->verbose && ! err ){
+      snprintf ( path, PATH_MAX, "restore mode for plugin: %s", mode );
+      logprg ( LOGINFO, path );
+   }
+   FREE ( path );
+
+   return err;
+}
+
+/*
+ * removes a restore mode file after database restore, the plugin could
+ * already remove it as an entry not found in backup
+ */
+void remove_restore_mode ( pgsqldata * pdata ){
+
+   char * dest;
+   char * path;
+
+   dest = pdata->where ? pdata->where : search_key ( pdata->paramlist, "PGDATA" );
+   path = MALLOC ( PATH_MAX );
+   if ( ! path ){
+      return;
+   }
+   snprintf ( path, PATH_MAX, "%s/" PGRESTOREMODE, dest );
+   if ( unlink ( path ) != 0 && errno != ENOENT ){
+      logprg ( LOGWARNING, "cant remove " PGRESTOREMODE " file:" );
+      logprg ( LOGWARNING, strerror ( errno ) );
+   }
+   FREE ( path );
+}
+
+/*
+ * finishes a successful director operation, authenticated session is kept
+ * open for next operation when session reuse is enabled
+ */
+int release_director ( pgsqldata * pdata ){
+
+   if ( director_session_reuse ( pdata ) && pdata->dirs.auth ){
+      return 0;
+   }
+
+   return shutdown_director_socket ( pdata );
+}
+
 int connect_director ( pgsqldata * pdata ){
 
    char * password;
    int err;
 
+   if ( pdata->dirs.auth ){
+      /* reuse already authenticated session */
+      if ( pdata->verbose ){
+         logprg ( LOGINFO, "reusing director session" );
+      }
+      return 0;
+   }
+
+   pdata->dirs.rsavepos = -1;
    err = connect_director_socket ( pdata );
    if ( err ){
       /* error */
       return 1;
    }
+   pdata->dirs.connected = 1;
 
    password = pasword_md5digest ( pdata );
    if ( ! password ){
       /* error */
+      shutdown_director_socket ( pdata );
       return 1;
    }
 
    err = auth_director ( pdata, password );
+   FREE ( password );
    if ( err ){
       /* error */
+      shutdown_director_socket ( pdata );
       return 1;
    }
+   pdata->dirs.auth = 1;
 
    return 0;
 }
 
+/*
+ * checks if a director message rejects a fileset name of a restore command:
+ *    No FileSet found for client "<client>".
+ *    Error getting FileSet "<fileset>": ERR=...
+ *    FileSet "<fileset>" not found.
+ */
+int is_fileset_error ( const char * msg ){
+
+   char buf [ 256 ];
+   int a;
+
+   for ( a = 0; msg [ a ] && a < (int) sizeof ( buf ) - 1; a++ ){
+      buf [ a ] = tolower ( (unsigned char) msg [ a ] );
+   }
+   buf [ a ] = 0;
+
+   return strstr ( buf, "no fileset" ) || strstr ( buf, "error getting fileset" ) ||
+         ( strstr ( buf, "fileset" ) && strstr ( buf, "not found" ) );
+}
+
 /* funkcja czyści (odczytuje w kosmos) aktualny bufor danych jakie wysłał
- * do nas director */
+ * do nas director, odrzucona nazwa filesetu jest zapamiętywana */
 void clear_receive_buffer ( pgsqldata * pdata ){
 
-   char * junk;
-   /* odczytujemy bufor aż do końca treści */
-   while (( junk = recv_director_msg ( pdata ) )){
-      FREE ( junk );
+   char * msg;
+
+   /* odczytujemy bufor aż do końca treści, bez alokacji komunikatów */
+   while (( msg = recv_director_view ( pdata, NULL ) )){
+      if ( is_fileset_error ( msg ) ){
+         pdata->dirs.badfileset = 1;
+      }
    }
 }
 
@@ -1435,252 +2465,356 @@ static const char * fstemplate[2][2] =
 };
 
 /*
- * funkcja weryfikuje po stronie baculi który z dostępnych filesetów
- * odpowiada za backup plików bazodanowych
- * in:
- *    pdata
+ * makes sure a catalog connection is available, it is used for optional
+ * catalog features, so no abort on error
  * out:
- *    fileset - zaalokowana nazwa filesetu do wykorzystania w komendzie restore
+ *    0 - connected
+ *    1 - no catalog connection
  */
-char * find_fileset ( pgsqldata * pdata, int type ){
+int catdb_available ( pgsqldata * pdata ){
 
-   int err;
-   int len;
-   char * msg;
-   char * recv;
-   char * fileset1;
-   char * fileset2;
+   if ( ! pdata->catdb ){
+      pdata->catdb = catdbconnect ( pdata->paramlist );
+   }
+
+   return pdata->catdb ? 0 : 1;
+}
+
+/*
+ * returns an allocated fileset name for selected type cached in catalog
+ * or NULL when not found
+ */
+char * get_cached_fileset ( pgsqldata * pdata, int type ){
+
+   PGresult * result;
+   char * sql;
    char * fileset = NULL;
 
-   msg = MALLOC ( BUFLEN );
-   if ( ! msg ){
-      logprg ( LOGERROR, "out of memeory!" );
+   if ( catdb_available ( pdata ) ){
       return NULL;
    }
 
-   /* ".filesets */
-   err = send_director_msg ( pdata, (char *) ".filesets" );
-   if ( err ){
-      logprg ( LOGERROR, "Error sending data (.filesets)" );
-      return NULL;
+   sql = MALLOC ( SQLLEN );
+   ASSERT_NVAL_RET_NULL ( sql );
+   snprintf ( sql, SQLLEN, "select fileset from pgsql_filesets where client='%s' and fstype='%i'",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ), type );
+
+   result = PQexec ( pdata->catdb, sql );
+   FREE ( sql );
+
+   if ( PQresultStatus ( result ) == PGRES_TUPLES_OK && PQntuples ( result ) ){
+      fileset = bstrdup ( PQgetvalue ( result, 0, 0 ) );
    }
+   PQclear ( result );
 
-   /* we expect two filesets name only */
-   fileset1 = recv_director_msg ( pdata );
-   if ( !fileset1 ){
-      logprg ( LOGERROR, "Error: No filesets found" );
-      return NULL;
+   return fileset;
+}
+
+/*
+ * removes cached fileset name for selected type from catalog
+ */
+void invalidate_cached_fileset ( pgsqldata * pdata, int type ){
+
+   PGresult * result;
+   char * sql;
+
+   if ( catdb_available ( pdata ) ){
+      return;
    }
 
-   fileset2 = recv_director_msg ( pdata );
-   if ( fileset2 ){
-      /* read two filesets, clear other data */
-      clear_receive_buffer ( pdata );
-   } else {
-      logprg ( LOGERROR, "Error: No valid filesets found" );
+   sql = MALLOC ( SQLLEN );
+   ASSERT_NVAL_RET ( sql );
+   snprintf ( sql, SQLLEN, "delete from pgsql_filesets where client='%s' and fstype='%i'",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ), type );
+
+   result = PQexec ( pdata->catdb, sql );
+   FREE ( sql );
+   PQclear ( result );
+}
+
+/*
+ * saves resolved fileset name for selected type in catalog
+ */
+void set_cached_fileset ( pgsqldata * pdata, int type, const char * fileset ){
+
+   PGresult * result;
+   char * sql;
+   char * name;
+
+   if ( catdb_available ( pdata ) ){
+      return;
+   }
+
+   invalidate_cached_fileset ( pdata, type );
+
+   /* a fileset name comes from director, so it is escaped */
+   name = PQescapeLiteral ( pdata->catdb, fileset, strlen ( fileset ) );
+   ASSERT_NVAL_RET ( name );
+   sql = MALLOC ( BUFLEN );
+   if ( ! sql ){
+      PQfreemem ( name );
+      return;
+   }
+   snprintf ( sql, BUFLEN, "insert into pgsql_filesets (client, fstype, fileset) values ('%s', '%i', %s)",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ), type, name );
+
+   result = PQexec ( pdata->catdb, sql );
+   FREE ( sql );
+   if ( PQresultStatus ( result ) != PGRES_COMMAND_OK && pdata->verbose ){
+      logprg ( LOGWARNING, "CATDB: unable to cache fileset name" );
+   }
+   PQclear ( result );
+   PQfreemem ( name );
+}
+
+/*
+ * gets a list of all filesets available for our console
+ * out:
+ *    keylist of fileset names or NULL on error
+ */
+keylist * get_director_filesets ( pgsqldata * pdata ){
+
+   keylist * list = NULL;
+   char * recv;
+   int len;
+
+   /* .filesets */
+   if ( send_director_msg ( pdata, (char *) ".filesets" ) ){
+      logprg ( LOGERROR, "Error sending data (.filesets)" );
       return NULL;
    }
 
-   /* if fileset names has an end line char we should erase this char */
-   len = strlen ( fileset1 ) - 1;
-   if ( fileset1 != NULL && len > 0 && fileset1 [ len ] == '\n' ){
-      fileset1 [ len ] = 0;
+   while (( recv = recv_director_view ( pdata, &len ) )){
+      /* if fileset names has an end line char we should erase this char */
+      if ( len > 0 && recv [ len - 1 ] == '\n' ){
+         recv [ len - 1 ] = 0;
+      }
+      if ( recv [ 0 ] ){
+         list = add_keylist ( list, recv, recv );
+      }
    }
-   len = strlen ( fileset2 ) - 1;
-   if ( fileset2 != NULL && len > 0 && fileset2 [ len ] == '\n' ){
-      fileset2 [ len ] = 0;
+
+   return list;
+}
+
+/*
+ * checks if a fileset contains backups of selected type, it builds a restore
+ * tree on director and compares its top level entries with a fileset template
+ * out:
+ *    1 - fileset match
+ *    0 - fileset does not match or error
+ */
+int check_fileset_type ( pgsqldata * pdata, const char * fileset, int type ){
+
+   char * msg;
+   char * recv;
+   int match = 0;
+
+   msg = MALLOC ( BUFLEN );
+   if ( ! msg ){
+      logprg ( LOGERROR, "out of memeory!" );
+      return 0;
    }
-   /* check which fileset will be valid, startinf from fileset1 */
-   snprintf ( msg, BUFLEN, "restore fileset=\"%s\" select",
-               fileset1 );
 
-   err = send_director_msg ( pdata, msg );
-   if ( err ){
-      FREE ( fileset1 );
-      FREE ( fileset2 );
+   snprintf ( msg, BUFLEN, "restore fileset=\"%s\" select", fileset );
+   if ( send_director_msg ( pdata, msg ) ){
       logprg ( LOGERROR, "Error sending data (restore fileset)" );
-      return NULL;
+      FREE ( msg );
+      return 0;
    }
+   FREE ( msg );
    /* XXX TODO: handle "No Full backup before ..." error message */
    clear_receive_buffer ( pdata );
 
    /* ls */
-   err = send_director_msg ( pdata, (char *) "ls" );
-   if ( err ){
-      FREE ( fileset1 );
-      FREE ( fileset2 );
+   if ( send_director_msg ( pdata, (char *) "ls" ) ){
       logprg ( LOGERROR, "Error sending data (ls)" );
-      return NULL;
+      return 0;
    }
 
    /* important */
-   recv = recv_director_msg ( pdata );
+   recv = recv_director_view ( pdata, NULL );
    if ( recv ){
+      if ( strncmp ( recv, fstemplate[type][0], strlen ( fstemplate[type][0] ) ) == 0 ||
+           strncmp ( recv, fstemplate[type][1], strlen ( fstemplate[type][1] ) ) == 0 ){
+         match = 1;
+      }
       clear_receive_buffer ( pdata );
    }
-   
-   if ( strncmp ( recv, fstemplate[type][0], strlen ( fstemplate[type][0] ) ) == 0 ||
-        strncmp ( recv, fstemplate[type][1], strlen ( fstemplate[type][1] ) ) == 0 ){
 
-      /* shoot !!! */
-      FREE ( recv );
-      FREE ( fileset2 );
-      fileset = fileset1;
-   } else {
-      FREE ( recv );
-      FREE ( fileset1 );
-      /* check second option */
-      err = send_director_msg ( pdata, (char *) "." );
-      if ( err ){
-         FREE ( fileset2 );
-         logprg ( LOGERROR, "Error sending data (.)" );
-         return NULL;
-      }
+   /* leave restore tree */
+   if ( send_director_msg ( pdata, (char *) "." ) ){
+      logprg ( LOGERROR, "Error sending data (.)" );
+      return 0;
+   }
+   clear_receive_buffer ( pdata );
 
-      clear_receive_buffer ( pdata );
+   return match;
+}
+
+/*
+ * funkcja weryfikuje po stronie baculi który z dostępnych filesetów
+ * odpowiada za backup plików bazodanowych, nazwa znalezionego filesetu
+ * jest zapamiętywana w katalogu (pgsql_filesets), więc kolejne wywołania
+ * weryfikują jedynie czy fileset jest nadal dostępny
+ * in:
+ *    pdata
+ * out:
+ *    fileset - zaalokowana nazwa filesetu do wykorzystania w komendzie restore
+ */
+char * find_fileset ( pgsqldata * pdata, int type ){
 
-      snprintf ( msg, BUFLEN, "restore fileset=\"%s\" select",
-                  fileset2 );
+   keylist * filesets;
+   keyitem * item;
+   char * cached;
+   char * fileset = NULL;
 
-      err = send_director_msg ( pdata, msg );
-      if ( err ){
-         FREE ( fileset2 );
-         logprg ( LOGERROR, "Error sending data (restore fileset)" );
-         return NULL;
-      }
-      /* XXX TODO: handle "No Full backup before ..." error message */
-      clear_receive_buffer ( pdata );
+   filesets = get_director_filesets ( pdata );
+   if ( ! filesets ){
+      logprg ( LOGERROR, "Error: No filesets found" );
+      return NULL;
+   }
 
-      /* ls */
-      err = send_director_msg ( pdata, (char *) "ls" );
-      if ( err ){
-         FREE ( fileset2 );
-         logprg ( LOGERROR, "Error sending data (ls)" );
-         return NULL;
+   /* a cached name is valid when director still has this fileset */
+   cached = get_cached_fileset ( pdata, type );
+   if ( cached ){
+      if ( search_key ( filesets, cached ) ){
+         if ( pdata->verbose ){
+            logprg ( LOGINFO, "using cached fileset name" );
+         }
+         keylist_free ( filesets );
+         return cached;
       }
+      FREE ( cached );
+      invalidate_cached_fileset ( pdata, type );
+   }
 
-      /* important */
-      recv = recv_director_msg ( pdata );
-      clear_receive_buffer ( pdata );
-
-      if ( strncmp ( recv, fstemplate[type][0], strlen ( fstemplate[type][0] ) ) == 0 ||
-           strncmp ( recv, fstemplate[type][1], strlen ( fstemplate[type][1] ) ) == 0 ){
-         /* shoot! */
-         fileset = fileset2;
-         FREE ( recv );
-      } else {
-         /* no valid fileset or backup found */
-         FREE ( recv );
-         FREE ( fileset2 );
-         return NULL;
+   foreach_dlist ( item, filesets ){
+      if ( check_fileset_type ( pdata, item->key, type ) ){
+         fileset = bstrdup ( item->key );
+         break;
       }
    }
+   keylist_free ( filesets );
 
-   err = send_director_msg ( pdata, (char *) "." );
-   if ( err ){
-      FREE ( fileset );
-      logprg ( LOGERROR, "Error sending data (.)" );
-      return NULL;
+   if ( fileset ){
+      set_cached_fileset ( pdata, type, fileset );
+   } else {
+      logprg ( LOGERROR, "Error: No valid filesets found" );
    }
-   clear_receive_buffer ( pdata );
 
    return fileset;
 }
 
 /*
- * performs restore command with any available information about fileset
- * additional it verifies jobid number and waits for its finish
+ * invalidates a cached fileset name after director rejected it in a restore
+ * command and discovers it again on a new director session, a restore should be
+ * retried only when a fileset has changed; other restore failures are final
  *
  * in:
  *    pdata
- *    fileset - fileset name which will be used for restore
+ *    type - fileset type
+ *    fileset - current (failed) fileset name, replaced by a new one
  * out:
- *    err - 0 if everything OK, 1 on error
+ *    0 - new fileset found, restore could be retried
+ *    1 - no other fileset available
  */
-int restore_db_files ( pgsqldata * pdata, const char * fileset ){
+int retry_with_new_fileset ( pgsqldata * pdata, int type, char ** fileset ){
 
-   char * msg;
-   char * recv;
-   int err;
-   int rjobid,fjobid;
-   char jobstatus;
+   char * nfileset;
 
-   /* now we can send commands */
-   msg = MALLOC ( BUFLEN );
-   if ( ! msg ){
-      logprg ( LOGERROR, "out of memeory!" );
+   if ( ! pdata->dirs.badfileset ){
       return 1;
    }
+   pdata->dirs.badfileset = 0;
+   invalidate_cached_fileset ( pdata, type );
 
-   /*
-    * restore command for recovery:
-    * > restore where=<where> fileset=<$fileset> [restoreclient=<client>] [current,before="YYYY-MM-DD HH:MM:SS"] select
-    * - where is optional, if we have a restore date then we have to supply before
-    */
-   snprintf ( msg, BUFLEN, "restore where=\"%s\" fileset=\"%s\" %s%s %s%s%s%s select yes",
-               // pdata->where ? pdata->where : search_key ( pdata->paramlist, "PGDATA" ),
-               pdata->where ? pdata->where : "\"\"",
-               fileset,
-               pdata->restoreclient ? "restoreclient=" : "",
-               pdata->restoreclient ? pdata->restoreclient : "",
-               pdata->pitr == PITR_CURRENT || pdata->pitr == PITR_XID ?
-                  "current" : "before=",
-               pdata->pitr == PITR_TIME ? "\"" : "",
-               pdata->pitr == PITR_TIME ? pdata->restorepit : "",
-               pdata->pitr == PITR_TIME ? "\"" : "" );
-
-   err = send_director_msg ( pdata, msg );
-
-   if ( err ){
-      logprg ( LOGERROR, "Error sending data (restore fileset select)" );
+   /* a console dialog of a rejected restore could be unfinished */
+   shutdown_director_socket ( pdata );
+   if ( connect_director ( pdata ) ){
+      logprg ( LOGERROR, "Error connecting to director" );
       return 1;
    }
 
-   clear_receive_buffer ( pdata );
-
-   /* add pgsqldb:<archclient>/ */
-   snprintf ( msg, BUFLEN, "add pgsqldb:%s/",
-               search_key ( pdata->paramlist, "ARCHCLIENT" ) );
-
-   err = send_director_msg ( pdata, msg );
-   if ( err ){
-      logprg ( LOGERROR, "Error sending data (add fileset)" );
+   nfileset = find_fileset ( pdata, type );
+   if ( ! nfileset ){
       return 1;
    }
-   clear_receive_buffer ( pdata );
-
-   /* add pgsqltbs:<archclient>/ */
-   /* TODO: chech how Bacula handle no tablespaces files
-    * done -> OK, prints: No files marked */
-   snprintf ( msg, BUFLEN, "add pgsqltbs:%s/",
-               search_key ( pdata->paramlist, "ARCHCLIENT" ) );
-
-   err = send_director_msg ( pdata, msg );
-   if ( err ){
-      logprg ( LOGERROR, "Error sending data (add fileset)" );
+   if ( strcmp ( nfileset, *fileset ) == 0 ){
+      FREE ( nfileset );
       return 1;
    }
-   clear_receive_buffer ( pdata );
 
-   /* done */
-   err = send_director_msg ( pdata, (char *) "done" );
-   if ( err ){
-      logprg ( LOGERROR, "Error sending data (done)" );
-      return 1;
+   if ( pdata->verbose ){
+      logprg ( LOGINFO, "retrying restore with rediscovered fileset" );
    }
+   FREE ( *fileset );
+   *fileset = nfileset;
 
-   /* searching for JobId number in running job */
+   return 0;
+}
+
+/*
+ * searches a JobId number of a restore job just submitted with "done yes"
+ * in director answer
+ *
+ * in:
+ *    pdata
+ * out:
+ *    JobId of started job, 0 on error
+ */
+int get_restore_jobid ( pgsqldata * pdata ){
+
+   char * recv;
+   int err;
+   int rjobid = 0;
+
+   /* searching for JobId number in running job message */
    while (( recv = recv_director_msg ( pdata ) )){
       if ( pdata->verbose ){
          logprg ( LOGINFO, recv );
       }
       err = sscanf ( recv, "%*[^.]. JobId=%i", &rjobid );
+      if ( is_fileset_error ( recv ) ){
+         pdata->dirs.badfileset = 1;
+      }
+      FREE ( recv );
       if ( err == 1 ){
          break;
       }
    }
    clear_receive_buffer ( pdata );
 
+   if ( ! rjobid ){
+      logprg ( LOGERROR, "Error restore job not started" );
+   }
+
+   return rjobid;
+}
+
+/*
+ * executes a wait command for a restore job and checks its status
+ *
+ * in:
+ *    pdata
+ *    rjobid - JobId of restore job
+ * out:
+ *    err - 0 if job finished OK, 1 on error
+ */
+int wait_restore_jobid ( pgsqldata * pdata, int rjobid ){
+
+   char * msg;
+   char * recv;
+   int err;
+   int fjobid;
+   char jobstatus;
+
+   msg = MALLOC ( BUFLEN );
+   if ( ! msg ){
+      logprg ( LOGERROR, "out of memeory!" );
+      return 1;
+   }
+
    if ( pdata->verbose ){
       snprintf ( msg, BUFLEN, "starting restore job: JobId=%i", rjobid );
       logprg ( LOGINFO, msg );
@@ -1692,6 +2826,7 @@ int restore_db_files ( pgsqldata * pdata, const char * fileset ){
    err = send_director_msg ( pdata, msg );
    if ( err ){
       logprg ( LOGERROR, "Error sending data (wait jobid)" );
+      FREE ( msg );
       return 1;
    }
 
@@ -1700,30 +2835,307 @@ int restore_db_files ( pgsqldata * pdata, const char * fileset ){
     * JobStatus=OK (T)
     */
    recv = recv_director_msg ( pdata );
-   err = sscanf ( recv, "JobId=%i", &fjobid );
+   err = recv ? sscanf ( recv, "JobId=%i", &fjobid ) : 0;
    FREE ( recv );
    if ( err != 1 ){
       logprg ( LOGERROR, "Error waiting for restore job" );
-      return 1;
+      err = 1;
+      goto bailout;
    }
    recv = recv_director_msg ( pdata );
    //err = sscanf ( recv, "JobStatus=%*[^ ] (%c)", &jobstatus );
-   err = sscanf ( recv, "JobStatus=%s (%c)", msg, &jobstatus );
+   err = recv ? sscanf ( recv, "JobStatus=%s (%c)", msg, &jobstatus ) : 0;
    FREE ( recv );
    if ( err != 2 ){
       logprg ( LOGERROR, "Error restore jobstatus" );
-      return 1;
+      err = 1;
+      goto bailout;
    }
    if ( jobstatus != 'T' ){
       /* job finished with error */
       logprg ( LOGERROR, "Error restore job:" );
       logprg ( LOGERROR, msg );
+      err = 1;
+      goto bailout;
+   }
+   err = 0;
+
+bailout:
+   /* replies not read are drained, a next command on this session (a single
+    * file restore after a failed prefetch) would parse them otherwise */
+   clear_receive_buffer ( pdata );
+   FREE ( msg );
+
+   return err;
+}
+
+/*
+ * waits for a restore job just submitted with "done yes" to finish
+ *
+ * in:
+ *    pdata
+ * out:
+ *    err - 0 if job finished OK, 1 on error
+ */
+int wait_for_restore_job ( pgsqldata * pdata ){
+
+   int rjobid;
+
+   rjobid = get_restore_jobid ( pdata );
+   if ( ! rjobid ){
+      clear_receive_buffer ( pdata );
+      return 1;
+   }
+
+   return wait_restore_jobid ( pdata, rjobid );
+}
+
+/*
+ * performs restore command with any available information about fileset,
+ * a job is started but not waited for
+ *
+ * in:
+ *    pdata
+ *    fileset - fileset name which will be used for restore
+ * out:
+ *    JobId of started restore job, 0 on error
+ */
+int submit_db_restore ( pgsqldata * pdata, const char * fileset ){
+
+   char * msg;
+   int err;
+
+   /* now we can send commands */
+   msg = MALLOC ( BUFLEN );
+   if ( ! msg ){
+      logprg ( LOGERROR, "out of memeory!" );
       return 1;
    }
+   pdata->dirs.badfileset = 0;
+
+   /*
+    * restore command for recovery:
+    * > restore where=<where> fileset=<$fileset> [restoreclient=<client>] [current,before="YYYY-MM-DD HH:MM:SS"] select
+    * - where is optional, if we have a restore date then we have to supply before
+    * or when a base backup was selected in catalog:
+    * > restore where=<where> jobid=<jobid,...> [restoreclient=<client>] select
+    */
+   if ( pdata->jobids ){
+      snprintf ( msg, BUFLEN, "restore where=\"%s\" jobid=%s %s%s select yes",
+               pdata->where ? pdata->where : "\"\"",
+               pdata->jobids,
+               pdata->restoreclient ? "restoreclient=" : "",
+               pdata->restoreclient ? pdata->restoreclient : "" );
+   } else {
+      snprintf ( msg, BUFLEN, "restore where=\"%s\" fileset=\"%s\" %s%s %s%s%s%s select yes",
+                  // pdata->where ? pdata->where : search_key ( pdata->paramlist, "PGDATA" ),
+                  pdata->where ? pdata->where : "\"\"",
+                  fileset,
+                  pdata->restoreclient ? "restoreclient=" : "",
+                  pdata->restoreclient ? pdata->restoreclient : "",
+                  pdata->pitr == PITR_CURRENT || pdata->pitr == PITR_XID ?
+                     "current" : "before=",
+                  pdata->pitr == PITR_TIME ? "\"" : "",
+                  pdata->pitr == PITR_TIME ? pdata->restorepit : "",
+                  pdata->pitr == PITR_TIME ? "\"" : "" );
+   }
+
+   err = send_director_msg ( pdata, msg );
+
+   if ( err ){
+      logprg ( LOGERROR, "Error sending data (restore fileset select)" );
+      FREE ( msg );
+      return 0;
+   }
 
    clear_receive_buffer ( pdata );
 
-   return 0;
+   /* add commands and done are pipelined in a single write, answers for
+    * both add commands are drained later */
+   /* add pgsqldb:<archclient>/ */
+   snprintf ( msg, BUFLEN, "add pgsqldb:%s/",
+               search_key ( pdata->paramlist, "ARCHCLIENT" ) );
+   err = queue_director_msg ( pdata, msg );
+
+   /* add pgsqltbs:<archclient>/ */
+   /* TODO: chech how Bacula handle no tablespaces files
+    * done -> OK, prints: No files marked */
+   snprintf ( msg, BUFLEN, "add pgsqltbs:%s/",
+               search_key ( pdata->paramlist, "ARCHCLIENT" ) );
+   err |= queue_director_msg ( pdata, msg );
+
+   /* done */
+   err |= queue_director_msg ( pdata, "done" );
+   if ( ! err ){
+      err = flush_director_msgs ( pdata );
+   }
+   if ( err ){
+      logprg ( LOGERROR, "Error sending data (add fileset)" );
+      FREE ( msg );
+      return 0;
+   }
+   clear_receive_buffer ( pdata );
+   clear_receive_buffer ( pdata );
+   FREE ( msg );
+
+   return get_restore_jobid ( pdata );
+}
+
+/*
+ * performs restore of database files from a single fileset and waits for
+ * restore job to finish
+ *
+ * in:
+ *    pdata
+ *    fileset - fileset name which will be used for restore
+ * out:
+ *    err - 0 if everything OK, 1 on error
+ */
+int restore_db_files ( pgsqldata * pdata, const char * fileset ){
+
+   int rjobid;
+
+   rjobid = submit_db_restore ( pdata, fileset );
+   if ( ! rjobid ){
+      return 1;
+   }
+
+   return wait_restore_jobid ( pdata, rjobid );
+}
+
+/*
+ * selects the newest complete shard set finished before the recovery target
+ * from pgsql catalog, every shard of a set has to be finished with its JobId
+ * saved, so all files of a single pg_start_backup/pg_stop_backup window are
+ * restored
+ *
+ * in:
+ *    pdata
+ *    shards - number of shards (DBSHARDS)
+ * out:
+ *    jobids - JobIds of all shards of selected set
+ *    0 - on success
+ *    1 - on error or when no complete set is found
+ */
+int select_shard_set ( pgsqldata * pdata, int shards, int * jobids ){
+
+   PGresult * result;
+   char * sql;
+   char * buf;
+   char * pit = NULL;
+   int a;
+   int err = 1;
+
+   if ( catdb_available ( pdata ) ){
+      logprg ( LOGERROR, "sharded database restore requires a catalog database" );
+      return 1;
+   }
+
+   if ( pdata->pitr == PITR_TIME ){
+      pit = PQescapeLiteral ( pdata->catdb, pdata->restorepit, strlen ( pdata->restorepit ) );
+      ASSERT_NVAL_RET_ONE ( pit );
+   }
+   sql = MALLOC ( BUFLEN );
+   buf = MALLOC ( BUFLEN );
+   if ( ! sql || ! buf ){
+      if ( sql ){
+         FREE ( sql );
+      }
+      if ( pit ){
+         PQfreemem ( pit );
+      }
+      return 1;
+   }
+   snprintf ( sql, BUFLEN,
+         "select s.id, s.mod_date, p.jobid from pgsql_shardsets s join pgsql_shards p on p.setid=s.id "
+         "where s.id=(select id from pgsql_shardsets t where client='%s' and shards=%i and status=%i%s%s "
+         "and (select count(*) from pgsql_shards where setid=t.id and status=%i and jobid is not null)=%i "
+         "order by id desc limit 1) order by p.shard",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ), shards, PGSQL_STATUS_DB_ONLINE_FINISH,
+         pit ? " and mod_date <= " : "", pit ? pit : "",
+         PGSQL_STATUS_DB_ONLINE_FINISH, shards );
+   result = PQexec ( pdata->catdb, sql );
+   if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
+      logprg ( LOGERROR, "CATDB: shard set query error" );
+   } else
+   if ( PQntuples ( result ) != shards ){
+      snprintf ( buf, BUFLEN, "no complete set of %i shards found in catalog", shards );
+      logprg ( LOGERROR, buf );
+   } else {
+      for ( a = 0; a < shards; a++ ){
+         jobids [ a ] = atoi ( PQgetvalue ( result, a, 2 ) );
+      }
+      snprintf ( buf, BUFLEN, "restoring shard set %s finished at %s",
+            PQgetvalue ( result, 0, 0 ), PQgetvalue ( result, 0, 1 ) );
+      logprg ( LOGINFO, buf );
+      err = 0;
+   }
+   PQclear ( result );
+   if ( pit ){
+      PQfreemem ( pit );
+   }
+   FREE ( buf );
+   FREE ( sql );
+
+   return err;
+}
+
+/*
+ * restores all shards of a sharded database backup in parallel, restore jobs
+ * for JobIds of all shards of a single set are submitted first and then
+ * waited for, so Director runs them concurrently (up to its Maximum
+ * Concurrent Jobs)
+ *
+ * in:
+ *    pdata
+ *    shards - number of shards (DBSHARDS)
+ * out:
+ *    err - 0 if everything OK, 1 on error
+ */
+int restore_db_shards ( pgsqldata * pdata, int shards ){
+
+   int jobids [ PGMAXSHARDS ];
+   int rjobids [ PGMAXSHARDS ];
+   int njobs = 0;
+   int err = 0;
+   int a;
+   char * buf;
+   double start;
+
+   if ( select_shard_set ( pdata, shards, jobids ) ){
+      return 1;
+   }
+
+   buf = MALLOC ( BUFLEN );
+   ASSERT_NVAL_RET_ONE ( buf );
+
+   start = monotonic_time ();
+   for ( a = 0; a < shards; a++ ){
+      /* every shard is restored by its own job */
+      snprintf ( buf, BUFLEN, "%i", jobids [ a ] );
+      pdata->jobids = bstrdup ( buf );
+      rjobids [ njobs ] = submit_db_restore ( pdata, NULL );
+      FREE ( pdata->jobids );
+      if ( ! rjobids [ njobs ] ){
+         err = 1;
+         break;
+      }
+      njobs++;
+   }
+
+   /* already started jobs are waited for even on error, so files are not
+    * restored behind our back */
+   for ( a = 0; a < njobs; a++ ){
+      err |= wait_restore_jobid ( pdata, rjobids [ a ] );
+   }
+
+   if ( pdata->verbose ){
+      snprintf ( buf, BUFLEN, "%i shards restored in %.3fs", njobs, monotonic_time () - start );
+      logprg ( LOGINFO, buf );
+   }
+   FREE ( buf );
+
+   return err;
 }
 
 /*
@@ -1847,212 +3259,1294 @@ int tune_tablespaces_links ( pgsqldata * pdata ){
       }
    }
 
-   FREE ( reltab );
-   FREE ( link );
-   FREE ( path );
-   FREE ( file );
+   FREE ( reltab );
+   FREE ( link );
+   FREE ( path );
+   FREE ( file );
+
+   return 0;
+}
+
+void build_pitr_wal_bound ( pgsqldata * pdata, const char * client, const char * tli,
+      const char * startwal, char * target, int len );
+
+/*
+ * reports an expected volume of WAL replayed by recovery from a selected base
+ * backup start up to the recovery target, based on WAL archived in catalog
+ *
+ * in:
+ *    pdata
+ *    startwal - first WAL segment of selected base backup
+ */
+void report_expected_replay ( pgsqldata * pdata, const char * startwal ){
+
+   PGresult * result;
+   char * sql;
+   char * target;
+   char * client;
+   char tli [ 9 ];
+   int segs;
+
+   sql = MALLOC ( BUFLEN );
+   target = MALLOC ( BUFLEN );
+   if ( ! sql || ! target ){
+      if ( sql ){
+         FREE ( sql );
+      }
+      return;
+   }
+
+   client = search_key ( pdata->paramlist, "ARCHCLIENT" );
+   strncpy ( tli, startwal, 8 );
+   tli [ 8 ] = 0;
+   build_pitr_wal_bound ( pdata, client, tli, startwal, target, BUFLEN );
+   snprintf ( sql, BUFLEN,
+         "select count(distinct filename) from pgsql_archivelogs where client='%s' and filename like '%s%%' and filename >= '%s' and length(filename)=%i and status in (%s)%s",
+         client, tli, startwal, WALNAMELEN, PGSQL_STATUS_WAL_OK, target );
+   FREE ( target );
+
+   result = PQexec ( pdata->catdb, sql );
+   if ( PQresultStatus ( result ) == PGRES_TUPLES_OK && PQntuples ( result ) == 1 ){
+      segs = atoi ( PQgetvalue ( result, 0, 0 ) );
+      snprintf ( sql, BUFLEN, "expected WAL replay from %s: %i segments, %i MB",
+            startwal, segs, segs * ( WALSEGSIZE / ( 1024 * 1024 ) ) );
+      logprg ( LOGINFO, sql );
+   } else {
+      logprg ( LOGWARNING, "CATDB: expected WAL replay query error" );
+   }
+   PQclear ( result );
+   FREE ( sql );
+}
+
+/*
+ * informs that newer sharded database backups are not selected as a base
+ * backup when DBSHARDS is not set, they are restored as a complete shard set
+ * only
+ *
+ * in:
+ *    pdata
+ *    target - recovery target condition of pgsql_backupdbs query
+ *    after - end date of selected base backup or NULL when none found
+ */
+void report_sharded_backups ( pgsqldata * pdata, const char * target, const char * after ){
+
+   PGresult * result;
+   char * sql;
+
+   sql = MALLOC ( BUFLEN );
+   ASSERT_NVAL_RET ( sql );
+   snprintf ( sql, BUFLEN,
+         "select count(distinct shardset) from pgsql_backupdbs where client='%s' and status in (%s) "
+         "and shardset is not null%s%s%s%s",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ), PGSQL_STATUS_DB_OK, target,
+         after ? " and end_date > '" : "", after ? after : "", after ? "'" : "" );
+   result = PQexec ( pdata->catdb, sql );
+   if ( PQresultStatus ( result ) == PGRES_TUPLES_OK && PQntuples ( result ) == 1 &&
+         atoi ( PQgetvalue ( result, 0, 0 ) ) > 0 ){
+      snprintf ( sql, BUFLEN, "%s newer sharded database backups skipped, set DBSHARDS to restore them",
+            PQgetvalue ( result, 0, 0 ) );
+      logprg ( LOGWARNING, sql );
+   }
+   PQclear ( result );
+   FREE ( sql );
+}
+
+/*
+ * selects the newest database backup finished before the recovery target
+ * from pgsql catalog and computes a list of Bacula jobs required to restore
+ * it: a full backup and optional differential and incremental backups on top,
+ * so restore does not depend on Bacula backup selection by date which could
+ * choose an older base backup and more WAL to replay
+ *
+ * in:
+ *    pdata
+ * out:
+ *    0 - on success, pdata->jobids is set
+ *    1 - no backup found in catalog, Bacula selects backups
+ */
+int select_base_backup ( pgsqldata * pdata ){
+
+   PGresult * result;
+   char * sql;
+   char * jobids;
+   char * pit;
+   char target [ BUFLEN ];
+   int need;
+   int level;
+   int pos = 0;
+   int a, n;
+
+   if ( pdata->pitr == PITR_XID || catdb_available ( pdata ) ){
+      /* transaction target could not be compared with backup time */
+      return 1;
+   }
+
+   sql = MALLOC ( BUFLEN );
+   ASSERT_NVAL_RET_ONE ( sql );
+   if ( pdata->pitr == PITR_TIME ){
+      pit = PQescapeLiteral ( pdata->catdb, pdata->restorepit, strlen ( pdata->restorepit ) );
+      if ( ! pit ){
+         FREE ( sql );
+         return 1;
+      }
+      snprintf ( target, BUFLEN, " and end_date <= %s", pit );
+      PQfreemem ( pit );
+   } else {
+      target [ 0 ] = 0;
+   }
+   /* a chain of backups ends with the selected one, newest first */
+   snprintf ( sql, BUFLEN,
+         "select jobid, blevel, coalesce(start_lsn, ''), coalesce(stop_lsn, ''), coalesce(start_wal, ''), end_date from pgsql_backupdbs "
+         "where client='%s' and status in (%s) and jobid is not null and shardset is null and id <= "
+         "(select max(id) from pgsql_backupdbs where client='%s' and status in (%s) and jobid is not null and shardset is null%s) "
+         "order by id desc limit 1000",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ), PGSQL_STATUS_DB_OK,
+         search_key ( pdata->paramlist, "ARCHCLIENT" ), PGSQL_STATUS_DB_OK, target );
+
+   result = PQexec ( pdata->catdb, sql );
+   if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
+      logprg ( LOGWARNING, "CATDB: base backup query error" );
+      PQclear ( result );
+      FREE ( sql );
+      return 1;
+   }
+   n = PQntuples ( result );
+   report_sharded_backups ( pdata, target, n ? PQgetvalue ( result, 0, 5 ) : NULL );
+   if ( ! n ){
+      PQclear ( result );
+      FREE ( sql );
+      return 1;
+   }
+
+   jobids = MALLOC ( BUFLEN );
+   if ( ! jobids ){
+      PQclear ( result );
+      FREE ( sql );
+      return 1;
+   }
+   /* incremental requires every older incremental down to a differential or full,
+    * differential requires a full only */
+   need = 'I';
+   for ( a = 0; a < n && need && pos < BUFLEN; a++ ){
+      level = atoi ( PQgetvalue ( result, a, 1 ) );
+      if ( a && level == 'I' && need != 'I' ){
+         continue;
+      }
+      if ( a && level == 'D' && need == 'F' ){
+         continue;
+      }
+      pos += snprintf ( jobids + pos, BUFLEN - pos, "%s%s", pos ? "," : "", PQgetvalue ( result, a, 0 ) );
+      need = level == 'I' ? 'I' : level == 'D' ? 'F' : 0;
+   }
+   if ( need || pos >= BUFLEN ){
+      logprg ( LOGWARNING, "full backup of selected base backup not found in catalog" );
+      PQclear ( result );
+      FREE ( jobids );
+      FREE ( sql );
+      return 1;
+   }
+
+   snprintf ( sql, BUFLEN, "base backup JobId %s level %c finished %s, start %s stop %s, restore jobs %s",
+         PQgetvalue ( result, 0, 0 ), atoi ( PQgetvalue ( result, 0, 1 ) ) ? atoi ( PQgetvalue ( result, 0, 1 ) ) : 'F',
+         PQgetvalue ( result, 0, 5 ), PQgetvalue ( result, 0, 2 ), PQgetvalue ( result, 0, 3 ), jobids );
+   logprg ( LOGINFO, sql );
+   if ( is_wal_filename ( PQgetvalue ( result, 0, 4 ) ) ){
+      report_expected_replay ( pdata, PQgetvalue ( result, 0, 4 ) );
+   }
+   PQclear ( result );
+   FREE ( sql );
+   pdata->jobids = jobids;
+
+   return 0;
+}
+
+/*
+ * restores database files from a single database fileset, a cached fileset
+ * name is rediscovered when restore fails
+ *
+ * in:
+ *    pdata
+ * out:
+ *    err - 0 if everything OK, 1 on error
+ */
+int restore_db_fileset ( pgsqldata * pdata ){
+
+   int err;
+   char * fileset;   // allocated
+
+   fileset = find_fileset ( pdata, DBFILESET );
+   if ( !fileset ){
+      logprg ( LOGERROR, "no valid fileset found" );
+      return 1;
+   }
+
+   if ( pdata->verbose ){
+      logprg ( LOGINFO, "pgsql backups found" );
+      logprg ( LOGINFO, "preparing for pgsql restore" );
+   }
+
+   if ( ! pdata->jobids && select_base_backup ( pdata ) && pdata->verbose ){
+      logprg ( LOGINFO, "no base backup in catalog, Bacula selects backups" );
+   }
+   
+   err = restore_db_files ( pdata, fileset );
+   if ( err && pdata->jobids ){
+      /* Bacula selection by date could restore a different base backup than
+       * the one WAL staging and recovery were prepared for */
+      logprg ( LOGERROR, "restore of selected base backup failed" );
+      FREE ( fileset );
+      return err;
+   }
+   if ( err ){
+      /* cached fileset could be outdated when director rejected it, rediscover it and try again */
+      err = retry_with_new_fileset ( pdata, DBFILESET, &fileset );
+      if ( ! err ){
+         err = restore_db_files ( pdata, fileset );
+      }
+   }
+   FREE ( fileset );
+
+   return err;
+}
+
+/*
+ * bconsole commands for database restore:
+   > * .filesets
+ * for any supplied filesets we execute
+   > * restore fileset=<$fileset> select
+   > * ls
+ * now we should get information about which fileset it is, verifing and if everything is ok, execute:
+   > * restore where=<where> fileset=<$fileset> [restoreclient=<client>][current,before="YYYY-MM-DD HH:MM:SS"] select
+ */
+int restore_database ( pgsqldata * pdata ){
+
+   int err;
+   int shards;
+
+   if ( pdata->verbose ){
+      logprg ( LOGINFO, "connecting to director" );
+   }
+   
+   err = connect_director ( pdata );
+   if ( err ){
+      logprg ( LOGERROR, "Error connecting to director" );
+      return 1;
+   }
+
+   if ( pdata->verbose ){
+      logprg ( LOGINFO, "looking for pgsql backups..." );
+   }
+
+   shards = atoi ( search_key ( pdata->paramlist, "DBSHARDS" ) );
+   if ( shards > PGMAXSHARDS ){
+      logprg ( LOGERROR, "too many DBSHARDS" );
+      shutdown_director_socket ( pdata );
+      return 1;
+   }
+   /* pgsql-restore and the plugin read DELTARESTORE separately */
+   if ( write_restore_mode ( pdata ) ){
+      shutdown_director_socket ( pdata );
+      return 1;
+   }
+   err = shards > 1 ? restore_db_shards ( pdata, shards ) : restore_db_fileset ( pdata );
+   remove_restore_mode ( pdata );
+   if ( err ) {
+      logprg ( LOGERROR, "error restoring database files" );
+      shutdown_director_socket ( pdata );
+      return 1;
+   }
+
+   if ( pdata->where ){
+      if ( pdata->verbose ){
+         logprg ( LOGINFO, "tablespace references tuning" );
+      }
+      err = tune_tablespaces_links ( pdata );
+      if ( err ) {
+         logprg ( LOGERROR, "error restoring database files" );
+         shutdown_director_socket ( pdata );
+         return 1;
+      }
+   }
+
+   if ( pdata->verbose ){
+      logprg ( LOGINFO, "datafiles restore done" );
+   }
+   
+   release_director ( pdata );
+
+   return 0;
+}
+
+/*
+ * performs restore command with any available information about fileset
+ * additional it verifies jobid number and waits for its finish, it performs
+ * restore of the wal file
+ *
+ * in:
+ *    pdata
+ *    fileset - fileset name which will be used for restore
+ * out:
+ *    err - 0 if everything OK, 1 on error
+ */
+int restore_wal_file ( pgsqldata * pdata, const char * fileset ){
+
+   char * msg;
+   char * fullpath;
+   char * wheredir;
+   int err;
+
+   pdata->dirs.badfileset = 0;
+   msg = MALLOC ( BUFLEN );
+   if ( ! msg ){
+      logprg ( LOGERROR, "out of memeory!" );
+      return 1;
+   }
+   fullpath = MALLOC ( BUFLEN );
+   if ( ! fullpath ){
+      FREE ( msg );
+      logprg ( LOGERROR, "out of memeory!" );
+      return 1;
+   }
+   
+   /* building a restore path for where */
+   realpath ( pdata->pathtowalfilename, fullpath );
+   wheredir = dirname ( fullpath );
+   
+   /*
+    * restore command execution:
+    * > restore where=<real_pathtowalfilename> fileset=<$fileset> file=<pgsqlarch:$client/walfilename> [restoreclient=<client>] done yes
+    * - where is optional, if we have a restore date then we have to supply before
+    * restore where=/tmp/pg_xlog fileset=pgsql-archset file=pgsqlarch:ubuntu-client-test/000000010000000000000024 done yes
+    */
+   /* XXX: is before really needed for pgsqlarch? */
+#if 0
+   snprintf ( msg, BUFLEN, 
+            "restore where=\"%s\" fileset=\"%s\" file=\"pgsqlarch:%s/%s\" %s%s done yes",
+            wheredir, fileset,
+            search_key ( pdata->paramlist, "ARCHCLIENT" ),
+            pdata->walfilename,
+            pdata->pitr == PITR_CURRENT || pdata->pitr == PITR_XID ?
+               "current" : "before=",
+            pdata->pitr == PITR_TIME ? pdata->restorepit : "" );
+#else
+   snprintf ( msg, BUFLEN, 
+            "restore where=\"%s\" fileset=\"%s\" file=\"pgsqlarch:%s/%s\" %s%s done yes",
+            wheredir, fileset,
+            search_key ( pdata->paramlist, "ARCHCLIENT" ),
+            pdata->walfilename,
+            pdata->restoreclient ? "restoreclient=" : "",
+            pdata->restoreclient ? pdata->restoreclient : "" );
+#endif
+
+   err = send_director_msg ( pdata, msg );
+
+   if ( err ){
+      logprg ( LOGERROR, "Error sending data (restore file)" );
+      return 1;
+   }
+
+   err = wait_for_restore_job ( pdata );
+   FREE ( msg );
+   FREE ( fullpath );
+
+   return err;
+}
+
+/*
+ * returns an allocated location of the WAL prefetch spool directory: prepared
+ * by database restore (-s), WALSPOOL from config file or /tmp/<ARCHCLIENT>.spool
+ * by default
+ */
+char * get_wal_spool ( pgsqldata * pdata ){
+
+   char * spool;
+   char * buf;
+
+   if ( pdata->walspool ){
+      return bstrdup ( pdata->walspool );
+   }
+   spool = search_key ( pdata->paramlist, "WALSPOOL" );
+   if ( spool ){
+      return bstrdup ( spool );
+   }
+
+   buf = MALLOC ( PATH_MAX );
+   ASSERT_NVAL_RET_NULL ( buf );
+   snprintf ( buf, PATH_MAX, "/tmp/%s.spool", search_key ( pdata->paramlist, "ARCHCLIENT" ) );
+   spool = bstrdup ( buf );
+   FREE ( buf );
+
+   return spool;
+}
+
+/*
+ * checks a WAL spool directory before use, spooled files are served to
+ * recovery, so it has to be a directory (not a symbolic link) owned by
+ * the current user, others could only traverse it
+ *
+ * out:
+ *    0 - spool is safe to use
+ *    1 - spool not found or unsafe
+ */
+int check_wal_spool ( const char * spool ){
+
+   struct stat st;
+
+   if ( lstat ( spool, &st ) || ! S_ISDIR ( st.st_mode ) || st.st_uid != geteuid () ||
+         ( st.st_mode & ( S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH ) ) ){
+      return 1;
+   }
+
+   return 0;
+}
+
+/*
+ * prepares a WAL spool for staging and for restore_command running as a cluster
+ * owner: a private directory is created in WALSPOOL, otherwise in /tmp, so an
+ * existing entry is never reused nor removed; restore_command gets its location
+ * with -s
+ *
+ * in:
+ *    pdata
+ * out:
+ *    0 - on success, pdata->walspool is set
+ *    1 - on error, WAL staging is skipped
+ */
+int prepare_wal_spool ( pgsqldata * pdata ){
+
+   pgugid pgid;
+   char * spool;
+   char * buf;
+
+   if ( get_pgdata_pgugid ( pdata, &pgid ) ){
+      logprg ( LOGWARNING, "unable to get cluster owner for WAL spool" );
+      return 1;
+   }
+
+   buf = MALLOC ( PATH_MAX );
+   ASSERT_NVAL_RET_ONE ( buf );
+   spool = search_key ( pdata->paramlist, "WALSPOOL" );
+   if ( spool ){
+      /* the cluster owner has to reach its private spool inside */
+      if ( mkdir ( spool, S_IRWXU | S_IXGRP | S_IXOTH ) && errno != EEXIST ){
+         logprg ( LOGWARNING, "unable to create WAL spool directory:" );
+         logprg ( LOGWARNING, strerror ( errno ) );
+         FREE ( buf );
+         return 1;
+      }
+      snprintf ( buf, PATH_MAX, "%s/%s.spool.XXXXXX", spool, search_key ( pdata->paramlist, "ARCHCLIENT" ) );
+   } else {
+      snprintf ( buf, PATH_MAX, "/tmp/%s.spool.XXXXXX", search_key ( pdata->paramlist, "ARCHCLIENT" ) );
+   }
+   if ( ! mkdtemp ( buf ) ){
+      logprg ( LOGWARNING, "unable to create WAL spool directory:" );
+      logprg ( LOGWARNING, strerror ( errno ) );
+      FREE ( buf );
+      return 1;
+   }
+
+   if ( lchown ( buf, pgid.uid, pgid.gid ) ){
+      logprg ( LOGWARNING, "unable to prepare WAL spool directory:" );
+      logprg ( LOGWARNING, strerror ( errno ) );
+      remove_dir ( pdata, buf );
+      FREE ( buf );
+      return 1;
+   }
+   pdata->walspool = bstrdup ( buf );
+   FREE ( buf );
+
+   return 0;
+}
+
+/*
+ * returns a number of WAL segments to prefetch on every spool miss,
+ * 0 means prefetching is disabled
+ */
+int get_wal_prefetch ( pgsqldata * pdata ){
+
+   char * val;
+   int prefetch;
+
+   val = search_key ( pdata->paramlist, "WALPREFETCH" );
+   prefetch = val ? atoi ( val ) : 0;
+   if ( prefetch < 0 ){
+      prefetch = 0;
+   }
+   if ( prefetch > WALPREFETCHMAX ){
+      prefetch = WALPREFETCHMAX;
+   }
+
+   return prefetch;
+}
+
+/*
+ * removes all WAL files from the spool directory, when rmspool is set
+ * a private spool prepared by database restore is removed too; other
+ * entries of a configured spool are never touched
+ */
+void clean_wal_spool ( pgsqldata * pdata, int rmspool ){
+
+   char * spool;
+
+   spool = get_wal_spool ( pdata );
+   ASSERT_NVAL_RET ( spool );
+
+   if ( rmspool && pdata->walspool ){
+      remove_dir ( pdata, spool );
+   } else {
+      DIR * dirp;
+      struct dirent * filedir;
+      char * file;
+
+      dirp = opendir ( spool );
+      if ( dirp ){
+         file = MALLOC ( PATH_MAX );
+         while ( file && ( filedir = readdir ( dirp ) ) ){
+            if ( is_wal_filename ( filedir->d_name ) ){
+               snprintf ( file, PATH_MAX, "%s/%s", spool, filedir->d_name );
+               unlink ( file );
+            }
+         }
+         closedir ( dirp );
+         FREE ( file );
+      }
+   }
+   FREE ( spool );
+}
+
+/*
+ * removes WAL segments which precede a requested one from the spool directory,
+ * recovery does not ask for them anymore; staged and prefetched segments which
+ * follow are kept
+ *
+ * in:
+ *    pdata
+ *    wal - requested WAL segment name
+ */
+void trim_wal_spool ( pgsqldata * pdata, const char * wal ){
+
+   DIR * dirp;
+   struct dirent * filedir;
+   char * spool;
+   char * file;
+
+   spool = get_wal_spool ( pdata );
+   ASSERT_NVAL_RET ( spool );
+
+   dirp = opendir ( spool );
+   if ( dirp ){
+      file = MALLOC ( PATH_MAX );
+      while ( file && ( filedir = readdir ( dirp ) ) ){
+         if ( is_wal_filename ( filedir->d_name ) && strcmp ( filedir->d_name, wal ) < 0 ){
+            snprintf ( file, PATH_MAX, "%s/%s", spool, filedir->d_name );
+            unlink ( file );
+         }
+      }
+      closedir ( dirp );
+      FREE ( file );
+   }
+   FREE ( spool );
+}
+
+/*
+ * serves a requested WAL file from the WAL spool (filled by prefetch or staging),
+ * a spooled file is moved
+ * (or copied and removed when spool is on different filesystem) into %p location
+ *
+ * in:
+ *    pdata->walfilename, pdata->pathtowalfilename
+ * out:
+ *    0 - WAL file served from spool
+ *    1 - WAL file not found in spool or error
+ */
+int get_wal_from_spool ( pgsqldata * pdata ){
+
+   char * spool;
+   char * file;
+   int err;
+
+   spool = get_wal_spool ( pdata );
+   ASSERT_NVAL_RET_ONE ( spool );
+
+   file = MALLOC ( PATH_MAX );
+   if ( ! file ){
+      FREE ( spool );
+      return 1;
+   }
+   snprintf ( file, PATH_MAX, "%s/%s", spool, pdata->walfilename );
+   err = check_wal_spool ( spool );
+   FREE ( spool );
+
+   if ( err || access ( file, R_OK ) ){
+      /* spool miss */
+      FREE ( file );
+      return 1;
+   }
+
+   err = rename ( file, pdata->pathtowalfilename );
+   if ( err ){
+      err = _copy_wal_file ( pdata, file, pdata->pathtowalfilename );
+      if ( ! err ){
+         unlink ( file );
+      }
+   }
+   FREE ( file );
+
+   if ( ! err && pdata->verbose ){
+      logprg ( LOGINFO, "WAL file served from prefetch spool" );
+   }
+
+   return err;
+}
+
+/*
+ * predicts next WAL segments required by recovery (the same timeline and
+ * incrementing segment numbers) and checks in catalog which of them are
+ * available on Bacula
+ *
+ * in:
+ *    pdata->walfilename - currently requested WAL segment
+ *    prefetch - number of segments to check
+ * out:
+ *    keylist of WAL segment names to restore (including requested one)
+ *    NULL when nothing to prefetch
+ */
+keylist * get_prefetch_wal_list ( pgsqldata * pdata, int prefetch ){
+
+   keylist * list = NULL;
+   PGresult * result;
+   char * sql;
+   char * walname;
+   char wal [ WALNAMELEN + 1 ];
+   int len, pos;
+   int a, n;
+
+   if ( ! is_wal_filename ( pdata->walfilename ) ){
+      /* history files and other can't be predicted */
+      return NULL;
+   }
+
+   len = SQLLEN + ( WALNAMELEN + 4 ) * ( prefetch + 1 );
+   sql = MALLOC ( len );
+   ASSERT_NVAL_RET_NULL ( sql );
+
+   pos = snprintf ( sql, len, "select filename from pgsql_archivelogs where client='%s' and status='%i' and filename in ('%s'",
+         search_key ( pdata->paramlist, "ARCHCLIENT" ),
+         PGSQL_STATUS_WAL_BACK_DONE,
+         pdata->walfilename );
+
+   strncpy ( wal, pdata->walfilename, WALNAMELEN + 1 );
+   for ( a = 0; a < prefetch && pos < len; a++ ){
+      next_wal_filename ( wal, wal );
+      /* segments after the recovery target are not required */
+      if ( pdata->lastwal && strncmp ( wal, pdata->lastwal, 8 ) == 0 && strcmp ( wal, pdata->lastwal ) > 0 ){
+         break;
+      }
+      pos += snprintf ( sql + pos, len - pos, ",'%s'", wal );
+   }
+   if ( pos < len ){
+      snprintf ( sql + pos, len - pos, ") order by filename" );
+   }
+
+   result = PQexec ( pdata->catdb, sql );
+   FREE ( sql );
+
+   if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
+      logprg ( LOGWARNING, "CATDB: prefetch WAL list query error" );
+      PQclear ( result );
+      return NULL;
+   }
+
+   n = PQntuples ( result );
+   for ( a = 0; a < n; a++ ){
+      walname = PQgetvalue ( result, a, 0 );
+      list = add_keylist ( list, walname, walname );
+   }
+   PQclear ( result );
+
+   return list;
+}
+
+/*
+ * restores a list of WAL files into the prefetch spool directory, the list is
+ * split into as few restore jobs as director command buffer allows
+ *
+ * in:
+ *    pdata
+ *    fileset - fileset name which will be used for restore
+ *    list - WAL filenames to restore
+ *    spool - spool directory location
+ * out:
+ *    err - 0 if everything OK, 1 on error
+ */
+int restore_wal_spool ( pgsqldata * pdata, const char * fileset, keylist * list, const char * spool ){
+
+   char * msg;
+   char * tail;
+   keyitem * item;
+   char info [ 64 ];
+   int len, pos, tlen;
+   int nr;
+   int err = 0;
+
+   msg = MALLOC ( MSGBUFLEN );
+   if ( ! msg ){
+      logprg ( LOGERROR, "out of memeory!" );
+      return 1;
+   }
+   tail = MALLOC ( BUFLEN );
+   if ( ! tail ){
+      FREE ( msg );
+      logprg ( LOGERROR, "out of memeory!" );
+      return 1;
+   }
+
+   /*
+    * restore command execution:
+    * > restore where=<spool> fileset=<$fileset> file=<pgsqlarch:$client/wal1> file=<...> [restoreclient=<client>] done yes
+    */
+   tlen = snprintf ( tail, BUFLEN, " %s%s done yes",
+            pdata->restoreclient ? "restoreclient=" : "",
+            pdata->restoreclient ? pdata->restoreclient : "" );
+
+   item = (keyitem *) list->first();
+   while ( item && ! err ){
+      pos = snprintf ( msg, MSGBUFLEN, "restore where=\"%s\" fileset=\"%s\"",
+               spool, fileset );
+      nr = 0;
+      while ( item ){
+         len = snprintf ( msg + pos, MSGBUFLEN - pos, " file=\"pgsqlarch:%s/%s\"",
+                  search_key ( pdata->paramlist, "ARCHCLIENT" ),
+                  item->key );
+         if ( pos + len + tlen >= MSGBUFLEN ){
+            /* command buffer is full, rest goes to the next job */
+            msg [ pos ] = 0;
+            break;
+         }
+         pos += len;
+         nr++;
+         item = (keyitem *) list->next ( item );
+      }
+      if ( ! nr ){
+         logprg ( LOGERROR, "WAL prefetch command too long" );
+         err = 1;
+         break;
+      }
+      strncat ( msg, tail, MSGBUFLEN - pos - 1 );
+
+      if ( pdata->verbose ){
+         snprintf ( info, sizeof ( info ), "prefetching %i WAL files into spool", nr );
+         logprg ( LOGINFO, info );
+      }
+
+      err = send_director_msg ( pdata, msg );
+      if ( err ){
+         logprg ( LOGERROR, "Error sending data (restore file)" );
+         break;
+      }
+      err = wait_for_restore_job ( pdata );
+   }
+
+   FREE ( tail );
+   FREE ( msg );
+
+   return err;
+}
+
+/*
+ * restores the requested WAL file together with next predicted segments into
+ * the spool directory and serves requested file from the spool
+ *
+ * in:
+ *    pdata
+ *    fileset - fileset name which will be used for restore
+ *    prefetch - number of additional segments to prefetch
+ * out:
+ *    0 - WAL file restored
+ *    1 - prefetch unavailable or failed, caller should restore a single file
+ */
+int prefetch_wal_files ( pgsqldata * pdata, const char * fileset, int prefetch ){
+
+   keylist * list;
+   char * spool;
+   int err;
+
+   list = get_prefetch_wal_list ( pdata, prefetch );
+   if ( ! list ){
+      return 1;
+   }
+   if ( ! search_key ( list, pdata->walfilename ) ){
+      keylist_free ( list );
+      return 1;
+   }
+
+   spool = get_wal_spool ( pdata );
+   if ( ! spool ){
+      keylist_free ( list );
+      return 1;
+   }
+
+   /* segments before a spool miss are not required anymore, so the spool is
+    * bounded to one prefetch batch and staged segments still ahead */
+   trim_wal_spool ( pdata, pdata->walfilename );
+   if ( mkdir ( spool, S_IRWXU ) && errno != EEXIST ){
+      logprg ( LOGWARNING, "unable to create WAL spool directory:" );
+      logprg ( LOGWARNING, strerror ( errno ) );
+      FREE ( spool );
+      keylist_free ( list );
+      return 1;
+   }
+   if ( check_wal_spool ( spool ) ){
+      logprg ( LOGWARNING, "WAL spool directory is not private, prefetch disabled" );
+      FREE ( spool );
+      keylist_free ( list );
+      return 1;
+   }
+
+   err = restore_wal_spool ( pdata, fileset, list, spool );
+   keylist_free ( list );
+   FREE ( spool );
+
+   if ( ! err ){
+      err = get_wal_from_spool ( pdata );
+   }
+   if ( err ){
+      logprg ( LOGWARNING, "WAL prefetch failed, restoring single file" );
+   }
+
+   return err;
+}
+
+/*
+ * reads a name of the first WAL segment required by restored cluster from its
+ * backup_label file:
+ * START WAL LOCATION: 0/2000020 (file 000000010000000000000002)
+ *
+ * in:
+ *    pdata
+ *    wal - buffer for WAL segment name, at least WALNAMELEN + 1 bytes
+ * out:
+ *    0 - on success
+ *    1 - backup_label not found or invalid
+ */
+int get_backup_start_wal ( pgsqldata * pdata, char * wal ){
+
+   FILE * label;
+   char * buf;
+   int err = 1;
+
+   buf = MALLOC ( BUFLEN );
+   ASSERT_NVAL_RET_ONE ( buf );
+
+   snprintf ( buf, BUFLEN, "%s/backup_label",
+            pdata->where ? pdata->where :
+            search_key ( pdata->paramlist, "PGDATA" ) );
+
+   label = fopen ( buf, "r" );
+   if ( ! label ){
+      FREE ( buf );
+      return 1;
+   }
+
+   while ( fgets ( buf, BUFLEN, label ) ){
+      if ( sscanf ( buf, "START WAL LOCATION: %*s (file %24[0-9A-F])", wal ) == 1 &&
+           is_wal_filename ( wal ) ){
+         err = 0;
+         break;
+      }
+   }
+   fclose ( label );
+   FREE ( buf );
+
+   return err;
+}
+
+/*
+ * returns a number of WAL segments to stage before recovery starts,
+ * 0 means staging is disabled
+ */
+int get_wal_stage ( pgsqldata * pdata ){
+
+   char * val;
+   int stage;
+
+   val = search_key ( pdata->paramlist, "WALSTAGE" );
+   stage = val ? atoi ( val ) : 0;
+
+   return stage < 0 ? 0 : stage;
+}
+
+/*
+ * finds the last WAL segment required by the recovery target in a transaction
+ * index (WALINDEX): for a target time it is the first indexed segment with
+ * a transaction ended after the target, recovery stops there; for a target
+ * transaction it is the last segment which could end it, not indexed segments
+ * included; the next segment is added as a target record could continue there
+ *
+ * in:
+ *    pdata
+ *    client - archived client name
+ *    tli - backup timeline
+ *    startwal - first segment required by restored cluster
+ * out:
+ *    lastwal - the last segment name, at least WALNAMELEN + 1 bytes
+ *    0 - on success
+ *    1 - the index has no bound
+ */
+int get_pitr_last_wal ( pgsqldata * pdata, const char * client, const char * tli,
+      const char * startwal, char * lastwal ){
+
+   PGresult * result;
+   char * sql;
+   char * pit = NULL;
+   int err = 1;
+
+   switch ( pdata->pitr ){
+      case PITR_TIME:
+         break;
+      case PITR_XID:
+         /* a recovery_target_xid is a number, the catalog query needs it verified */
+         if ( ! pdata->restorepit [ 0 ] || strspn ( pdata->restorepit, "0123456789" ) != strlen ( pdata->restorepit ) ){
+            return 1;
+         }
+         break;
+      default:
+         return 1;
+   }
+   if ( catdb_available ( pdata ) ){
+      return 1;
+   }
+
+   if ( pdata->pitr == PITR_TIME ){
+      pit = PQescapeLiteral ( pdata->catdb, pdata->restorepit, strlen ( pdata->restorepit ) );
+      ASSERT_NVAL_RET_ONE ( pit );
+   }
+   sql = MALLOC ( BUFLEN );
+   if ( ! sql ){
+      if ( pit ){
+         PQfreemem ( pit );
+      }
+      return 1;
+   }
+   if ( pdata->pitr == PITR_TIME ){
+      snprintf ( sql, BUFLEN,
+            "select min(filename) from pgsql_walsummaries where client='%s' and filename like '%s%%' and filename >= '%s' and max_time > %s",
+            client, tli, startwal, pit );
+      PQfreemem ( pit );
+   } else {
+      /* an epoch of 64 bit transaction id is not in WAL */
+      snprintf ( sql, BUFLEN,
+            "select max(a.filename) from pgsql_archivelogs a left join pgsql_walsummaries s on s.client=a.client and s.filename=a.filename "
+            "where a.client='%s' and a.filename like '%s%%' and a.filename >= '%s' and length(a.filename)=%i and a.status in (%s) "
+            "and (s.commits is null or s.unknown_xids > 0 or %lu between s.min_xid and s.max_xid)",
+            client, tli, startwal, WALNAMELEN, PGSQL_STATUS_WAL_OK,
+            (unsigned long) ( strtoull ( pdata->restorepit, NULL, 10 ) & 0xFFFFFFFF ) );
+   }
+
+   result = PQexec ( pdata->catdb, sql );
+   FREE ( sql );
+   if ( PQresultStatus ( result ) == PGRES_TUPLES_OK && PQntuples ( result ) == 1 &&
+         ! PQgetisnull ( result, 0, 0 ) ){
+      strncpy ( lastwal, PQgetvalue ( result, 0, 0 ), WALNAMELEN + 1 );
+      err = next_wal_filename ( lastwal, lastwal );
+   }
+   PQclear ( result );
+
+   return err;
+}
+
+/*
+ * renders a catalog query condition which limits WAL files to the recovery
+ * target, taken from a transaction index when available; otherwise a segment
+ * with target time is archived at or after the target time; an empty condition
+ * for other recovery targets
+ */
+void build_pitr_wal_bound ( pgsqldata * pdata, const char * client, const char * tli,
+      const char * startwal, char * target, int len ){
+
+   char lastwal [ WALNAMELEN + 1 ];
+   char * pit;
+
+   if ( ! get_pitr_last_wal ( pdata, client, tli, startwal, lastwal ) ){
+      snprintf ( target, len, " and filename <= '%s'", lastwal );
+   } else
+   if ( pdata->pitr == PITR_TIME && ! catdb_available ( pdata ) &&
+         ( pit = PQescapeLiteral ( pdata->catdb, pdata->restorepit, strlen ( pdata->restorepit ) ) ) ){
+      snprintf ( target, len,
+            " and filename <= coalesce((select min(filename) from pgsql_archivelogs where client='%s' and filename like '%s%%' and filename >= '%s' and create_date >= %s), filename)",
+            client, tli, startwal, pit );
+      PQfreemem ( pit );
+   } else {
+      target [ 0 ] = 0;
+   }
+}
+
+/*
+ * computes a list of WAL files required by recovery from the base backup start
+ * segment up to the recovery target, for time based recovery the list ends
+ * with the first segment archived after the target time, otherwise with the
+ * last archived segment on the backup timeline
+ *
+ * in:
+ *    pdata
+ *    startwal - first segment required by restored cluster
+ *    limit - maximum number of segments
+ * out:
+ *    keylist of WAL file names with its catalog status as attrs
+ *    NULL when nothing found
+ */
+keylist * get_stage_wal_list ( pgsqldata * pdata, const char * startwal, int limit ){
+
+   keylist * list = NULL;
+   PGresult * result;
+   char * sql;
+   char * target;
+   char * client;
+   char tli [ 9 ];
+   int a, n;
+
+   sql = MALLOC ( BUFLEN );
+   ASSERT_NVAL_RET_NULL ( sql );
+   target = MALLOC ( BUFLEN );
+   if ( ! target ){
+      FREE ( sql );
+      return NULL;
+   }
+
+   client = search_key ( pdata->paramlist, "ARCHCLIENT" );
+   strncpy ( tli, startwal, 8 );
+   tli [ 8 ] = 0;
 
-   return 0;
+   build_pitr_wal_bound ( pdata, client, tli, startwal, target, BUFLEN );
+
+   /* ARCHDEST copy is preferred over Bacula restore, so min(status) */
+   snprintf ( sql, BUFLEN,
+         "select filename, min(status) as status from pgsql_archivelogs where client='%s' and filename like '%s%%' and filename >= '%s' and status in (%s)%s group by filename order by filename limit %i",
+         client, tli, startwal, PGSQL_STATUS_WAL_OK, target, limit );
+   FREE ( target );
+
+   result = PQexec ( pdata->catdb, sql );
+   FREE ( sql );
+
+   if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
+      logprg ( LOGWARNING, "CATDB: stage WAL list query error" );
+      PQclear ( result );
+      return NULL;
+   }
+
+   n = PQntuples ( result );
+   for ( a = 0; a < n; a++ ){
+      list = add_keylist_attr ( list,
+               PQgetvalue ( result, a, 0 ),
+               PQgetvalue ( result, a, 0 ),
+               atoi ( PQgetvalue ( result, a, 1 ) ) );
+   }
+   PQclear ( result );
+
+   return list;
 }
 
 /*
- * bconsole commands for database restore:
-   > * .filesets
- * for any supplied filesets we execute
-   > * restore fileset=<$fileset> select
-   > * ls
- * now we should get information about which fileset it is, verifing and if everything is ok, execute:
-   > * restore where=<where> fileset=<$fileset> [restoreclient=<client>][current,before="YYYY-MM-DD HH:MM:SS"] select
+ * prepares a recovery progress tracking: a first segment comes from
+ * backup_label and the last one from the catalog, bounded by recovery target
+ * (PROGRESSLOG, PROGRESSINTERVAL)
+ *
+ * in:
+ *    pdata
+ * out:
+ *    rp - initialized progress
+ *    0 - on success
+ *    1 - when the expected WAL range is unknown, progress is reported without ETA
  */
-int restore_database ( pgsqldata * pdata ){
-
-   int err;
-   char * fileset;   // allocated
+int init_recovery_progress ( pgsqldata * pdata, recprogress * rp ){
 
-   if ( pdata->verbose ){
-      logprg ( LOGINFO, "connecting to director" );
+   PGresult * result;
+   char * sql;
+   char * target;
+   char * client;
+   char * val;
+   char startwal [ WALNAMELEN + 1 ];
+   char tli [ 9 ];
+   char buf [ BUFLEN ];
+   int err = 1;
+
+   memset ( rp, 0, sizeof ( recprogress ) );
+   val = search_key ( pdata->paramlist, "PROGRESSINTERVAL" );
+   rp->interval = val ? atoi ( val ) : 10;
+
+   val = search_key ( pdata->paramlist, "PROGRESSLOG" );
+   if ( ! val ){
+      snprintf ( buf, BUFLEN, "/tmp/%s.progress.json", search_key ( pdata->paramlist, "ARCHCLIENT" ) );
+      rp->jsonpath = bstrdup ( buf );
+   } else
+   if ( strcasecmp ( val, "none" ) != 0 ){
+      rp->jsonpath = bstrdup ( val );
    }
-   
-   err = connect_director ( pdata );
-   if ( err ){
-      logprg ( LOGERROR, "Error connecting to director" );
+
+   if ( get_backup_start_wal ( pdata, startwal ) ){
       return 1;
    }
+   wal_segment_number ( startwal, &rp->firstseg );
+   rp->curseg = rp->firstseg;
+   strncpy ( rp->curwal, startwal, WALNAMELEN + 1 );
 
-   if ( pdata->verbose ){
-      logprg ( LOGINFO, "looking for pgsql backups..." );
-   }
-   
-   fileset = find_fileset ( pdata, DBFILESET );
-   if ( !fileset ){
-      logprg ( LOGERROR, "no valid fileset found" );
-      shutdown_director_socket ( pdata );
+   if ( catdb_available ( pdata ) ){
       return 1;
    }
 
-   if ( pdata->verbose ){
-      logprg ( LOGINFO, "pgsql backups found" );
-      logprg ( LOGINFO, "preparing for pgsql restore" );
-   }
-   
-   err = restore_db_files ( pdata, fileset );
-   FREE ( fileset );
-   if ( err ) {
-      logprg ( LOGERROR, "error restoring database files" );
-      shutdown_director_socket ( pdata );
+   sql = MALLOC ( BUFLEN );
+   ASSERT_NVAL_RET_ONE ( sql );
+   target = MALLOC ( BUFLEN );
+   if ( ! target ){
+      FREE ( sql );
       return 1;
    }
-
-   if ( pdata->where ){
-      if ( pdata->verbose ){
-         logprg ( LOGINFO, "tablespace references tuning" );
-      }
-      err = tune_tablespaces_links ( pdata );
-      if ( err ) {
-         logprg ( LOGERROR, "error restoring database files" );
-         shutdown_director_socket ( pdata );
-         return 1;
-      }
+   client = search_key ( pdata->paramlist, "ARCHCLIENT" );
+   strncpy ( tli, startwal, 8 );
+   tli [ 8 ] = 0;
+   build_pitr_wal_bound ( pdata, client, tli, startwal, target, BUFLEN );
+
+   snprintf ( sql, BUFLEN,
+         "select max(filename) from pgsql_archivelogs where client='%s' and filename like '%s%%' and filename >= '%s' and status in (%s)%s",
+         client, tli, startwal, PGSQL_STATUS_WAL_OK, target );
+   FREE ( target );
+
+   result = PQexec ( pdata->catdb, sql );
+   FREE ( sql );
+   if ( PQresultStatus ( result ) == PGRES_TUPLES_OK && PQntuples ( result ) == 1 &&
+         ! PQgetisnull ( result, 0, 0 ) ){
+      err = wal_segment_number ( PQgetvalue ( result, 0, 0 ), &rp->lastseg );
    }
+   PQclear ( result );
 
-   if ( pdata->verbose ){
-      logprg ( LOGINFO, "datafiles restore done" );
-      logprg ( LOGINFO, "disconnecting from director" );
+   if ( ! err && pdata->verbose ){
+      snprintf ( buf, BUFLEN, "recovery expected to replay %llu WAL segments",
+            (unsigned long long) ( rp->lastseg - rp->firstseg + 1 ) );
+      logprg ( LOGINFO, buf );
    }
-   
-   shutdown_director_socket ( pdata );
 
-   return 0;
+   return err;
 }
 
 /*
- * performs restore command with any available information about fileset
- * additional it verifies jobid number and waits for its finish, it performs
- * restore of the wal file
+ * stages all WAL files required for recovery in the WAL spool before postmaster
+ * startup, WAL files still located at ARCHDEST are copied directly and all other
+ * are restored with multi-file restore jobs, so recovery does not have to wait
+ * on Director for every segment. Any error here is not fatal, recovery will ask
+ * for missing WAL files with restore_command as usual.
  *
  * in:
  *    pdata
- *    fileset - fileset name which will be used for restore
  * out:
- *    err - 0 if everything OK, 1 on error
+ *    0 - on success or when staging is disabled
+ *    1 - on error
  */
-int restore_wal_file ( pgsqldata * pdata, const char * fileset ){
-
-   char * msg;
-   char * recv;
-   char * fullpath;
-   char * wheredir;
-   int err;
-   int rjobid,fjobid;
-   char jobstatus;
+int stage_wal_files ( pgsqldata * pdata ){
+
+   char startwal [ WALNAMELEN + 1 ];
+   keylist * list;
+   keylist * baclist = NULL;
+   keyitem * item;
+   char * spool;
+   char * src;
+   char * dst;
+   char * fileset;
+   int limit;
+   int nr = 0;
+   int err = 0;
 
-   msg = MALLOC ( BUFLEN );
-   if ( ! msg ){
-      logprg ( LOGERROR, "out of memeory!" );
+   limit = get_wal_stage ( pdata );
+   if ( ! limit ){
+      return 0;
+   }
+   if ( ! pdata->walspool ){
+      logprg ( LOGWARNING, "WAL spool not prepared, WAL staging skipped" );
       return 1;
    }
-   fullpath = MALLOC ( BUFLEN );
-   if ( ! fullpath ){
-      FREE ( msg );
-      logprg ( LOGERROR, "out of memeory!" );
+
+   if ( get_backup_start_wal ( pdata, startwal ) ){
+      logprg ( LOGWARNING, "backup_label not found, WAL staging skipped" );
       return 1;
    }
-   
-   /* building a restore path for where */
-   realpath ( pdata->pathtowalfilename, fullpath );
-   wheredir = dirname ( fullpath );
-   
-   /*
-    * restore command execution:
-    * > restore where=<real_pathtowalfilename> fileset=<$fileset> file=<pgsqlarch:$client/walfilename> [restoreclient=<client>] done yes
-    * - where is optional, if we have a restore date then we have to supply before
-    * restore where=/tmp/pg_xlog fileset=pgsql-archset file=pgsqlarch:ubuntu-client-test/000000010000000000000024 done yes
-    */
-   /* XXX: is before really needed for pgsqlarch? */
-#if 0
-   snprintf ( msg, BUFLEN, 
-            "restore where=\"%s\" fileset=\"%s\" file=\"pgsqlarch:%s/%s\" %s%s done yes",
-            wheredir, fileset,
-            search_key ( pdata->paramlist, "ARCHCLIENT" ),
-            pdata->walfilename,
-            pdata->pitr == PITR_CURRENT || pdata->pitr == PITR_XID ?
-               "current" : "before=",
-            pdata->pitr == PITR_TIME ? pdata->restorepit : "" );
-#else
-   snprintf ( msg, BUFLEN, 
-            "restore where=\"%s\" fileset=\"%s\" file=\"pgsqlarch:%s/%s\" %s%s done yes",
-            wheredir, fileset,
-            search_key ( pdata->paramlist, "ARCHCLIENT" ),
-            pdata->walfilename,
-            pdata->restoreclient ? "restoreclient=" : "",
-            pdata->restoreclient ? pdata->restoreclient : "" );
-#endif
 
-   err = send_director_msg ( pdata, msg );
+   dbconnect ( pdata );
 
-   if ( err ){
-      logprg ( LOGERROR, "Error sending data (restore file)" );
+   list = get_stage_wal_list ( pdata, startwal, limit );
+   if ( ! list ){
+      return 0;
+   }
+
+   spool = get_wal_spool ( pdata );
+   src = MALLOC ( PATH_MAX );
+   dst = MALLOC ( PATH_MAX );
+   if ( ! spool || ! src || ! dst ){
+      logprg ( LOGERROR, "out of memeory!" );
+      keylist_free ( list );
+      FREE ( spool );
+      FREE ( src );
+      FREE ( dst );
       return 1;
    }
 
-   /* searching for JobId number in running job message */
-   while (( recv = recv_director_msg ( pdata ) )){
-      if ( pdata->verbose ){
-         logprg ( LOGINFO, recv );
+   if ( ! err ){
+      foreach_dlist ( item, list ){
+         if ( item->attrs == PGSQL_STATUS_WAL_BACK_DONE ){
+            baclist = add_keylist ( baclist, item->key, item->value );
+            continue;
+         }
+         snprintf ( src, PATH_MAX, "%s/%s", search_key ( pdata->paramlist, "ARCHDEST" ), item->key );
+         snprintf ( dst, PATH_MAX, "%s/%s", spool, item->key );
+         if ( _copy_wal_file ( pdata, src, dst ) ){
+            /* restore_command will try it later */
+            unlink ( dst );
+         } else {
+            nr++;
+         }
       }
-      err = sscanf ( recv, "%*[^.]. JobId=%i", &rjobid );
-      if ( err == 1 ){
-         break;
+
+      if ( pdata->verbose ){
+         snprintf ( src, PATH_MAX, "staging WAL files from %s: %i copied from ARCHDEST", startwal, nr );
+         logprg ( LOGINFO, src );
       }
    }
-   
-   clear_receive_buffer ( pdata );
 
-   if ( pdata->verbose ){
-      snprintf ( msg, BUFLEN, "starting restore job: JobId=%i", rjobid );
-      logprg ( LOGINFO, msg );
-      logprg ( LOGINFO, "waiting for job to finish" );
+   if ( ! err && baclist ){
+      err = connect_director ( pdata );
+      if ( err ){
+         logprg ( LOGWARNING, "Error connecting to director" );
+      } else {
+         fileset = find_fileset ( pdata, ARCHFILESET );
+         if ( fileset ){
+            err = restore_wal_spool ( pdata, fileset, baclist, spool );
+            FREE ( fileset );
+         } else {
+            logprg ( LOGWARNING, "no valid wal fileset found" );
+            err = 1;
+         }
+         if ( err ){
+            shutdown_director_socket ( pdata );
+         } else {
+            release_director ( pdata );
+         }
+      }
    }
-   
-   snprintf ( msg, BUFLEN, "wait jobid=%i", rjobid );
 
-   err = send_director_msg ( pdata, msg );
    if ( err ){
-      logprg ( LOGERROR, "Error sending data (wait jobid)" );
-      return 1;
+      logprg ( LOGWARNING, "WAL staging incomplete, recovery will restore missing WAL files" );
+   } else
+   if ( pdata->verbose ){
+      logprg ( LOGINFO, "WAL staging done" );
    }
 
-   /*
-    * JobId=NN
-    * JobStatus=OK (T)
-    */
-   recv = recv_director_msg ( pdata );
-   err = sscanf ( recv, "JobId=%i", &fjobid );
-   FREE ( recv );
-   if ( err != 1 ){
-      logprg ( LOGERROR, "Error waiting for restore job" );
-      return 1;
-   }
-   recv = recv_director_msg ( pdata );
-   //err = sscanf ( recv, "JobStatus=%*[^ ] (%c)", &jobstatus );
-   err = sscanf ( recv, "JobStatus=%s (%c)", msg, &jobstatus );
-   FREE ( recv );
-   
-   if ( err != 2 ){
-      logprg ( LOGERROR, "Error restore jobstatus" );
-      return 1;
-   }
-   
-   if ( jobstatus != 'T' ){
-      /* job finished with an error */
-      logprg ( LOGERROR, "Error restore job:" );
-      logprg ( LOGERROR, msg );
-      return 1;
+   if ( baclist ){
+      keylist_free ( baclist );
    }
+   keylist_free ( list );
+   FREE ( spool );
+   FREE ( src );
+   FREE ( dst );
 
-   clear_receive_buffer ( pdata );
-
-   return 0;
+   return err;
 }
 
 /*
@@ -2067,6 +4561,7 @@ int restore_wal_file ( pgsqldata * pdata, const char * fileset ){
 int restore_arch ( pgsqldata * pdata ){
 
    int err;
+   int prefetch;
    char * fileset;   // allocated
 
    if ( pdata->verbose ){
@@ -2100,7 +4595,21 @@ int restore_arch ( pgsqldata * pdata ){
       FREE ( msg );
    }
    
-   err = restore_wal_file ( pdata, fileset );
+   err = 1;
+   prefetch = get_wal_prefetch ( pdata );
+   if ( prefetch ){
+      err = prefetch_wal_files ( pdata, fileset, prefetch );
+   }
+   if ( err ){
+      err = restore_wal_file ( pdata, fileset );
+   }
+   if ( err ){
+      /* cached fileset could be outdated when director rejected it, rediscover it and try again */
+      err = retry_with_new_fileset ( pdata, ARCHFILESET, &fileset );
+      if ( ! err ){
+         err = restore_wal_file ( pdata, fileset );
+      }
+   }
    FREE ( fileset );
    if ( err ) {
       logprg ( LOGERROR, "error restoring database files" );
@@ -2110,10 +4619,9 @@ int restore_arch ( pgsqldata * pdata ){
 
    if ( pdata->verbose ){
       logprg ( LOGINFO, "wal file restore done" );
-      logprg ( LOGINFO, "disconnecting from director" );
    }
    
-   shutdown_director_socket ( pdata );
+   release_director ( pdata );
 
    return 0;
 }
@@ -2127,6 +4635,9 @@ int create_recovery_conf ( pgsqldata * pdata ){
    char * recovery_path;         // allocated
    char * recovery_command;      // allocated
    char * recovery_target_point; // allocated
+   char startwal [ WALNAMELEN + 1 ];
+   char lastwal [ WALNAMELEN + 1 ];
+   char tli [ 9 ];
    int recovery_file;
    int err;
 
@@ -2156,11 +4667,29 @@ int create_recovery_conf ( pgsqldata * pdata ){
       return 1;
    }
 
-   snprintf ( recovery_command, PATH_MAX, "restore_command = '%s -v -c %s %s%s wal %%f %%p'\n",
+   /* WAL prefetch stops at the last segment required by recovery target */
+   lastwal [ 0 ] = 0;
+   if ( pdata->pitr != PITR_CURRENT && ! get_backup_start_wal ( pdata, startwal ) ){
+      strncpy ( tli, startwal, 8 );
+      tli [ 8 ] = 0;
+      if ( get_pitr_last_wal ( pdata, search_key ( pdata->paramlist, "ARCHCLIENT" ), tli, startwal, lastwal ) ){
+         lastwal [ 0 ] = 0;
+      } else
+      if ( pdata->verbose ){
+         snprintf ( recovery_command, PATH_MAX, "recovery target requires WAL up to %s", lastwal );
+         logprg ( LOGINFO, recovery_command );
+      }
+   }
+
+   snprintf ( recovery_command, PATH_MAX, "restore_command = '%s -v -c %s %s%s%s%s%s%s wal %%f %%p'\n",
                get_program_directory (),
                pdata->configfile,
                pdata->restoreclient ? "-r " : "",
-               pdata->restoreclient ? pdata->restoreclient : "" );
+               pdata->restoreclient ? pdata->restoreclient : "",
+               lastwal [ 0 ] ? " -l " : "",
+               lastwal,
+               pdata->walspool ? " -s " : "",
+               pdata->walspool ? pdata->walspool : "" );
    err = write ( recovery_file, recovery_command, strlen (recovery_command) );
    if ( err < (int)strlen ( recovery_command ) ){
       err = errno;
@@ -2178,27 +4707,108 @@ int create_recovery_conf ( pgsqldata * pdata ){
          return 1;
       }
 
-      snprintf ( recovery_target_point, PATH_MAX, 
-                  pdata->pitr == PITR_TIME ?
-                     "recovery_target_time = '%s'\n" :
-                     "recovery_target_xid = '%s'\n",
-                     pdata->restorepit );
+      snprintf ( recovery_target_point, PATH_MAX, 
+                  pdata->pitr == PITR_TIME ?
+                     "recovery_target_time = '%s'\n" :
+                     "recovery_target_xid = '%s'\n",
+                     pdata->restorepit );
+
+      err = write ( recovery_file, recovery_target_point, strlen ( recovery_target_point ) );
+      if ( err < (int) strlen ( recovery_target_point ) ){
+         err = errno;
+         logprg ( LOGERROR, "error writting to recovery.conf file!" );
+         logprg ( LOGERROR, strerror ( err ) );
+         FREE ( recovery_target_point );
+         return 1;
+      }
+      FREE ( recovery_target_point );
+   }
+   
+   close ( recovery_file );
+   
+   return 0;
+}
+/*
+ * prints archived WAL segments found in a transaction index (WALINDEX) for
+ * a recovery target: segments with transactions ended around a target time
+ * and the first one ended after it, where recovery stops, or segments which
+ * could end a target transaction; one line for every segment:
+ *    <walfile> <min.time> <max.time> <commits> <aborts>
+ *
+ * in:
+ *    pdata
+ * out:
+ *    0 - segments found
+ *    1 - nothing found or catalog error
+ */
+int find_wal_by_target ( pgsqldata * pdata ){
+
+   PGresult * result;
+   char * sql;
+   char * client;
+   char * pit = NULL;
+   int a, n;
+
+   if ( pdata->pitr == PITR_XID &&
+         ( ! pdata->restorepit [ 0 ] || strspn ( pdata->restorepit, "0123456789" ) != strlen ( pdata->restorepit ) ) ){
+      logprg ( LOGERROR, "recovery transaction has to be a number" );
+      return 1;
+   }
+   if ( catdb_available ( pdata ) ){
+      logprg ( LOGERROR, "Problem connecting to catalog database!" );
+      return 1;
+   }
+
+   if ( pdata->pitr == PITR_TIME ){
+      pit = PQescapeLiteral ( pdata->catdb, pdata->restorepit, strlen ( pdata->restorepit ) );
+      ASSERT_NVAL_RET_ONE ( pit );
+   }
+   sql = MALLOC ( BUFLEN );
+   if ( ! sql ){
+      if ( pit ){
+         PQfreemem ( pit );
+      }
+      return 1;
+   }
+   client = search_key ( pdata->paramlist, "ARCHCLIENT" );
+   if ( pdata->pitr == PITR_TIME ){
+      snprintf ( sql, BUFLEN,
+            "select filename, min_time, max_time, commits, aborts from pgsql_walsummaries where client='%s' and "
+            "((min_time <= %s and max_time >= %s) or filename = (select filename from pgsql_walsummaries "
+            "where client='%s' and max_time > %s order by start_lsn, filename limit 1)) order by filename",
+            client, pit, pit, client, pit );
+      PQfreemem ( pit );
+   } else {
+      snprintf ( sql, BUFLEN,
+            "select filename, min_time, max_time, commits, aborts from pgsql_walsummaries where client='%s' and "
+            "%lu between min_xid and max_xid order by filename",
+            client, (unsigned long) ( strtoull ( pdata->restorepit, NULL, 10 ) & 0xFFFFFFFF ) );
+   }
+
+   result = PQexec ( pdata->catdb, sql );
+   FREE ( sql );
+   if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
+      logprg ( LOGERROR, "CATDB: WAL index query error" );
+      PQclear ( result );
+      return 1;
+   }
+
+   n = PQntuples ( result );
+   for ( a = 0; a < n; a++ ){
+      printf ( "%s %s %s %s %s\n", PQgetvalue ( result, a, 0 ),
+            PQgetvalue ( result, a, 1 ), PQgetvalue ( result, a, 2 ),
+            PQgetvalue ( result, a, 3 ), PQgetvalue ( result, a, 4 ) );
+   }
+   PQclear ( result );
 
-      err = write ( recovery_file, recovery_target_point, strlen ( recovery_target_point ) );
-      if ( err < (int) strlen ( recovery_target_point ) ){
-         err = errno;
-         logprg ( LOGERROR, "error writting to recovery.conf file!" );
-         logprg ( LOGERROR, strerror ( err ) );
-         FREE ( recovery_target_point );
-         return 1;
-      }
-      FREE ( recovery_target_point );
+   if ( ! n ){
+      logprg ( LOGWARNING, "no indexed WAL segment found for recovery target" );
+      return 1;
    }
-   
-   close ( recovery_file );
-   
+
    return 0;
 }
+
 /*
  * erases a recovery.conf file in cluster directory (PGDATA)
  */
@@ -2279,11 +4889,638 @@ int copy_wal_loc_archdest ( pgsqldata * pdata ){
  *    restore | wal <wal.filename> <where> }
  *
  */
+/* file read buffer size for backup verification */
+#define VERIFYBUFSIZE      ( 1024 * 1024 )
+/* maximum number of failures listed in verification report */
+#define VERIFYMAXERRORS    10
+/* interval in seconds between verification progress reports */
+#define VERIFYREPORTINTERVAL  5
+/* PostgreSQL page layout */
+#define PGPAGEHDRSIZE      24
+#define PGPAGELAYOUTVER    4
+#define PGPAGEVALIDFLAGS   0x0007
+#define PGCHECKSUMNSUMS    32
+#define PGCHECKSUMPRIME    16777619
+
+/* base offsets of PostgreSQL data page checksum, see checksum_impl.h */
+static const uint32_t pg_checksum_offsets [ PGCHECKSUMNSUMS ] = {
+   0x5B1F36E9, 0xB8525960, 0x02AB50AA, 0x1DE66D2A,
+   0x79FF467A, 0x9BB9F8A3, 0x217E7CD2, 0x83E13D2C,
+   0xF8D4474F, 0xE39EB970, 0x42C6AE16, 0x993216FA,
+   0x7B093B5D, 0x98DAFF3C, 0xF718902A, 0x0B1C9CDB,
+   0xE58F764B, 0x187636BC, 0x5D7B3BB1, 0xE73DE7DE,
+   0x92BEC979, 0xCCA6C0B2, 0x304A0979, 0x85AA43D4,
+   0x783125BB, 0x6CA8EAA2, 0xE407EAC6, 0x4B5CFC3E,
+   0x9FBF8C76, 0x15CA20BE, 0xF2CA9FD3, 0x959BD756
+};
+
+/* a single backup manifest file verified by a verification thread */
+typedef struct _verifyfile verifyfile;
+struct _verifyfile {
+   char * path;            /* manifest path, relative to restore destination */
+   long long size;
+   uint32_t crc;
+   int hascrc;
+   char * error;           /* first problem found or NULL */
+   long long bytes;
+   long long pages;        /* pages with header and checksum verified */
+   long long skipped;      /* pages changed during backup, checksum not verified */
+};
+
+/* backup verification state shared by verification threads */
+typedef struct _verifyctx verifyctx;
+struct _verifyctx {
+   const char * dir;
+   verifyfile * files;
+   int nfiles;
+   int checksums;          /* data page checksums enabled in cluster */
+   int blcksz;
+   int relsegsize;         /* blocks per segment of large relation */
+   uint64_t startlsn;
+   int verbose;
+   pthread_mutex_t mutex;
+   int filesdone;
+   long long bytesdone;
+   double start;
+   double lastreport;
+};
+
+/*
+ * computes PostgreSQL data page checksum, pd_checksum field is not
+ * included in computation
+ *
+ * in:
+ *    page - page data
+ *    blkno - block number in relation
+ *    blcksz - page size
+ * out:
+ *    page checksum
+ */
+uint16_t pg_page_checksum ( const unsigned char * page, uint32_t blkno, int blcksz ){
+
+   uint32_t sums [ PGCHECKSUMNSUMS ];
+   uint32_t words [ PGCHECKSUMNSUMS ];
+   uint32_t result = 0;
+   uint32_t tmp;
+   int rows = blcksz / sizeof ( words );
+   int i, j;
+
+   memcpy ( sums, pg_checksum_offsets, sizeof ( sums ) );
+   for ( i = 0; i < rows + 2; i++ ){
+      if ( i < rows ){
+         memcpy ( words, page + i * sizeof ( words ), sizeof ( words ) );
+         if ( i == 0 ){
+            /* pd_checksum is the first half of the third word */
+            memset ( (char *) words + 8, 0, sizeof ( uint16_t ) );
+         }
+      } else {
+         /* two additional rounds of zeroes for better mixing */
+         memset ( words, 0, sizeof ( words ) );
+      }
+      for ( j = 0; j < PGCHECKSUMNSUMS; j++ ){
+         tmp = sums [ j ] ^ words [ j ];
+         sums [ j ] = tmp * PGCHECKSUMPRIME ^ ( tmp >> 17 );
+      }
+   }
+   for ( j = 0; j < PGCHECKSUMNSUMS; j++ ){
+      result ^= sums [ j ];
+   }
+   result ^= blkno;
+
+   return (uint16_t) ( ( result % 65535 ) + 1 );
+}
+
+/*
+ * checks if a backup manifest path is a relation data file: base/<db>/<relfile>,
+ * global/<relfile> or a tablespace PG_<version>/<db>/<relfile>, with optional
+ * fork suffix and segment number
+ *
+ * in:
+ *    path - manifest path
+ *    segno - segment number found in file name
+ * out:
+ *    1 - relation data file
+ *    0 - any other file
+ */
+int verify_is_relation ( const char * path, int * segno ){
+
+   const char * name;
+   const char * p;
+
+   if ( strncmp ( path, "base/", 5 ) && strncmp ( path, "global/", 7 ) && ! strstr ( path, "/PG_" ) ){
+      return 0;
+   }
+   name = strrchr ( path, '/' );
+   name = name ? name + 1 : path;
+   for ( p = name; isdigit ( *p ); p++ );
+   if ( p == name ){
+      return 0;
+   }
+   if ( ! strncmp ( p, "_fsm", 4 ) || ! strncmp ( p, "_vm", 3 ) ){
+      p += p [ 1 ] == 'f' ? 4 : 3;
+   } else
+   if ( ! strncmp ( p, "_init", 5 ) ){
+      p += 5;
+   }
+   *segno = 0;
+   if ( *p == '.' ){
+      *segno = atoi ( ++p );
+      for ( ; isdigit ( *p ); p++ );
+   }
+
+   return *p == 0;
+}
+
+/*
+ * verifies a page header sanity and a page checksum, new pages have to be
+ * zeroed entirely
+ *
+ * in:
+ *    ctx - verification state
+ *    page - page data
+ *    blkno - block number in relation
+ *    msg - buffer for a problem description
+ *    len - msg buffer size
+ * out:
+ *    0 - page verified
+ *    1 - page is invalid, msg describes a problem
+ *    -1 - page changed during backup, checksum was not verified
+ */
+int verify_page ( verifyctx * ctx, const unsigned char * page, uint32_t blkno, char * msg, int len ){
+
+   uint32_t xlogid, xrecoff;
+   uint16_t checksum, flags, lower, upper, special, sizever;
+   uint16_t expected;
+   int i;
+
+   memcpy ( &xlogid, page, sizeof ( uint32_t ) );
+   memcpy ( &xrecoff, page + 4, sizeof ( uint32_t ) );
+   memcpy ( &checksum, page + 8, sizeof ( uint16_t ) );
+   memcpy ( &flags, page + 10, sizeof ( uint16_t ) );
+   memcpy ( &lower, page + 12, sizeof ( uint16_t ) );
+   memcpy ( &upper, page + 14, sizeof ( uint16_t ) );
+   memcpy ( &special, page + 16, sizeof ( uint16_t ) );
+   memcpy ( &sizever, page + 18, sizeof ( uint16_t ) );
+
+   if ( upper == 0 ){
+      /* new page, never initialized by PostgreSQL */
+      for ( i = 0; i < ctx->blcksz; i++ ){
+         if ( page [ i ] ){
+            snprintf ( msg, len, "new page block %u is not zeroed", blkno );
+            return 1;
+         }
+      }
+      return 0;
+   }
+   if ( ( flags & ~PGPAGEVALIDFLAGS ) || lower < PGPAGEHDRSIZE || lower > upper ||
+        upper > special || special > ctx->blcksz || ( special & 7 ) ||
+        ( sizever & 0x00FF ) != PGPAGELAYOUTVER || ( sizever & 0xFF00 ) != ctx->blcksz ){
+      snprintf ( msg, len, "invalid page header block %u (lower %u upper %u special %u version %04X)",
+            blkno, lower, upper, special, sizever );
+      return 1;
+   }
+   if ( ! ctx->checksums ){
+      return 0;
+   }
+   /* a page written after backup start may be torn, full page image from WAL fixes it */
+   if ( ctx->startlsn && ( (uint64_t) xlogid << 32 | xrecoff ) >= ctx->startlsn ){
+      return -1;
+   }
+   expected = pg_page_checksum ( page, blkno, ctx->blcksz );
+   if ( checksum != expected ){
+      snprintf ( msg, len, "bad page checksum block %u (found %04X expected %04X)",
+            blkno, checksum, expected );
+      return 1;
+   }
+
+   return 0;
+}
+
+/*
+ * verifies a single backup manifest file: its size, CRC32C checksum and for
+ * relation files every page, used by verification threads
+ */
+int verify_file_task ( void * arg, int item ){
+
+   verifyctx * ctx = (verifyctx *) arg;
+   verifyfile * vf = &ctx->files [ item ];
+   unsigned char * buf;
+   char path [ PATH_MAX ];
+   char msg [ BUFLEN ];
+   char badmsg [ BUFLEN ];
+   uint32_t crc = 0;
+   long long badpages = 0;
+   double now;
+   uint32_t blkno;
+   int relation;
+   int segno;
+   int fd;
+   int n, off;
+   int rc;
+
+   snprintf ( path, PATH_MAX, "%s/%s", ctx->dir, vf->path );
+   fd = open ( path, O_RDONLY );
+   if ( fd < 0 && errno == ENOENT ){
+      /* tablespaces verified in original location are not below PGDATA */
+      snprintf ( path, PATH_MAX, "/%s", vf->path );
+      fd = open ( path, O_RDONLY );
+   }
+   if ( fd < 0 ){
+      snprintf ( msg, BUFLEN, "%s: cannot open: %s", vf->path, strerror ( errno ) );
+      vf->error = bstrdup ( msg );
+      return 1;
+   }
+   buf = (unsigned char *) MALLOC ( VERIFYBUFSIZE );
+   if ( ! buf ){
+      close ( fd );
+      vf->error = bstrdup ( "memory allocation error" );
+      return 1;
+   }
+
+   relation = verify_is_relation ( vf->path, &segno );
+   blkno = (uint32_t) segno * ctx->relsegsize;
+   badmsg [ 0 ] = 0;
+   /* the buffer is a multiple of page size, so pages are never split between reads */
+   while ( ( n = read ( fd, buf, VERIFYBUFSIZE ) ) > 0 ){
+      crc = crc32c ( crc, buf, n );
+      vf->bytes += n;
+      for ( off = 0; relation && off + ctx->blcksz <= n; off += ctx->blcksz, blkno++ ){
+         rc = verify_page ( ctx, buf + off, blkno, msg, BUFLEN );
+         if ( rc > 0 ){
+            if ( ! badpages++ ){
+               strncpy ( badmsg, msg, BUFLEN );
+            }
+         } else
+         if ( rc < 0 ){
+            vf->skipped++;
+         } else {
+            vf->pages++;
+         }
+      }
+   }
+   if ( n < 0 ){
+      snprintf ( msg, BUFLEN, "%s: read error: %s", vf->path, strerror ( errno ) );
+      vf->error = bstrdup ( msg );
+   }
+   close ( fd );
+   FREE ( buf );
+
+   if ( ! vf->error ){
+      if ( vf->bytes != vf->size ){
+         snprintf ( msg, BUFLEN, "%s: size %lld differs from backup size %lld", vf->path, vf->bytes, vf->size );
+         vf->error = bstrdup ( msg );
+      } else
+      if ( vf->hascrc && crc != vf->crc ){
+         snprintf ( msg, BUFLEN, "%s: CRC32C %08x differs from backup %08x", vf->path, crc, vf->crc );
+         vf->error = bstrdup ( msg );
+      } else
+      if ( badpages ){
+         snprintf ( msg, BUFLEN, "%s: %s, %lld invalid pages", vf->path, badmsg, badpages );
+         vf->error = bstrdup ( msg );
+      }
+   }
+
+   pthread_mutex_lock ( &ctx->mutex );
+   ctx->filesdone++;
+   ctx->bytesdone += vf->bytes;
+   now = monotonic_time ();
+   if ( ctx->verbose && ( now - ctx->lastreport >= VERIFYREPORTINTERVAL || ctx->filesdone == ctx->nfiles ) ){
+      ctx->lastreport = now;
+      snprintf ( msg, BUFLEN, "verified %i/%i files: %.1f MB, %.1f MB/s",
+            ctx->filesdone, ctx->nfiles, ctx->bytesdone / 1048576.0,
+            now > ctx->start ? ctx->bytesdone / 1048576.0 / ( now - ctx->start ) : 0.0 );
+      logprg ( LOGINFO, msg );
+   }
+   pthread_mutex_unlock ( &ctx->mutex );
+
+   return vf->error ? 1 : 0;
+}
+
+/*
+ * reads cluster page layout and data checksums setting with pg_controldata,
+ * when it is not available pages are verified with default layout and
+ * without checksums
+ *
+ * in:
+ *    pdata
+ *    ctx - verification state with a cluster directory
+ */
+void verify_read_controldata ( pgsqldata * pdata, verifyctx * ctx ){
+
+   FILE * out;
+   const char * pgctl;
+   char * bindir;
+   char * buf;
+   int val;
+
+   ctx->blcksz = 8192;
+   ctx->relsegsize = 131072;
+   ctx->checksums = 0;
+
+   buf = MALLOC ( BUFLEN );
+   if ( ! buf ){
+      return;
+   }
+   pgctl = find_pgctl ( pdata );
+   if ( pgctl ){
+      bindir = bstrdup ( pgctl );
+      snprintf ( buf, BUFLEN, "LC_ALL=C %s/pg_controldata \"%s\" 2>/dev/null", dirname ( bindir ), ctx->dir );
+      FREE ( bindir );
+   } else {
+      snprintf ( buf, BUFLEN, "LC_ALL=C pg_controldata \"%s\" 2>/dev/null", ctx->dir );
+   }
+
+   out = popen ( buf, "r" );
+   if ( ! out ){
+      logprg ( LOGWARNING, "pg_controldata not available, page checksums are not verified" );
+      FREE ( buf );
+      return;
+   }
+   while ( fgets ( buf, BUFLEN, out ) ){
+      if ( sscanf ( buf, "Database block size: %i", &val ) == 1 && val >= 1024 && val <= 32768 && ! ( val & ( val - 1 ) ) ){
+         ctx->blcksz = val;
+      } else
+      if ( sscanf ( buf, "Blocks per segment of large relation: %i", &val ) == 1 && val > 0 ){
+         ctx->relsegsize = val;
+      } else
+      if ( sscanf ( buf, "Data page checksum version: %i", &val ) == 1 ){
+         ctx->checksums = val != 0;
+      }
+   }
+   if ( pclose ( out ) ){
+      logprg ( LOGWARNING, "pg_controldata failed, page checksums are not verified" );
+      ctx->checksums = 0;
+   }
+   FREE ( buf );
+}
+
+/*
+ * reads a backup manifest of a verified cluster, only regular files are
+ * verified
+ *
+ * in:
+ *    ctx - verification state with a cluster directory
+ *    stoplsn - backup stop LSN found in manifest or 0
+ * out:
+ *    0 - on success, ctx->files filled
+ *    1 - manifest not found or invalid
+ */
+int verify_read_manifest ( verifyctx * ctx, uint64_t * stoplsn ){
+
+   FILE * mf;
+   manifest_entry entry;
+   verifyfile * files = NULL;
+   verifyfile * tmp;
+   char * buf;
+   unsigned int hi, lo;
+   int size = 0;
+   int err = 0;
+
+   buf = MALLOC ( BUFLEN );
+   ASSERT_NVAL_RET_ONE ( buf );
+   snprintf ( buf, BUFLEN, "%s/" PGMANIFEST, ctx->dir );
+   mf = fopen ( buf, "r" );
+   if ( ! mf ){
+      FREE ( buf );
+      return 1;
+   }
+
+   *stoplsn = 0;
+   ctx->startlsn = 0;
+   ctx->nfiles = 0;
+   while ( freadline ( mf, buf, BUFLEN ) >= 0 ){
+      if ( sscanf ( buf, "start_lsn %X/%X", &hi, &lo ) == 2 ){
+         ctx->startlsn = (uint64_t) hi << 32 | lo;
+         continue;
+      }
+      if ( sscanf ( buf, "stop_lsn %X/%X", &hi, &lo ) == 2 ){
+         *stoplsn = (uint64_t) hi << 32 | lo;
+         continue;
+      }
+      if ( ! manifest_parse_line ( buf, &entry ) || entry.type != 'f' ){
+         continue;
+      }
+      if ( ctx->nfiles == size ){
+         size = size ? size * 2 : 1024;
+         tmp = (verifyfile *) realloc ( files, size * sizeof ( verifyfile ) );
+         if ( ! tmp ){
+            err = 1;
+            break;
+         }
+         files = tmp;
+      }
+      memset ( &files [ ctx->nfiles ], 0, sizeof ( verifyfile ) );
+      files [ ctx->nfiles ].path = bstrdup ( entry.path );
+      files [ ctx->nfiles ].size = entry.size;
+      files [ ctx->nfiles ].crc = entry.crc;
+      files [ ctx->nfiles ].hascrc = entry.hascrc;
+      ctx->nfiles++;
+   }
+   fclose ( mf );
+   FREE ( buf );
+   ctx->files = files;
+
+   return err;
+}
+
+/*
+ * checks that every WAL segment from the backup start up to the backup stop
+ * and a recovery target is available in pgsql catalog on the backup timeline
+ *
+ * in:
+ *    pdata
+ *    startlsn, stoplsn - backup LSN range from backup manifest
+ * out:
+ *    number of problems found
+ */
+int verify_wal_continuity ( pgsqldata * pdata, uint64_t startlsn, uint64_t stoplsn ){
+
+   PGresult * result;
+   char startwal [ WALNAMELEN + 1 ];
+   char tli [ 9 ];
+   char * sql;
+   char * target;
+   char * client;
+   uint64_t expected, segno;
+   uint64_t stopseg;
+   int problems = 0;
+   int a, n;
+
+   if ( get_backup_start_wal ( pdata, startwal ) ){
+      logprg ( LOGWARNING, "backup_label not found, WAL continuity not verified" );
+      return 0;
+   }
+   if ( catdb_available ( pdata ) ){
+      logprg ( LOGWARNING, "no catalog connection, WAL continuity not verified" );
+      return 0;
+   }
+
+   sql = MALLOC ( BUFLEN );
+   ASSERT_NVAL_RET_ONE ( sql );
+   target = MALLOC ( BUFLEN );
+   if ( ! target ){
+      FREE ( sql );
+      return 1;
+   }
+
+   /* the first segment name comes from backup_label and its number from start LSN */
+   strncpy ( tli, startwal, 8 );
+   tli [ 8 ] = 0;
+   if ( startlsn ){
+      expected = startlsn / WALSEGSIZE;
+      snprintf ( startwal, WALNAMELEN + 1, "%s%08X%08X", tli,
+            (unsigned int) ( expected / WALSEGMENTS ), (unsigned int) ( expected % WALSEGMENTS ) );
+   } else {
+      wal_segment_number ( startwal, &expected );
+   }
+   stopseg = stoplsn ? stoplsn / WALSEGSIZE : expected;
+
+   client = search_key ( pdata->paramlist, "ARCHCLIENT" );
+   build_pitr_wal_bound ( pdata, client, tli, startwal, target, BUFLEN );
+   snprintf ( sql, BUFLEN,
+         "select distinct filename from pgsql_archivelogs where client='%s' and filename like '%s%%' and filename >= '%s' and status in (%s)%s order by filename",
+         client, tli, startwal, PGSQL_STATUS_WAL_OK, target );
+   FREE ( target );
+
+   result = PQexec ( pdata->catdb, sql );
+   if ( PQresultStatus ( result ) != PGRES_TUPLES_OK ){
+      logprg ( LOGWARNING, "CATDB: WAL continuity query error" );
+      PQclear ( result );
+      FREE ( sql );
+      return 1;
+   }
+
+   n = PQntuples ( result );
+   for ( a = 0; a < n; a++ ){
+      if ( wal_segment_number ( PQgetvalue ( result, a, 0 ), &segno ) || segno < expected ){
+         /* partial or backup history files */
+         continue;
+      }
+      if ( segno > expected ){
+         snprintf ( sql, BUFLEN, "WAL gap: %llu segments missing before %s",
+               (unsigned long long) ( segno - expected ), PQgetvalue ( result, a, 0 ) );
+         logprg ( LOGERROR, sql );
+         problems++;
+      }
+      expected = segno + 1;
+   }
+   PQclear ( result );
+
+   if ( expected <= stopseg ){
+      snprintf ( sql, BUFLEN, "WAL segments up to backup stop %s%08X%08X are not archived", tli,
+            (unsigned int) ( stopseg / WALSEGMENTS ), (unsigned int) ( stopseg % WALSEGMENTS ) );
+      logprg ( LOGERROR, sql );
+      problems++;
+   } else
+   if ( pdata->verbose ){
+      snprintf ( sql, BUFLEN, "WAL continuity verified from %s up to %s%08X%08X", startwal, tli,
+            (unsigned int) ( ( expected - 1 ) / WALSEGMENTS ), (unsigned int) ( ( expected - 1 ) % WALSEGMENTS ) );
+      logprg ( LOGINFO, sql );
+   }
+   FREE ( sql );
+
+   return problems;
+}
+
+/*
+ * verifies a database backup without starting a postmaster: a backup is
+ * restored into <where> directory first unless it is already there, without
+ * <where> a cluster in PGDATA is verified in place; every file from backup
+ * manifest is checked for size and CRC32C, relation files for page headers
+ * and checksums, WAL archive for continuity up to a recovery target
+ *
+ * in:
+ *    pdata
+ * out:
+ *    0 - backup verified
+ *    1 - verification failed
+ */
+int verify_database ( pgsqldata * pdata ){
+
+   verifyctx ctx;
+   uint64_t stoplsn;
+   struct stat st;
+   char * buf;
+   long long bytes = 0, pages = 0, skipped = 0;
+   double tstart, elapsed;
+   int failed, reported = 0;
+   int err = 0;
+   int i;
+
+   buf = MALLOC ( BUFLEN );
+   ASSERT_NVAL_RET_ONE ( buf );
+   memset ( &ctx, 0, sizeof ( ctx ) );
+   ctx.dir = pdata->where ? pdata->where : search_key ( pdata->paramlist, "PGDATA" );
+   ctx.verbose = pdata->verbose;
+
+   snprintf ( buf, BUFLEN, "%s/" PGMANIFEST, ctx.dir );
+   if ( pdata->where && stat ( buf, &st ) ){
+      /* never restored into PGDATA, verification must not touch a running cluster */
+      tstart = monotonic_time ();
+      if ( restore_database ( pdata ) ){
+         FREE ( buf );
+         return 1;
+      }
+      report_stage_time ( "database restore", tstart );
+   }
+
+   if ( verify_read_manifest ( &ctx, &stoplsn ) ){
+      logprg ( LOGERROR, PGMANIFEST " not found or invalid, backup has to be made with manifest" );
+      FREE ( buf );
+      return 1;
+   }
+   verify_read_controldata ( pdata, &ctx );
+   snprintf ( buf, BUFLEN, "verifying %i files in %s, page size %i, page checksums %s",
+         ctx.nfiles, ctx.dir, ctx.blcksz, ctx.checksums ? "enabled" : "disabled" );
+   logprg ( LOGINFO, buf );
+
+   pthread_mutex_init ( &ctx.mutex, NULL );
+   tstart = ctx.start = ctx.lastreport = monotonic_time ();
+   failed = pgsql_run_parallel ( get_restore_threads ( pdata->paramlist ), ctx.nfiles, verify_file_task, &ctx );
+   elapsed = monotonic_time () - tstart;
+   pthread_mutex_destroy ( &ctx.mutex );
+
+   /* failures are reported in manifest order */
+   for ( i = 0; i < ctx.nfiles; i++ ){
+      bytes += ctx.files [ i ].bytes;
+      pages += ctx.files [ i ].pages;
+      skipped += ctx.files [ i ].skipped;
+      if ( ctx.files [ i ].error ){
+         if ( reported++ < VERIFYMAXERRORS ){
+            logprg ( LOGERROR, ctx.files [ i ].error );
+         }
+         FREE ( ctx.files [ i ].error );
+      }
+      FREE ( ctx.files [ i ].path );
+   }
+   if ( reported > VERIFYMAXERRORS ){
+      snprintf ( buf, BUFLEN, "... and %i more failed files", reported - VERIFYMAXERRORS );
+      logprg ( LOGERROR, buf );
+   }
+   if ( ctx.files ){
+      free ( ctx.files );
+   }
+
+   snprintf ( buf, BUFLEN, "verified %i files, %.1f MB in %.3fs (%.1f MB/s), %lld pages, %lld pages changed during backup, %i failed",
+         ctx.nfiles, bytes / 1048576.0, elapsed, elapsed > 0 ? bytes / 1048576.0 / elapsed : 0.0,
+         pages, skipped, failed );
+   logprg ( failed ? LOGERROR : LOGINFO, buf );
+   err = failed != 0;
+
+   if ( verify_wal_continuity ( pdata, ctx.startlsn, stoplsn ) ){
+      err = 1;
+   }
+   FREE ( buf );
+
+   return err;
+}
+
 int main(int argc, char* argv[]){
 
    pgsqldata * pdata;
    int err = 0;
    int loc = 0;
+   double tstage;
 
    pgsqllibinit ( argc, argv );
 
@@ -2297,6 +5534,7 @@ int main(int argc, char* argv[]){
             logprg ( LOGINFO, "Database RESTORE mode." );
          }
          print_restore_info ( pdata );
+         tstage = monotonic_time ();
 
          /* 1.  Stop the postmaster, if it's running. */
          if ( check_postgres_is_running ( pdata ) ){
@@ -2316,19 +5554,21 @@ int main(int argc, char* argv[]){
          if ( err ){
             logprg ( LOGWARNING, "cant copy unarchived wal files. some transactions will be lost" );
          }
+         tstage = report_stage_time ( "shutdown and WAL copy", tstage );
 
          /* 3.  Clean out all existing files and subdirectories under the cluster data directory and
           * under the root directories of any tablespaces you are using. */
-         err = remove_pgdata_tablespaces ( pdata );
-         if ( err ){
-            logprg ( LOGERROR, "cant clean postgres tablespaces" );
-            abortprg ( pdata, 11, "you have to clean postgres tablespaces manually" );
-         }
-
-         err = remove_pgdata_cluster ( pdata );
-         if ( err ){
-            logprg ( LOGERROR, "cant clean postgres data cluster" );
-            abortprg ( pdata, 10, "you have to clean postgres data cluster manually" );
+         /* in delta restore mode files are left in place and the plugin removes
+          * everything not found in backup at the end of restore job */
+         if ( delta_restore_enabled ( pdata ) ){
+            logprg ( LOGINFO, "delta restore, existing cluster files are kept" );
+         } else {
+            err = remove_pgdata_files ( pdata );
+            if ( err ){
+               logprg ( LOGERROR, "cant clean postgres data cluster and tablespaces" );
+               abortprg ( pdata, 10, "you have to clean postgres data cluster manually" );
+            }
+            tstage = report_stage_time ( "cluster cleanup", tstage );
          }
 
          /* 4.  Restore the database files from your backup dump. Be careful that they are restored
@@ -2343,6 +5583,7 @@ int main(int argc, char* argv[]){
          if ( err ){
             abortprg ( pdata, 12, "cant restore postgres database" );
          }
+         tstage = report_stage_time ( "database restore", tstage );
 
          /* 5.  Remove any files present in pg_xlog/; these came from the backup dump and are therefore
           * probably obsolete rather than current. If you didn't archive pg_xlog/ at all, then
@@ -2362,11 +5603,25 @@ int main(int argc, char* argv[]){
          /* 7.  Create a recovery command file recovery.conf in the cluster data directory (see
           * Recovery Settings). You may also want to temporarily modify pg_hba.conf to prevent ordinary
           * users from connecting until you are sure the recovery has worked. */
+         /* a spool is shared by WAL staging and restore_command */
+         prepare_wal_spool ( pdata );
          err = create_recovery_conf ( pdata );
          if ( err ){
             abortprg ( pdata, 13, "cant create restore.conf file" );
          }
 
+         /* all WAL files required for recovery are restored in bulk before postmaster starts,
+          * so recovery does not wait on the Director for every segment */
+         stage_wal_files ( pdata );
+         tstage = report_stage_time ( "WAL staging", tstage );
+
+         /* restored files are not synced one by one, all filesystems are synced once
+          * so recovery does not start on data which could be lost on a crash */
+         if ( sync_restored_files ( pdata ) ){
+            logprg ( LOGWARNING, "cant sync restored files to disk" );
+         }
+         tstage = report_stage_time ( "restored files sync", tstage );
+
          /* 8.  Start the postmaster. The postmaster will go into recovery mode and proceed to read
           * through the archived WAL files it needs. Upon completion of the recovery process, the
           * postmaster will rename recovery.conf to recovery.done (to prevent accidentally re-entering
@@ -2374,6 +5629,11 @@ int main(int argc, char* argv[]){
           * operations. */
          /* we will not modify a pg_hba.conf */
          err = startup_postmaster ( pdata );
+         tstage = report_stage_time ( "recovery and startup", tstage );
+         /* prefetched and not used WAL files are not required anymore */
+         if ( pdata->walspool ){
+            clean_wal_spool ( pdata, 1 );
+         }
          if ( err ){
             logprg ( LOGERROR, "unable to startup PostgreSQL instance" );
             abortprg ( pdata, 8, "you have to do it manually" );
@@ -2390,8 +5650,30 @@ int main(int argc, char* argv[]){
             abortprg ( pdata, 8, "you have to do it manually before starting instance" );
          }
          
+         break;
+      case PGSQL_DB_VERIFY:
+         inteos_info ( pdata );
+         if ( pdata->verbose ){
+            logprg ( LOGINFO, "Database VERIFY mode." );
+         }
+         print_restore_info ( pdata );
+         err = verify_database ( pdata );
+         if ( err ){
+            abortprg ( pdata, 16, "backup verification failed" );
+         }
+         logprg ( LOGINFO, "backup verification done" );
+         break;
+      case PGSQL_WAL_FIND:
+         if ( pdata->verbose ){
+            logprg ( LOGINFO, "WAL FIND mode." );
+         }
+         err = find_wal_by_target ( pdata );
+         if ( err ){
+            abortprg ( pdata, 17, "WAL for recovery target not found" );
+         }
          break;
       case PGSQL_ARCH_RESTORE:
+         tstage = monotonic_time ();
          if ( pdata->verbose ){
             logprg ( LOGINFO, "WAL RESTORE mode." );
          }
@@ -2401,6 +5683,19 @@ int main(int argc, char* argv[]){
           * pdata->pathtowalfilename
           * 
           * in most cases path to wal file is relative, to PGDATA */
+         if ( ! get_wal_from_spool ( pdata ) ){
+            /* prefetched earlier, nothing more to do */
+            if ( pdata->verbose ){
+               char * buf;
+               buf = MALLOC ( BUFLEN );
+               /* a timing line is used for recovery progress reporting */
+               snprintf ( buf, BUFLEN, "WAL %s restore done in %.3fs.", pdata->walfilename,
+                     monotonic_time () - tstage );
+               logprg ( LOGINFO, buf );
+               FREE ( buf );
+            }
+            break;
+         }
          loc = find_wal_location ( pdata );
          switch ( loc ){
             case WAL_LOC_BACULA:
@@ -2422,13 +5717,15 @@ int main(int argc, char* argv[]){
          if ( pdata->verbose ){
             char * buf;
             buf = MALLOC ( BUFLEN );
-            snprintf ( buf, BUFLEN, "WAL %s restore done.", pdata->walfilename );
+            snprintf ( buf, BUFLEN, "WAL %s restore done in %.3fs.", pdata->walfilename,
+                  monotonic_time () - tstage );
             logprg ( LOGINFO, buf );
             FREE ( buf );
          }
          break;
    }
 
+   shutdown_director_socket ( pdata );
    PQfinish ( pdata->catdb );
    freepdata ( pdata );
    return 0;
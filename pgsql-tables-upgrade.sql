@@ -0,0 +1,90 @@
+-- 
+-- Copyright (c) 2013 by Inteos sp. z o.o.
+-- All rights reserved. See LICENSE.pgsql for details.
+-- 
+-- Upgrade of existing catalog tables to the current definitions of
+-- pgsql-tables.sql, every statement could be run again safely
+-- 
+
+-- fileset names resolved by pgsql-restore (fstype: 0 - database, 1 - wal)
+create table if not exists pgsql_filesets (
+   id          serial,
+   client      varchar not null,
+   fstype      integer not null,
+   fileset     varchar not null,
+   mod_date    timestamp default now(),
+   unique (client, fstype)
+);
+
+-- job statistics of database backups
+alter table pgsql_backupdbs alter column start_xid set default '';
+alter table pgsql_backupdbs alter column end_xid set default '';
+alter table pgsql_backupdbs add column if not exists jobid integer;
+alter table pgsql_backupdbs add column if not exists files bigint not null default 0;
+alter table pgsql_backupdbs add column if not exists bytes bigint not null default 0;
+alter table pgsql_backupdbs add column if not exists elapsed float not null default 0;
+alter table pgsql_backupdbs add column if not exists stats text;
+
+-- sharded database backups
+alter table pgsql_backupdbs add column if not exists shardset integer;
+create table if not exists pgsql_shardsets (
+   id          serial primary key,
+   client      varchar not null,
+   shards      integer not null,
+   jobid       integer,
+   create_date timestamp default now(),
+   mod_date    timestamp default now(),
+   joined      integer not null default 0,
+   finished    integer not null default 0,
+   failed      integer not null default 0,
+   closed      boolean not null default false,
+   status      integer not null default 0,
+   foreign key (status) references pgsql_status (statusid)
+);
+create table if not exists pgsql_shards (
+   setid       integer not null references pgsql_shardsets (id) on delete cascade,
+   shard       integer not null,
+   jobid       integer,
+   status      integer not null default 0,
+   planbytes   bigint not null default 0,
+   files       bigint not null default 0,
+   bytes       bigint not null default 0,
+   filelist    text,
+   unique (setid, shard),
+   foreign key (status) references pgsql_status (statusid)
+);
+
+-- base backup selection by recovery target
+alter table pgsql_backupdbs add column if not exists start_lsn varchar;
+alter table pgsql_backupdbs add column if not exists stop_lsn varchar;
+alter table pgsql_backupdbs add column if not exists start_wal varchar;
+
+-- WAL summaries of block incremental backups
+create table if not exists pgsql_walsummaries (
+   id          serial,
+   client      varchar not null,
+   filename    varchar not null,
+   create_date timestamp default now(),
+   tli         bigint not null,
+   start_lsn   bigint not null,
+   end_lsn     bigint not null,
+   records     bigint not null default 0,
+   blocks      bigint not null default 0,
+   summary     text,
+   tail_lsn    bigint,
+   tail_total  integer,
+   next_lsn    bigint,
+   tail        bytea,
+   unique (client, filename)
+);
+create index if not exists pgsql_walsummaries_lsn on pgsql_walsummaries (client, end_lsn);
+
+-- transaction index of archived WAL
+alter table pgsql_walsummaries add column if not exists commits bigint;
+alter table pgsql_walsummaries add column if not exists aborts bigint;
+alter table pgsql_walsummaries add column if not exists min_time timestamp with time zone;
+alter table pgsql_walsummaries add column if not exists max_time timestamp with time zone;
+alter table pgsql_walsummaries add column if not exists min_xid bigint;
+alter table pgsql_walsummaries add column if not exists max_xid bigint;
+alter table pgsql_walsummaries add column if not exists unknown_xids bigint;
+create index if not exists pgsql_walsummaries_time on pgsql_walsummaries (client, max_time);
@@ -2,7 +2,8 @@
 -- Copyright (c) 2013 by Inteos sp. z o.o.
 -- All rights reserved. See LICENSE.pgsql for details.
 -- 
--- Catalog tables definitions
+-- Catalog tables definitions, existing tables are upgraded with
+-- pgsql-tables-upgrade.sql
 -- 
 
 -- version table
@@ -60,16 +61,61 @@ insert into pgsql_status values ('15','DB offline backup in progress');
 insert into pgsql_status values ('16','DB offline backup finished');
 insert into pgsql_status values ('17','DB offline backup failed');
 
+-- database backups, blevel is a Bacula job level character code (F, D, I),
+-- backup start/stop locations are used by pgsql-restore to select a base
+-- backup closest to a recovery target
 drop table pgsql_backupdbs cascade;
 create table pgsql_backupdbs (
    id          serial,
    client      varchar not null,
    start_date  timestamp default now(),
    end_date    timestamp default null,
-   start_xid   varchar not null,
-   end_xid     varchar not null,
+   start_xid   varchar not null default '',
+   end_xid     varchar not null default '',
    blevel      integer not null default 0,
    status      integer not null default 0,
+   jobid       integer,
+   shardset    integer,
+   start_lsn   varchar,
+   stop_lsn    varchar,
+   start_wal   varchar,
+   files       bigint not null default 0,
+   bytes       bigint not null default 0,
+   elapsed     float not null default 0,
+   stats       text,
+   foreign key (status) references pgsql_status (statusid)
+);
+
+-- sharded database backups (pgsql:<conf>:db:shard=K/N), a set of N jobs
+-- sharing one pg_start_backup/pg_stop_backup window
+drop table pgsql_shardsets cascade;
+create table pgsql_shardsets (
+   id          serial primary key,
+   client      varchar not null,
+   shards      integer not null,
+   jobid       integer,
+   create_date timestamp default now(),
+   mod_date    timestamp default now(),
+   joined      integer not null default 0,
+   finished    integer not null default 0,
+   failed      integer not null default 0,
+   closed      boolean not null default false,
+   status      integer not null default 0,
+   foreign key (status) references pgsql_status (statusid)
+);
+
+-- shards of a set with their planned file lists (paths separated by new line)
+drop table pgsql_shards cascade;
+create table pgsql_shards (
+   setid       integer not null references pgsql_shardsets (id) on delete cascade,
+   shard       integer not null,
+   jobid       integer,
+   status      integer not null default 0,
+   planbytes   bigint not null default 0,
+   files       bigint not null default 0,
+   bytes       bigint not null default 0,
+   filelist    text,
+   unique (setid, shard),
    foreign key (status) references pgsql_status (statusid)
 );
 
@@ -84,3 +130,48 @@ create table pgsql_archivelogs (
    unique (client, filename),
    foreign key (status) references pgsql_status (statusid)
 );
+
+-- WAL summaries of archived segments (WALSUMMARY): relation blocks changed by
+-- records starting in [start_lsn, end_lsn), LSNs as numbers; a record which
+-- continues in the next segment (starting at next_lsn) is kept in tail;
+-- transaction index (WALINDEX): number of commit and abort records with their
+-- timestamp and transaction id ranges, unknown_xids counts prepared
+-- transactions ended without an id found
+drop table pgsql_walsummaries cascade;
+create table pgsql_walsummaries (
+   id          serial,
+   client      varchar not null,
+   filename    varchar not null,
+   create_date timestamp default now(),
+   tli         bigint not null,
+   start_lsn   bigint not null,
+   end_lsn     bigint not null,
+   records     bigint not null default 0,
+   blocks      bigint not null default 0,
+   summary     text,
+   tail_lsn    bigint,
+   tail_total  integer,
+   next_lsn    bigint,
+   tail        bytea,
+   commits     bigint,
+   aborts      bigint,
+   min_time    timestamp with time zone,
+   max_time    timestamp with time zone,
+   min_xid     bigint,
+   max_xid     bigint,
+   unknown_xids   bigint,
+   unique (client, filename)
+);
+create index pgsql_walsummaries_lsn on pgsql_walsummaries (client, end_lsn);
+create index pgsql_walsummaries_time on pgsql_walsummaries (client, max_time);
+
+-- fileset names resolved by pgsql-restore (fstype: 0 - database, 1 - wal)
+drop table pgsql_filesets cascade;
+create table pgsql_filesets (
+   id          serial,
+   client      varchar not null,
+   fstype      integer not null,
+   fileset     varchar not null,
+   mod_date    timestamp default now(),
+   unique (client, fstype)
+);
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2013 by Inteos sp. z o.o.
+ * All rights reserved. See LICENSE.Inteos for details.
+ *
+ * WAL decoder test against real WAL segments. Segments given in order are
+ * decoded by a single reader, as by a restore, and every segment is decoded
+ * again by a fresh reader which gets a record continued from a previous
+ * segment with walreader_set_tail, as pgsql-archlog does with a tail saved
+ * in catalog; both have to decode the same records. A summary has to hold
+ * an expected changed block and a transaction index has to find commits.
+ * Run by pgsql-wal-test.sh on WAL of a throwaway cluster.
+ *
+ * usage: pgsql-wal-test -s spcoid -d dboid -r relnode -b block segment...
+ *
+ * exit: 0 - passed, 1 - failed, 2 - usage or i/o error
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "utils.h"
+#include "pgsqlwal.h"
+
+/* a decoder callback argument, a WAL summary and a transaction index */
+typedef struct _waltestindex waltestindex;
+struct _waltestindex {
+   walsummary * ws;
+   walxactindex * wx;
+};
+
+/*
+ * a decoder callback which feeds both a WAL summary and a transaction index
+ */
+static void waltest_record ( const walrecord * rec, void * arg ){
+
+   waltestindex * ti = (waltestindex *) arg;
+
+   walsummary_record ( rec, ti->ws );
+   if ( ti->wx ){
+      walxact_record ( rec, ti->wx );
+   }
+}
+
+/*
+ * reads a whole WAL segment file
+ *
+ * out:
+ *    segment data, has to be freed with free(), NULL on error
+ */
+static unsigned char * read_segment ( const char * path, size_t * len ){
+
+   unsigned char * buf;
+   struct stat st;
+   FILE * f;
+
+   f = fopen ( path, "r" );
+   if ( ! f ){
+      fprintf ( stderr, "open %s error: %s\n", path, strerror ( errno ) );
+      return NULL;
+   }
+   if ( fstat ( fileno ( f ), &st ) != 0 || ! ( buf = (unsigned char *) malloc ( st.st_size + 1 ) ) ){
+      fprintf ( stderr, "read %s error\n", path );
+      fclose ( f );
+      return NULL;
+   }
+   if ( fread ( buf, 1, st.st_size, f ) != (size_t) st.st_size ){
+      fprintf ( stderr, "read %s error: %s\n", path, strerror ( errno ) );
+      free ( buf );
+      fclose ( f );
+      return NULL;
+   }
+   fclose ( f );
+   *len = st.st_size;
+
+   return buf;
+}
+
+/*
+ * checks if a block is in a summary of a relation main fork
+ */
+static int summary_has_block ( walsummary * ws, walblockref * ref ){
+
+   walrelblocks * rb;
+   uint32_t a;
+
+   rb = walsummary_find ( ws, ref->spcoid, ref->dboid, ref->relnode, WALMAINFORK );
+   if ( ! rb ){
+      return 0;
+   }
+   if ( ref->blkno >= rb->limit ){
+      return 1;
+   }
+   walsummary_sort ( rb );
+   for ( a = 0; a < rb->nblocks; a++ ){
+      if ( rb->blocks [ a ] == ref->blkno ){
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+static void usage ( void ){
+
+   fprintf ( stderr, "usage: pgsql-wal-test -s spcoid -d dboid -r relnode -b block segment...\n" );
+   exit ( 2 );
+}
+
+int main ( int argc, char * argv[] ){
+
+   walreader wr;
+   walreader wt;
+   walsummary * ws;
+   walsummary * wst;
+   walxactindex wx;
+   waltestindex ti;
+   waltestindex tt;
+   walblockref ref;
+   unsigned char * seg;
+   unsigned char * tail = NULL;
+   uint64_t taillsn = 0;
+   uint32_t tailtot = 0;
+   uint32_t taillen = 0;
+   uint64_t segstart;
+   int64_t records;
+   int64_t blocks;
+   size_t len;
+   int failed = 0;
+   int opt;
+   int a;
+
+   memset ( &ref, 0, sizeof ( ref ) );
+   while ( ( opt = getopt ( argc, argv, "s:d:r:b:" ) ) != -1 ){
+      switch ( opt ){
+         case 's':
+            ref.spcoid = strtoul ( optarg, NULL, 10 );
+            break;
+         case 'd':
+            ref.dboid = strtoul ( optarg, NULL, 10 );
+            break;
+         case 'r':
+            ref.relnode = strtoul ( optarg, NULL, 10 );
+            break;
+         case 'b':
+            ref.blkno = strtoul ( optarg, NULL, 10 );
+            break;
+         default:
+            usage ();
+      }
+   }
+   if ( ! ref.spcoid || ! ref.dboid || ! ref.relnode || optind >= argc ){
+      usage ();
+   }
+
+   ws = walsummary_alloc ();
+   if ( ! ws || walreader_init ( &wr ) != 0 ){
+      fprintf ( stderr, "memory allocation error\n" );
+      return 2;
+   }
+   walxact_init ( &wx );
+   ti.ws = ws;
+   ti.wx = &wx;
+
+   for ( a = optind; a < argc; a++ ){
+      seg = read_segment ( argv [ a ], &len );
+      if ( ! seg ){
+         return 2;
+      }
+      if ( len < WALLONGPHD ){
+         fprintf ( stderr, "%s: not a WAL segment\n", argv [ a ] );
+         return 2;
+      }
+      memcpy ( &segstart, seg + 8, sizeof ( segstart ) );
+
+      /* a segment decoded alone, with a record continued from previous one */
+      wst = walsummary_alloc ();
+      if ( ! wst || walreader_init ( &wt ) != 0 ){
+         fprintf ( stderr, "memory allocation error\n" );
+         return 2;
+      }
+      tt.ws = wst;
+      tt.wx = NULL;
+      if ( taillen && walreader_set_tail ( &wt, taillsn, tailtot, tail, taillen, segstart ) != 0 ){
+         printf ( "%s: tail of %u bytes rejected\n", argv [ a ], taillen );
+         failed = 1;
+      }
+
+      records = wr.records;
+      blocks = ws->blocks;
+      if ( wal_decode_segment ( &wr, seg, len, waltest_record, &ti ) != 0 ){
+         printf ( "%s: decode error\n", argv [ a ] );
+         failed = 1;
+      }
+      records = wr.records - records;
+      blocks = ws->blocks - blocks;
+      if ( wal_decode_segment ( &wt, seg, len, waltest_record, &tt ) != 0 ){
+         printf ( "%s: decode error with a tail\n", argv [ a ] );
+         failed = 1;
+      }
+      printf ( "%s: records %lld, decoded %X/%X - %X/%X, tail %u bytes\n", argv [ a ], (long long) records,
+            (unsigned int) ( wr.covstart >> 32 ), (unsigned int) wr.covstart,
+            (unsigned int) ( wr.covend >> 32 ), (unsigned int) wr.covend, wr.reclen );
+      if ( wt.records != records || wst->blocks != blocks || wt.covstart != wr.covstart || wt.covend != wr.covend ){
+         printf ( "%s: decoded with a tail: records %lld, %X/%X - %X/%X differ\n", argv [ a ], (long long) wt.records,
+               (unsigned int) ( wt.covstart >> 32 ), (unsigned int) wt.covstart,
+               (unsigned int) ( wt.covend >> 32 ), (unsigned int) wt.covend );
+         failed = 1;
+      }
+
+      /* a record continued in the next segment, as saved in catalog */
+      free ( tail );
+      tail = NULL;
+      taillen = 0;
+      if ( wr.reclen ){
+         tail = (unsigned char *) malloc ( wr.reclen );
+         if ( ! tail ){
+            fprintf ( stderr, "memory allocation error\n" );
+            return 2;
+         }
+         memcpy ( tail, wr.rec, wr.reclen );
+         taillsn = wr.reclsn;
+         tailtot = wr.rectot;
+         taillen = wr.reclen;
+      }
+      walsummary_free ( wst );
+      walreader_free ( &wt );
+      free ( seg );
+   }
+
+   printf ( "records: %lld, block references: %lld, commits: %lld, aborts: %lld\n",
+         (long long) wr.records, (long long) ws->blocks, (long long) wx.commits, (long long) wx.aborts );
+   if ( wr.records <= 0 ){
+      printf ( "no records decoded\n" );
+      failed = 1;
+   }
+   if ( wx.commits <= 0 ){
+      printf ( "no commits found\n" );
+      failed = 1;
+   }
+   if ( ! summary_has_block ( ws, &ref ) ){
+      printf ( "block %u/%u/%u:%u not in summary\n", ref.spcoid, ref.dboid, ref.relnode, ref.blkno );
+      failed = 1;
+   }
+   printf ( "%s\n", failed ? "FAILED" : "OK" );
+
+   free ( tail );
+   walsummary_free ( ws );
+   walreader_free ( &wr );
+
+   return failed;
+}
@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# Copyright (c) 2013 by Inteos sp. z o.o.
+# All rights reserved. See LICENSE.Inteos for details.
+#
+# WAL decoder test for pgsql-wal-test on real WAL. It starts a throwaway
+# PostgreSQL cluster, creates a table, then after a checkpoint updates a known
+# block of it and inserts enough rows for records to span several segments,
+# and runs pgsql-wal-test on WAL segments written since the checkpoint.
+#
+# PostgreSQL (10 or later) binaries are taken from pg_config --bindir or -B,
+# the script has to be run as an unprivileged user as initdb refuses to run
+# as root.
+#
+# usage: pgsql-wal-test.sh [-n rows] [-B pgbindir] [-P port] [-k]
+#
+
+NROWS=200000
+PGBIN=
+PORT=55433
+KEEP=no
+BINDIR=`cd \`dirname $0\` && pwd`
+WORK=/tmp/pgsql-wal-test.$$
+
+usage ()
+{
+   echo "usage: $0 [-n rows] [-B pgbindir] [-P port] [-k]"
+   echo "   -n  number of rows inserted after the checkpoint"
+   echo "   -B  PostgreSQL binaries directory"
+   echo "   -P  port of throwaway PostgreSQL cluster"
+   echo "   -k  keep work directory"
+   exit 1
+}
+
+while getopts "n:B:P:k" opt
+do
+   case $opt in
+      n) NROWS=$OPTARG ;;
+      B) PGBIN=$OPTARG ;;
+      P) PORT=$OPTARG ;;
+      k) KEEP=yes ;;
+      *) usage ;;
+   esac
+done
+
+[ -z "$PGBIN" ] && PGBIN=`pg_config --bindir 2>/dev/null`
+if [ ! -x "$PGBIN/initdb" ]
+then
+   echo "PostgreSQL binaries not found, use -B <pgbindir>."
+   exit 2
+fi
+if [ ! -x "$BINDIR/pgsql-wal-test" ]
+then
+   echo "$BINDIR/pgsql-wal-test not found, run make pgsql-wal-test first."
+   exit 2
+fi
+
+cleanup ()
+{
+   [ -f $WORK/pgdata/postmaster.pid ] && $PGBIN/pg_ctl -D $WORK/pgdata -m immediate stop >/dev/null 2>&1
+   [ "$KEEP" = "no" ] && rm -rf $WORK
+}
+trap cleanup EXIT INT TERM
+
+mkdir -p $WORK || exit 2
+
+echo "Starting throwaway PostgreSQL on port $PORT ..."
+$PGBIN/initdb -D $WORK/pgdata -U pgtest --auth=trust >$WORK/initdb.log 2>&1 || { echo "initdb failed, see $WORK/initdb.log"; KEEP=yes; exit 2; }
+$PGBIN/pg_ctl -D $WORK/pgdata -w -l $WORK/postgresql.log \
+   -o "-p $PORT -k $WORK -c listen_addresses=127.0.0.1 -c max_wal_size=1GB" start >/dev/null || { echo "PostgreSQL start failed, see $WORK/postgresql.log"; KEEP=yes; exit 2; }
+$PGBIN/createdb -h 127.0.0.1 -p $PORT -U pgtest waltest || exit 2
+
+sql ()
+{
+   $PGBIN/psql -X -q -A -t -v ON_ERROR_STOP=1 -h 127.0.0.1 -p $PORT -U pgtest -c "$1" waltest
+}
+
+sql "create table waltest (id integer, val text); insert into waltest select i, repeat('x', 100) from generate_series(1, 10000) i;" || exit 2
+DBOID=`sql "select oid from pg_database where datname = 'waltest'"`
+RELNODE=`sql "select pg_relation_filenode('waltest')"`
+BLOCK=5
+START=`sql "checkpoint; select pg_walfile_name(pg_current_wal_lsn())"`
+sql "update waltest set val = 'changed' where ctid = '($BLOCK,1)'" || exit 2
+sql "insert into waltest select i, repeat('y', 200) from generate_series(1, $NROWS) i" || exit 2
+END=`sql "select pg_walfile_name(pg_switch_wal())"`
+SEGS=`ls $WORK/pgdata/pg_wal | awk -v s=$START -v e=$END 'length($1) == 24 && $1 >= s && $1 <= e { print }' | sort`
+
+echo "Decoding WAL $START - $END, database $DBOID, relation $RELNODE, block $BLOCK ..."
+( cd $WORK/pgdata/pg_wal && $BINDIR/pgsql-wal-test -s 1663 -d $DBOID -r $RELNODE -b $BLOCK $SEGS )
+RC=$?
+[ $RC -ne 0 ] && KEEP=yes && echo "work directory kept: $WORK"
+exit $RC
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2013 by Inteos sp. z o.o.
+ * All rights reserved. See LICENSE.Inteos for details.
+ *
+ * Restore write path benchmark. It writes a set of synthetic relation files
+ * the same way as the plugin receives them from Bacula (small buffers) with
+ * plain write() calls and with the restore writer in different modes, then
+ * reports throughput and space allocated on disk for every mode.
+ *
+ * usage: pgsql-write-bench [-d dir] [-n files] [-s sizeMB] [-z zero%] [-m changed%]
+ *                          [-b bufsize] [-F]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "utils.h"
+#include "pgsqlwriter.h"
+
+/* benchmark modes */
+enum {
+   BENCH_PLAIN,
+   BENCH_WRITER,
+   BENCH_PREALLOC,
+   BENCH_SPARSE,
+   BENCH_PREALLOC_SPARSE,
+   BENCH_DELTA,
+   BENCH_MODES,
+};
+
+static const char * modenames [ BENCH_MODES ] = {
+   "write()",
+   "writer",
+   "writer+prealloc",
+   "writer+sparse",
+   "writer+prealloc+sparse",
+   "writer+delta+sparse",
+};
+
+/* benchmark parameters */
+typedef struct _benchparam benchparam;
+struct _benchparam {
+   const char * dir;
+   int      files;
+   off_t    size;
+   int      zeropct;
+   int      changepct;
+   int      bufsize;
+   int      dosync;
+};
+
+/*
+ * a simple xorshift generator, data does not need to be random, only
+ * reproducible and not compressible
+ */
+static uint32_t bench_random ( uint32_t * state ){
+
+   uint32_t x = *state;
+
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *state = x;
+
+   return x;
+}
+
+/*
+ * fills a page of a file, pages are zero with zeropct probability; when
+ * changed is set some pages get a different content (delta restore source)
+ */
+static void bench_fill_page ( benchparam * bp, int file, off_t page, int changed, char * buf ){
+
+   uint32_t state;
+   uint32_t * p;
+   int a;
+
+   state = ( file + 1 ) * 2654435761u ^ ( (uint32_t) page + 1 ) * 40503u;
+   if ( bench_random ( &state ) % 100 < (uint32_t) bp->zeropct ){
+      memset ( buf, 0, RWBLOCK );
+      return;
+   }
+   if ( changed && bench_random ( &state ) % 100 < (uint32_t) bp->changepct ){
+      state ^= 0x5bd1e995;
+   }
+   p = (uint32_t *) buf;
+   for ( a = 0; a < RWBLOCK / 4; a++ ){
+      p [ a ] = bench_random ( &state );
+   }
+}
+
+/*
+ * writes all benchmark files in a given mode
+ *
+ * out:
+ *    0 - on success
+ *    -1 - on error
+ */
+static int bench_run ( benchparam * bp, int mode, double * elapsed, off_t * allocated ){
+
+   char path [ 4096 ];
+   char * data;
+   char * page;
+   rwriter rw;
+   struct stat st;
+   double start;
+   off_t off;
+   off_t dlen;
+   int flags;
+   int fd;
+   int file;
+   int len;
+   int pos;
+
+   data = (char *) malloc ( bp->size );
+   page = (char *) malloc ( RWBLOCK );
+   if ( ! data || ! page || rwriter_init ( &rw ) ){
+      fprintf ( stderr, "memory allocation error\n" );
+      return -1;
+   }
+
+   switch ( mode ){
+      case BENCH_PREALLOC:
+         flags = RW_PREALLOC;
+         break;
+      case BENCH_SPARSE:
+         flags = RW_SPARSE;
+         break;
+      case BENCH_PREALLOC_SPARSE:
+         flags = RW_PREALLOC | RW_SPARSE;
+         break;
+      case BENCH_DELTA:
+         flags = RW_DELTA | RW_SPARSE;
+         break;
+      default:
+         flags = 0;
+   }
+
+   *elapsed = 0;
+   *allocated = 0;
+   for ( file = 0; file < bp->files; file++ ){
+      /* generate file content outside of measured time */
+      for ( off = 0; off < bp->size; off += RWBLOCK ){
+         bench_fill_page ( bp, file, off / RWBLOCK, mode == BENCH_DELTA, page );
+         dlen = bp->size - off < RWBLOCK ? bp->size - off : RWBLOCK;
+         memcpy ( data + off, page, dlen );
+      }
+      snprintf ( path, sizeof ( path ), "%s/bench.%d", bp->dir, file );
+      if ( mode == BENCH_DELTA ){
+         /* delta mode rewrites files left by the previous run */
+         fd = open ( path, O_RDWR | O_CREAT, 0600 );
+      } else {
+         unlink ( path );
+         fd = open ( path, O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+      }
+      if ( fd < 0 ){
+         fprintf ( stderr, "open %s error: %s\n", path, strerror ( errno ) );
+         return -1;
+      }
+
+      start = monotonic_time ();
+      if ( mode != BENCH_PLAIN && rwriter_open ( &rw, fd, bp->size, flags ) ){
+         fprintf ( stderr, "writer open error\n" );
+         return -1;
+      }
+      for ( off = 0; off < bp->size; off += len ){
+         len = bp->size - off < bp->bufsize ? bp->size - off : bp->bufsize;
+         if ( mode == BENCH_PLAIN ){
+            for ( pos = 0; pos < len; ){
+               dlen = write ( fd, data + off + pos, len - pos );
+               if ( dlen < 0 ){
+                  break;
+               }
+               pos += dlen;
+            }
+         } else {
+            pos = rwriter_write ( &rw, data + off, len );
+         }
+         if ( pos != len ){
+            fprintf ( stderr, "write %s error: %s\n", path, strerror ( errno ) );
+            return -1;
+         }
+      }
+      if ( mode != BENCH_PLAIN && rwriter_close ( &rw ) ){
+         fprintf ( stderr, "close %s error: %s\n", path, strerror ( errno ) );
+         return -1;
+      }
+      if ( bp->dosync ){
+         fsync ( fd );
+      }
+      *elapsed += monotonic_time () - start;
+      close ( fd );
+
+      if ( stat ( path, &st ) == 0 ){
+         *allocated += (off_t) st.st_blocks * 512;
+      }
+   }
+
+   rwriter_free ( &rw );
+   free ( data );
+   free ( page );
+
+   return 0;
+}
+
+static void usage ( void ){
+
+   fprintf ( stderr, "usage: pgsql-write-bench [-d dir] [-n files] [-s sizeMB] [-z zero%%] [-m changed%%]\n" );
+   fprintf ( stderr, "                         [-b bufsize] [-F]\n" );
+   fprintf ( stderr, "   -F  do not fsync files, measure page cache throughput only\n" );
+   exit ( 1 );
+}
+
+int main ( int argc, char * argv[] ){
+
+   benchparam bp;
+   double elapsed;
+   double mb;
+   off_t allocated;
+   char path [ 4096 ];
+   int mode;
+   int opt;
+   int a;
+
+   bp.dir = ".";
+   bp.files = 4;
+   bp.size = 64 * 1024 * 1024;
+   bp.zeropct = 30;
+   bp.changepct = 10;
+   bp.bufsize = 65536;
+   bp.dosync = 1;
+
+   while ( ( opt = getopt ( argc, argv, "d:n:s:z:m:b:F" ) ) != -1 ){
+      switch ( opt ){
+         case 'd':
+            bp.dir = optarg;
+            break;
+         case 'n':
+            bp.files = atoi ( optarg );
+            break;
+         case 's':
+            bp.size = (off_t) atoi ( optarg ) * 1024 * 1024;
+            break;
+         case 'z':
+            bp.zeropct = atoi ( optarg );
+            break;
+         case 'm':
+            bp.changepct = atoi ( optarg );
+            break;
+         case 'b':
+            bp.bufsize = atoi ( optarg );
+            break;
+         case 'F':
+            bp.dosync = 0;
+            break;
+         default:
+            usage ();
+      }
+   }
+   if ( bp.files < 1 || bp.size < 1 || bp.bufsize < 1 ){
+      usage ();
+   }
+
+   mb = (double) bp.size * bp.files / ( 1024 * 1024 );
+   printf ( "files: %d x %lld MB, zero pages: %d%%, buffer: %d bytes, fsync: %s\n",
+         bp.files, (long long) bp.size / ( 1024 * 1024 ), bp.zeropct, bp.bufsize,
+         bp.dosync ? "yes" : "no" );
+   printf ( "%-24s %10s %10s %12s\n", "mode", "time [s]", "MB/s", "on disk MB" );
+
+   for ( mode = 0; mode < BENCH_MODES; mode++ ){
+      if ( bench_run ( &bp, mode, &elapsed, &allocated ) ){
+         return 2;
+      }
+      printf ( "%-24s %10.3f %10.1f %12.1f\n", modenames [ mode ], elapsed,
+            elapsed > 0 ? mb / elapsed : 0, (double) allocated / ( 1024 * 1024 ) );
+   }
+
+   for ( a = 0; a < bp.files; a++ ){
+      snprintf ( path, sizeof ( path ), "%s/bench.%d", bp.dir, a );
+      unlink ( path );
+   }
+
+   return 0;
+}
@@ -27,6 +27,7 @@ TODO:
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <pthread.h>
 #include "config.h"
 #include "pgsqllib.h"
 
@@ -83,6 +84,7 @@ pgsqldata * allocpdata ( void ){
 
    pdata = (pgsqldata *) malloc ( sizeof ( pgsqldata ) );
    memset ( pdata, 0, sizeof ( pgsqldata ) );
+   pdata->dirs.rsavepos = -1;
    
    return pdata;
 }
@@ -101,6 +103,16 @@ void freepdata ( pgsqldata * pdata ){
       FREE ( pdata->where );
    if ( pdata->restoreclient )
       FREE ( pdata->restoreclient );
+   if ( pdata->jobids )
+      FREE ( pdata->jobids );
+   if ( pdata->lastwal )
+      FREE ( pdata->lastwal );
+   if ( pdata->walspool )
+      FREE ( pdata->walspool );
+   if ( pdata->dirs.rbuf )
+      FREE ( pdata->dirs.rbuf );
+   if ( pdata->dirs.wbuf )
+      FREE ( pdata->dirs.wbuf );
 
    free ( pdata );
 }
@@ -144,6 +156,7 @@ void freepinst ( pgsqlpinst * pinst ){
 char * logstr ( char * msg, LOG_LEVEL_T level ){
 
    time_t t;
+   struct tm tm;
    char * lvl;
    char mtime[ 24 + 1 ];
    /*
@@ -160,8 +173,8 @@ char * logstr ( char * msg, LOG_LEVEL_T level ){
    /* current time */
    time ( &t );
 
-   /* render current time in required format into msg */
-   strftime ( mtime, LOGMSGLEN, "%F %T %Z", localtime ( &t ) );
+   /* render current time in required format into msg, logs come from worker threads too */
+   strftime ( mtime, LOGMSGLEN, "%F %T %Z", localtime_r ( &t, &tm ) );
 
    /* choose log level string */
    switch (level){
@@ -356,6 +369,8 @@ keylist * parse_pgsql_conf ( char * configfile ){
       paramlist = add_keylist ( paramlist, "ARCHDEST", "/tmp" );
    if ( ! search_key ( paramlist, "ARCHCLIENT" ) )
       paramlist = add_keylist ( paramlist, "ARCHCLIENT", "catdb" );
+   if ( ! search_key ( paramlist, "ARCHFSYNC" ) )
+      paramlist = add_keylist ( paramlist, "ARCHFSYNC", "yes" );
    if ( ! search_key ( paramlist, "DIRNAME" ) )
       paramlist = add_keylist ( paramlist, "DIRNAME", "director" );
    if ( ! search_key ( paramlist, "DIRHOST" ) )
@@ -364,6 +379,18 @@ keylist * parse_pgsql_conf ( char * configfile ){
       paramlist = add_keylist ( paramlist, "DIRPORT", "9101" );
    if ( ! search_key ( paramlist, "DIRPASSWD" ) )
       paramlist = add_keylist ( paramlist, "DIRPASSWD", "dirpasswd" );
+   if ( ! search_key ( paramlist, "WALPREFETCH" ) )
+      paramlist = add_keylist ( paramlist, "WALPREFETCH", "16" );
+   if ( ! search_key ( paramlist, "WALSTAGE" ) )
+      paramlist = add_keylist ( paramlist, "WALSTAGE", "16" );
+   if ( ! search_key ( paramlist, "RESTORETHREADS" ) )
+      paramlist = add_keylist ( paramlist, "RESTORETHREADS", "4" );
+   if ( ! search_key ( paramlist, "RESTORESYNC" ) )
+      paramlist = add_keylist ( paramlist, "RESTORESYNC", "syncfs" );
+   if ( ! search_key ( paramlist, "DBSHARDS" ) )
+      paramlist = add_keylist ( paramlist, "DBSHARDS", "1" );
+   if ( ! search_key ( paramlist, "PROGRESSINTERVAL" ) )
+      paramlist = add_keylist ( paramlist, "PROGRESSINTERVAL", "10" );
 
    return paramlist;
 }
@@ -843,6 +870,250 @@ int _copy_wal_file ( pgsqldata * pdata, char * src, char * dst ){
    return 0;
 }
 
+/*
+ * checks if supplied name is a regular WAL segment file name:
+ * TTTTTTTTLLLLLLLLSSSSSSSS (timeline, log, segment as hex digits)
+ * history, backup label and partial files are not segments
+ *
+ * in:
+ *    name - file name to check
+ * out:
+ *    1 - it is a WAL segment name
+ *    0 - it is something else
+ */
+int is_wal_filename ( const char * name ){
+
+   int a;
+
+   if ( ! name || strlen ( name ) != WALNAMELEN ){
+      return 0;
+   }
+   for ( a = 0; a < WALNAMELEN; a++ ){
+      if ( ! isxdigit ( (unsigned char) name [ a ] ) ){
+         return 0;
+      }
+   }
+   return 1;
+}
+
+/*
+ * parses a textual LSN in %X/%X form
+ */
+static int parse_pglog_lsn ( const char * str, uint64_t * lsn ){
+
+   char * end;
+   unsigned long hi;
+   unsigned long lo;
+
+   hi = strtoul ( str, &end, 16 );
+   if ( end == str || *end != '/' ){
+      return 1;
+   }
+   str = end + 1;
+   lo = strtoul ( str, &end, 16 );
+   if ( end == str ){
+      return 1;
+   }
+   *lsn = ( (uint64_t) hi << 32 ) | ( lo & 0xFFFFFFFF );
+   return 0;
+}
+
+/* postmaster log messages recognized during recovery, a message is compared
+ * at the position just after a severity tag, so it is a prefix compare only */
+typedef struct _pglogpattern pglogpattern;
+struct _pglogpattern {
+   pglogevtype type;
+   const char * msg;
+   int len;
+   const char * lsnat;     /* LSN follows this string in message */
+};
+
+#define PGLOGPAT(t,m,l) { t, m, sizeof ( m ) - 1, l }
+static const pglogpattern pglogpatterns [] = {
+   PGLOGPAT ( PGLOG_RECOVERY_COMPLETE, "archive recovery complete", NULL ),
+   PGLOGPAT ( PGLOG_SHUTDOWN, "database system is shut down", NULL ),
+   PGLOGPAT ( PGLOG_RESTORED, "restored log file \"", NULL ),
+   PGLOGPAT ( PGLOG_REDO_START, "redo starts at ", "redo starts at " ),
+   PGLOGPAT ( PGLOG_REDO_DONE, "redo done at ", "redo done at " ),
+   PGLOGPAT ( PGLOG_REDO_PROGRESS, "consistent recovery state reached at ", "reached at " ),
+   PGLOGPAT ( PGLOG_REDO_PROGRESS, "redo in progress", "current LSN: " ),
+   { PGLOG_NONE, NULL, 0, NULL },
+};
+
+/* a timing line logged by restore_command: "INFO:  <program>: WAL <name> restore done in <s>s." */
+#define PGLOGWALFETCH   ": WAL "
+#define PGLOGWALDONE    " restore done in "
+
+/*
+ * parses a postmaster log line in a single pass: the line is scanned once for
+ * a severity tag ("LOG:  " or "FATAL:  ") and then a message which follows
+ * the tag is compared with known message prefixes
+ *
+ * in:
+ *    line - log line
+ *    len - line length
+ * out:
+ *    ev - event found, ev->type is PGLOG_NONE for other lines
+ *    ev->type
+ */
+int parse_pglog_line ( const char * line, int len, pglogevent * ev ){
+
+   const char * p;
+   const char * end;
+   const char * msg = NULL;
+   const char * lsn;
+   const pglogpattern * pat;
+   int fatal = 0;
+   int info = 0;
+
+   ev->type = PGLOG_NONE;
+   ev->walname [ 0 ] = 0;
+   ev->lsn = 0;
+   ev->fetchtime = 0;
+
+   end = line + len;
+   for ( p = line; p < end - 5; p++ ){
+      if ( *p != ':' || p [ 1 ] != ' ' || p [ 2 ] != ' ' ){
+         continue;
+      }
+      if ( p - line >= 3 && strncmp ( p - 3, "LOG", 3 ) == 0 ){
+         msg = p + 3;
+         break;
+      }
+      if ( p - line >= 5 && strncmp ( p - 5, "FATAL", 5 ) == 0 ){
+         msg = p + 3;
+         fatal = 1;
+         break;
+      }
+      if ( p - line >= 4 && strncmp ( p - 4, "INFO", 4 ) == 0 ){
+         msg = p + 3;
+         info = 1;
+         break;
+      }
+   }
+   if ( ! msg ){
+      return PGLOG_NONE;
+   }
+
+   if ( info ){
+      /* our own restore_command output, a program name is skipped */
+      msg = strstr ( msg, PGLOGWALFETCH );
+      if ( msg && end - msg > (int) sizeof ( PGLOGWALFETCH ) - 1 + WALNAMELEN ){
+         msg += sizeof ( PGLOGWALFETCH ) - 1;
+         lsn = msg + WALNAMELEN;
+         if ( strncmp ( lsn, PGLOGWALDONE, sizeof ( PGLOGWALDONE ) - 1 ) == 0 ){
+            memcpy ( ev->walname, msg, WALNAMELEN );
+            ev->walname [ WALNAMELEN ] = 0;
+            ev->fetchtime = strtod ( lsn + sizeof ( PGLOGWALDONE ) - 1, NULL );
+            ev->type = PGLOG_WAL_FETCH;
+         }
+      }
+      return ev->type;
+   }
+
+   if ( fatal ){
+      /* pg_ctl -w polls a server during recovery, it is not an error */
+      if ( strncmp ( msg, "the database system is starting up", 34 ) != 0 ){
+         ev->type = PGLOG_FATAL;
+      }
+      return ev->type;
+   }
+
+   for ( pat = pglogpatterns; pat->msg; pat++ ){
+      if ( end - msg < pat->len || strncmp ( msg, pat->msg, pat->len ) != 0 ){
+         continue;
+      }
+      switch ( pat->type ){
+         case PGLOG_RESTORED:
+            /* restored log file "<walname>" from archive */
+            if ( end - msg >= pat->len + WALNAMELEN ){
+               memcpy ( ev->walname, msg + pat->len, WALNAMELEN );
+               ev->walname [ WALNAMELEN ] = 0;
+            }
+            break;
+         default:
+            if ( pat->lsnat ){
+               lsn = strstr ( msg, pat->lsnat );
+               if ( ! lsn || parse_pglog_lsn ( lsn + strlen ( pat->lsnat ), &ev->lsn ) ){
+                  continue;
+               }
+            }
+      }
+      ev->type = pat->type;
+      break;
+   }
+
+   return ev->type;
+}
+
+/*
+ * converts a WAL segment name into a linear segment number on its timeline
+ *
+ * in:
+ *    wal - WAL segment name
+ * out:
+ *    segno - segment number
+ *    0 - success
+ *    1 - wal is not a segment name
+ */
+int wal_segment_number ( const char * wal, uint64_t * segno ){
+
+   char part [ 9 ];
+   unsigned long log;
+   unsigned long seg;
+
+   if ( ! is_wal_filename ( wal ) ){
+      return 1;
+   }
+   part [ 8 ] = 0;
+   memcpy ( part, wal + 8, 8 );
+   log = strtoul ( part, NULL, 16 );
+   memcpy ( part, wal + 16, 8 );
+   seg = strtoul ( part, NULL, 16 );
+   *segno = (uint64_t) log * WALSEGMENTS + seg;
+
+   return 0;
+}
+
+/*
+ * computes a name of the WAL segment which follows the supplied one
+ * on the same timeline, segments are 16MB so there is 0x100 segments
+ * in every log file
+ *
+ * in:
+ *    wal - current WAL segment name
+ *    next - buffer for next segment name, at least WALNAMELEN + 1 bytes
+ * out:
+ *    0 - success
+ *    1 - wal is not a segment name
+ */
+int next_wal_filename ( const char * wal, char * next ){
+
+   unsigned long tli, log, seg;
+   char part [ 9 ];
+
+   if ( ! is_wal_filename ( wal ) ){
+      return 1;
+   }
+   /* libbac sscanf does not handle hex conversions, so split it by hand */
+   part [ 8 ] = 0;
+   memcpy ( part, wal, 8 );
+   tli = strtoul ( part, NULL, 16 );
+   memcpy ( part, wal + 8, 8 );
+   log = strtoul ( part, NULL, 16 );
+   memcpy ( part, wal + 16, 8 );
+   seg = strtoul ( part, NULL, 16 );
+
+   seg++;
+   if ( seg >= WALSEGMENTS ){
+      seg = 0;
+      log++;
+   }
+   snprintf ( next, WALNAMELEN + 1, "%08lX%08lX%08lX", tli, log, seg );
+
+   return 0;
+}
+
 /*
  * checks if PostgreSQL instance is running
  * 
@@ -1180,3 +1451,103 @@ char * format_btime ( const char * str ){
    return out;
 }
 #endif
+
+/*
+ * returns a number of worker threads for parallel restore operations
+ */
+int get_restore_threads ( keylist * paramlist ){
+
+   char * val;
+   int nthreads;
+
+   val = search_key ( paramlist, "RESTORETHREADS" );
+   nthreads = val ? atoi ( val ) : RESTORETHREADS;
+
+   return nthreads < 1 ? 1 : nthreads;
+}
+
+/* shared state of the pgsql_run_parallel workers */
+typedef struct _pgsql_pool pgsql_pool;
+struct _pgsql_pool {
+   pthread_mutex_t mutex;
+   int next;
+   int nitems;
+   int nerrors;
+   pgsql_task_fn fn;
+   void * arg;
+};
+
+static void * pgsql_pool_worker ( void * data ){
+
+   pgsql_pool * pool = (pgsql_pool *) data;
+   int item;
+
+   for (;;){
+      pthread_mutex_lock ( &pool->mutex );
+      item = pool->next < pool->nitems ? pool->next++ : -1;
+      pthread_mutex_unlock ( &pool->mutex );
+      if ( item < 0 ){
+         break;
+      }
+      if ( pool->fn ( pool->arg, item ) ){
+         pthread_mutex_lock ( &pool->mutex );
+         pool->nerrors++;
+         pthread_mutex_unlock ( &pool->mutex );
+      }
+   }
+
+   return NULL;
+}
+
+/*
+ * executes a task function for every item number in [0, nitems) using
+ * a pool of worker threads, items are distributed dynamically
+ *
+ * in:
+ *    nthreads - number of worker threads
+ *    nitems - number of items to process
+ *    fn - task function
+ *    arg - task function argument
+ * out:
+ *    number of failed items
+ */
+int pgsql_run_parallel ( int nthreads, int nitems, pgsql_task_fn fn, void * arg ){
+
+   pgsql_pool pool;
+   pthread_t * threads;
+   int started = 0;
+   int a;
+
+   pthread_mutex_init ( &pool.mutex, NULL );
+   pool.next = 0;
+   pool.nitems = nitems;
+   pool.nerrors = 0;
+   pool.fn = fn;
+   pool.arg = arg;
+
+   if ( nthreads > nitems ){
+      nthreads = nitems;
+   }
+
+   threads = (pthread_t *) malloc ( sizeof ( pthread_t ) * ( nthreads > 0 ? nthreads : 1 ) );
+   if ( threads ){
+      for ( a = 0; a < nthreads; a++ ){
+         if ( pthread_create ( &threads [ started ], NULL, pgsql_pool_worker, &pool ) == 0 ){
+            started++;
+         }
+      }
+   }
+
+   /* no threads available, do it in current thread */
+   if ( ! started ){
+      pgsql_pool_worker ( &pool );
+   }
+
+   for ( a = 0; a < started; a++ ){
+      pthread_join ( threads [ a ], NULL );
+   }
+   FREE ( threads );
+   pthread_mutex_destroy ( &pool.mutex );
+
+   return pool.nerrors;
+}
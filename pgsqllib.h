@@ -15,6 +15,7 @@
 #include <bacula.h>
 #include "keylist.h"
 #include "parseconfig.h"
+#include "pgsqlstatus.h"
 
 /* definitions */
 
@@ -24,6 +25,38 @@
 #define SQLLEN       256
 #define LOGMSGLEN    (6 + 32 + 7 + 24 + 1)
 
+/* WAL segment file name length and number of 16MB segments in a log file */
+#define WALNAMELEN   24
+#define WALSEGMENTS  0x100
+/* upper limit of WAL segments prefetched into restore spool */
+#define WALPREFETCHMAX  64
+/* maximum number of database backup shards restored in parallel */
+#define PGMAXSHARDS     64
+
+/* events found in postmaster log during recovery */
+typedef enum {
+   PGLOG_NONE = 0,
+   PGLOG_RECOVERY_COMPLETE,   /* archive recovery complete */
+   PGLOG_SHUTDOWN,            /* database system is shut down */
+   PGLOG_FATAL,               /* any FATAL error */
+   PGLOG_RESTORED,            /* restored log file from archive */
+   PGLOG_REDO_START,          /* redo starts at LSN */
+   PGLOG_REDO_PROGRESS,       /* redo in progress / consistent state at LSN */
+   PGLOG_REDO_DONE,           /* redo done at LSN */
+   PGLOG_WAL_FETCH,           /* restore_command timing from pgsql-restore wal -v */
+} pglogevtype;
+
+typedef struct _pglogevent pglogevent;
+struct _pglogevent {
+   pglogevtype type;
+   char walname [ WALNAMELEN + 1 ];    /* PGLOG_RESTORED */
+   uint64_t lsn;                       /* PGLOG_REDO_* */
+   double fetchtime;                   /* PGLOG_WAL_FETCH */
+};
+
+/* WAL segment size in bytes */
+#define WALSEGSIZE   ( 16 * 1024 * 1024 )
+
 /* Assertions definitions */
 #ifndef ASSERT_bfuncs
 #define ASSERT_bfuncs \
@@ -229,6 +262,8 @@ typedef enum {
    PGSQL_DB_BACKUP,
    PGSQL_DB_RESTORE,
    PGSQL_ARCH_RESTORE,
+   PGSQL_DB_VERIFY,
+   PGSQL_WAL_FIND,
 } PGSQL_MODE_T;
 
 /* restore point-in-time */
@@ -238,36 +273,26 @@ typedef enum {
    PITR_XID,
 } PGSQL_PITR_T;
 
-/* pgsql_status definitions */
-typedef enum {
-   PGSQL_STATUS_UNKNOWN             = 0,
-   
-   PGSQL_STATUS_WAL_ARCH_START      = 1,
-   PGSQL_STATUS_WAL_ARCH_INPROG     = 2,  /* unimplemented */
-   PGSQL_STATUS_WAL_ARCH_FINISH     = 3,
-   PGSQL_STATUS_WAL_ARCH_FAILED     = 4,
-   PGSQL_STATUS_WAL_ARCH_MULTI      = 5,
-   
-   PGSQL_STATUS_WAL_BACK_START      = 6,
-   PGSQL_STATUS_WAL_BACK_INPROG     = 7,  /* unimplemented */
-   PGSQL_STATUS_WAL_BACK_DONE       = 8,
-   PGSQL_STATUS_WAL_BACK_FAILED     = 9,  /* unimplemented */
-   
-   PGSQL_STATUS_DB_ONLINE_START     = 10, /* unimplemented */
-   PGSQL_STATUS_DB_ONLINE_INPROG    = 11, /* unimplemented */
-   PGSQL_STATUS_DB_ONLINE_FINISH    = 12, /* unimplemented */
-   PGSQL_STATUS_DB_ONLINE_FAILED    = 13, /* unimplemented */
-
-   PGSQL_STATUS_DB_OFFLINE_START    = 14, /* unimplemented */
-   PGSQL_STATUS_DB_OFFLINE_INPROG   = 15, /* unimplemented */
-   PGSQL_STATUS_DB_OFFLINE_FINISH   = 16, /* unimplemented */
-   PGSQL_STATUS_DB_OFFLINE_FAILED   = 17, /* unimplemented */
-} PGSQL_STATUS_T;
-
-#define PGSQL_STATUS_WAL_OK    "3,5,8"
-#define PGSQL_STATUS_WAL_ERR   "4,9"
-#define PGSQL_STATUS_DB_OK     "12,16"
-#define PGSQL_STATUS_DB_ERR    "13,17"
+/*
+ * buffered director console session used by pgsql-restore
+ */
+#define DIRBUFLEN    65536
+#define DIRMSGMAX    (16 * 1024 * 1024)
+typedef struct _dirsession dirsession;
+struct _dirsession {
+   char     * rbuf;        /* receive buffer */
+   int      rsize;
+   int      rstart;        /* first unconsumed byte */
+   int      rend;          /* end of received data */
+   int      rsavepos;      /* position of a byte replaced by message EOS or -1 */
+   char     rsave;
+   char     * wbuf;        /* pipelined commands queue */
+   int      wsize;
+   int      wlen;
+   int      connected;
+   int      auth;
+   int      badfileset;    /* director rejected a fileset name of a restore */
+};
 
 /* pgsqldata for pgsql-arch or pgsql-restore */
 typedef struct _pgsqldata pgsqldata;
@@ -283,8 +308,12 @@ struct _pgsqldata
    char     * restorepit;
    char     * where;
    char     * restoreclient;
+   char     * jobids;      /* selected base backup jobs or NULL */
+   char     * lastwal;     /* the last WAL segment required by recovery target or NULL */
+   char     * walspool;    /* WAL spool prepared for recovery or NULL */
    int      verbose;
    int      bsock;
+   dirsession dirs;
 };
 
 /* pgsqlpinst for pgsql-fd instance data */
@@ -330,6 +359,15 @@ struct _PGSQL_MSG_BUF_T {
    char mtext [ MSGBUFLEN ];
 };
 
+/*
+ * parallel task executed by pgsql_run_parallel for every item number,
+ * returns 0 on success
+ */
+typedef int (*pgsql_task_fn) ( void * arg, int item );
+
+/* default number of worker threads used by restore utilities */
+#define RESTORETHREADS  4
+
 /*
  * date/time verification function structs
  */
@@ -365,6 +403,10 @@ int _insert_status_in_catalog ( pgsqldata * pdata, int status );
 int _update_status_in_catalog ( pgsqldata * pdata, int pgid, int status );
 int _copy_wal_file ( pgsqldata * pdata, char * src, char * dst );
 int _check_postgres_is_running ( pgsqldata * pdata, char * pgdataloc );
+int is_wal_filename ( const char * name );
+int next_wal_filename ( const char * wal, char * next );
+int parse_pglog_line ( const char * line, int len, pglogevent * ev );
+int wal_segment_number ( const char * wal, uint64_t * segno );
 const char * find_pgctl ( pgsqldata * pdata );
 //int readline ( int fd, char * buf, int size );
 //int freadline ( FILE * stream, char * buf, int size );
@@ -373,5 +415,7 @@ int pgsql_msg_send ( pgsqldata * pdata, int msqid, uint type, const char * messa
 int pgsql_msg_recv ( pgsqldata * pdata, int msqid, int type, char * message );
 void pgsql_msg_shutdown ( pgsqldata * pdata, int msqid );
 char * format_btime ( const char * str );
+int get_restore_threads ( keylist * paramlist );
+int pgsql_run_parallel ( int nthreads, int nitems, pgsql_task_fn fn, void * arg );
 
 #endif /* _PGSQLLIB_H_ */
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2013 by Inteos sp. z o.o.
+ * All rights reserved. See LICENSE.Inteos for details.
+ *
+ * Catalog status codes (pgsql_status table) shared by pgsql plugin and its
+ * utilities.
+ */
+
+#ifndef _PGSQLSTATUS_H_
+#define _PGSQLSTATUS_H_
+
+/* pgsql_status definitions */
+typedef enum {
+   PGSQL_STATUS_UNKNOWN             = 0,
+   
+   PGSQL_STATUS_WAL_ARCH_START      = 1,
+   PGSQL_STATUS_WAL_ARCH_INPROG     = 2,  /* unimplemented */
+   PGSQL_STATUS_WAL_ARCH_FINISH     = 3,
+   PGSQL_STATUS_WAL_ARCH_FAILED     = 4,
+   PGSQL_STATUS_WAL_ARCH_MULTI      = 5,
+   
+   PGSQL_STATUS_WAL_BACK_START      = 6,
+   PGSQL_STATUS_WAL_BACK_INPROG     = 7,  /* unimplemented */
+   PGSQL_STATUS_WAL_BACK_DONE       = 8,
+   PGSQL_STATUS_WAL_BACK_FAILED     = 9,  /* unimplemented */
+   
+   PGSQL_STATUS_DB_ONLINE_START     = 10,
+   PGSQL_STATUS_DB_ONLINE_INPROG    = 11,
+   PGSQL_STATUS_DB_ONLINE_FINISH    = 12,
+   PGSQL_STATUS_DB_ONLINE_FAILED    = 13,
+
+   PGSQL_STATUS_DB_OFFLINE_START    = 14, /* unimplemented */
+   PGSQL_STATUS_DB_OFFLINE_INPROG   = 15, /* unimplemented */
+   PGSQL_STATUS_DB_OFFLINE_FINISH   = 16, /* unimplemented */
+   PGSQL_STATUS_DB_OFFLINE_FAILED   = 17, /* unimplemented */
+} PGSQL_STATUS_T;
+
+#define PGSQL_STATUS_WAL_OK    "3,5,8"
+#define PGSQL_STATUS_WAL_ERR   "4,9"
+#define PGSQL_STATUS_DB_OK     "12,16"
+#define PGSQL_STATUS_DB_ERR    "13,17"
+
+#endif /* _PGSQLSTATUS_H_ */
@@ -0,0 +1,1088 @@
+/*
+ * Copyright (c) 2013 by Inteos sp. z o.o.
+ * All rights reserved. See LICENSE.Inteos for details.
+ *
+ * WAL decoder for Inteos PostgreSQL plugin.
+ * A WAL segment is a sequence of pages, every page starts with a header and
+ * records are MAXALIGNed and may span pages and segments. Record layout
+ * (PostgreSQL 9.5 and later) is a fixed header, block reference headers,
+ * a main data header, then block images and data and main data at the end.
+ * Decoder stops at the end of valid WAL: a zeroed area, a page of recycled
+ * segment or a record with bad crc, exactly as recovery does.
+ *
+ * A summary is a hash of relation forks with their changed block lists, kept
+ * as text in catalog:
+ *    r <spcoid> <dboid> <relnode> <fork> <limit|-> <block ranges|->
+ *    d <spcoid> <dboid>
+ * where block ranges are comma separated <block>[-<block>] and d lines are
+ * databases created by a file copy, not WAL logged.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "pgsqlwal.h"
+#include "utils.h"
+
+#define WALMAXALIGN(x)     ( ( (x) + 7 ) & ~( (uint64_t) 7 ) )
+
+/* block reference header flags */
+#define BKPBLOCK_FORK_MASK 0x0F
+#define BKPBLOCK_HAS_IMAGE 0x10
+#define BKPBLOCK_HAS_DATA  0x20
+#define BKPBLOCK_SAME_REL  0x80
+#define BKPIMAGE_HAS_HOLE  0x01
+/* compressed image flags, before and since PostgreSQL 15 */
+#define BKPIMAGE_COMPRESSED95    0x02
+#define BKPIMAGE_COMPRESSED15    0x1C
+
+/* special block ids of record headers */
+#define XLR_BLOCK_ID_DATA_SHORT  255
+#define XLR_BLOCK_ID_DATA_LONG   254
+#define XLR_BLOCK_ID_ORIGIN      253
+#define XLR_BLOCK_ID_TOPLEVEL_XID 252
+
+/* summary hash initial size, power of 2 */
+#define WALHASHSIZE        1024
+/* initial size of relation block list */
+#define WALBLOCKSINIT      16
+
+/*
+ * initializes WAL reader
+ *
+ * out:
+ *    0 - success
+ *    -1 - memory allocation error
+ */
+int walreader_init ( walreader * wr ){
+
+   memset ( wr, 0, sizeof ( walreader ) );
+   wr->recsize = 65536;
+   wr->rec = (unsigned char *) malloc ( wr->recsize );
+
+   return wr->rec ? 0 : -1;
+}
+
+void walreader_free ( walreader * wr ){
+
+   free ( wr->rec );
+   wr->rec = NULL;
+   wr->recsize = 0;
+}
+
+/*
+ * makes sure record assembly buffer holds a record of given length
+ */
+static int walreader_reserve ( walreader * wr, uint32_t len ){
+
+   unsigned char * buf;
+   uint32_t size;
+
+   if ( len <= wr->recsize ){
+      return 0;
+   }
+   for ( size = wr->recsize; size < len; size *= 2 );
+   buf = (unsigned char *) realloc ( wr->rec, size );
+   if ( ! buf ){
+      return -1;
+   }
+   wr->rec = buf;
+   wr->recsize = size;
+
+   return 0;
+}
+
+/*
+ * sets a record which started in a previous segment, decoded by another
+ * process, its remaining part is assembled from the next decoded segment
+ *
+ * in:
+ *    wr - WAL reader
+ *    reclsn - record start
+ *    rectot - record total length
+ *    data, len - record bytes of a previous segment
+ *    contlsn - LSN where the record continues, the next segment start
+ * out:
+ *    0 - success
+ *    -1 - invalid tail or memory allocation error
+ */
+int walreader_set_tail ( walreader * wr, uint64_t reclsn, uint32_t rectot, const unsigned char * data, uint32_t len, uint64_t contlsn ){
+
+   wr->reclen = 0;
+   if ( rectot < WALRECORDHDR || rectot > WALMAXRECORD || len == 0 || len >= rectot ||
+         walreader_reserve ( wr, rectot ) != 0 ){
+      return -1;
+   }
+   memcpy ( wr->rec, data, len );
+   wr->reclsn = reclsn;
+   wr->rectot = rectot;
+   wr->reclen = len;
+   wr->contlsn = contlsn;
+
+   return 0;
+}
+
+/* reads a value of a given type from unaligned buffer */
+#define WALGET(var,ptr)    memcpy ( &(var), (ptr), sizeof ( var ) )
+
+/*
+ * decodes record headers of an assembled record, block references and
+ * the main data location
+ *
+ * in:
+ *    wr - WAL reader with an assembled record
+ *    r - record to fill
+ * out:
+ *    0 - success
+ *    -1 - invalid record
+ */
+static int wal_decode_record ( walreader * wr, walrecord * r ){
+
+   const unsigned char * p = wr->rec + WALRECORDHDR;
+   uint32_t remaining = wr->rectot - WALRECORDHDR;
+   uint32_t datatotal = 0;
+   uint32_t len32;
+   uint16_t datalen, imglen;
+   uint8_t id, flags, imginfo, len8;
+   int compressed;
+   int hasrel = 0;
+   walblockref * b;
+   walblockref last;
+
+#define WALNEED(n) \
+   if ( remaining < (n) ){ \
+      return -1; \
+   }
+
+   memset ( &last, 0, sizeof ( last ) );
+   memset ( r, 0, offsetof ( walrecord, blocks ) );
+   r->maindata = NULL;
+   r->mainlen = 0;
+   r->lsn = wr->reclsn;
+   r->totlen = wr->rectot;
+   WALGET ( r->xid, wr->rec + 4 );
+   r->info = wr->rec [ 16 ];
+   r->rmid = wr->rec [ 17 ];
+   r->magic = wr->magic;
+
+   while ( remaining > datatotal ){
+      id = *p++;
+      remaining--;
+      if ( id == XLR_BLOCK_ID_DATA_SHORT ){
+         WALNEED ( 1 );
+         len8 = *p++;
+         remaining--;
+         r->mainlen = len8;
+         datatotal += len8;
+         /* main data header is always the last one */
+         break;
+      } else
+      if ( id == XLR_BLOCK_ID_DATA_LONG ){
+         WALNEED ( 4 );
+         WALGET ( len32, p );
+         p += 4;
+         remaining -= 4;
+         r->mainlen = len32;
+         datatotal += len32;
+         break;
+      } else
+      if ( id == XLR_BLOCK_ID_ORIGIN ){
+         WALNEED ( 2 );
+         p += 2;
+         remaining -= 2;
+      } else
+      if ( id == XLR_BLOCK_ID_TOPLEVEL_XID ){
+         WALNEED ( 4 );
+         p += 4;
+         remaining -= 4;
+      } else
+      if ( id <= WALMAXBLOCKID && r->nblocks <= WALMAXBLOCKID ){
+         WALNEED ( 3 );
+         flags = *p++;
+         WALGET ( datalen, p );
+         p += 2;
+         remaining -= 3;
+         if ( flags & BKPBLOCK_HAS_IMAGE ){
+            WALNEED ( 5 );
+            WALGET ( imglen, p );
+            imginfo = p [ 4 ];
+            p += 5;
+            remaining -= 5;
+            compressed = imginfo & ( r->magic >= WALMAGIC15 ? BKPIMAGE_COMPRESSED15 : BKPIMAGE_COMPRESSED95 );
+            if ( ( imginfo & BKPIMAGE_HAS_HOLE ) && compressed ){
+               WALNEED ( 2 );
+               p += 2;
+               remaining -= 2;
+            }
+            datatotal += imglen;
+         }
+         datatotal += datalen;
+         b = &r->blocks [ r->nblocks ];
+         if ( ! ( flags & BKPBLOCK_SAME_REL ) ){
+            WALNEED ( 12 );
+            WALGET ( last.spcoid, p );
+            WALGET ( last.dboid, p + 4 );
+            WALGET ( last.relnode, p + 8 );
+            p += 12;
+            remaining -= 12;
+            hasrel = 1;
+         } else
+         if ( ! hasrel ){
+            return -1;
+         }
+         WALNEED ( 4 );
+         b->spcoid = last.spcoid;
+         b->dboid = last.dboid;
+         b->relnode = last.relnode;
+         b->fork = flags & BKPBLOCK_FORK_MASK;
+         WALGET ( b->blkno, p );
+         p += 4;
+         remaining -= 4;
+         r->nblocks++;
+      } else {
+         return -1;
+      }
+   }
+#undef WALNEED
+
+   if ( remaining != datatotal ){
+      return -1;
+   }
+   /* main data is the last fragment of record */
+   r->maindata = wr->rec + wr->rectot - r->mainlen;
+
+   return 0;
+}
+
+/*
+ * verifies and decodes an assembled record, then calls a record callback
+ *
+ * out:
+ *    0 - success
+ *    -1 - invalid record, the end of valid WAL
+ */
+static int wal_emit ( walreader * wr, walrecord_fn fn, void * arg, uint64_t * lastend, int * switched ){
+
+   walrecord r;
+   uint32_t crc;
+
+   WALGET ( crc, wr->rec + 20 );
+   if ( crc32c ( crc32c ( 0, wr->rec + WALRECORDHDR, wr->rectot - WALRECORDHDR ), wr->rec, 20 ) != crc ||
+         wal_decode_record ( wr, &r ) != 0 ){
+      wr->reclen = 0;
+      return -1;
+   }
+   wr->records++;
+   if ( fn ){
+      fn ( &r, arg );
+   }
+   if ( r.rmid == RM_XLOG_ID && ( r.info & ~XLR_INFO_MASK ) == XLOG_SWITCH ){
+      *switched = 1;
+   }
+   *lastend = wr->reclsn + wr->rectot;
+   wr->reclen = 0;
+
+   return 0;
+}
+
+/*
+ * appends a record fragment to assembly buffer
+ */
+static void wal_append ( walreader * wr, const unsigned char * data, uint32_t len ){
+
+   memcpy ( wr->rec + wr->reclen, data, len );
+   wr->reclen += len;
+}
+
+/*
+ * decodes all records of a WAL segment; a record started in a previous
+ * segment is completed when the reader holds its beginning, otherwise it is
+ * skipped and coverage starts at the next record; a record which continues in
+ * the next segment is kept in the reader
+ *
+ * in:
+ *    wr - WAL reader
+ *    seg - segment data
+ *    len - segment data length, a whole segment or its part
+ *    fn - a callback for every decoded record
+ *    arg - callback argument
+ * out:
+ *    0 - success, wr->covstart and wr->covend describe decoded records
+ *    -1 - not a WAL segment or unsupported WAL version
+ */
+int wal_decode_segment ( walreader * wr, const unsigned char * seg, size_t len, walrecord_fn fn, void * arg ){
+
+   const unsigned char * page;
+   uint16_t magic, info;
+   uint32_t segsize, pagesize, remlen, tot, n;
+   uint64_t pageaddr, lastend;
+   size_t po, off;
+   int switched = 0;
+   int stop = 0;
+   int skip = 0;
+
+   if ( len < WALLONGPHD ){
+      return -1;
+   }
+   WALGET ( magic, seg );
+   WALGET ( info, seg + 2 );
+   WALGET ( pageaddr, seg + 8 );
+   WALGET ( segsize, seg + 32 );
+   WALGET ( pagesize, seg + 36 );
+   if ( magic < WALMAGIC95 || magic > WALMAGICMAX || ! ( info & XLP_LONG_HEADER ) ||
+         pagesize < 1024 || pagesize > 65536 || ( pagesize & ( pagesize - 1 ) ) ||
+         segsize < pagesize || segsize % pagesize || pageaddr % segsize ){
+      return -1;
+   }
+   wr->magic = magic;
+   WALGET ( wr->tli, seg + 4 );
+   wr->segsize = segsize;
+   wr->pagesize = pagesize;
+   wr->segstart = pageaddr;
+   if ( len > segsize ){
+      len = segsize;
+   }
+
+   /* a kept record continues here only if segments are consecutive */
+   if ( wr->reclen && wr->contlsn != wr->segstart ){
+      wr->reclen = 0;
+   }
+   wr->covstart = wr->reclen ? wr->reclsn : wr->segstart;
+   lastend = wr->covstart;
+
+   for ( po = 0; ! stop && po + pagesize <= len; po += pagesize ){
+      page = seg + po;
+      WALGET ( magic, page );
+      WALGET ( info, page + 2 );
+      WALGET ( pageaddr, page + 8 );
+      WALGET ( remlen, page + 16 );
+      if ( magic != wr->magic || pageaddr != wr->segstart + po ){
+         /* a page of recycled segment, WAL ends here */
+         break;
+      }
+      off = ( info & XLP_LONG_HEADER ) ? WALLONGPHD : WALSHORTPHD;
+
+      if ( info & XLP_FIRST_IS_CONTRECORD ){
+         n = remlen < pagesize - off ? remlen : pagesize - off;
+         if ( wr->reclen ){
+            if ( remlen != wr->rectot - wr->reclen ){
+               wr->reclen = 0;
+               break;
+            }
+            wal_append ( wr, page + off, n );
+            if ( wr->reclen == wr->rectot && wal_emit ( wr, fn, arg, &lastend, &switched ) != 0 ){
+               break;
+            }
+         } else
+         if ( po == 0 || skip ){
+            /* a record started in an unknown segment, it is not covered */
+            skip = 1;
+         } else {
+            /* a continuation of a record which was never started */
+            break;
+         }
+         off += n;
+         if ( remlen > n ){
+            /* the record continues on the next page */
+            continue;
+         }
+         off = WALMAXALIGN ( off );
+         if ( skip ){
+            skip = 0;
+            wr->covstart = wr->segstart + po + off;
+            lastend = wr->covstart;
+         }
+      } else
+      if ( wr->reclen ){
+         /* a record being assembled does not continue, WAL ends here */
+         wr->reclen = 0;
+         break;
+      }
+
+      while ( ! switched && off < pagesize ){
+         WALGET ( tot, page + off );
+         if ( tot < WALRECORDHDR || tot > WALMAXRECORD || walreader_reserve ( wr, tot ) != 0 ){
+            /* a zeroed area or garbage, WAL ends here */
+            stop = 1;
+            break;
+         }
+         wr->reclsn = wr->segstart + po + off;
+         wr->rectot = tot;
+         wr->reclen = 0;
+         n = tot < pagesize - off ? tot : pagesize - off;
+         wal_append ( wr, page + off, n );
+         off += n;
+         if ( wr->reclen < tot ){
+            break;
+         }
+         if ( wal_emit ( wr, fn, arg, &lastend, &switched ) != 0 ){
+            stop = 1;
+            break;
+         }
+         off = WALMAXALIGN ( off );
+      }
+      if ( switched ){
+         /* a segment switch, the rest of segment is not used */
+         wr->reclen = 0;
+         wr->covend = wr->segstart + segsize;
+         return 0;
+      }
+   }
+
+   if ( stop || po + pagesize <= len ){
+      /* WAL ended inside of the segment */
+      wr->reclen = 0;
+      wr->covend = lastend;
+   } else
+   if ( wr->reclen ){
+      wr->covend = wr->reclsn;
+      wr->contlsn = wr->segstart + po;
+   } else {
+      wr->covend = wr->segstart + po;
+   }
+
+   return 0;
+}
+
+/*
+ * parses an LSN in PostgreSQL X/X notation
+ *
+ * out:
+ *    LSN or 0 when string is invalid
+ */
+uint64_t wal_parse_lsn ( const char * str ){
+
+   unsigned int hi, lo;
+
+   if ( ! str || sscanf ( str, "%X/%X", &hi, &lo ) != 2 ){
+      return 0;
+   }
+
+   return ( (uint64_t) hi << 32 ) | lo;
+}
+
+/*
+ * allocates an empty WAL summary
+ */
+walsummary * walsummary_alloc ( void ){
+
+   walsummary * ws;
+
+   ws = (walsummary *) calloc ( 1, sizeof ( walsummary ) );
+   if ( ! ws ){
+      return NULL;
+   }
+   ws->hashsize = WALHASHSIZE;
+   ws->hash = (walrelblocks **) calloc ( ws->hashsize, sizeof ( walrelblocks * ) );
+   if ( ! ws->hash ){
+      free ( ws );
+      return NULL;
+   }
+
+   return ws;
+}
+
+void walsummary_free ( walsummary * ws ){
+
+   walrelblocks * rb;
+   walrelblocks * next;
+   uint32_t a;
+
+   if ( ! ws ){
+      return;
+   }
+   for ( a = 0; a < ws->hashsize; a++ ){
+      for ( rb = ws->hash [ a ]; rb; rb = next ){
+         next = rb->next;
+         free ( rb->blocks );
+         free ( rb );
+      }
+   }
+   free ( ws->hash );
+   free ( ws->dbs );
+   free ( ws );
+}
+
+static uint32_t walsummary_hash ( uint32_t spcoid, uint32_t dboid, uint32_t relnode, uint32_t fork ){
+
+   uint32_t h;
+
+   h = relnode * 0x9E3779B1u;
+   h ^= ( dboid + fork ) * 0x85EBCA77u;
+   h ^= spcoid * 0xC2B2AE3Du;
+   h ^= h >> 15;
+
+   return h;
+}
+
+/*
+ * doubles the summary hash when it is filled
+ */
+static void walsummary_grow ( walsummary * ws ){
+
+   walrelblocks ** hash;
+   walrelblocks * rb;
+   walrelblocks * next;
+   uint32_t size = ws->hashsize * 2;
+   uint32_t a, h;
+
+   hash = (walrelblocks **) calloc ( size, sizeof ( walrelblocks * ) );
+   if ( ! hash ){
+      /* longer chains are still correct */
+      return;
+   }
+   for ( a = 0; a < ws->hashsize; a++ ){
+      for ( rb = ws->hash [ a ]; rb; rb = next ){
+         next = rb->next;
+         h = walsummary_hash ( rb->spcoid, rb->dboid, rb->relnode, rb->fork ) & ( size - 1 );
+         rb->next = hash [ h ];
+         hash [ h ] = rb;
+      }
+   }
+   free ( ws->hash );
+   ws->hash = hash;
+   ws->hashsize = size;
+}
+
+/*
+ * finds changed blocks of a relation fork
+ *
+ * out:
+ *    relation fork blocks or NULL when fork was not changed
+ */
+walrelblocks * walsummary_find ( walsummary * ws, uint32_t spcoid, uint32_t dboid, uint32_t relnode, uint32_t fork ){
+
+   walrelblocks * rb;
+   uint32_t h;
+
+   h = walsummary_hash ( spcoid, dboid, relnode, fork ) & ( ws->hashsize - 1 );
+   for ( rb = ws->hash [ h ]; rb; rb = rb->next ){
+      if ( rb->relnode == relnode && rb->dboid == dboid && rb->spcoid == spcoid && rb->fork == fork ){
+         return rb;
+      }
+   }
+
+   return NULL;
+}
+
+/*
+ * finds or adds a relation fork of a block reference
+ */
+static walrelblocks * walsummary_get ( walsummary * ws, const walblockref * ref ){
+
+   walrelblocks * rb;
+   uint32_t h;
+
+   rb = walsummary_find ( ws, ref->spcoid, ref->dboid, ref->relnode, ref->fork );
+   if ( rb ){
+      return rb;
+   }
+   if ( ws->nrels >= ws->hashsize ){
+      walsummary_grow ( ws );
+   }
+   rb = (walrelblocks *) calloc ( 1, sizeof ( walrelblocks ) );
+   if ( ! rb ){
+      return NULL;
+   }
+   rb->spcoid = ref->spcoid;
+   rb->dboid = ref->dboid;
+   rb->relnode = ref->relnode;
+   rb->fork = ref->fork;
+   rb->limit = WALNOLIMIT;
+   h = walsummary_hash ( rb->spcoid, rb->dboid, rb->relnode, rb->fork ) & ( ws->hashsize - 1 );
+   rb->next = ws->hash [ h ];
+   ws->hash [ h ] = rb;
+   ws->nrels++;
+
+   return rb;
+}
+
+static int walsummary_blkcmp ( const void * a, const void * b ){
+
+   uint32_t x = *(const uint32_t *) a;
+   uint32_t y = *(const uint32_t *) b;
+
+   return x < y ? -1 : x > y;
+}
+
+/*
+ * sorts changed blocks of a relation fork and removes duplicates
+ */
+void walsummary_sort ( walrelblocks * rb ){
+
+   uint32_t a, n;
+
+   if ( rb->sorted == rb->nblocks ){
+      return;
+   }
+   qsort ( rb->blocks, rb->nblocks, sizeof ( uint32_t ), walsummary_blkcmp );
+   for ( a = 1, n = 1; a < rb->nblocks; a++ ){
+      if ( rb->blocks [ a ] != rb->blocks [ n - 1 ] ){
+         rb->blocks [ n++ ] = rb->blocks [ a ];
+      }
+   }
+   rb->nblocks = n;
+   rb->sorted = n;
+}
+
+/*
+ * adds a changed block, a block list is compacted before it grows, as hot
+ * blocks are referenced by WAL over and over again
+ *
+ * out:
+ *    0 - success
+ *    -1 - memory allocation error
+ */
+int walsummary_add_block ( walsummary * ws, const walblockref * ref ){
+
+   walrelblocks * rb;
+   uint32_t * blocks;
+   uint32_t size;
+
+   rb = walsummary_get ( ws, ref );
+   if ( ! rb ){
+      return -1;
+   }
+   ws->blocks++;
+   if ( rb->nblocks && rb->blocks [ rb->nblocks - 1 ] == ref->blkno ){
+      return 0;
+   }
+   if ( rb->nblocks == rb->size ){
+      walsummary_sort ( rb );
+      if ( rb->nblocks >= rb->size / 2 ){
+         size = rb->size ? rb->size * 2 : WALBLOCKSINIT;
+         blocks = (uint32_t *) realloc ( rb->blocks, size * sizeof ( uint32_t ) );
+         if ( ! blocks ){
+            return -1;
+         }
+         rb->blocks = blocks;
+         rb->size = size;
+      }
+   }
+   rb->blocks [ rb->nblocks++ ] = ref->blkno;
+
+   return 0;
+}
+
+/*
+ * lowers a block limit of relation fork: a fork truncated to limit blocks
+ * or created (limit 0), blocks from limit up are not in a previous backup
+ */
+int walsummary_set_limit ( walsummary * ws, const walblockref * ref, uint32_t limit ){
+
+   walrelblocks * rb;
+
+   rb = walsummary_get ( ws, ref );
+   if ( ! rb ){
+      return -1;
+   }
+   if ( limit < rb->limit ){
+      rb->limit = limit;
+   }
+
+   return 0;
+}
+
+/*
+ * adds a database created by a file copy, its files are not WAL logged
+ */
+int walsummary_add_db ( walsummary * ws, uint32_t spcoid, uint32_t dboid ){
+
+   uint32_t * dbs;
+
+   if ( walsummary_has_db ( ws, spcoid, dboid ) ){
+      return 0;
+   }
+   dbs = (uint32_t *) realloc ( ws->dbs, ( ws->ndbs + 1 ) * 2 * sizeof ( uint32_t ) );
+   if ( ! dbs ){
+      return -1;
+   }
+   ws->dbs = dbs;
+   ws->dbs [ ws->ndbs * 2 ] = spcoid;
+   ws->dbs [ ws->ndbs * 2 + 1 ] = dboid;
+   ws->ndbs++;
+
+   return 0;
+}
+
+int walsummary_has_db ( walsummary * ws, uint32_t spcoid, uint32_t dboid ){
+
+   uint32_t a;
+
+   for ( a = 0; a < ws->ndbs; a++ ){
+      if ( ws->dbs [ a * 2 ] == spcoid && ws->dbs [ a * 2 + 1 ] == dboid ){
+         return 1;
+      }
+   }
+
+   return 0;
+}
+
+/*
+ * a record callback which builds a summary: every block reference is
+ * a changed block, relation storage create and truncate records set block
+ * limits and a database create by a file copy marks a whole database
+ *
+ * in:
+ *    rec - decoded record
+ *    arg - walsummary
+ */
+void walsummary_record ( const walrecord * rec, void * arg ){
+
+   walsummary * ws = (walsummary *) arg;
+   walblockref ref;
+   uint32_t blkno, flags;
+   int32_t fork;
+   int a;
+
+   for ( a = 0; a < rec->nblocks; a++ ){
+      walsummary_add_block ( ws, &rec->blocks [ a ] );
+   }
+
+   switch ( rec->rmid ){
+      case RM_SMGR_ID:
+         if ( ( rec->info & ~XLR_INFO_MASK ) == XLOG_SMGR_CREATE && rec->mainlen >= 16 ){
+            /* xl_smgr_create: rnode, forkNum */
+            WALGET ( ref.spcoid, rec->maindata );
+            WALGET ( ref.dboid, rec->maindata + 4 );
+            WALGET ( ref.relnode, rec->maindata + 8 );
+            WALGET ( fork, rec->maindata + 12 );
+            ref.fork = fork;
+            walsummary_set_limit ( ws, &ref, 0 );
+         } else
+         if ( ( rec->info & ~XLR_INFO_MASK ) == XLOG_SMGR_TRUNCATE && rec->mainlen >= 16 ){
+            /* xl_smgr_truncate: blkno, rnode and flags since 9.6 */
+            WALGET ( blkno, rec->maindata );
+            WALGET ( ref.spcoid, rec->maindata + 4 );
+            WALGET ( ref.dboid, rec->maindata + 8 );
+            WALGET ( ref.relnode, rec->maindata + 12 );
+            flags = SMGR_TRUNCATE_HEAP | SMGR_TRUNCATE_VM | SMGR_TRUNCATE_FSM;
+            if ( rec->mainlen >= 20 ){
+               WALGET ( flags, rec->maindata + 16 );
+            }
+            if ( flags & SMGR_TRUNCATE_HEAP ){
+               ref.fork = WALMAINFORK;
+               walsummary_set_limit ( ws, &ref, blkno );
+            }
+            /* map forks are truncated to a computed size, so they are sent whole */
+            if ( flags & SMGR_TRUNCATE_FSM ){
+               ref.fork = WALFSMFORK;
+               walsummary_set_limit ( ws, &ref, 0 );
+            }
+            if ( flags & SMGR_TRUNCATE_VM ){
+               ref.fork = WALVMFORK;
+               walsummary_set_limit ( ws, &ref, 0 );
+            }
+         }
+         break;
+      case RM_DBASE_ID:
+         /*
+          * xl_dbase_create_rec (file copy): db_id, tablespace_id; since 15 also
+          * a WAL logged create has the same beginning and is harmless here
+          */
+         if ( ( ( rec->info & ~XLR_INFO_MASK ) == XLOG_DBASE_CREATE ||
+                  ( rec->magic >= WALMAGIC15 && ( rec->info & ~XLR_INFO_MASK ) == 0x10 ) ) &&
+               rec->mainlen >= 8 ){
+            WALGET ( ref.dboid, rec->maindata );
+            WALGET ( ref.spcoid, rec->maindata + 4 );
+            walsummary_add_db ( ws, ref.spcoid, ref.dboid );
+         }
+         break;
+   }
+}
+
+/*
+ * a growing text buffer for summary formatting
+ */
+typedef struct _walbuf walbuf;
+struct _walbuf {
+   char * buf;
+   size_t len;
+   size_t size;
+   int err;
+};
+
+static void walbuf_printf ( walbuf * b, const char * fmt, ... ) __attribute__ (( format ( printf, 2, 3 ) ));
+static void walbuf_printf ( walbuf * b, const char * fmt, ... ){
+
+   va_list ap;
+   char * buf;
+   int n;
+
+   if ( b->err ){
+      return;
+   }
+   if ( b->size - b->len < 64 ){
+      buf = (char *) realloc ( b->buf, b->size * 2 );
+      if ( ! buf ){
+         b->err = 1;
+         return;
+      }
+      b->buf = buf;
+      b->size *= 2;
+   }
+   va_start ( ap, fmt );
+   n = vsnprintf ( b->buf + b->len, b->size - b->len, fmt, ap );
+   va_end ( ap );
+   b->len += n;
+}
+
+/*
+ * renders a summary as text
+ *
+ * out:
+ *    allocated text, has to be freed with free(), NULL on memory error
+ */
+char * walsummary_format ( walsummary * ws ){
+
+   walbuf b;
+   walrelblocks * rb;
+   uint32_t a, h, first;
+
+   b.size = 4096;
+   b.len = 0;
+   b.err = 0;
+   b.buf = (char *) malloc ( b.size );
+   if ( ! b.buf ){
+      return NULL;
+   }
+   b.buf [ 0 ] = 0;
+
+   for ( h = 0; h < ws->hashsize; h++ ){
+      for ( rb = ws->hash [ h ]; rb; rb = rb->next ){
+         walsummary_sort ( rb );
+         walbuf_printf ( &b, "r %u %u %u %u ", rb->spcoid, rb->dboid, rb->relnode, rb->fork );
+         if ( rb->limit == WALNOLIMIT ){
+            walbuf_printf ( &b, "- " );
+         } else {
+            walbuf_printf ( &b, "%u ", rb->limit );
+         }
+         if ( ! rb->nblocks ){
+            walbuf_printf ( &b, "-" );
+         }
+         for ( a = 0; a < rb->nblocks; a = first + 1 ){
+            first = a;
+            while ( first + 1 < rb->nblocks && rb->blocks [ first + 1 ] == rb->blocks [ first ] + 1 ){
+               first++;
+            }
+            if ( first == a ){
+               walbuf_printf ( &b, a ? ",%u" : "%u", rb->blocks [ a ] );
+            } else {
+               walbuf_printf ( &b, a ? ",%u-%u" : "%u-%u", rb->blocks [ a ], rb->blocks [ first ] );
+            }
+         }
+         walbuf_printf ( &b, "\n" );
+      }
+   }
+   for ( a = 0; a < ws->ndbs; a++ ){
+      walbuf_printf ( &b, "d %u %u\n", ws->dbs [ a * 2 ], ws->dbs [ a * 2 + 1 ] );
+   }
+   if ( b.err ){
+      free ( b.buf );
+      return NULL;
+   }
+
+   return b.buf;
+}
+
+/*
+ * merges a summary rendered by walsummary_format into a summary
+ *
+ * out:
+ *    0 - success
+ *    -1 - invalid summary text or memory allocation error
+ */
+int walsummary_parse ( walsummary * ws, const char * text ){
+
+   walblockref ref;
+   const char * p = text;
+   char * end;
+   unsigned long first, last;
+
+   while ( *p ){
+      if ( *p == '\n' ){
+         p++;
+         continue;
+      }
+      if ( p [ 0 ] == 'd' && p [ 1 ] == ' ' ){
+         ref.spcoid = strtoul ( p + 2, &end, 10 );
+         ref.dboid = strtoul ( end, &end, 10 );
+         if ( walsummary_add_db ( ws, ref.spcoid, ref.dboid ) != 0 ){
+            return -1;
+         }
+         p = end;
+      } else
+      if ( p [ 0 ] == 'r' && p [ 1 ] == ' ' ){
+         ref.spcoid = strtoul ( p + 2, &end, 10 );
+         ref.dboid = strtoul ( end, &end, 10 );
+         ref.relnode = strtoul ( end, &end, 10 );
+         ref.fork = strtoul ( end, &end, 10 );
+         while ( *end == ' ' ){
+            end++;
+         }
+         if ( *end == '-' ){
+            end++;
+         } else {
+            last = strtoul ( end, &end, 10 );
+            if ( walsummary_set_limit ( ws, &ref, last ) != 0 ){
+               return -1;
+            }
+         }
+         while ( *end == ' ' ){
+            end++;
+         }
+         if ( *end == '-' ){
+            /* a fork without changed blocks, only its limit is known */
+            end++;
+         } else {
+            while ( *end >= '0' && *end <= '9' ){
+               first = strtoul ( end, &end, 10 );
+               last = first;
+               if ( *end == '-' ){
+                  last = strtoul ( end + 1, &end, 10 );
+               }
+               for ( ; first <= last; first++ ){
+                  ref.blkno = first;
+                  if ( walsummary_add_block ( ws, &ref ) != 0 ){
+                     return -1;
+                  }
+               }
+               if ( *end == ',' ){
+                  end++;
+               }
+            }
+         }
+         p = end;
+      } else {
+         return -1;
+      }
+      if ( *p != '\n' && *p != 0 ){
+         return -1;
+      }
+   }
+
+   return 0;
+}
+
+/*
+ * resets a transaction index
+ */
+void walxact_init ( walxactindex * wx ){
+
+   memset ( wx, 0, sizeof ( walxactindex ) );
+}
+
+/*
+ * finds a prepared transaction id of commit or abort prepared record, it
+ * follows optional parts of xl_xact_commit and xl_xact_abort in xinfo order
+ *
+ * out:
+ *    transaction id or 0 when not found
+ */
+static uint32_t walxact_twophase_xid ( const walrecord * rec ){
+
+   const unsigned char * p = rec->maindata + 8;
+   const unsigned char * end = rec->maindata + rec->mainlen;
+   uint32_t xinfo;
+   uint32_t xid;
+   int32_t n;
+
+#define XACTSKIP(size) \
+   if ( end - p < 4 ){ \
+      return 0; \
+   } \
+   WALGET ( n, p ); \
+   if ( n < 0 || end - p - 4 < (int64_t) n * (size) ){ \
+      return 0; \
+   } \
+   p += 4 + (int64_t) n * (size);
+
+   if ( ! ( rec->info & XLOG_XACT_HAS_INFO ) || end - p < 4 ){
+      return 0;
+   }
+   WALGET ( xinfo, p );
+   p += 4;
+   if ( xinfo & XACT_XINFO_HAS_DBINFO ){
+      p += 8;
+   }
+   if ( xinfo & XACT_XINFO_HAS_SUBXACTS ){
+      XACTSKIP ( 4 );
+   }
+   if ( xinfo & XACT_XINFO_HAS_RELFILENODES ){
+      XACTSKIP ( 12 );
+   }
+   if ( xinfo & XACT_XINFO_HAS_DROPPED_STATS ){
+      /* an object id of statistics item is 64 bit since 18 */
+      XACTSKIP ( rec->magic >= WALMAGIC18 ? 16 : 12 );
+   }
+   if ( ( xinfo & XACT_XINFO_HAS_INVALS ) && ( rec->info & XLOG_XACT_OPMASK ) == XLOG_XACT_COMMIT_PREPARED ){
+      XACTSKIP ( 16 );
+   }
+   if ( ! ( xinfo & XACT_XINFO_HAS_TWOPHASE ) || end - p < 4 ){
+      return 0;
+   }
+   WALGET ( xid, p );
+
+#undef XACTSKIP
+
+   return xid;
+}
+
+/*
+ * a decoder callback which adds commit and abort records into a transaction
+ * index: xl_xact_commit and xl_xact_abort start with a timestamp, a
+ * transaction id comes from a record header or from prepared transaction
+ *
+ * in:
+ *    rec - decoded record
+ *    arg - transaction index
+ */
+void walxact_record ( const walrecord * rec, void * arg ){
+
+   walxactindex * wx = (walxactindex *) arg;
+   int64_t xtime;
+   uint32_t xid;
+   int op;
+
+   if ( rec->rmid != RM_XACT_ID || rec->mainlen < 8 ){
+      return;
+   }
+   op = rec->info & XLOG_XACT_OPMASK;
+   switch ( op ){
+      case XLOG_XACT_COMMIT:
+      case XLOG_XACT_COMMIT_PREPARED:
+         wx->commits++;
+         break;
+      case XLOG_XACT_ABORT:
+      case XLOG_XACT_ABORT_PREPARED:
+         wx->aborts++;
+         break;
+      default:
+         return;
+   }
+   WALGET ( xtime, rec->maindata );
+   if ( wx->commits + wx->aborts == 1 || xtime < wx->mintime ){
+      wx->mintime = xtime;
+   }
+   if ( wx->commits + wx->aborts == 1 || xtime > wx->maxtime ){
+      wx->maxtime = xtime;
+   }
+
+   xid = rec->xid;
+   if ( op == XLOG_XACT_COMMIT_PREPARED || op == XLOG_XACT_ABORT_PREPARED ){
+      xid = walxact_twophase_xid ( rec );
+   }
+   if ( ! xid ){
+      wx->unknownxids++;
+      return;
+   }
+   if ( ! wx->minxid || xid < wx->minxid ){
+      wx->minxid = xid;
+   }
+   if ( xid > wx->maxxid ){
+      wx->maxxid = xid;
+   }
+}
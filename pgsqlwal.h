@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2013 by Inteos sp. z o.o.
+ * All rights reserved. See LICENSE.Inteos for details.
+ *
+ * WAL decoder for Inteos PostgreSQL plugin.
+ * Decoder reads WAL segments written by PostgreSQL 9.5 or later, assembles
+ * records (also those which span pages and segments), verifies their crc and
+ * hands record headers with block references to a callback. A WAL summary
+ * built this way is a list of changed blocks for every relation fork in an
+ * LSN range, it drives block incremental database backups. A transaction
+ * index keeps commit and abort timestamps and transaction ids of a range,
+ * so a recovery target could be located in WAL.
+ */
+
+#ifndef _PGSQLWAL_H_
+#define _PGSQLWAL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* the oldest supported WAL page magic (PostgreSQL 9.5), the 15 and 18 ones */
+#define WALMAGIC95         0xD087
+#define WALMAGIC15         0xD110
+#define WALMAGIC18         0xD118
+#define WALMAGICMAX        0xDFFF
+
+/* WAL page header */
+#define XLP_FIRST_IS_CONTRECORD  0x0001
+#define XLP_LONG_HEADER    0x0002
+#define WALSHORTPHD        24
+#define WALLONGPHD         40
+#define WALRECORDHDR       24
+#define WALMAXRECORD       ( 1024 * 1024 * 1024 )
+#define WALMAXBLOCKID      32
+
+/* resource managers and record types used by summaries */
+#define RM_XLOG_ID         0
+#define RM_XACT_ID         1
+#define RM_SMGR_ID         2
+#define RM_DBASE_ID        4
+#define XLR_INFO_MASK      0x0F
+#define XLOG_SWITCH        0x40
+#define XLOG_SMGR_CREATE   0x10
+#define XLOG_SMGR_TRUNCATE 0x20
+#define SMGR_TRUNCATE_HEAP 0x0001
+#define SMGR_TRUNCATE_VM   0x0002
+#define SMGR_TRUNCATE_FSM  0x0004
+#define XLOG_DBASE_CREATE  0x00
+
+/* transaction records used by a transaction index */
+#define XLOG_XACT_OPMASK   0x70
+#define XLOG_XACT_HAS_INFO 0x80
+#define XLOG_XACT_COMMIT   0x00
+#define XLOG_XACT_ABORT    0x20
+#define XLOG_XACT_COMMIT_PREPARED   0x30
+#define XLOG_XACT_ABORT_PREPARED    0x40
+#define XACT_XINFO_HAS_DBINFO       0x0001
+#define XACT_XINFO_HAS_SUBXACTS     0x0002
+#define XACT_XINFO_HAS_RELFILENODES 0x0004
+#define XACT_XINFO_HAS_INVALS       0x0008
+#define XACT_XINFO_HAS_TWOPHASE     0x0010
+#define XACT_XINFO_HAS_DROPPED_STATS   0x0100
+
+/* PostgreSQL timestamps are microseconds since 2000-01-01 00:00:00 UTC */
+#define WALEPOCHDIFF       946684800LL
+
+/* relation forks */
+#define WALMAINFORK        0
+#define WALFSMFORK         1
+#define WALVMFORK          2
+
+/* block limit of a relation fork which was neither created nor truncated */
+#define WALNOLIMIT         0xFFFFFFFF
+
+/* a block reference of WAL record */
+typedef struct _walblockref walblockref;
+struct _walblockref {
+   uint32_t spcoid;
+   uint32_t dboid;
+   uint32_t relnode;
+   uint32_t fork;
+   uint32_t blkno;
+};
+
+/* a decoded WAL record */
+typedef struct _walrecord walrecord;
+struct _walrecord {
+   uint64_t lsn;           /* record start */
+   uint32_t totlen;
+   uint32_t xid;
+   uint8_t  rmid;
+   uint8_t  info;
+   uint16_t magic;         /* page magic, tells a PostgreSQL version */
+   int      nblocks;
+   walblockref blocks [ WALMAXBLOCKID + 1 ];
+   const unsigned char * maindata;
+   uint32_t mainlen;
+};
+
+typedef void (*walrecord_fn) ( const walrecord * rec, void * arg );
+
+/*
+ * WAL reader, keeps a record which continues in the next segment, so
+ * consecutive segments can be decoded one by one, in one or more processes
+ */
+typedef struct _walreader walreader;
+struct _walreader {
+   uint32_t segsize;
+   uint32_t pagesize;
+   uint16_t magic;
+   uint32_t tli;
+   uint64_t segstart;      /* LSN of decoded segment */
+   uint64_t covstart;      /* records starting in [covstart,covend) were decoded */
+   uint64_t covend;
+   int64_t  records;
+   unsigned char * rec;    /* record assembly buffer */
+   uint32_t recsize;
+   uint64_t reclsn;        /* a record being assembled: start, */
+   uint32_t rectot;        /* total length */
+   uint32_t reclen;        /* and assembled bytes, 0 when none */
+   uint64_t contlsn;       /* LSN where an assembled record continues */
+};
+
+/* changed blocks of a relation fork */
+typedef struct _walrelblocks walrelblocks;
+struct _walrelblocks {
+   uint32_t spcoid;
+   uint32_t dboid;
+   uint32_t relnode;
+   uint32_t fork;
+   uint32_t limit;         /* blocks from limit up were truncated or the fork was created */
+   uint32_t * blocks;
+   uint32_t nblocks;
+   uint32_t size;
+   uint32_t sorted;        /* blocks [0,sorted) are sorted and unique */
+   walrelblocks * next;
+};
+
+/* a WAL summary */
+typedef struct _walsummary walsummary;
+struct _walsummary {
+   walrelblocks ** hash;
+   uint32_t hashsize;
+   uint32_t nrels;
+   uint32_t * dbs;         /* spcoid,dboid pairs of databases created by copy */
+   uint32_t ndbs;
+   int64_t  blocks;        /* block references added */
+};
+
+/* commit and abort records of a WAL range, a transaction index */
+typedef struct _walxactindex walxactindex;
+struct _walxactindex {
+   int64_t  commits;
+   int64_t  aborts;
+   int64_t  mintime;       /* the earliest and the latest transaction end timestamp */
+   int64_t  maxtime;
+   uint32_t minxid;        /* a range of ended transaction ids */
+   uint32_t maxxid;
+   int64_t  unknownxids;   /* ended transactions with an id not found */
+};
+
+/* functions */
+int walreader_init ( walreader * wr );
+void walreader_free ( walreader * wr );
+int walreader_set_tail ( walreader * wr, uint64_t reclsn, uint32_t rectot, const unsigned char * data, uint32_t len, uint64_t contlsn );
+int wal_decode_segment ( walreader * wr, const unsigned char * seg, size_t len, walrecord_fn fn, void * arg );
+uint64_t wal_parse_lsn ( const char * str );
+walsummary * walsummary_alloc ( void );
+void walsummary_free ( walsummary * ws );
+int walsummary_add_block ( walsummary * ws, const walblockref * ref );
+int walsummary_set_limit ( walsummary * ws, const walblockref * ref, uint32_t limit );
+int walsummary_add_db ( walsummary * ws, uint32_t spcoid, uint32_t dboid );
+int walsummary_has_db ( walsummary * ws, uint32_t spcoid, uint32_t dboid );
+walrelblocks * walsummary_find ( walsummary * ws, uint32_t spcoid, uint32_t dboid, uint32_t relnode, uint32_t fork );
+void walsummary_sort ( walrelblocks * rb );
+void walsummary_record ( const walrecord * rec, void * arg );
+char * walsummary_format ( walsummary * ws );
+int walsummary_parse ( walsummary * ws, const char * text );
+void walxact_init ( walxactindex * wx );
+void walxact_record ( const walrecord * rec, void * arg );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PGSQLWAL_H_ */
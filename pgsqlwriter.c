@@ -0,0 +1,356 @@
+/*
+ * Copyright (c) 2013 by Inteos sp. z o.o.
+ * All rights reserved. See LICENSE.Inteos for details.
+ *
+ * Restore file writer for Inteos PostgreSQL plugin.
+ * Data restored by Bacula comes in small buffers, the writer collects them into
+ * RWBUFLEN aligned chunks and for every chunk decides block by block what to do:
+ *  - a block equal to existing file content (delta mode) is skipped,
+ *  - a zero block (sparse mode) is skipped or deallocated, so it becomes a hole,
+ *  - any other block is written, adjacent blocks with a single pwrite.
+ */
+
+#ifdef __linux__
+ #ifndef _GNU_SOURCE
+  #define _GNU_SOURCE
+ #endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+ #include <linux/falloc.h>
+#endif
+
+#include "pgsqlwriter.h"
+
+/* a block of zeros used for zero detection */
+static const char zeroblock [ RWBLOCK ] = { 0 };
+
+/* block actions */
+#define RW_WRITE  0
+#define RW_SKIP   1
+#define RW_PUNCH  2
+
+/*
+ * checks if a data block contains zeros only, memcmp is vectorized by libc
+ * so it is much faster then a byte loop
+ *
+ * in:
+ *    data - block to check
+ *    len - block length, up to RWBLOCK
+ * out:
+ *    1 - block is all zeros
+ *    0 - block has data
+ */
+int is_zero_block ( const char * data, int len ){
+
+   return memcmp ( data, zeroblock, len ) == 0;
+}
+
+/*
+ * writes a whole buffer at given offset, short writes are continued
+ */
+static int pwrite_full ( int fd, const char * data, int len, off_t off ){
+
+   ssize_t nw;
+
+   while ( len > 0 ){
+      nw = pwrite ( fd, data, len, off );
+      if ( nw < 0 ){
+         if ( errno == EINTR ){
+            continue;
+         }
+         return -1;
+      }
+      data += nw;
+      off += nw;
+      len -= nw;
+   }
+
+   return 0;
+}
+
+/*
+ * reads a buffer at given offset, the part beyond end of file is zeroed
+ */
+static int pread_full ( int fd, char * data, int len, off_t off ){
+
+   ssize_t nr;
+
+   while ( len > 0 ){
+      nr = pread ( fd, data, len, off );
+      if ( nr < 0 ){
+         if ( errno == EINTR ){
+            continue;
+         }
+         return -1;
+      }
+      if ( nr == 0 ){
+         /* end of file */
+         memset ( data, 0, len );
+         break;
+      }
+      data += nr;
+      off += nr;
+      len -= nr;
+   }
+
+   return 0;
+}
+
+/*
+ * deallocates a file range which should read as zeros, when hole punching is
+ * not supported by filesystem the range is written with zeros unless it is
+ * already zero (a new preallocated file)
+ */
+static int rwriter_punch ( rwriter * rw, int pos, int len ){
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+   if ( fallocate ( rw->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            rw->off + pos, len ) == 0 ){
+      rw->stats.holes += ( len + RWBLOCK - 1 ) / RWBLOCK;
+      return 0;
+   }
+#endif
+   if ( ! ( rw->flags & RW_DELTA ) ){
+      return 0;
+   }
+   rw->stats.writes++;
+   rw->stats.blkwritten += ( len + RWBLOCK - 1 ) / RWBLOCK;
+   return pwrite_full ( rw->fd, rw->buf + pos, len, rw->off + pos );
+}
+
+/*
+ * writes a run of blocks from buffer
+ */
+static int rwriter_run ( rwriter * rw, int pos, int len ){
+
+   rw->stats.writes++;
+   rw->stats.blkwritten += ( len + RWBLOCK - 1 ) / RWBLOCK;
+   return pwrite_full ( rw->fd, rw->buf + pos, len, rw->off + pos );
+}
+
+/*
+ * starts writeback of a just flushed chunk and waits for writeback of previous
+ * chunks, so the amount of dirty page cache of a restored file stays bounded
+ */
+static void rwriter_writebehind ( rwriter * rw ){
+
+#ifdef SYNC_FILE_RANGE_WRITE
+   sync_file_range ( rw->fd, rw->off, rw->len, SYNC_FILE_RANGE_WRITE );
+   if ( rw->off > rw->syncoff ){
+      sync_file_range ( rw->fd, rw->syncoff, rw->off - rw->syncoff,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER );
+      rw->syncoff = rw->off;
+   }
+#endif
+}
+
+/*
+ * flushes a buffered data to file
+ *
+ * in:
+ *    rw - writer
+ * out:
+ *    0 - on success
+ *    -1 - on error, errno is set
+ */
+static int rwriter_flush ( rwriter * rw ){
+
+   int pos;
+   int blen;
+   int action;
+   int wstart = -1;
+   int hstart = -1;
+
+   if ( rw->len == 0 ){
+      return 0;
+   }
+
+   if ( rw->flags & RW_DELTA ){
+      if ( pread_full ( rw->fd, rw->cmpbuf, rw->len, rw->off ) ){
+         return -1;
+      }
+   }
+
+   for ( pos = 0; pos < rw->len; pos += blen ){
+      blen = rw->len - pos < RWBLOCK ? rw->len - pos : RWBLOCK;
+
+      if ( ( rw->flags & RW_DELTA ) &&
+            memcmp ( rw->cmpbuf + pos, rw->buf + pos, blen ) == 0 ){
+         rw->stats.blkequal++;
+         action = RW_SKIP;
+      } else
+      if ( ( rw->flags & RW_SPARSE ) && is_zero_block ( rw->buf + pos, blen ) ){
+         rw->stats.blkzero++;
+         /* allocated space which should be a hole */
+         action = ( rw->flags & RW_DELTA ) || rw->prealloc ? RW_PUNCH : RW_SKIP;
+      } else {
+         action = RW_WRITE;
+      }
+
+      if ( action != RW_WRITE && wstart >= 0 ){
+         if ( rwriter_run ( rw, wstart, pos - wstart ) ){
+            return -1;
+         }
+         wstart = -1;
+      }
+      if ( action != RW_PUNCH && hstart >= 0 ){
+         if ( rwriter_punch ( rw, hstart, pos - hstart ) ){
+            return -1;
+         }
+         hstart = -1;
+      }
+      if ( action == RW_WRITE && wstart < 0 ){
+         wstart = pos;
+      }
+      if ( action == RW_PUNCH && hstart < 0 ){
+         hstart = pos;
+      }
+   }
+   if ( wstart >= 0 && rwriter_run ( rw, wstart, rw->len - wstart ) ){
+      return -1;
+   }
+   if ( hstart >= 0 && rwriter_punch ( rw, hstart, rw->len - hstart ) ){
+      return -1;
+   }
+
+   if ( rw->flags & RW_WRITEBEHIND ){
+      rwriter_writebehind ( rw );
+   }
+
+   rw->off += rw->len;
+   rw->len = 0;
+
+   return 0;
+}
+
+/*
+ * initializes a writer structure
+ *
+ * out:
+ *    0 - on success
+ *    -1 - on memory allocation error
+ */
+int rwriter_init ( rwriter * rw ){
+
+   memset ( rw, 0, sizeof ( rwriter ) );
+   rw->fd = -1;
+   rw->buf = (char *) malloc ( RWBUFLEN );
+
+   return rw->buf ? 0 : -1;
+}
+
+/*
+ * releases writer buffers
+ */
+void rwriter_free ( rwriter * rw ){
+
+   if ( rw->buf ){
+      free ( rw->buf );
+   }
+   if ( rw->cmpbuf ){
+      free ( rw->cmpbuf );
+   }
+   rw->buf = rw->cmpbuf = NULL;
+}
+
+/*
+ * starts writing an opened file
+ *
+ * in:
+ *    rw - initialized writer
+ *    fd - file descriptor opened for write (read/write in delta mode), without
+ *         RW_DELTA a file has to be empty as skipped blocks are not written
+ *    size - expected file size, used for preallocation
+ *    flags - RW_PREALLOC, RW_SPARSE, RW_DELTA, RW_WRITEBEHIND
+ * out:
+ *    0 - on success
+ *    -1 - on memory allocation error
+ */
+int rwriter_open ( rwriter * rw, int fd, off_t size, int flags ){
+
+   rw->fd = fd;
+   rw->flags = flags;
+   rw->size = size;
+   rw->off = 0;
+   rw->syncoff = 0;
+   rw->len = 0;
+   rw->prealloc = 0;
+
+   if ( ( flags & RW_DELTA ) && ! rw->cmpbuf ){
+      rw->cmpbuf = (char *) malloc ( RWBUFLEN );
+      if ( ! rw->cmpbuf ){
+         return -1;
+      }
+   }
+
+#ifdef __linux__
+   /* existing file in delta mode is not preallocated, it would fill its holes;
+    * posix_fallocate is not used as it writes zeros when unsupported */
+   if ( ( flags & RW_PREALLOC ) && ! ( flags & RW_DELTA ) && size > 0 ){
+      rw->prealloc = fallocate ( fd, 0, 0, size ) == 0;
+   }
+#endif
+
+   return 0;
+}
+
+/*
+ * writes data to file through writer buffer
+ *
+ * in:
+ *    rw - writer
+ *    data - data to write
+ *    count - data length
+ * out:
+ *    count - on success
+ *    -1 - on error, errno is set
+ */
+int rwriter_write ( rwriter * rw, const char * data, int count ){
+
+   int len;
+   int pos;
+
+   for ( pos = 0; pos < count; pos += len ){
+      len = RWBUFLEN - rw->len;
+      if ( len > count - pos ){
+         len = count - pos;
+      }
+      memcpy ( rw->buf + rw->len, data + pos, len );
+      rw->len += len;
+      if ( rw->len == RWBUFLEN && rwriter_flush ( rw ) ){
+         return -1;
+      }
+   }
+
+   return count;
+}
+
+/*
+ * finishes file writing, flushes buffered data and sets file size to the
+ * amount of data written, file descriptor is not closed
+ *
+ * out:
+ *    0 - on success
+ *    -1 - on error, errno is set
+ */
+int rwriter_close ( rwriter * rw ){
+
+   int err;
+
+   err = rwriter_flush ( rw );
+   if ( ! err ){
+      /* skipped blocks at end of file and preallocated space beyond written data */
+      err = ftruncate ( rw->fd, rw->off );
+   }
+   rw->stats.files++;
+   rw->fd = -1;
+
+   return err;
+}
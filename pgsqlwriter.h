@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2013 by Inteos sp. z o.o.
+ * All rights reserved. See LICENSE.Inteos for details.
+ *
+ * Restore file writer for Inteos PostgreSQL plugin.
+ * Writer coalesces restored data into large aligned writes, preallocates file
+ * space, leaves holes in place of zero blocks and in delta mode writes only
+ * blocks which differ from existing file content. In write-behind mode a
+ * writeback of written data is started during restore, so a final filesystem
+ * sync has only a little to do.
+ */
+
+#ifndef _PGSQLWRITER_H_
+#define _PGSQLWRITER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/* a compare/zero detection block size, a PostgreSQL page size */
+#define RWBLOCK      8192
+/* a coalesced write size, multiply of RWBLOCK */
+#define RWBUFLEN     ( 128 * RWBLOCK )
+
+/* writer open flags */
+#define RW_PREALLOC  0x01     /* preallocate file space up to expected size */
+#define RW_SPARSE    0x02     /* do not write zero blocks, leave holes */
+#define RW_DELTA     0x04     /* existing file, write changed blocks only */
+#define RW_WRITEBEHIND 0x08   /* start writeback of every flushed chunk */
+
+/* writer statistics */
+typedef struct _rwstats rwstats;
+struct _rwstats {
+   int64_t  files;         /* closed files */
+   int64_t  blkwritten;    /* blocks written to file */
+   int64_t  blkzero;       /* zero blocks skipped */
+   int64_t  blkequal;      /* blocks equal to existing file content */
+   int64_t  holes;         /* blocks deallocated by punching a hole */
+   int64_t  writes;        /* number of write calls */
+};
+
+typedef struct _rwriter rwriter;
+struct _rwriter {
+   int      fd;
+   int      flags;
+   int      prealloc;      /* file space preallocated successfully */
+   off_t    size;          /* expected file size */
+   off_t    off;           /* file offset of buffered data */
+   off_t    syncoff;       /* file offset up to which writeback was waited */
+   int      len;           /* buffered data length */
+   char     * buf;         /* coalesced data buffer */
+   char     * cmpbuf;      /* existing file content buffer in delta mode */
+   rwstats  stats;
+};
+
+/* functions */
+int rwriter_init ( rwriter * rw );
+void rwriter_free ( rwriter * rw );
+int rwriter_open ( rwriter * rw, int fd, off_t size, int flags );
+int rwriter_write ( rwriter * rw, const char * data, int count );
+int rwriter_close ( rwriter * rw );
+int is_zero_block ( const char * data, int len );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PGSQLWRITER_H_ */
@@ -19,8 +19,12 @@ extern "C" {
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <time.h>
+#include <sys/time.h>
+#include <stdint.h>
 #ifndef __WIN32__
  #include <grp.h>
+ #include <poll.h>
 #else
  #include <windef.h>
  #include <winbase.h>
@@ -157,51 +161,168 @@ int check_program_is_running ( char * pidfile ){
 #endif
 
 /*
- * standard readline
+ * returns a monotonic clock value in seconds, used for elapsed time measurement
+ * only, falls back to wall clock where monotonic clock is not available
  */
-int readline ( int fd, char * buf, int size ){
+double monotonic_time ( void ){
 
-   char c;
-   int n;
+#ifdef CLOCK_MONOTONIC
+   struct timespec ts;
 
-   for ( n = 0; n < size; n++ ){
-      if ( read ( fd, &c, 1 ) == 1 ){
-         /* read a char */
-         if ( c == '\n' ){
-            buf [ n ] = 0;
-            break;
-         } else {
-            buf [ n ] = c;
+   if ( clock_gettime ( CLOCK_MONOTONIC, &ts ) == 0 ){
+      return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+   }
+#endif
+   struct timeval tv;
+
+   gettimeofday ( &tv, NULL );
+   return (double) tv.tv_sec + (double) tv.tv_usec / 1e6;
+}
+
+/*
+ * allocates a line reader for descriptor
+ *
+ * in:
+ *    fd - descriptor to read from
+ *    size - buffer size, a maximum line length
+ * out:
+ *    line reader or NULL on error
+ */
+linereader * linereader_alloc ( int fd, int size ){
+
+   linereader * lr;
+
+   lr = (linereader *) malloc ( sizeof ( linereader ) );
+   ASSERT_NVAL_RET_NULL ( lr );
+   lr->buf = (char *) malloc ( size + 1 );
+   if ( ! lr->buf ){
+      free ( lr );
+      return NULL;
+   }
+   lr->fd = fd;
+   lr->size = size;
+   lr->start = lr->end = 0;
+   lr->eof = 0;
+
+   return lr;
+}
+
+/*
+ * releases a line reader, descriptor is not closed
+ */
+void linereader_free ( linereader * lr ){
+
+   ASSERT_NVAL_RET ( lr );
+   free ( lr->buf );
+   free ( lr );
+}
+
+/*
+ * returns a next line from descriptor, a data is read in buffer size chunks
+ * instead of a byte by byte; a line longer then buffer is returned in parts
+ *
+ * in:
+ *    lr - line reader
+ * out:
+ *    len - line length without newline
+ *    line - a null terminated line, valid up to the next call
+ *    NULL - on end of file or error
+ */
+char * linereader_next ( linereader * lr, int * len ){
+
+   char * line;
+   char * nl;
+   int nr;
+
+   ASSERT_NVAL_RET_NULL ( lr );
+
+   for (;;){
+      nl = (char *) memchr ( lr->buf + lr->start, '\n', lr->end - lr->start );
+      if ( nl || ( lr->end - lr->start == lr->size ) || ( lr->eof && lr->end > lr->start ) ){
+         /* a complete line, a full buffer or the last line without newline */
+         line = lr->buf + lr->start;
+         if ( ! nl ){
+            nl = lr->buf + lr->end;
          }
+         *len = nl - line;
+         lr->start = ( nl - lr->buf ) + ( nl < lr->buf + lr->end ? 1 : 0 );
+         *nl = 0;
+         return line;
+      }
+      if ( lr->eof ){
+         return NULL;
+      }
+      /* move remaining data to the buffer beginning and read more */
+      if ( lr->start ){
+         memmove ( lr->buf, lr->buf + lr->start, lr->end - lr->start );
+         lr->end -= lr->start;
+         lr->start = 0;
+      }
+      nr = read ( lr->fd, lr->buf + lr->end, lr->size - lr->end );
+      if ( nr < 0 && errno == EINTR ){
+         continue;
+      }
+      if ( nr <= 0 ){
+         lr->eof = 1;
       } else {
-         buf [ n ] = 0;
-         break;
+         lr->end += nr;
       }
    }
-   return n;
 }
 
+#ifndef __WIN32__
+/*
+ * waits until a next line is ready to read from descriptor
+ *
+ * in:
+ *    lr - line reader
+ *    timeout - maximum wait time in milliseconds
+ * out:
+ *    1 - a line, new data or end of file is ready, linereader_next won't wait
+ *        for a complete line only
+ *    0 - on timeout
+ */
+int linereader_wait ( linereader * lr, int timeout ){
+
+   struct pollfd pfd;
+   int nr;
+
+   ASSERT_NVAL_RET_ONE ( lr );
+
+   if ( lr->eof || lr->end - lr->start == lr->size ||
+         memchr ( lr->buf + lr->start, '\n', lr->end - lr->start ) ){
+      return 1;
+   }
+
+   pfd.fd = lr->fd;
+   pfd.events = POLLIN;
+   pfd.revents = 0;
+   do {
+      nr = poll ( &pfd, 1, timeout );
+   } while ( nr < 0 && errno == EINTR );
+
+   return nr != 0;
+}
+#endif
+
 /*
- * standard readline for file stream
+ * standard readline for file stream, stdio buffers data so fgets is used
+ * for a whole line
+ *
+ * out:
+ *    line length, -1 on end of file
  */
 int freadline ( FILE * stream, char * buf, int size ){
 
-   char c;
    int n;
 
-   for ( n = 0; n < size; n++ ){
-      if ( fread ( &c, 1, 1, stream ) == 1 ){
-         /* read a char */
-         if ( c == '\n' ){
-            buf [ n ] = 0;
-            break;
-         } else {
-            buf [ n ] = c;
-         }
-      } else {
-         buf [ n ] = 0;
-         break;
-      }
+   if ( ! fgets ( buf, size, stream ) ){
+      buf [ 0 ] = 0;
+      return -1;
+   }
+   n = strlen ( buf );
+   if ( n && buf [ n - 1 ] == '\n' ){
+      buf [ --n ] = 0;
    }
    return n;
 }
@@ -501,6 +622,287 @@ int strisprintable ( char * str, int len ){
    return 1;
 }
 
+/* initial number of pathset slots, power of 2 */
+#define PATHSETSIZE  1024
+
+/*
+ * FNV-1a string hash
+ */
+unsigned int path_hash ( const char * path ){
+
+   unsigned int h = 2166136261u;
+
+   while ( *path ){
+      h ^= (unsigned char) *path++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+/*
+ * returns a slot of path or an empty slot where path should be inserted
+ */
+static unsigned int pathset_slot ( char ** slots, unsigned int size, const char * path ){
+
+   unsigned int a;
+
+   a = path_hash ( path ) & ( size - 1 );
+   while ( slots [ a ] && strcmp ( slots [ a ], path ) != 0 ){
+      a = ( a + 1 ) & ( size - 1 );
+   }
+   return a;
+}
+
+/*
+ * allocates an empty path set
+ */
+pathset * pathset_alloc ( void ){
+
+   pathset * set;
+
+   set = (pathset *) malloc ( sizeof ( pathset ) );
+   ASSERT_NVAL_RET_NULL ( set );
+   set->slots = (char **) calloc ( PATHSETSIZE, sizeof ( char * ) );
+   if ( ! set->slots ){
+      free ( set );
+      return NULL;
+   }
+   set->size = PATHSETSIZE;
+   set->count = 0;
+
+   return set;
+}
+
+/*
+ * releases a path set with all paths
+ */
+void pathset_free ( pathset * set ){
+
+   unsigned int a;
+
+   ASSERT_NVAL_RET ( set );
+   for ( a = 0; a < set->size; a++ ){
+      if ( set->slots [ a ] ){
+         free ( set->slots [ a ] );
+      }
+   }
+   free ( set->slots );
+   free ( set );
+}
+
+/*
+ * checks if path is in set
+ *
+ * out:
+ *    1 - path found
+ *    0 - path not found
+ */
+int pathset_find ( pathset * set, const char * path ){
+
+   ASSERT_NVAL_RET_ZERO ( set );
+   return set->slots [ pathset_slot ( set->slots, set->size, path ) ] != NULL;
+}
+
+/*
+ * adds a path to set, the set grows twice when it is 3/4 full
+ *
+ * out:
+ *    1 - path added
+ *    0 - path already in set
+ *    -1 - memory allocation error
+ */
+int pathset_add ( pathset * set, const char * path ){
+
+   char ** slots;
+   unsigned int size;
+   unsigned int a;
+   unsigned int s;
+
+   ASSERT_NVAL_RET_NONE ( set );
+
+   if ( ( set->count + 1 ) * 4 > set->size * 3 ){
+      size = set->size * 2;
+      slots = (char **) calloc ( size, sizeof ( char * ) );
+      ASSERT_NVAL_RET_NONE ( slots );
+      for ( a = 0; a < set->size; a++ ){
+         if ( set->slots [ a ] ){
+            slots [ pathset_slot ( slots, size, set->slots [ a ] ) ] = set->slots [ a ];
+         }
+      }
+      free ( set->slots );
+      set->slots = slots;
+      set->size = size;
+   }
+
+   s = pathset_slot ( set->slots, set->size, path );
+   if ( set->slots [ s ] ){
+      return 0;
+   }
+   set->slots [ s ] = strdup ( path );
+   ASSERT_NVAL_RET_NONE ( set->slots [ s ] );
+   set->count++;
+
+   return 1;
+}
+
+/* CRC32C (Castagnoli) reflected polynomial */
+#define CRC32CPOLY   0x82F63B78
+
+/* slicing by 8 lookup tables, built at load time */
+static uint32_t crc32c_table [ 8 ][ 256 ];
+/* SSE 4.2 crc32 instruction available */
+static int crc32c_hw = 0;
+
+static void crc32c_init ( void ) __attribute__ (( constructor ));
+static void crc32c_init ( void ){
+
+   uint32_t crc;
+   int a, b;
+
+   for ( a = 0; a < 256; a++ ){
+      crc = a;
+      for ( b = 0; b < 8; b++ ){
+         crc = crc & 1 ? ( crc >> 1 ) ^ CRC32CPOLY : crc >> 1;
+      }
+      crc32c_table [ 0 ][ a ] = crc;
+   }
+   for ( a = 0; a < 256; a++ ){
+      crc = crc32c_table [ 0 ][ a ];
+      for ( b = 1; b < 8; b++ ){
+         crc = crc32c_table [ 0 ][ crc & 0xff ] ^ ( crc >> 8 );
+         crc32c_table [ b ][ a ] = crc;
+      }
+   }
+#if defined(__x86_64__) && defined(__GNUC__)
+   crc32c_hw = __builtin_cpu_supports ( "sse4.2" );
+#endif
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/*
+ * CRC32C with SSE 4.2 crc32 instruction, 8 bytes at a time
+ */
+__attribute__ (( target ( "sse4.2" ) ))
+static uint32_t crc32c_sse42 ( uint32_t crc, const unsigned char * p, size_t len ){
+
+   uint64_t crc64 = crc;
+   uint64_t v;
+
+   for ( ; len && ( (uintptr_t) p & 7 ); len-- ){
+      crc64 = __builtin_ia32_crc32qi ( (uint32_t) crc64, *p++ );
+   }
+   for ( ; len >= 8; len -= 8, p += 8 ){
+      memcpy ( &v, p, 8 );
+      crc64 = __builtin_ia32_crc32di ( crc64, v );
+   }
+   for ( ; len; len-- ){
+      crc64 = __builtin_ia32_crc32qi ( (uint32_t) crc64, *p++ );
+   }
+
+   return (uint32_t) crc64;
+}
+#endif
+
+/*
+ * CRC32C (Castagnoli) checksum of a buffer, hardware crc32 instruction is used
+ * when available, slicing by 8 tables otherwise; a checksum of data split into
+ * chunks is computed by passing a previous result as crc
+ *
+ * in:
+ *    crc - 0 or a checksum of previous data
+ *    buf - data
+ *    len - data length
+ * out:
+ *    checksum
+ */
+uint32_t crc32c ( uint32_t crc, const void * buf, size_t len ){
+
+   const unsigned char * p = (const unsigned char *) buf;
+   uint32_t lo, hi;
+
+   crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+   if ( crc32c_hw ){
+      return ~crc32c_sse42 ( crc, p, len );
+   }
+#endif
+   for ( ; len && ( (uintptr_t) p & 7 ); len-- ){
+      crc = crc32c_table [ 0 ][ ( crc ^ *p++ ) & 0xff ] ^ ( crc >> 8 );
+   }
+   for ( ; len >= 8; len -= 8, p += 8 ){
+      lo = crc ^ ( p [ 0 ] | p [ 1 ] << 8 | p [ 2 ] << 16 | (uint32_t) p [ 3 ] << 24 );
+      hi = p [ 4 ] | p [ 5 ] << 8 | p [ 6 ] << 16 | (uint32_t) p [ 7 ] << 24;
+      crc = crc32c_table [ 7 ][ lo & 0xff ] ^ crc32c_table [ 6 ][ ( lo >> 8 ) & 0xff ] ^
+            crc32c_table [ 5 ][ ( lo >> 16 ) & 0xff ] ^ crc32c_table [ 4 ][ lo >> 24 ] ^
+            crc32c_table [ 3 ][ hi & 0xff ] ^ crc32c_table [ 2 ][ ( hi >> 8 ) & 0xff ] ^
+            crc32c_table [ 1 ][ ( hi >> 16 ) & 0xff ] ^ crc32c_table [ 0 ][ hi >> 24 ];
+   }
+   for ( ; len; len-- ){
+      crc = crc32c_table [ 0 ][ ( crc ^ *p++ ) & 0xff ] ^ ( crc >> 8 );
+   }
+
+   return ~crc;
+}
+
+/*
+ * parses a line of database backup manifest, comments and backup LSN lines
+ * are not entries
+ *
+ * in:
+ *    line - manifest line without a newline, path is returned in place
+ * out:
+ *    1 - entry parsed
+ *    0 - not an entry
+ */
+int manifest_parse_line ( char * line, manifest_entry * entry ){
+
+   char crc [ 16 ];
+   int n = 0;
+
+   if ( ! line || ( line [ 0 ] != 'f' && line [ 0 ] != 'l' && line [ 0 ] != 'd' ) || line [ 1 ] != ' ' ){
+      return 0;
+   }
+   memset ( entry, 0, sizeof ( manifest_entry ) );
+   entry->type = line [ 0 ];
+   entry->path = line + 2;
+   if ( entry->type == 'f' ){
+      if ( sscanf ( line + 2, "%lld %ld %15s %n", &entry->size, &entry->mtime, crc, &n ) < 3 || ! n ){
+         return 0;
+      }
+      if ( strcmp ( crc, "-" ) != 0 ){
+         entry->crc = (uint32_t) strtoul ( crc, NULL, 16 );
+         entry->hascrc = 1;
+      }
+      entry->path = line + 2 + n;
+   }
+
+   return 1;
+}
+
+/*
+ * parses a header line of database backup manifest
+ *
+ * in:
+ *    line - first manifest line without a newline
+ * out:
+ *    job level of backup: 'F', 'I' or 'D'
+ *    0 - not a manifest header
+ */
+int manifest_parse_header ( const char * line ){
+
+   const char * p;
+
+   if ( ! line || strncmp ( line, PGMANIFESTHDR " ", strlen ( PGMANIFESTHDR ) + 1 ) != 0 ){
+      return 0;
+   }
+   p = strstr ( line, " level=" );
+   if ( ! p || ( p [ 7 ] != 'F' && p [ 7 ] != 'I' && p [ 7 ] != 'D' ) ){
+      return 0;
+   }
+
+   return p [ 7 ];
+}
+
 #ifdef __cplusplus
 }
 #endif
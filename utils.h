@@ -14,6 +14,7 @@ extern "C" {
 #endif
 
 #include <sys/types.h>
+#include <stdint.h>
 #ifdef __WIN32__
  #include <windef.h>
 #endif
@@ -160,14 +161,82 @@ struct _udtime_t {
    int s;
 };
 
+/*
+ * a set of path strings, open addressing hash table
+ */
+typedef struct _pathset pathset;
+struct _pathset {
+   char ** slots;
+   unsigned int size;      /* number of slots, power of 2 */
+   unsigned int count;     /* number of paths in set */
+};
+
+/*
+ * buffered line reader for descriptors (pipes, fifos), lines are returned
+ * in place, without any copy
+ */
+typedef struct _linereader linereader;
+struct _linereader {
+   int fd;
+   char * buf;
+   int size;               /* buffer size */
+   int start;              /* first not consumed byte */
+   int end;                /* end of read data */
+   int eof;                /* end of file or read error */
+};
+
+/* a name of database backup manifest virtual file in PGDATA, it differs from
+ * backup_manifest of PostgreSQL 13+ base backups */
+#define PGMANIFEST   "pgsql_manifest"
+/* a first line of backup manifest, followed by client=, jobid= and level= */
+#define PGMANIFESTHDR   "# pgsql backup manifest"
+
+/* a restore mode file which pgsql-restore leaves in a restore destination for
+ * the plugin during a database restore, it holds PGRESTOREDELTA or
+ * PGRESTORECLEAN; it is never backed up */
+#define PGRESTOREMODE   "pgsql_restore_mode"
+#define PGRESTOREDELTA  "delta"
+#define PGRESTORECLEAN  "clean"
+
+/*
+ * an entry of database backup manifest (pgsql-fd pgsql_manifest):
+ *    d <path>
+ *    l <path>
+ *    f <size> <mtime> <crc32c|-> <path>
+ * path is relative to restore destination
+ */
+typedef struct _manifest_entry manifest_entry;
+struct _manifest_entry {
+   int type;               /* 'f', 'l' or 'd' */
+   long long size;
+   long mtime;
+   uint32_t crc;
+   int hascrc;             /* crc is known, file was read by backup job */
+   char * path;            /* points into a parsed line */
+};
+
 /* utilities functions */
 #ifndef __WIN32__
 int check_program_is_running ( char * pidfile );
 #endif
-int readline ( int fd, char * buf, int size );
+double monotonic_time ( void );
+linereader * linereader_alloc ( int fd, int size );
+void linereader_free ( linereader * lr );
+char * linereader_next ( linereader * lr, int * len );
+#ifndef __WIN32__
+int linereader_wait ( linereader * lr, int timeout );
+#endif
 int freadline ( FILE * stream, char * buf, int size );
 //char * format_btime ( const char * str );
 int strisprintable ( char * str, int len );
+unsigned int path_hash ( const char * path );
+pathset * pathset_alloc ( void );
+void pathset_free ( pathset * set );
+int pathset_find ( pathset * set, const char * path );
+int pathset_add ( pathset * set, const char * path );
+uint32_t crc32c ( uint32_t crc, const void * buf, size_t len );
+int manifest_parse_line ( char * line, manifest_entry * entry );
+int manifest_parse_header ( const char * line );
 #ifdef __sun__
 int getgrouplist (const char *uname, gid_t agroup, gid_t *groups, int *grpcnt);
 #endif